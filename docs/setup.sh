@@ -23,7 +23,9 @@ installed() {
 
 # perror prints its arguments to stderr.
 perror() {
-    printf "%s\n" "$*" >/dev/stderr
+    # >&2 rather than >/dev/stderr: on Linux the latter reopens (and
+    # truncates) stderr when it is redirected to a file.
+    printf "%s\n" "$*" >&2
     return 0
 }
 
@@ -786,4 +788,5 @@ script --quiet --flush --log-out "${SETUP_LOGFILE}" \
             BDR_DIR=\"${BDR_DIR}\" \
             BDR_REPO_DIR=\"${BDR_REPO_DIR}\" \
             BDRPI_SETUP_CONFIG_FILE=\"${BDRPI_SETUP_CONFIG_FILE}\" \
+            DOWNLOAD_MIRROR_DIR=\"${DOWNLOAD_MIRROR_DIR:-}\" \
             \"${BDR_REPO_DIR}/update.sh\" $*'"
@@ -22,6 +22,11 @@
 #/#     clear-cache
 #/#         Clear the local cache of images and image detatils.
 #/#
+#/# Environment:
+#/#     DOWNLOAD_MIRROR_DIR
+#/#         Directory of previously downloaded files (e.g. an OS
+#/#         image .xz) to use instead of the network.
+#/#
 
 set -u
 set -o pipefail
@@ -46,7 +51,9 @@ installed() {
 
 # perror prints its arguments to stderr.
 perror() {
-    printf "%s\n" "$*" >/dev/stderr
+    # >&2 rather than >/dev/stderr: on Linux the latter reopens (and
+    # truncates) stderr when it is redirected to a file.
+    printf "%s\n" "$*" >&2
     return 0
 }
 
@@ -536,14 +543,161 @@ boot_config_append() {
     boot_config_printf "${SECTION}" "%s=%s\n\n" "${KEY}" "${VALUE}"
 }
 
+# Downloads are cached by the sha256 of their content:
+#
+#   ${DOWNLOAD_CACHE_DIR}/sha256/<hash>   verified content
+#   ${DOWNLOAD_CACHE_DIR}/urls/<key>      hash of the content last
+#                                         fetched from a URL
+#   ${DOWNLOAD_CACHE_DIR}/partial/        interrupted downloads, resumed
+#                                         on the next attempt
+#
+# Files ending in .xz are cached decompressed; the hash is that of the
+# decompressed content. If DOWNLOAD_MIRROR_DIR is set, a file there
+# with the same name as the URL is used instead of the network.
+
+DOWNLOAD_CACHE_DIR="${DOWNLOAD_CACHE_DIR:-${HOME}/.bdr-pi-cache}"
+DOWNLOAD_MIRROR_DIR="${DOWNLOAD_MIRROR_DIR:-}"
+
+# download_sha256 prints the sha256 of stdin.
+download_sha256() {
+    if command -v sha256sum >/dev/null 2>&1; then
+        sha256sum | awk '{print $1}'
+    else
+        shasum -a 256 | awk '{print $1}'
+    fi
+}
+
+# _download_key $1=url prints the cache key for a URL.
+_download_key() {
+    printf "%s" "$1" | download_sha256
+}
+
+# _download_name $1=url prints the file name of a URL, sans query.
+_download_name() {
+    basename "${1%%\?*}"
+}
+
+# _download_fetch $1=url $2=dest fetches url into dest, resuming dest
+# if it already exists.
+_download_fetch() {
+    local URL="$1"
+    local DEST="$2"
+
+    if [[ -n "${DOWNLOAD_MIRROR_DIR}" ]]; then
+        local MIRROR_FILE
+        MIRROR_FILE="${DOWNLOAD_MIRROR_DIR}/$(_download_name "${URL}")"
+        if [[ -f "${MIRROR_FILE}" ]]; then
+            perror "Copying ${MIRROR_FILE} from mirror"
+            cp "${MIRROR_FILE}" "${DEST}"
+            return
+        fi
+    fi
+
+    if [[ -s "${DEST}" ]]; then
+        perror "Resuming ${URL}..."
+        if curl -fL --progress-bar --continue-at - --output "${DEST}" "${URL}"; then
+            return 0
+        fi
+
+        # The server may not support ranges, or the partial file was
+        # already complete but never verified. Start over.
+        rm -f "${DEST}"
+    fi
+
+    perror "Downloading ${URL}..."
+    curl -fL --progress-bar --output "${DEST}" "${URL}"
+}
+
+# download_cached $1=url $2=sha256 (optional) downloads url into the
+# cache and prints the path of the cached content. If sha256 is given,
+# the content is verified against it and the network is skipped when
+# the content is already cached. Otherwise the content last fetched
+# from url is reused.
+#
+# With --keep-compressed, .xz files are cached as downloaded and
+# sha256 (which describes the decompressed content) is left for the
+# caller to check.
+download_cached() {
+    local DECOMPRESS=true
+    if [[ "${1:-}" == "--keep-compressed" ]]; then
+        DECOMPRESS=false
+        shift
+    fi
+
+    local URL="${1:-}"
+    local HASH="${2:-}"
+
+    [[ -n "${URL}" ]] || abort "internal error: no download url"
+
+    mkdir -p "${DOWNLOAD_CACHE_DIR}/sha256" \
+          "${DOWNLOAD_CACHE_DIR}/urls" \
+          "${DOWNLOAD_CACHE_DIR}/partial" || \
+        abort "could not create download cache ${DOWNLOAD_CACHE_DIR}"
+
+    local KEY NAME
+    KEY="$(_download_key "${URL}")"
+    NAME="$(_download_name "${URL}")"
+
+    if [[ "${NAME}" = *.xz ]] && ! "${DECOMPRESS}"; then
+        KEY="$(_download_key "xz:${URL}")"
+        HASH=""
+    fi
+
+    local URL_FILE="${DOWNLOAD_CACHE_DIR}/urls/${KEY}"
+    local CACHED="${HASH}"
+    if [[ -z "${CACHED}" && -f "${URL_FILE}" ]]; then
+        CACHED="$(cat "${URL_FILE}")"
+    fi
+
+    if [[ -n "${CACHED}" && -f "${DOWNLOAD_CACHE_DIR}/sha256/${CACHED}" ]]; then
+        perror "Using cached ${NAME}"
+        echo "${CACHED}" >"${URL_FILE}"
+        echo "${DOWNLOAD_CACHE_DIR}/sha256/${CACHED}"
+        return 0
+    fi
+
+    local PARTIAL="${DOWNLOAD_CACHE_DIR}/partial/${KEY}-${NAME}"
+    _download_fetch "${URL}" "${PARTIAL}" || \
+        abort "failed to download ${URL}"
+
+    # Hash (and decompress) in a single pass over the download.
+    local TMP="${PARTIAL}.tmp"
+    local GOT
+    if [[ "${NAME}" = *.xz ]] && "${DECOMPRESS}"; then
+        perror "Decompressing and validating ${NAME}..."
+        GOT="$(set -o pipefail; xz --decompress --stdout --thread=0 "${PARTIAL}" | tee "${TMP}" | download_sha256)" || {
+            rm -f "${PARTIAL}" "${TMP}"
+            abort "failed to decompress ${NAME}"
+        }
+    else
+        GOT="$(download_sha256 <"${PARTIAL}")"
+        mv "${PARTIAL}" "${TMP}"
+    fi
+
+    if [[ -n "${HASH}" && "${GOT}" != "${HASH}" ]]; then
+        rm -f "${PARTIAL}" "${TMP}"
+        abort "hash mismatch for ${NAME}: got ${GOT}, expected ${HASH}"
+    fi
+
+    mv "${TMP}" "${DOWNLOAD_CACHE_DIR}/sha256/${GOT}" || abort "failed to cache ${NAME}"
+    rm -f "${PARTIAL}"
+    echo "${GOT}" >"${URL_FILE}"
+
+    echo "${DOWNLOAD_CACHE_DIR}/sha256/${GOT}"
+}
+
 ROOT_DIR="$(cd "$(dirname "$0}")" && pwd)"
 
 DRYRUN="false"
 
+# Native streaming image writer; dd is used if it hasn't been built.
+IMGWRITE="${ROOT_DIR}/native/bdr_imgwrite"
+
 OSLIST_URL="https://downloads.raspberrypi.org/os_list_imagingutility_v4.json"
 
 BDRPI_TMP="${TMPDIR:-/tmp}/bdr-pi-imager.$$"
 CACHE_DIR="${HOME}/.bdr-pi-cache"
+DOWNLOAD_CACHE_DIR="${CACHE_DIR}"
 
 # print usage and quit
 usage() {
@@ -617,50 +771,7 @@ list_disks() {
 
 # download a resource $1=URL $2=sha256 (or omit for no checks)
 download_resource() {
-    local IMAGEURL="${1:-}"
-    local HASH="${2:-}"
-
-    if [[ -z "${IMAGEURL}" ]]; then
-        abort "internal error: no image url"
-    fi
-
-    local FILE
-    FILE="$(basename "${IMAGEURL}")"
-    local CACHE_FILE="${CACHE_DIR}/${FILE}"
-
-    if [[ -f "${CACHE_FILE}" ]]; then
-        perror "Using cached file ${CACHE_FILE}"
-    else
-        perror "Downloading ${IMAGEURL}..."
-
-        curl --progress-bar --output "${CACHE_FILE}" "${IMAGEURL}" || \
-            abort "failed to download ${IMAGEURL}"
-    fi
-
-    local FINAL_CACHE_FILE="${CACHE_FILE}"
-    if [[ "${CACHE_FILE}" = *.xz ]]; then
-        FINAL_CACHE_FILE="${CACHE_FILE/%\.xz/}"
-
-        if [[ -f "${FINAL_CACHE_FILE}" ]]; then
-            perror "Using cached uncompressed file ${FINAL_CACHE_FILE}"
-        else
-            perror "Decompressing ${CACHE_FILE}"
-            xz --decompress --stdout --thread=0 "${CACHE_FILE}" > "${FINAL_CACHE_FILE}"
-        fi
-    fi
-
-    if [[ -n "${HASH}" ]]; then
-        perror "Validating ${FINAL_CACHE_FILE}..."
-
-        local FILEHASH
-        FILEHASH="$(shasum -a 256 "${FINAL_CACHE_FILE}" | awk '{print $1}')"
-
-        [[ "${FILEHASH}" == "${HASH}" ]] || abort "hash mismatch got ${FILEHASH}, expected ${HASH}"
-
-        perror "ok"
-    fi
-
-    echo "${FINAL_CACHE_FILE}"
+    download_cached "$@"
 }
 
 # get a list of images via OSLIST_URL
@@ -734,7 +845,13 @@ select_image() {
         grep -E "^${PICK}:" |\
         cut -d: -f2-)"
 
-    IMAGE="$(download_resource "${IMAGEURL}" "${IMAGEHASH}")"
+    if [[ -x "${IMGWRITE}" ]]; then
+        # bdr_imgwrite decompresses and checks the hash as it writes.
+        IMAGE="$(download_cached --keep-compressed "${IMAGEURL}")"
+        echo "${IMAGEHASH}" >"$(tmpfile image-sha256)"
+    else
+        IMAGE="$(download_resource "${IMAGEURL}" "${IMAGEHASH}")"
+    fi
     [[ -z "${IMAGE}" ]] && exit 1
 
     echo "${IMAGE}"
@@ -874,8 +991,16 @@ set_autolaunch_racecapture() {
     AUTOLAUNCH=$(prompt_yesno Y "Automatically launch racecapture on login?")
     if [[ "${AUTOLAUNCH}" == "N" ]]; then
         set_setup_config RACECAPTURE_AUTOLAUNCH false
+        return 0
+    fi
+    set_setup_config RACECAPTURE_AUTOLAUNCH true
+
+    local SERVICE
+    SERVICE=$(prompt_yesno Y "Launch racecapture as a boot service (faster, no login prompt)?")
+    if [[ "${SERVICE}" == "N" ]]; then
+        set_setup_config RACECAPTURE_LAUNCH_MODE login
     else
-        set_setup_config RACECAPTURE_AUTOLAUNCH true
+        set_setup_config RACECAPTURE_LAUNCH_MODE service
     fi
 }
 
@@ -981,8 +1106,18 @@ image() {
     perror "Writing image... (this could take a while)"
 
     # Write the image. rpi-imager skips the first 4kb and then writes
-    # it last. Not sure why.
-    ${SAFE} sudo dd bs=1m if="${IMAGE}" of="${RDISK}" status=progress
+    # it last, so a failed write doesn't leave a partition table
+    # behind; bdr_imgwrite does the same.
+    if [[ -x "${IMGWRITE}" ]]; then
+        local IMGWRITE_ARGS=(--verify --progress)
+        if [[ -s "$(tmpfile image-sha256)" ]]; then
+            IMGWRITE_ARGS+=(--sha256 "$(cat "$(tmpfile image-sha256)")")
+        fi
+        ${SAFE} sudo "${IMGWRITE}" "${IMGWRITE_ARGS[@]}" "${IMAGE}" "${RDISK}" >/dev/null || \
+            abort "failed to write image"
+    else
+        ${SAFE} sudo dd bs=1m if="${IMAGE}" of="${RDISK}" status=progress
+    fi
 
     perror "...done"
 
@@ -0,0 +1,154 @@
+#!/bin/bash
+
+#{{begin_exclude}}#
+if [[ -n "${_DOWNLOAD_SH_INCLUDED:-}" ]]; then
+    return
+fi
+_DOWNLOAD_SH_INCLUDED=1
+_DOWNLOAD_SH="${BASH_SOURCE[0]}"
+_DOWNLOAD_LIB_DIR="$(cd "$(dirname "${_DOWNLOAD_SH}")" && pwd)"
+source "${_DOWNLOAD_LIB_DIR}/io.sh"
+#{{end_exclude}}#
+
+# Downloads are cached by the sha256 of their content:
+#
+#   ${DOWNLOAD_CACHE_DIR}/sha256/<hash>   verified content
+#   ${DOWNLOAD_CACHE_DIR}/urls/<key>      hash of the content last
+#                                         fetched from a URL
+#   ${DOWNLOAD_CACHE_DIR}/partial/        interrupted downloads, resumed
+#                                         on the next attempt
+#
+# Files ending in .xz are cached decompressed; the hash is that of the
+# decompressed content. If DOWNLOAD_MIRROR_DIR is set, a file there
+# with the same name as the URL is used instead of the network.
+
+DOWNLOAD_CACHE_DIR="${DOWNLOAD_CACHE_DIR:-${HOME}/.bdr-pi-cache}"
+DOWNLOAD_MIRROR_DIR="${DOWNLOAD_MIRROR_DIR:-}"
+
+# download_sha256 prints the sha256 of stdin.
+download_sha256() {
+    if command -v sha256sum >/dev/null 2>&1; then
+        sha256sum | awk '{print $1}'
+    else
+        shasum -a 256 | awk '{print $1}'
+    fi
+}
+
+# _download_key $1=url prints the cache key for a URL.
+_download_key() {
+    printf "%s" "$1" | download_sha256
+}
+
+# _download_name $1=url prints the file name of a URL, sans query.
+_download_name() {
+    basename "${1%%\?*}"
+}
+
+# _download_fetch $1=url $2=dest fetches url into dest, resuming dest
+# if it already exists.
+_download_fetch() {
+    local URL="$1"
+    local DEST="$2"
+
+    if [[ -n "${DOWNLOAD_MIRROR_DIR}" ]]; then
+        local MIRROR_FILE
+        MIRROR_FILE="${DOWNLOAD_MIRROR_DIR}/$(_download_name "${URL}")"
+        if [[ -f "${MIRROR_FILE}" ]]; then
+            perror "Copying ${MIRROR_FILE} from mirror"
+            cp "${MIRROR_FILE}" "${DEST}"
+            return
+        fi
+    fi
+
+    if [[ -s "${DEST}" ]]; then
+        perror "Resuming ${URL}..."
+        if curl -fL --progress-bar --continue-at - --output "${DEST}" "${URL}"; then
+            return 0
+        fi
+
+        # The server may not support ranges, or the partial file was
+        # already complete but never verified. Start over.
+        rm -f "${DEST}"
+    fi
+
+    perror "Downloading ${URL}..."
+    curl -fL --progress-bar --output "${DEST}" "${URL}"
+}
+
+# download_cached $1=url $2=sha256 (optional) downloads url into the
+# cache and prints the path of the cached content. If sha256 is given,
+# the content is verified against it and the network is skipped when
+# the content is already cached. Otherwise the content last fetched
+# from url is reused.
+#
+# With --keep-compressed, .xz files are cached as downloaded and
+# sha256 (which describes the decompressed content) is left for the
+# caller to check.
+download_cached() {
+    local DECOMPRESS=true
+    if [[ "${1:-}" == "--keep-compressed" ]]; then
+        DECOMPRESS=false
+        shift
+    fi
+
+    local URL="${1:-}"
+    local HASH="${2:-}"
+
+    [[ -n "${URL}" ]] || abort "internal error: no download url"
+
+    mkdir -p "${DOWNLOAD_CACHE_DIR}/sha256" \
+          "${DOWNLOAD_CACHE_DIR}/urls" \
+          "${DOWNLOAD_CACHE_DIR}/partial" || \
+        abort "could not create download cache ${DOWNLOAD_CACHE_DIR}"
+
+    local KEY NAME
+    KEY="$(_download_key "${URL}")"
+    NAME="$(_download_name "${URL}")"
+
+    if [[ "${NAME}" = *.xz ]] && ! "${DECOMPRESS}"; then
+        KEY="$(_download_key "xz:${URL}")"
+        HASH=""
+    fi
+
+    local URL_FILE="${DOWNLOAD_CACHE_DIR}/urls/${KEY}"
+    local CACHED="${HASH}"
+    if [[ -z "${CACHED}" && -f "${URL_FILE}" ]]; then
+        CACHED="$(cat "${URL_FILE}")"
+    fi
+
+    if [[ -n "${CACHED}" && -f "${DOWNLOAD_CACHE_DIR}/sha256/${CACHED}" ]]; then
+        perror "Using cached ${NAME}"
+        echo "${CACHED}" >"${URL_FILE}"
+        echo "${DOWNLOAD_CACHE_DIR}/sha256/${CACHED}"
+        return 0
+    fi
+
+    local PARTIAL="${DOWNLOAD_CACHE_DIR}/partial/${KEY}-${NAME}"
+    _download_fetch "${URL}" "${PARTIAL}" || \
+        abort "failed to download ${URL}"
+
+    # Hash (and decompress) in a single pass over the download.
+    local TMP="${PARTIAL}.tmp"
+    local GOT
+    if [[ "${NAME}" = *.xz ]] && "${DECOMPRESS}"; then
+        perror "Decompressing and validating ${NAME}..."
+        GOT="$(set -o pipefail; xz --decompress --stdout --thread=0 "${PARTIAL}" | tee "${TMP}" | download_sha256)" || {
+            rm -f "${PARTIAL}" "${TMP}"
+            abort "failed to decompress ${NAME}"
+        }
+    else
+        GOT="$(download_sha256 <"${PARTIAL}")"
+        mv "${PARTIAL}" "${TMP}"
+    fi
+
+    if [[ -n "${HASH}" && "${GOT}" != "${HASH}" ]]; then
+        rm -f "${PARTIAL}" "${TMP}"
+        abort "hash mismatch for ${NAME}: got ${GOT}, expected ${HASH}"
+    fi
+
+    mv "${TMP}" "${DOWNLOAD_CACHE_DIR}/sha256/${GOT}" || abort "failed to cache ${NAME}"
+    rm -f "${PARTIAL}"
+    echo "${GOT}" >"${URL_FILE}"
+
+    echo "${DOWNLOAD_CACHE_DIR}/sha256/${GOT}"
+}
@@ -9,7 +9,9 @@ _IO_SH_INCLUDED=1
 
 # perror prints its arguments to stderr.
 perror() {
-    printf "%s\n" "$*" >/dev/stderr
+    # >&2 rather than >/dev/stderr: on Linux the latter reopens (and
+    # truncates) stderr when it is redirected to a file.
+    printf "%s\n" "$*" >&2
     return 0
 }
 
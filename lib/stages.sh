@@ -11,8 +11,37 @@ source "${_STAGES_LIB_DIR}/io.sh"
 source "${_STAGES_LIB_DIR}/reboot.sh"
 #{{end_exclude}}#
 
+# Stages are scripts in ${BDR_REPO_DIR}/stages that define run_stage.
+# A stage may declare how it can be scheduled with header comments:
+#
+#   # STAGE_DEPENDS: 100_lifepo4wered_pi 110_boot_options
+#       Stages that must complete first. An empty list means the stage
+#       is independent. Without this header, a stage depends on every
+#       stage that sorts before it.
+#   # STAGE_REBOOT: true
+#       The stage may call reboot_required. At most one such stage runs
+#       at a time, and no new stages start once a reboot is pending.
+#   # STAGE_INTERACTIVE: true
+#       The stage reads from the terminal. It runs alone, in the
+#       foreground, with its output going straight to the terminal.
+#   # STAGE_INPUTS: resources/bdr_racecapture.sh native
+#       Files and directories, relative to ${BDR_REPO_DIR}, that the
+#       stage reads besides its own script.
+#   # STAGE_CONFIG: WIFI_SSID WIFI_PASS
+#       Setup config keys the stage reads indirectly (keys passed to
+#       get_setup_config in the stage itself are found automatically).
+#
+# A completed stage records a hash of its script, inputs and config
+# values in ${BDR_DIR}/state/<stage>, and is skipped until that hash
+# changes (or --force is used).
+#
+# Other stages run concurrently (up to BDR_STAGE_JOBS at a time, by
+# default the number of CPUs) with their output captured in
+# ${BDR_DIR}/logs/stages/<stage>.log and printed when they finish.
+
 _FORCE_STAGES=false
 _STATE_DIR="${BDR_DIR}/state"
+_STAGE_LOG_DIR="${BDR_DIR}/logs/stages"
 
 # stage_force_all forces all stages to be executed even if the state
 # directory indicates it's already been run.
@@ -23,6 +52,7 @@ stage_force_all() {
 # _stage_init initializes stages
 _stage_init() {
     mkdir -p "${_STATE_DIR}" || abort "could not create state dir ${_STATE_DIR}"
+    mkdir -p "${_STAGE_LOG_DIR}" || abort "could not create stage log dir ${_STAGE_LOG_DIR}"
 }
 
 # stage_list lists all stages, in order.
@@ -41,8 +71,84 @@ _stage_name() {
     basename -s .sh "${STAGE}"
 }
 
+# _stage_meta $1=stage-path $2=key prints the value of the stage's
+# "# KEY: value" header and fails if there is no such header.
+_stage_meta() {
+    local STAGE="$1"
+    local KEY="$2"
+
+    grep -q "^# ${KEY}:" "${STAGE}" || return 1
+    sed -n -e "s/^# ${KEY}:[[:space:]]*//p" "${STAGE}" | head -n 1
+}
+
+# _stage_flag $1=stage-path $2=key succeeds if the header is "true".
+_stage_flag() {
+    [[ "$(_stage_meta "$1" "$2")" == "true" ]]
+}
+
+# _stage_config_keys $1=stage-path prints the setup config keys the
+# stage reads, one per line.
+_stage_config_keys() {
+    local STAGE="$1"
+
+    {
+        _stage_meta "${STAGE}" STAGE_CONFIG | tr -s ' \t' '\n'
+        grep -oE 'get_setup_config(_array|_array_size)?[[:space:]]+"?[A-Za-z_][A-Za-z0-9_]*' "${STAGE}" | \
+            sed -e 's/.*[[:space:]"]//'
+    } | grep -v '^$' | sort -u
+}
+
+# _stage_hash_input $1=path prints a checksum line for each file at
+# path. For a directory in a git checkout only tracked files count, so
+# build products don't change the hash.
+_stage_hash_input() {
+    local INPUT="$1"
+
+    if [[ -f "${INPUT}" ]]; then
+        sha256sum "${INPUT}"
+    elif [[ -d "${INPUT}" ]]; then
+        if git -C "${INPUT}" rev-parse --is-inside-work-tree >/dev/null 2>&1; then
+            (cd "${INPUT}" && git ls-files -z | sort -z | xargs -0 -r sha256sum)
+        else
+            find "${INPUT}" -type f -print0 | sort -z | xargs -0 -r sha256sum
+        fi
+    else
+        echo "missing ${INPUT}"
+    fi
+}
+
+# _stage_hash $1=stage-path prints a hash of the stage script, its
+# STAGE_INPUTS and the current values of the config keys it reads.
+_stage_hash() {
+    local STAGE="$1"
+    local CONFIG="${BDRPI_SETUP_CONFIG_FILE:-}"
+    local INPUT KEY
+
+    {
+        sha256sum <"${STAGE}"
+        for INPUT in $(_stage_meta "${STAGE}" STAGE_INPUTS); do
+            _stage_hash_input "${BDR_REPO_DIR}/${INPUT}"
+        done
+        for KEY in $(_stage_config_keys "${STAGE}"); do
+            echo "config ${KEY}"
+            if [[ -s "${CONFIG}" ]]; then
+                grep -E "^${KEY}(\.[0-9]+)?=" "${CONFIG}"
+            fi
+        done
+    } | sha256sum | cut -d ' ' -f 1
+}
+
+# _stage_state $1=stage-name $2=field prints a field ("hash" or
+# "duration") from the stage's state file.
+_stage_state() {
+    sed -n -e "s/^$2 //p" "${_STATE_DIR}/$1" 2>/dev/null | head -n 1
+}
+
+# _stage_check $1=stage-name $2=stage-path succeeds if the stage has
+# completed and its hash is unchanged since.
 _stage_check() {
     local STAGE_NAME="$1"
+    local STAGE="$2"
     local STATE_FILE="${_STATE_DIR}/${STAGE_NAME}"
     if [[ ! -f "${STATE_FILE}" ]]; then
         return 1
@@ -57,6 +163,24 @@ _stage_check() {
 
     if "${_FORCE_STAGES}"; then
         report "rerunning stage ${STAGE_NAME}"
+        return 1
+    fi
+
+    local HASH
+    HASH="$(_stage_hash "${STAGE}")"
+
+    local OLD_HASH
+    OLD_HASH="$(_stage_state "${STAGE_NAME}" hash)"
+    if [[ -z "${OLD_HASH}" ]]; then
+        # Completed before hashes were recorded; trust it rather than
+        # repeating every stage once.
+        echo "hash ${HASH}" >>"${STATE_FILE}"
+        return 0
+    fi
+
+    if [[ "${OLD_HASH}" != "${HASH}" ]]; then
+        report "rerunning stage ${STAGE_NAME}, its inputs changed"
+        return 1
     fi
 
     return 0
@@ -68,52 +192,287 @@ _stage_start() {
     echo "stage ${STAGE_NAME}"
 }
 
+# _stage_complete $1=stage-name $2=stage-path $3=duration records the
+# stage as complete with its current hash.
 _stage_complete() {
     local STAGE_NAME="$1"
-    date "+%s" >"${_STATE_DIR}/${STAGE_NAME}"
+    local STAGE="$2"
+    local DURATION="$3"
+    local HASH
+    HASH="$(_stage_hash "${STAGE}")"
+
+    {
+        date "+%s"
+        echo "hash ${HASH}"
+        echo "duration ${DURATION}"
+    } >"${_STATE_DIR}/${STAGE_NAME}"
+}
+
+_stage_flush() {
+    if [[ "${SETUP_FLUSH_PID:-0}" -gt 0 ]]; then
+        # Send SIGUSR1 to this PID to flush output.
+        kill -USR1 "${SETUP_FLUSH_PID}"
+    fi
+}
+
+# _stage_reboot prompts for and performs a pending reboot.
+_stage_reboot() {
+    local INPUT
+    read -r -t 5 \
+         -n 1 \
+         -p "rebooting in 5s (press ENTER to reboot immediately, any other key to stop) " \
+         INPUT
+    if [[ -n "${INPUT}" ]]; then
+        echo
+        report "reboot canceled; run 'sudo reboot' to continue setup"
+        exit 0
+    fi
+
+    report "rebooting now"
+    shutdown -r now
+    exit 0
+}
+
+# _stage_bg $1=stage-path $2=stage-name $3=run-dir runs a stage in a
+# background subshell with output captured to its log. The exit code
+# is written to run-dir/<name>.rc (even if the stage aborts) and
+# run-dir/<name>.reboot is created if it requested a reboot.
+_stage_bg() {
+    local STAGE="$1"
+    local STAGE_NAME="$2"
+    local RUN_DIR="$3"
+
+    (
+        trap '_RC=$?; reboot_is_required && touch "${RUN_DIR}/${STAGE_NAME}.reboot"; echo "${_RC}" >"${RUN_DIR}/${STAGE_NAME}.rc"' EXIT
+
+        # shellcheck disable=SC1090
+        source "${STAGE}"
+        run_stage
+    ) </dev/null >"${_STAGE_LOG_DIR}/${STAGE_NAME}.log" 2>&1 &
+}
+
+# _stage_summary $1=wall-time $@=name:result:duration[:saved] prints
+# how long each stage took, how much time running them concurrently
+# saved, and how much stage time skipping unchanged stages saved
+# (their duration when they last ran).
+_stage_summary() {
+    local WALL="$1"
+    shift
+
+    [[ "$#" -gt 0 ]] || return 0
+
+    local TOTAL=0
+    local SAVED_TOTAL=0
+    local SKIPPED=0
+    local LINE NAME RESULT DURATION SAVED
+    echo "stage timing:"
+    for LINE in "$@"; do
+        IFS=: read -r NAME RESULT DURATION SAVED <<<"${LINE}"
+        if [[ "${RESULT}" == "skipped" ]]; then
+            printf "  %-32s %-8s %5ss (%ss last run)\n" "${NAME}" "${RESULT}" "${DURATION}" "${SAVED:-0}"
+            SAVED_TOTAL=$((SAVED_TOTAL + ${SAVED:-0}))
+            SKIPPED=$((SKIPPED + 1))
+        else
+            printf "  %-32s %-8s %5ss\n" "${NAME}" "${RESULT}" "${DURATION}"
+        fi
+        TOTAL=$((TOTAL + DURATION))
+    done
+    printf "  %-32s %-8s %5ss (%ss of stage time)\n" "total" "" "${WALL}" "${TOTAL}"
+    if [[ "${SKIPPED}" -gt 0 ]]; then
+        printf "  %-32s %-8s %5ss (%s unchanged, full rerun ~%ss of stage time)\n" \
+               "saved" "" "${SAVED_TOTAL}" "${SKIPPED}" "$((TOTAL + SAVED_TOTAL))"
+    fi
+}
+
+# _stage_is_done $1=name succeeds if the named stage has completed
+# during stage_run (it reads stage_run's NAMES and STATUS arrays).
+_stage_is_done() {
+    local I
+    for I in "${!NAMES[@]}"; do
+        if [[ "${NAMES[I]}" == "$1" ]]; then
+            [[ "${STATUS[I]}" == "done" ]]
+            return
+        fi
+    done
+    return 1
 }
 
 stage_run() {
+    _stage_init
+
     declare -a _STAGES
     while IFS= read -r _STAGE; do
         _STAGES+=("${_STAGE}")
     done < <(_stage_list)
 
-    for _STAGE in "${_STAGES[@]}"; do
-        STAGE_NAME="$(_stage_name "${_STAGE}")"
+    local JOBS="${BDR_STAGE_JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)}"
+    [[ "${JOBS}" -ge 1 ]] || JOBS=1
+
+    local RUN_DIR
+    RUN_DIR="$(mktemp -d "${TMPDIR:-/tmp}/bdr-pi-stages.XXXXXX")" || abort "could not create stage run dir"
+
+    # Per-stage bookkeeping, indexed like _STAGES. STATUS is one of
+    # pending, running, done or failed.
+    declare -a NAMES DEPS STATUS STARTED PIDS
+    declare -a TIMING
+    local IDX PREV
+    for IDX in "${!_STAGES[@]}"; do
+        local _STAGE="${_STAGES[IDX]}"
+        NAMES[IDX]="$(_stage_name "${_STAGE}")"
 
-        if _stage_check "${STAGE_NAME}"; then
-            echo "skipping ${STAGE_NAME}, already complete"
-            continue
+        if DEPS[IDX]="$(_stage_meta "${_STAGE}" STAGE_DEPENDS)"; then
+            local DEP
+            for DEP in ${DEPS[IDX]}; do
+                [[ -f "${BDR_REPO_DIR}/stages/${DEP}.sh" ]] || \
+                    abort "stage ${NAMES[IDX]} depends on unknown stage ${DEP}"
+            done
+        else
+            DEPS[IDX]=""
+            for PREV in "${!NAMES[@]}"; do
+                [[ "${PREV}" -lt "${IDX}" ]] && DEPS[IDX]+=" ${NAMES[PREV]}"
+            done
         fi
 
-        _stage_start "${STAGE_NAME}"
+        STATUS[IDX]="pending"
+    done
 
-        # shellcheck disable=SC1090
-        source "${_STAGE}"
-        run_stage || abort "stage ${STAGE_NAME} failed"
-        _stage_complete "${STAGE_NAME}"
+    local RUN_START RUNNING REBOOT_RUNNING FAILED
+    RUN_START="$(date "+%s")"
+    RUNNING=0
+    REBOOT_RUNNING=false
+    FAILED=""
 
-        if [[ "${SETUP_FLUSH_PID}" -gt 0 ]]; then
-            # Send SIGUSR1 to this PID to flush output.
-            kill -USR1 "${SETUP_FLUSH_PID}"
-        fi
+    while true; do
+        # Start everything that's ready.
+        for IDX in "${!_STAGES[@]}"; do
+            [[ "${STATUS[IDX]}" == "pending" ]] || continue
+            [[ -z "${FAILED}" ]] || break
+            reboot_is_required && break
 
-        if reboot_is_required; then
-            local INPUT
-            read -r -t 5 \
-                 -n 1 \
-                 -p "rebooting in 5s (press ENTER to reboot immediately, any other key to stop) " \
-                 INPUT
-            if [[ -n "${INPUT}" ]]; then
-                echo
-                report "reboot canceled; run 'sudo reboot' to continue setup"
-                exit 0
+            local _STAGE="${_STAGES[IDX]}"
+            local NAME="${NAMES[IDX]}"
+
+            local READY=true
+            local DEP
+            for DEP in ${DEPS[IDX]}; do
+                if ! _stage_is_done "${DEP}"; then
+                    READY=false
+                    break
+                fi
+            done
+            "${READY}" || continue
+
+            STAGE_NAME="${NAME}"
+            if _stage_check "${NAME}" "${_STAGE}"; then
+                echo "skipping ${NAME}, already complete and unchanged"
+                STATUS[IDX]="done"
+                TIMING+=("${NAME}:skipped:0:$(_stage_state "${NAME}" duration)")
+                continue
             fi
 
-            report "rebooting now"
-            shutdown -r now
-            exit 0
+            if _stage_flag "${_STAGE}" STAGE_INTERACTIVE; then
+                # Wait for the terminal to be ours alone, without
+                # starting anything else in the meantime.
+                [[ "${RUNNING}" -eq 0 ]] || break
+
+                _stage_start "${NAME}"
+                local START
+                START="$(date "+%s")"
+
+                # shellcheck disable=SC1090
+                source "${_STAGE}"
+                run_stage || abort "stage ${NAME} failed"
+                local DURATION=$(( $(date "+%s") - START ))
+                _stage_complete "${NAME}" "${_STAGE}" "${DURATION}"
+                STATUS[IDX]="done"
+                TIMING+=("${NAME}:ok:${DURATION}")
+                _stage_flush
+                continue
+            fi
+
+            [[ "${RUNNING}" -lt "${JOBS}" ]] || continue
+
+            if _stage_flag "${_STAGE}" STAGE_REBOOT; then
+                "${REBOOT_RUNNING}" && continue
+                REBOOT_RUNNING=true
+            fi
+
+            _stage_start "${NAME}"
+            STARTED[IDX]="$(date "+%s")"
+            _stage_bg "${_STAGE}" "${NAME}" "${RUN_DIR}"
+            PIDS[IDX]="$!"
+            STATUS[IDX]="running"
+            RUNNING=$((RUNNING + 1))
+        done
+        STAGE_NAME=""
+
+        [[ "${RUNNING}" -gt 0 ]] || break
+
+        # Wait for a stage to finish, then collect every finished one.
+        local WAITED_PID="" WAIT_RC=0
+        wait -n -p WAITED_PID 2>/dev/null || WAIT_RC="$?"
+        for IDX in "${!_STAGES[@]}"; do
+            [[ "${STATUS[IDX]}" == "running" ]] || continue
+
+            local NAME="${NAMES[IDX]}"
+            local RC_FILE="${RUN_DIR}/${NAME}.rc"
+            if [[ ! -f "${RC_FILE}" ]]; then
+                [[ "${PIDS[IDX]}" == "${WAITED_PID}" ]] || continue
+
+                # The subshell died without running its EXIT trap
+                # (SIGKILL, the OOM killer); it still failed.
+                echo "stage ${NAME} died without an exit code (wait status ${WAIT_RC})" \
+                     >>"${_STAGE_LOG_DIR}/${NAME}.log"
+                [[ "${WAIT_RC}" -ne 0 ]] || WAIT_RC=1
+                echo "${WAIT_RC}" >"${RC_FILE}"
+            fi
+
+            local RC DURATION
+            RC="$(cat "${RC_FILE}")"
+            DURATION=$(( $(date "+%s") - STARTED[IDX] ))
+            RUNNING=$((RUNNING - 1))
+            _stage_flag "${_STAGES[IDX]}" STAGE_REBOOT && REBOOT_RUNNING=false
+
+            echo "stage ${NAME} finished (${DURATION}s):"
+            cat "${_STAGE_LOG_DIR}/${NAME}.log"
+
+            if [[ "${RC}" -ne 0 ]]; then
+                STATUS[IDX]="failed"
+                TIMING+=("${NAME}:FAILED:${DURATION}")
+                FAILED="${FAILED:+${FAILED} }${NAME}"
+                continue
+            fi
+
+            _stage_complete "${NAME}" "${_STAGES[IDX]}" "${DURATION}"
+            STATUS[IDX]="done"
+            TIMING+=("${NAME}:ok:${DURATION}")
+
+            if [[ -f "${RUN_DIR}/${NAME}.reboot" ]]; then
+                # The stage ran in a subshell; reboot_required already
+                # scheduled setup to resume, so just note it here.
+                REBOOT_REQUIRED=true
+            fi
+
+            _stage_flush
+        done
+    done
+
+    rm -rf "${RUN_DIR}"
+
+    _stage_summary "$(( $(date "+%s") - RUN_START ))" "${TIMING[@]}"
+
+    if [[ -n "${FAILED}" ]]; then
+        abort "stage ${FAILED} failed (logs in ${_STAGE_LOG_DIR})"
+    fi
+
+    if reboot_is_required; then
+        _stage_reboot
+        return 0
+    fi
+
+    for IDX in "${!_STAGES[@]}"; do
+        if [[ "${STATUS[IDX]}" == "pending" ]]; then
+            abort "stage ${NAMES[IDX]} could not run: unmet dependencies ${DEPS[IDX]}"
         fi
     done
 }
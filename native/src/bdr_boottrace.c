@@ -0,0 +1,726 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/fb.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// bdr_boottrace records a timeline of the way from key-on to the
+// dashboard, so launch changes can be measured instead of guessed.
+//
+//   mark PHASE
+//       Appends PHASE, stamped with CLOCK_BOOTTIME (nanoseconds since
+//       the kernel started), to the timeline. The first mark of a boot
+//       also records when init started. resources/bdr_racecapture.sh,
+//       its .bashrc hook and the prewarm service mark their phases.
+//   report [TIMELINE...]
+//       Prints a timeline with the time between phases, or, given
+//       several saved timelines (e.g. a login launch and a service
+//       launch), each phase's time in each of them.
+//   prewarm DIR...
+//       Reads every file under DIR into the page cache, between
+//       prewarm_start and prewarm_done marks.
+//   standin DIR
+//       Stands in for race_capture: reads the app's files the way a
+//       cold start does (app_loaded), draws a frame on the framebuffer
+//       (first_frame), optionally saves the timeline and exits.
+//
+// The timeline is a text file of "NS PHASE" lines on tmpfs, so it
+// starts empty on every boot and marking costs no SD card writes.
+
+#define DEFAULT_TIMELINE  "/dev/shm/bdr_boottrace.timeline"
+#define DEFAULT_FB        "/dev/fb0"
+#define BOOT_ID_PATH      "/proc/sys/kernel/random/boot_id"
+#define HEADER            "# bdr_boottrace boot_id "
+
+// Frame drawn when --fb isn't a framebuffer device (for tests).
+#define FALLBACK_WIDTH   800
+#define FALLBACK_HEIGHT  480
+#define FALLBACK_BPP     4
+
+#define READ_CHUNK (256 * 1024)
+
+#define MAX_PHASE    64
+#define MAX_ENTRIES  256
+#define MAX_TIMELINES 8
+
+struct config {
+  const char* file;
+  const char* fb;
+  const char* save_dir;
+  int quiet;
+};
+
+struct entry {
+  uint64_t ns;
+  char phase[MAX_PHASE];
+};
+
+struct timeline {
+  const char* path;
+  struct entry entries[MAX_ENTRIES];
+  size_t num;
+};
+
+// load_stats counts what a walk over a directory read.
+struct load_stats {
+  uint64_t files;
+  uint64_t bytes;
+  uint64_t errors;
+};
+
+static struct config cfg = {
+  .file = DEFAULT_TIMELINE,
+  .fb = DEFAULT_FB,
+  .save_dir = NULL,
+  .quiet = 0,
+};
+
+static void perror_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+static void abort_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void usage(const char* argv0, const char* err) {
+  if (err != NULL) {
+    perror_msg("ERROR: %s", err);
+    printf("\n");
+  }
+  printf("Usage:\n");
+  printf("    %s [options] mark PHASE\n", argv0);
+  printf("    %s [options] report [TIMELINE...]\n", argv0);
+  printf("    %s [options] prewarm DIR...\n", argv0);
+  printf("    %s [options] standin DIR\n", argv0);
+  printf("\n");
+  printf("Options:\n");
+  printf("    --file=PATH\n");
+  printf("        Timeline to mark and report. Default $BDR_BOOTTRACE_FILE\n");
+  printf("        or %s.\n", DEFAULT_TIMELINE);
+  printf("    --fb=PATH\n");
+  printf("        Framebuffer the stand-in draws on. Default %s.\n", DEFAULT_FB);
+  printf("    --save=DIR\n");
+  printf("        Have the stand-in copy the timeline to\n");
+  printf("        DIR/boottrace_YYYYmmdd_HHMMSS.timeline after its first frame.\n");
+  printf("    --quiet\n");
+  printf("        Don't print prewarm and stand-in statistics.\n");
+  exit(1);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// read_line reads the first line of path into buf without the newline.
+static int read_line(const char* path, char* buf, size_t size) {
+  FILE* f = fopen(path, "r");
+
+  if (f == NULL) {
+    return -1;
+  }
+  if (fgets(buf, (int)size, f) == NULL) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  buf[strcspn(buf, "\n")] = 0;
+  return 0;
+}
+
+// init_start_ns returns when init (pid 1) started, from its stat
+// starttime in clock ticks since boot, or 0 if it can't be read.
+static uint64_t init_start_ns(void) {
+  char buf[1024];
+  char* p;
+  unsigned long long ticks;
+  long hz = sysconf(_SC_CLK_TCK);
+  int field;
+
+  if (read_line("/proc/1/stat", buf, sizeof(buf)) != 0 || hz <= 0) {
+    return 0;
+  }
+  // The command name may hold spaces; fields resume after its ')'.
+  p = strrchr(buf, ')');
+  if (p == NULL) {
+    return 0;
+  }
+  // starttime is field 22; p is at the end of field 2.
+  for (field = 2; field < 22 && p != NULL; field++) {
+    p = strchr(p + 1, ' ');
+  }
+  if (p == NULL || sscanf(p + 1, "%llu", &ticks) != 1) {
+    return 0;
+  }
+  return ticks * (1000000000ULL / (uint64_t)hz);
+}
+
+// open_timeline opens the timeline for appending, creating it with
+// this boot's header if it doesn't exist. The .bashrc hook marks as the
+// setup user and the prewarm service as root, so the file is shared,
+// and an existing file is opened without O_CREAT, which
+// fs.protected_regular would refuse in a sticky directory like
+// /dev/shm.
+static int open_timeline(const char* path) {
+  char boot_id[64] = "unknown";
+  char header[256];
+  uint64_t init_ns;
+  int fd, len;
+
+  for (;;) {
+    fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0 || errno != ENOENT) {
+      return fd;
+    }
+
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+      break;
+    }
+    if (errno != EEXIST) {
+      return -1;
+    }
+    // lost a race with another first mark
+  }
+
+  // Undo the umask so every user can mark.
+  fchmod(fd, 0666);
+
+  read_line(BOOT_ID_PATH, boot_id, sizeof(boot_id));
+  len = snprintf(header, sizeof(header), HEADER "%s\n", boot_id);
+  init_ns = init_start_ns();
+  if (init_ns > 0) {
+    len += snprintf(header + len, sizeof(header) - (size_t)len, "%llu init\n", (unsigned long long)init_ns);
+  }
+  if (write_all(fd, header, (size_t)len) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// mark appends a phase to the timeline. A single write to an O_APPEND
+// file, so concurrent marks don't interleave.
+static int mark(const char* phase) {
+  char line[MAX_PHASE + 32];
+  int fd, len, rc;
+
+  if (phase[0] == 0 || strlen(phase) >= MAX_PHASE || strpbrk(phase, " \t\n") != NULL) {
+    perror_msg("ERROR: phase must be a single word shorter than %d characters", MAX_PHASE);
+    return -1;
+  }
+
+  len = snprintf(line, sizeof(line), "%llu %s\n", (unsigned long long)now_ns(), phase);
+
+  fd = open_timeline(cfg.file);
+  if (fd < 0) {
+    perror_msg("ERROR: could not open %s: %s", cfg.file, strerror(errno));
+    return -1;
+  }
+  rc = write_all(fd, line, (size_t)len);
+  if (rc != 0) {
+    perror_msg("ERROR: could not write %s: %s", cfg.file, strerror(errno));
+  }
+  close(fd);
+  return rc;
+}
+
+static int entry_cmp(const void* a, const void* b) {
+  const struct entry* ea = a;
+  const struct entry* eb = b;
+
+  return ea->ns < eb->ns ? -1 : ea->ns > eb->ns;
+}
+
+// load reads a timeline, sorted by time, with the kernel start at 0.
+static int load(const char* path, struct timeline* tl) {
+  char line[256];
+  FILE* f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror_msg("ERROR: could not open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  tl->path = path;
+  tl->num = 1;
+  tl->entries[0].ns = 0;
+  strcpy(tl->entries[0].phase, "kernel");
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    struct entry* e = &tl->entries[tl->num];
+    unsigned long long ns;
+
+    if (line[0] == '#') {
+      continue;
+    }
+    if (sscanf(line, "%llu %63s", &ns, e->phase) != 2) {
+      continue;
+    }
+    if (tl->num == MAX_ENTRIES) {
+      perror_msg("WARNING: %s has more than %d phases", path, MAX_ENTRIES);
+      break;
+    }
+    e->ns = ns;
+    tl->num++;
+  }
+  fclose(f);
+
+  qsort(tl->entries, tl->num, sizeof(tl->entries[0]), entry_cmp);
+  return 0;
+}
+
+// find returns the first time phase was marked in tl, or -1.
+static int64_t find(const struct timeline* tl, const char* phase) {
+  size_t i;
+
+  for (i = 0; i < tl->num; i++) {
+    if (strcmp(tl->entries[i].phase, phase) == 0) {
+      return (int64_t)tl->entries[i].ns;
+    }
+  }
+  return -1;
+}
+
+static void report_one(const struct timeline* tl) {
+  size_t i;
+
+  printf("%-24s %10s %10s\n", "PHASE", "AT (s)", "DELTA (s)");
+  for (i = 0; i < tl->num; i++) {
+    const struct entry* e = &tl->entries[i];
+    double at = e->ns / 1e9;
+
+    if (i == 0) {
+      printf("%-24s %10.3f\n", e->phase, at);
+    } else {
+      printf("%-24s %10.3f %+10.3f\n", e->phase, at, (e->ns - tl->entries[i - 1].ns) / 1e9);
+    }
+  }
+}
+
+// report_compare prints each phase of the first timeline with its time
+// in every timeline, and the change from the first to the last.
+static void report_compare(const struct timeline* tls, size_t num) {
+  const struct timeline* first = &tls[0];
+  const struct timeline* last = &tls[num - 1];
+  size_t i, j;
+
+  printf("%-24s", "PHASE");
+  for (j = 0; j < num; j++) {
+    char col[16];
+    snprintf(col, sizeof(col), "#%d (s)", (int)j);
+    printf(" %10s", col);
+  }
+  printf(" %10s\n", "CHANGE (s)");
+
+  for (i = 0; i < first->num; i++) {
+    const char* phase = first->entries[i].phase;
+    int64_t a = find(first, phase);
+    int64_t b = find(last, phase);
+
+    // repeated phases are compared by their first mark
+    if ((uint64_t)a != first->entries[i].ns) {
+      continue;
+    }
+
+    printf("%-24s", phase);
+    for (j = 0; j < num; j++) {
+      int64_t ns = find(&tls[j], phase);
+      if (ns < 0) {
+        printf(" %10s", "-");
+      } else {
+        printf(" %10.3f", ns / 1e9);
+      }
+    }
+    if (b < 0) {
+      printf(" %10s\n", "-");
+    } else {
+      printf(" %+10.3f\n", (b - a) / 1e9);
+    }
+  }
+
+  // phases only the later timelines have, e.g. prewarm
+  for (j = 1; j < num; j++) {
+    for (i = 0; i < tls[j].num; i++) {
+      const char* phase = tls[j].entries[i].phase;
+      size_t k;
+
+      if (find(first, phase) >= 0 || (uint64_t)find(&tls[j], phase) != tls[j].entries[i].ns) {
+        continue;
+      }
+      // printed for an earlier timeline already
+      for (k = 1; k < j && find(&tls[k], phase) < 0; k++) {
+      }
+      if (k < j) {
+        continue;
+      }
+
+      printf("%-24s", phase);
+      for (k = 0; k < num; k++) {
+        int64_t ns = find(&tls[k], phase);
+        if (ns < 0) {
+          printf(" %10s", "-");
+        } else {
+          printf(" %10.3f", ns / 1e9);
+        }
+      }
+      printf(" %10s\n", "-");
+    }
+  }
+
+  printf("\n");
+  for (j = 0; j < num; j++) {
+    printf("#%d: %s\n", (int)j, tls[j].path);
+  }
+}
+
+static int report(char** paths, int num) {
+  static struct timeline tls[MAX_TIMELINES];
+  const char* current = cfg.file;
+  int i;
+
+  if (num == 0) {
+    paths = (char**)&current;
+    num = 1;
+  }
+  if (num > MAX_TIMELINES) {
+    perror_msg("ERROR: at most %d timelines can be compared", MAX_TIMELINES);
+    return -1;
+  }
+
+  for (i = 0; i < num; i++) {
+    if (load(paths[i], &tls[i]) != 0) {
+      return -1;
+    }
+  }
+
+  if (num == 1) {
+    report_one(&tls[0]);
+  } else {
+    report_compare(tls, (size_t)num);
+  }
+  return 0;
+}
+
+// Loading. nftw has no context argument, so the walk's state is global.
+
+static struct load_stats walk_stats;
+static char* walk_buf;
+
+static int load_file(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+  int fd;
+
+  (void)ftw;
+
+  if (type != FTW_F || !S_ISREG(st->st_mode)) {
+    return 0;
+  }
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if (fd < 0 && errno == EPERM) {
+    // O_NOATIME needs the file's owner
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    walk_stats.errors++;
+    return 0;
+  }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  for (;;) {
+    ssize_t n = read(fd, walk_buf, READ_CHUNK);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      walk_stats.errors++;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    walk_stats.bytes += (uint64_t)n;
+  }
+  close(fd);
+
+  walk_stats.files++;
+  return 0;
+}
+
+// load_dir reads every regular file under dir, adding to walk_stats.
+static int load_dir(const char* dir) {
+  if (walk_buf == NULL) {
+    walk_buf = malloc(READ_CHUNK);
+    if (walk_buf == NULL) {
+      abort_msg("ERROR: out of memory");
+    }
+  }
+
+  if (nftw(dir, load_file, 32, FTW_PHYS | FTW_MOUNT) != 0) {
+    perror_msg("ERROR: could not walk %s: %s", dir, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void print_stats(const char* what, uint64_t start_ns) {
+  double secs = (now_ns() - start_ns) / 1e9;
+
+  if (cfg.quiet) {
+    return;
+  }
+  printf("%s: %llu files, %.1f MiB in %.3f s (%.1f MiB/s), %llu errors\n",
+         what, (unsigned long long)walk_stats.files, walk_stats.bytes / 1048576.0, secs,
+         secs > 0 ? walk_stats.bytes / 1048576.0 / secs : 0.0,
+         (unsigned long long)walk_stats.errors);
+}
+
+// prewarm pulls dirs into the page cache. Marking is best effort: a
+// missing timeline mustn't stop the prewarm.
+static int prewarm(char** dirs, int num) {
+  uint64_t start = now_ns();
+  int i, rc = 0;
+
+  mark("prewarm_start");
+  for (i = 0; i < num; i++) {
+    if (load_dir(dirs[i]) != 0) {
+      rc = -1;
+    }
+  }
+  mark("prewarm_done");
+
+  print_stats("prewarm", start);
+  return rc;
+}
+
+// draw_frame fills one frame on the framebuffer (or, if path isn't
+// one, writes a frame's worth of pixels to it) and waits for it to
+// reach the device.
+static int draw_frame(const char* path) {
+  struct fb_var_screeninfo var;
+  struct fb_fix_screeninfo fix;
+  size_t line_len, height, y;
+  char* line;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    perror_msg("ERROR: could not open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  if (ioctl(fd, FBIOGET_VSCREENINFO, &var) == 0 && ioctl(fd, FBIOGET_FSCREENINFO, &fix) == 0) {
+    line_len = fix.line_length;
+    height = var.yres;
+  } else {
+    line_len = FALLBACK_WIDTH * FALLBACK_BPP;
+    height = FALLBACK_HEIGHT;
+  }
+
+  line = malloc(line_len);
+  if (line == NULL) {
+    abort_msg("ERROR: out of memory");
+  }
+  // a dark grey dashboard
+  memset(line, 0x20, line_len);
+
+  for (y = 0; y < height; y++) {
+    if (write_all(fd, line, line_len) != 0) {
+      perror_msg("ERROR: could not draw on %s: %s", path, strerror(errno));
+      free(line);
+      close(fd);
+      return -1;
+    }
+  }
+  fsync(fd);
+
+  free(line);
+  close(fd);
+  return 0;
+}
+
+// save copies the timeline into dir.
+static int save(const char* dir) {
+  char path[PATH_MAX];
+  char stamp[32];
+  char buf[4096];
+  time_t t = time(NULL);
+  struct tm tm;
+  int in, out;
+  ssize_t n;
+
+  localtime_r(&t, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+  snprintf(path, sizeof(path), "%s/boottrace_%s.timeline", dir, stamp);
+
+  in = open(cfg.file, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    perror_msg("ERROR: could not open %s: %s", cfg.file, strerror(errno));
+    return -1;
+  }
+  out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    perror_msg("ERROR: could not create %s: %s", path, strerror(errno));
+    close(in);
+    return -1;
+  }
+
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write_all(out, buf, (size_t)n) != 0) {
+      n = -1;
+      break;
+    }
+  }
+  if (n < 0) {
+    perror_msg("ERROR: could not copy %s to %s: %s", cfg.file, path, strerror(errno));
+  }
+  close(in);
+  fsync(out);
+  close(out);
+
+  if (n == 0 && !cfg.quiet) {
+    printf("saved %s\n", path);
+  }
+  return n < 0 ? -1 : 0;
+}
+
+static int standin(const char* dir) {
+  uint64_t start = now_ns();
+
+  mark("app_start");
+  if (load_dir(dir) != 0) {
+    return -1;
+  }
+  mark("app_loaded");
+  print_stats("standin", start);
+
+  if (draw_frame(cfg.fb) != 0) {
+    return -1;
+  }
+  mark("first_frame");
+
+  if (cfg.save_dir != NULL) {
+    return save(cfg.save_dir);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  enum {
+    OPT_FILE = 1,
+    OPT_FB,
+    OPT_SAVE,
+    OPT_QUIET,
+    OPT_HELP,
+  };
+  static const struct option opts[] = {
+    { "file", required_argument, NULL, OPT_FILE },
+    { "fb", required_argument, NULL, OPT_FB },
+    { "save", required_argument, NULL, OPT_SAVE },
+    { "quiet", no_argument, NULL, OPT_QUIET },
+    { "help", no_argument, NULL, OPT_HELP },
+    { 0 },
+  };
+  const char* env = getenv("BDR_BOOTTRACE_FILE");
+  const char* cmd;
+  int c, nargs;
+  char** args;
+
+  if (env != NULL && env[0] != 0) {
+    cfg.file = env;
+  }
+
+  while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+    switch (c) {
+    case OPT_FILE:
+      cfg.file = optarg;
+      break;
+    case OPT_FB:
+      cfg.fb = optarg;
+      break;
+    case OPT_SAVE:
+      cfg.save_dir = optarg;
+      break;
+    case OPT_QUIET:
+      cfg.quiet = 1;
+      break;
+    case 'h':
+    case OPT_HELP:
+      usage(argv[0], NULL);
+      break;
+    default:
+      usage(argv[0], "unknown argument");
+      break;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0], "a command is required");
+  }
+  cmd = argv[optind];
+  args = &argv[optind + 1];
+  nargs = argc - optind - 1;
+
+  if (strcmp(cmd, "mark") == 0) {
+    if (nargs != 1) {
+      usage(argv[0], "mark takes one PHASE");
+    }
+    return mark(args[0]) == 0 ? 0 : 1;
+  }
+  if (strcmp(cmd, "report") == 0) {
+    return report(args, nargs) == 0 ? 0 : 1;
+  }
+  if (strcmp(cmd, "prewarm") == 0) {
+    if (nargs < 1) {
+      usage(argv[0], "prewarm needs a DIR");
+    }
+    return prewarm(args, nargs) == 0 ? 0 : 1;
+  }
+  if (strcmp(cmd, "standin") == 0) {
+    if (nargs != 1) {
+      usage(argv[0], "standin takes one DIR");
+    }
+    return standin(args[0]) == 0 ? 0 : 1;
+  }
+
+  usage(argv[0], "unknown command");
+  return 1;
+}
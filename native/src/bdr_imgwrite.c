@@ -0,0 +1,722 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "sha256.h"
+
+// bdr_imgwrite writes a (possibly xz-compressed) disk image to a
+// device or file in a single pass. One thread decompresses into a
+// ring of block-sized buffers; a second hashes each buffer while the
+// main thread writes it, so the image is never expanded on disk and
+// never read twice.
+//
+// Writes are block-sized, aligned and bypass the page cache (O_DIRECT
+// on Linux, F_NOCACHE on macOS). With --skip-zeros, all-zero blocks
+// are not written where the target is known to read back as zeros: a
+// file (truncated, so they are holes) or a device that reports that
+// its --discard zeroes. Elsewhere they are zeroed with BLKZEROOUT,
+// which the device may do without the data crossing the bus, or
+// written like any other block; a formatted card holds old data. The
+// first block -- the partition table -- is written last, and only
+// after the hash checks out, so an interrupted or corrupt write never
+// leaves a card that looks bootable. --verify reads the written range
+// back and compares hashes.
+
+#define DEFAULT_BLOCK_SIZE (4 * 1024 * 1024)
+#define NUM_BUFFERS        8
+#define ALIGNMENT          4096
+#define XZ_INPUT_SIZE      (1024 * 1024)
+
+static const unsigned char XZ_MAGIC[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+struct config {
+  const char* image;
+  const char* target;
+  const char* sha256;
+  size_t block_size;
+  int skip_zeros;
+  int verify;
+  int direct;
+  int discard;
+  int progress;
+};
+
+struct buffer {
+  unsigned char* data;
+  size_t len;
+  int last;
+};
+
+// ring is shared by the decompressor, hasher and writer. A slot is
+// reused once both consumers have moved past it.
+struct ring {
+  pthread_mutex_t mu;
+  pthread_cond_t cond;
+  struct buffer bufs[NUM_BUFFERS];
+  uint64_t produced;
+  uint64_t hashed;
+  uint64_t written;
+};
+
+struct source {
+  int fd;
+  int xz;
+  lzma_stream strm;
+  unsigned char* in;
+  int in_eof;
+};
+
+struct hasher {
+  struct ring* ring;
+  struct sha256 sha;
+  uint64_t bytes;
+};
+
+static void perror_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+static void abort_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void usage(const char* argv0, const char* err) {
+  if (err != NULL) {
+    perror_msg("ERROR: %s", err);
+    printf("\n");
+  }
+  printf("Usage:\n");
+  printf("    %s [options] IMAGE TARGET\n", argv0);
+  printf("\n");
+  printf("Writes IMAGE (raw or .xz, - for stdin) to TARGET, a block device\n");
+  printf("or a file.\n");
+  printf("\n");
+  printf("Options:\n");
+  printf("    --sha256=HEX\n");
+  printf("        Expected sha256 of the uncompressed image. On mismatch the\n");
+  printf("        first block is not written and the exit status is 1.\n");
+  printf("    --block-size=BYTES\n");
+  printf("        Size of each write, a multiple of %d. Default %d.\n", ALIGNMENT, DEFAULT_BLOCK_SIZE);
+  printf("    --skip-zeros\n");
+  printf("        Do not write all-zero blocks where TARGET is known to read\n");
+  printf("        back as zeros (a file, or a device whose --discard zeroes);\n");
+  printf("        elsewhere zero them with BLKZEROOUT where supported.\n");
+  printf("    --discard\n");
+  printf("        Discard the whole device before writing (Linux only).\n");
+  printf("    --verify\n");
+  printf("        Read TARGET back and compare its hash after writing.\n");
+  printf("    --no-direct\n");
+  printf("        Write through the page cache.\n");
+  printf("    --progress / --no-progress\n");
+  printf("        Report progress every second. Default on when stderr is\n");
+  printf("        a terminal.\n");
+  exit(1);
+}
+
+// parse_size parses a decimal argument, aborting on garbage.
+static size_t parse_size(const char* name, const char* value) {
+  char* end = NULL;
+  unsigned long long v;
+
+  if (value == NULL || *value == 0) {
+    abort_msg("ERROR: %s must have a value", name);
+  }
+
+  errno = 0;
+  v = strtoull(value, &end, 10);
+  if (errno != 0 || end == value || *end != 0) {
+    abort_msg("ERROR: %s must be a number, got %s", name, value);
+  }
+  return (size_t)v;
+}
+
+static void parse_args(int argc, char** argv, struct config* cfg) {
+  enum {
+    OPT_SHA256 = 1,
+    OPT_BLOCK_SIZE,
+    OPT_SKIP_ZEROS,
+    OPT_DISCARD,
+    OPT_VERIFY,
+    OPT_NO_DIRECT,
+    OPT_PROGRESS,
+    OPT_NO_PROGRESS,
+    OPT_HELP,
+  };
+  static const struct option opts[] = {
+    { "sha256", required_argument, NULL, OPT_SHA256 },
+    { "block-size", required_argument, NULL, OPT_BLOCK_SIZE },
+    { "skip-zeros", no_argument, NULL, OPT_SKIP_ZEROS },
+    { "discard", no_argument, NULL, OPT_DISCARD },
+    { "verify", no_argument, NULL, OPT_VERIFY },
+    { "no-direct", no_argument, NULL, OPT_NO_DIRECT },
+    { "progress", no_argument, NULL, OPT_PROGRESS },
+    { "no-progress", no_argument, NULL, OPT_NO_PROGRESS },
+    { "help", no_argument, NULL, OPT_HELP },
+    { 0 },
+  };
+  int c;
+
+  while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+    switch (c) {
+    case OPT_SHA256:
+      cfg->sha256 = optarg;
+      break;
+    case OPT_BLOCK_SIZE:
+      cfg->block_size = parse_size("block-size", optarg);
+      break;
+    case OPT_SKIP_ZEROS:
+      cfg->skip_zeros = 1;
+      break;
+    case OPT_DISCARD:
+      cfg->discard = 1;
+      break;
+    case OPT_VERIFY:
+      cfg->verify = 1;
+      break;
+    case OPT_NO_DIRECT:
+      cfg->direct = 0;
+      break;
+    case OPT_PROGRESS:
+      cfg->progress = 1;
+      break;
+    case OPT_NO_PROGRESS:
+      cfg->progress = 0;
+      break;
+    case 'h':
+    case OPT_HELP:
+      usage(argv[0], NULL);
+      break;
+    default:
+      usage(argv[0], "unknown argument");
+      break;
+    }
+  }
+
+  if (argc - optind != 2) {
+    usage(argv[0], "IMAGE and TARGET are required");
+  }
+  cfg->image = argv[optind];
+  cfg->target = argv[optind + 1];
+
+  if (cfg->block_size == 0 || cfg->block_size % ALIGNMENT != 0) {
+    abort_msg("ERROR: block-size must be a non-zero multiple of %d", ALIGNMENT);
+  }
+  if (cfg->sha256 != NULL && strlen(cfg->sha256) != SHA256_HEX_LEN) {
+    abort_msg("ERROR: sha256 must be %d hex digits", SHA256_HEX_LEN);
+  }
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void* alloc_aligned(size_t size) {
+  void* p = NULL;
+  if (posix_memalign(&p, ALIGNMENT, size) != 0) {
+    abort_msg("ERROR: out of memory");
+  }
+  return p;
+}
+
+// read_full reads until buf is full or EOF.
+static size_t read_full(int fd, unsigned char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      abort_msg("ERROR: read: %s", strerror(errno));
+    }
+    if (n == 0) {
+      break;
+    }
+    got += (size_t)n;
+  }
+  return got;
+}
+
+static void source_open(struct source* src, const char* path) {
+  lzma_ret ret;
+
+  memset(src, 0, sizeof(*src));
+  if (strcmp(path, "-") == 0) {
+    src->fd = STDIN_FILENO;
+  } else {
+    src->fd = open(path, O_RDONLY);
+    if (src->fd < 0) {
+      abort_msg("ERROR: open %s: %s", path, strerror(errno));
+    }
+  }
+
+  // Sniff the magic rather than trusting the name; stdin has none.
+  src->in = malloc(XZ_INPUT_SIZE);
+  if (src->in == NULL) {
+    abort_msg("ERROR: out of memory");
+  }
+  src->strm.avail_in = read_full(src->fd, src->in, sizeof(XZ_MAGIC));
+  src->strm.next_in = src->in;
+  src->xz = src->strm.avail_in == sizeof(XZ_MAGIC) &&
+    memcmp(src->in, XZ_MAGIC, sizeof(XZ_MAGIC)) == 0;
+  if (!src->xz) {
+    return;
+  }
+
+#if LZMA_VERSION >= 50040002
+  {
+    lzma_mt mt = {
+      .flags = LZMA_CONCATENATED,
+      .threads = lzma_cputhreads(),
+      .memlimit_threading = lzma_physmem() / 4,
+      .memlimit_stop = UINT64_MAX,
+    };
+    if (mt.threads == 0) {
+      mt.threads = 1;
+    }
+    ret = lzma_stream_decoder_mt(&src->strm, &mt);
+  }
+#else
+  ret = lzma_stream_decoder(&src->strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+  if (ret != LZMA_OK) {
+    abort_msg("ERROR: could not initialize xz decoder (%d)", ret);
+  }
+}
+
+// source_read fills buf with up to len bytes of image and returns the
+// number of bytes read; less than len means the image has ended.
+static size_t source_read(struct source* src, unsigned char* buf, size_t len) {
+  if (!src->xz) {
+    size_t got = 0;
+    // bytes consumed while sniffing for the magic
+    if (src->strm.avail_in > 0) {
+      got = src->strm.avail_in < len ? src->strm.avail_in : len;
+      memcpy(buf, src->strm.next_in, got);
+      src->strm.next_in += got;
+      src->strm.avail_in -= got;
+    }
+    return got + read_full(src->fd, buf + got, len - got);
+  }
+
+  src->strm.next_out = buf;
+  src->strm.avail_out = len;
+  while (src->strm.avail_out > 0) {
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret;
+
+    if (src->strm.avail_in == 0 && !src->in_eof) {
+      src->strm.next_in = src->in;
+      src->strm.avail_in = read_full(src->fd, src->in, XZ_INPUT_SIZE);
+      if (src->strm.avail_in == 0) {
+        src->in_eof = 1;
+      }
+    }
+    if (src->in_eof) {
+      action = LZMA_FINISH;
+    }
+
+    ret = lzma_code(&src->strm, action);
+    if (ret == LZMA_STREAM_END) {
+      break;
+    }
+    if (ret != LZMA_OK) {
+      abort_msg("ERROR: xz decompression failed (%d)", ret);
+    }
+  }
+  return len - src->strm.avail_out;
+}
+
+static void* decompress_main(void* arg) {
+  struct source* src = ((void**)arg)[0];
+  struct ring* ring = ((void**)arg)[1];
+  size_t block_size = *(size_t*)((void**)arg)[2];
+  int last = 0;
+
+  while (!last) {
+    struct buffer* b;
+    uint64_t seq;
+
+    pthread_mutex_lock(&ring->mu);
+    seq = ring->produced;
+    while (seq - (ring->hashed < ring->written ? ring->hashed : ring->written) >= NUM_BUFFERS) {
+      pthread_cond_wait(&ring->cond, &ring->mu);
+    }
+    pthread_mutex_unlock(&ring->mu);
+
+    b = &ring->bufs[seq % NUM_BUFFERS];
+    b->len = source_read(src, b->data, block_size);
+    b->last = last = b->len < block_size;
+
+    pthread_mutex_lock(&ring->mu);
+    ring->produced++;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mu);
+  }
+  return NULL;
+}
+
+// ring_next waits for the buffer after *pos to be produced.
+static struct buffer* ring_next(struct ring* ring, uint64_t* pos) {
+  pthread_mutex_lock(&ring->mu);
+  while (*pos >= ring->produced) {
+    pthread_cond_wait(&ring->cond, &ring->mu);
+  }
+  pthread_mutex_unlock(&ring->mu);
+  return &ring->bufs[*pos % NUM_BUFFERS];
+}
+
+// ring_done marks the buffer at *pos consumed.
+static void ring_done(struct ring* ring, uint64_t* pos) {
+  pthread_mutex_lock(&ring->mu);
+  (*pos)++;
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->mu);
+}
+
+static void* hash_main(void* arg) {
+  struct hasher* h = arg;
+  int last = 0;
+
+  while (!last) {
+    struct buffer* b = ring_next(h->ring, &h->ring->hashed);
+    sha256_update(&h->sha, b->data, b->len);
+    h->bytes += b->len;
+    last = b->last;
+    ring_done(h->ring, &h->ring->hashed);
+  }
+  return NULL;
+}
+
+static int is_zero(const unsigned char* p, size_t len) {
+  const uint64_t* w = (const uint64_t*)p;
+  size_t i;
+
+  // buffers are aligned and block_size is a multiple of 8
+  for (i = 0; i < len / 8; i++) {
+    if (w[i] != 0) {
+      return 0;
+    }
+  }
+  for (i = len & ~(size_t)7; i < len; i++) {
+    if (p[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// open_direct opens path, bypassing the page cache where supported.
+// Returns whether that worked in *direct.
+static int open_direct(const char* path, int flags, int* direct) {
+  int fd = -1;
+
+#ifdef O_DIRECT
+  if (*direct) {
+    fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0 && errno != EINVAL) {
+      return fd;
+    }
+  }
+#endif
+  if (fd < 0) {
+    // e.g. tmpfs rejects O_DIRECT
+    fd = open(path, flags, 0644);
+#ifdef F_NOCACHE
+    if (fd >= 0 && *direct) {
+      fcntl(fd, F_NOCACHE, 1);
+      return fd;
+    }
+#endif
+    *direct = 0;
+  }
+  return fd;
+}
+
+// clear_direct drops O_DIRECT for a final, unaligned write.
+static void clear_direct(int fd) {
+#ifdef O_DIRECT
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0) {
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+  }
+#else
+  (void)fd;
+#endif
+}
+
+static void write_at(int fd, const unsigned char* data, size_t len, uint64_t off, int direct) {
+  size_t done = 0;
+
+  if (direct && len % ALIGNMENT != 0) {
+    clear_direct(fd);
+  }
+
+  while (done < len) {
+    ssize_t n = pwrite(fd, data + done, len - done, (off_t)(off + done));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      abort_msg("ERROR: write at %llu: %s", (unsigned long long)(off + done), strerror(errno));
+    }
+    done += (size_t)n;
+  }
+}
+
+static void discard(int fd, const char* path) {
+#ifdef BLKDISCARD
+  uint64_t size = 0;
+  uint64_t range[2];
+
+  if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+    abort_msg("ERROR: %s: cannot discard, not a block device", path);
+  }
+  range[0] = 0;
+  range[1] = size;
+  if (ioctl(fd, BLKDISCARD, range) != 0) {
+    abort_msg("ERROR: discard %s: %s", path, strerror(errno));
+  }
+#else
+  (void)fd;
+  abort_msg("ERROR: %s: --discard is not supported on this platform", path);
+#endif
+}
+
+// discard_zeroes tells whether a discarded device reads back as zeros.
+static int discard_zeroes(int fd) {
+#ifdef BLKDISCARDZEROES
+  unsigned int zeroes = 0;
+
+  return ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
+// How --skip-zeros handles an all-zero block.
+#define ZEROS_READ     0 // the target reads back as zeros: skip it
+#define ZEROS_ZEROOUT  1 // try BLKZEROOUT
+#define ZEROS_WRITE    2 // write it
+
+// zero_out tells whether the all-zero block at off may go unwritten,
+// zeroing it with BLKZEROOUT if need be. A target that can't do that
+// isn't asked again.
+static int zero_out(int fd, uint64_t off, size_t len, int* zeros) {
+#ifdef BLKZEROOUT
+  uint64_t range[2] = { off, len };
+
+  if (*zeros == ZEROS_ZEROOUT && ioctl(fd, BLKZEROOUT, range) != 0) {
+    *zeros = ZEROS_WRITE;
+  }
+#else
+  (void)fd;
+  (void)off;
+  (void)len;
+  if (*zeros == ZEROS_ZEROOUT) {
+    *zeros = ZEROS_WRITE;
+  }
+#endif
+  return *zeros != ZEROS_WRITE;
+}
+
+static void report_progress(uint64_t written, uint64_t skipped, double start, int final) {
+  double elapsed = now() - start;
+  double mib = (written + skipped) / (1024.0 * 1024.0);
+
+  fprintf(stderr, "\r%.0f MiB (%.0f MiB skipped), %.1f MiB/s%s",
+          mib, skipped / (1024.0 * 1024.0),
+          elapsed > 0 ? mib / elapsed : 0.0,
+          final ? "\n" : "");
+}
+
+// verify reads len bytes back from path and returns their hash.
+static void verify(const char* path, uint64_t len, size_t block_size, int direct, char* hex) {
+  unsigned char* buf = alloc_aligned(block_size);
+  unsigned char digest[SHA256_DIGEST_LEN];
+  struct sha256 sha;
+  uint64_t off = 0;
+  int fd;
+
+  fd = open_direct(path, O_RDONLY, &direct);
+  if (fd < 0) {
+    abort_msg("ERROR: open %s: %s", path, strerror(errno));
+  }
+#if defined(POSIX_FADV_DONTNEED)
+  if (!direct) {
+    // make sure we read the media, not what we just wrote
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+#endif
+
+  sha256_init(&sha);
+  while (off < len) {
+    size_t want = len - off < block_size ? (size_t)(len - off) : block_size;
+    // O_DIRECT reads must be aligned; read whole blocks and hash
+    // only what belongs to the image.
+    size_t req = direct ? (want + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1) : want;
+    ssize_t n = pread(fd, buf, req, (off_t)off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      abort_msg("ERROR: verify read at %llu: %s", (unsigned long long)off, strerror(errno));
+    }
+    if ((size_t)n < want) {
+      abort_msg("ERROR: verify: %s is shorter than the image", path);
+    }
+    sha256_update(&sha, buf, want);
+    off += want;
+  }
+  sha256_final(&sha, digest);
+  sha256_hex(digest, hex);
+
+  close(fd);
+  free(buf);
+}
+
+int main(int argc, char** argv) {
+  struct config cfg = {
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .direct = 1,
+    .progress = isatty(STDERR_FILENO),
+  };
+  struct ring ring = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+  };
+  struct source src;
+  struct hasher hasher = { .ring = &ring };
+  pthread_t decompress_thread, hash_thread;
+  void* decompress_args[3];
+  unsigned char* first = NULL;
+  size_t first_len = 0;
+  uint64_t off = 0, written = 0, skipped = 0;
+  unsigned char digest[SHA256_DIGEST_LEN];
+  char hex[SHA256_HEX_LEN + 1];
+  struct stat st;
+  int is_file, direct, fd, i, zeros, last = 0;
+  double start, last_progress;
+
+  parse_args(argc, argv, &cfg);
+
+  // Regular files are truncated so skipped blocks read back as holes;
+  // devices are written in place.
+  is_file = stat(cfg.target, &st) != 0 || S_ISREG(st.st_mode);
+  direct = cfg.direct;
+  fd = open_direct(cfg.target, O_WRONLY | O_CREAT | (is_file ? O_TRUNC : 0), &direct);
+  if (fd < 0) {
+    abort_msg("ERROR: open %s: %s", cfg.target, strerror(errno));
+  }
+  if (cfg.discard) {
+    discard(fd, cfg.target);
+  }
+  zeros = is_file || (cfg.discard && discard_zeroes(fd)) ? ZEROS_READ : ZEROS_ZEROOUT;
+
+  source_open(&src, cfg.image);
+  for (i = 0; i < NUM_BUFFERS; i++) {
+    ring.bufs[i].data = alloc_aligned(cfg.block_size);
+  }
+  sha256_init(&hasher.sha);
+
+  decompress_args[0] = &src;
+  decompress_args[1] = &ring;
+  decompress_args[2] = &cfg.block_size;
+  if (pthread_create(&decompress_thread, NULL, decompress_main, decompress_args) != 0 ||
+      pthread_create(&hash_thread, NULL, hash_main, &hasher) != 0) {
+    abort_msg("ERROR: could not start threads");
+  }
+
+  start = last_progress = now();
+  while (!last) {
+    struct buffer* b = ring_next(&ring, &ring.written);
+
+    if (off == 0) {
+      // Hold the partition table back until the hash is known.
+      first = alloc_aligned(cfg.block_size);
+      memcpy(first, b->data, b->len);
+      first_len = b->len;
+    } else if (cfg.skip_zeros && is_zero(b->data, b->len) && zero_out(fd, off, b->len, &zeros)) {
+      skipped += b->len;
+    } else {
+      write_at(fd, b->data, b->len, off, direct);
+      written += b->len;
+    }
+    off += b->len;
+    last = b->last;
+    ring_done(&ring, &ring.written);
+
+    if (cfg.progress && now() - last_progress >= 1.0) {
+      last_progress = now();
+      report_progress(written, skipped, start, 0);
+    }
+  }
+
+  pthread_join(decompress_thread, NULL);
+  pthread_join(hash_thread, NULL);
+  sha256_final(&hasher.sha, digest);
+  sha256_hex(digest, hex);
+
+  if (cfg.sha256 != NULL && strcasecmp(cfg.sha256, hex) != 0) {
+    abort_msg("ERROR: hash mismatch: got %s, expected %s (first block not written)", hex, cfg.sha256);
+  }
+
+  if (first_len > 0) {
+    write_at(fd, first, first_len, 0, direct);
+    written += first_len;
+  }
+  if (is_file && ftruncate(fd, (off_t)off) != 0) {
+    abort_msg("ERROR: truncate %s: %s", cfg.target, strerror(errno));
+  }
+  // EINVAL: a special file with nothing to sync
+  if (fsync(fd) != 0 && errno != EINVAL) {
+    abort_msg("ERROR: sync %s: %s", cfg.target, strerror(errno));
+  }
+  close(fd);
+
+  if (cfg.progress) {
+    report_progress(written, skipped, start, 1);
+  }
+  perror_msg("wrote %llu bytes (%llu skipped) in %.1fs, sha256 %s",
+             (unsigned long long)written, (unsigned long long)skipped, now() - start, hex);
+
+  if (cfg.verify) {
+    char got[SHA256_HEX_LEN + 1];
+    verify(cfg.target, off, cfg.block_size, cfg.direct, got);
+    if (strcmp(got, hex) != 0) {
+      abort_msg("ERROR: verify failed: read back %s, expected %s", got, hex);
+    }
+    perror_msg("verified %s", cfg.target);
+  }
+
+  printf("%s\n", hex);
+  return 0;
+}
@@ -0,0 +1,855 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <lzma.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// bdr_logsink runs a command and captures its stdout and stderr into
+// timestamped log files with as few SD card writes as possible. It
+// replaces `>> "${LOGFILE}" 2>&1` in resources/bdr_racecapture.sh.
+//
+// Output is collected in memory and written in one batch once
+// --flush-bytes have accumulated or --flush-interval seconds have
+// passed since the first unwritten byte, whichever comes first (and
+// on exit or SIGUSR1). Logs larger than --max-size are rotated, and
+// rotated logs are xz-compressed by a low-priority child process.
+// Only the newest --keep logs are kept, along with their crash
+// reports (below), and leftovers of interrupted compressions are
+// removed. On exit the last log is
+// compressed too, and the sink waits for its compressors: under
+// systemd, whatever is left in the unit once the launcher exits is
+// killed.
+//
+// The last --crash-seconds of output are also kept in memory. If the
+// command exits with a non-zero status or dies from a signal, they
+// are written to <log>.crash next to the log and synced, so the tail
+// survives even if the full log has since been rotated.
+//
+// SIGINT, SIGTERM and SIGHUP are forwarded to the command. The exit
+// status is the command's (128 + signal if it was killed).
+
+#define DEFAULT_PREFIX         "log"
+#define DEFAULT_KEEP           10
+#define DEFAULT_FLUSH_BYTES    (64 * 1024)
+#define DEFAULT_FLUSH_INTVL    30
+#define DEFAULT_MAX_SIZE       (16 * 1024 * 1024)
+#define DEFAULT_CRASH_SECONDS  60
+#define DEFAULT_CRASH_BUFFER   (1024 * 1024)
+
+// The pending buffer holds this many flush batches before a write is
+// forced regardless of the thresholds.
+#define PENDING_BATCHES 4
+
+// Marks record when history bytes arrived; one per read, coalesced
+// to this resolution.
+#define MAX_MARKS        4096
+#define MARK_RESOLUTION  0.1
+
+struct config {
+  const char* dir;
+  const char* prefix;
+  long keep;
+  long flush_bytes;
+  long flush_intvl;
+  long max_size;
+  long crash_seconds;
+  long crash_buffer;
+  int compress;
+  char** argv;
+};
+
+struct mark {
+  double t;
+  uint64_t off;
+};
+
+// history is a ring of the most recent output, for crash reports.
+struct history {
+  char* buf;
+  size_t cap;
+  uint64_t total;
+  struct mark marks[MAX_MARKS];
+  size_t first_mark;
+  size_t num_marks;
+};
+
+struct log {
+  char path[PATH_MAX];
+  int fd;
+  uint64_t size;
+  char* pending;
+  size_t pending_len;
+  size_t pending_cap;
+  double pending_since;
+  int rotated;
+};
+
+static void perror_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+static void abort_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void usage(const char* argv0, const char* err) {
+  if (err != NULL) {
+    perror_msg("ERROR: %s", err);
+    printf("\n");
+  }
+  printf("Usage:\n");
+  printf("    %s [options] --dir=DIR -- COMMAND [ARGS...]\n", argv0);
+  printf("\n");
+  printf("Options:\n");
+  printf("    --dir=DIR\n");
+  printf("        Directory for log files.\n");
+  printf("    --prefix=NAME\n");
+  printf("        Logs are named NAME_YYYYmmdd_HHMMSS.log. Default %s.\n", DEFAULT_PREFIX);
+  printf("    --keep=N\n");
+  printf("        Number of NAME_* logs to keep; their .crash files are kept\n");
+  printf("        with them. Default %d.\n", DEFAULT_KEEP);
+  printf("    --flush-bytes=BYTES\n");
+  printf("        Write once this much output is buffered. Default %d.\n", DEFAULT_FLUSH_BYTES);
+  printf("    --flush-interval=S\n");
+  printf("        Write buffered output at least this often. Default %d s.\n", DEFAULT_FLUSH_INTVL);
+  printf("    --max-size=BYTES\n");
+  printf("        Rotate logs larger than this. Default %d.\n", DEFAULT_MAX_SIZE);
+  printf("    --crash-seconds=S\n");
+  printf("        Seconds of output to save in <log>.crash when COMMAND\n");
+  printf("        fails. Default %d s.\n", DEFAULT_CRASH_SECONDS);
+  printf("    --crash-buffer=BYTES\n");
+  printf("        Memory used to keep that output. Default %d.\n", DEFAULT_CRASH_BUFFER);
+  printf("    --no-compress\n");
+  printf("        Leave rotated logs uncompressed.\n");
+  exit(1);
+}
+
+// parse_long parses a decimal argument, aborting on garbage.
+static long parse_long(const char* name, const char* value) {
+  char* end = NULL;
+  long v;
+
+  if (value == NULL || *value == 0) {
+    abort_msg("ERROR: %s must have a value", name);
+  }
+
+  errno = 0;
+  v = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != 0) {
+    abort_msg("ERROR: %s must be a number, got %s", name, value);
+  }
+  return v;
+}
+
+static void validate(const char* name, long value, long minval, long maxval) {
+  if (value < minval || value > maxval) {
+    abort_msg("ERROR: %s must be between %ld and %ld, got %ld", name, minval, maxval, value);
+  }
+}
+
+static void parse_args(int argc, char** argv, struct config* cfg) {
+  enum {
+    OPT_DIR = 1,
+    OPT_PREFIX,
+    OPT_KEEP,
+    OPT_FLUSH_BYTES,
+    OPT_FLUSH_INTVL,
+    OPT_MAX_SIZE,
+    OPT_CRASH_SECONDS,
+    OPT_CRASH_BUFFER,
+    OPT_NO_COMPRESS,
+    OPT_HELP,
+  };
+  static const struct option opts[] = {
+    { "dir", required_argument, NULL, OPT_DIR },
+    { "prefix", required_argument, NULL, OPT_PREFIX },
+    { "keep", required_argument, NULL, OPT_KEEP },
+    { "flush-bytes", required_argument, NULL, OPT_FLUSH_BYTES },
+    { "flush-interval", required_argument, NULL, OPT_FLUSH_INTVL },
+    { "max-size", required_argument, NULL, OPT_MAX_SIZE },
+    { "crash-seconds", required_argument, NULL, OPT_CRASH_SECONDS },
+    { "crash-buffer", required_argument, NULL, OPT_CRASH_BUFFER },
+    { "no-compress", no_argument, NULL, OPT_NO_COMPRESS },
+    { "help", no_argument, NULL, OPT_HELP },
+    { 0 },
+  };
+  int c;
+
+  // "+" stops at the first non-option so COMMAND's flags are left alone.
+  while ((c = getopt_long(argc, argv, "+h", opts, NULL)) != -1) {
+    switch (c) {
+    case OPT_DIR:
+      cfg->dir = optarg;
+      break;
+    case OPT_PREFIX:
+      cfg->prefix = optarg;
+      break;
+    case OPT_KEEP:
+      cfg->keep = parse_long("keep", optarg);
+      break;
+    case OPT_FLUSH_BYTES:
+      cfg->flush_bytes = parse_long("flush-bytes", optarg);
+      break;
+    case OPT_FLUSH_INTVL:
+      cfg->flush_intvl = parse_long("flush-interval", optarg);
+      break;
+    case OPT_MAX_SIZE:
+      cfg->max_size = parse_long("max-size", optarg);
+      break;
+    case OPT_CRASH_SECONDS:
+      cfg->crash_seconds = parse_long("crash-seconds", optarg);
+      break;
+    case OPT_CRASH_BUFFER:
+      cfg->crash_buffer = parse_long("crash-buffer", optarg);
+      break;
+    case OPT_NO_COMPRESS:
+      cfg->compress = 0;
+      break;
+    case 'h':
+    case OPT_HELP:
+      usage(argv[0], NULL);
+      break;
+    default:
+      usage(argv[0], "unknown argument");
+      break;
+    }
+  }
+
+  if (cfg->dir == NULL || cfg->dir[0] == 0) {
+    usage(argv[0], "dir must be set");
+  }
+  if (optind >= argc) {
+    usage(argv[0], "a command is required");
+  }
+  cfg->argv = &argv[optind];
+
+  if (cfg->prefix[0] == 0 || strchr(cfg->prefix, '/') != NULL) {
+    abort_msg("ERROR: prefix must be a non-empty file name");
+  }
+  validate("keep", cfg->keep, 1, 10000);
+  validate("flush-bytes", cfg->flush_bytes, 1, 64 * 1024 * 1024);
+  validate("flush-interval", cfg->flush_intvl, 0, 3600);
+  validate("max-size", cfg->max_size, cfg->flush_bytes, LONG_MAX);
+  validate("crash-seconds", cfg->crash_seconds, 0, 3600);
+  validate("crash-buffer", cfg->crash_buffer, 0, 256 * 1024 * 1024);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static void history_add(struct history* h, const char* data, size_t len, double t) {
+  size_t pos, n;
+
+  if (h->cap == 0) {
+    return;
+  }
+
+  if (h->num_marks == 0 || t - h->marks[(h->first_mark + h->num_marks - 1) % MAX_MARKS].t >= MARK_RESOLUTION) {
+    if (h->num_marks == MAX_MARKS) {
+      h->first_mark = (h->first_mark + 1) % MAX_MARKS;
+      h->num_marks--;
+    }
+    h->marks[(h->first_mark + h->num_marks) % MAX_MARKS] = (struct mark){ t, h->total };
+    h->num_marks++;
+  }
+
+  // Only the last cap bytes can be kept.
+  if (len > h->cap) {
+    h->total += len - h->cap;
+    data += len - h->cap;
+    len = h->cap;
+  }
+  pos = (size_t)(h->total % h->cap);
+  n = h->cap - pos < len ? h->cap - pos : len;
+  memcpy(h->buf + pos, data, n);
+  memcpy(h->buf, data + n, len - n);
+  h->total += len;
+}
+
+// history_write writes output received in the last seconds to fd.
+static int history_write(const struct history* h, int fd, double seconds) {
+  uint64_t oldest = h->total > h->cap ? h->total - h->cap : 0;
+  uint64_t start = h->total;
+  double cutoff = now() - seconds;
+  size_t i;
+
+  for (i = 0; i < h->num_marks; i++) {
+    const struct mark* m = &h->marks[(h->first_mark + i) % MAX_MARKS];
+    if (m->t >= cutoff) {
+      start = m->off;
+      break;
+    }
+  }
+  if (start < oldest) {
+    start = oldest;
+  }
+
+  while (start < h->total) {
+    size_t pos = (size_t)(start % h->cap);
+    size_t n = h->cap - pos;
+    if (n > h->total - start) {
+      n = (size_t)(h->total - start);
+    }
+    if (write_all(fd, h->buf + pos, n) != 0) {
+      return -1;
+    }
+    start += n;
+  }
+  return 0;
+}
+
+// compress_file xz-compresses path to path.xz and removes path.
+static int compress_file(const char* path) {
+  char out_path[PATH_MAX + 8];
+  char tmp_path[PATH_MAX + 16];
+  uint8_t in[64 * 1024], out[64 * 1024];
+  lzma_stream strm = LZMA_STREAM_INIT;
+  lzma_action action = LZMA_RUN;
+  int in_fd, out_fd, rc = -1;
+
+  snprintf(out_path, sizeof(out_path), "%s.xz", path);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.xz.tmp", path);
+
+  in_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) {
+    return -1;
+  }
+  out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0) {
+    close(in_fd);
+    return -1;
+  }
+
+  // Low preset: logs compress well anyway and the Pi has other work.
+  if (lzma_easy_encoder(&strm, 1, LZMA_CHECK_CRC64) != LZMA_OK) {
+    goto out;
+  }
+
+  for (;;) {
+    lzma_ret ret;
+
+    if (strm.avail_in == 0 && action == LZMA_RUN) {
+      ssize_t n = read(in_fd, in, sizeof(in));
+      if (n < 0) {
+        goto out;
+      }
+      strm.next_in = in;
+      strm.avail_in = (size_t)n;
+      if (n == 0) {
+        action = LZMA_FINISH;
+      }
+    }
+
+    strm.next_out = out;
+    strm.avail_out = sizeof(out);
+    ret = lzma_code(&strm, action);
+    if (write_all(out_fd, (char*)out, sizeof(out) - strm.avail_out) != 0) {
+      goto out;
+    }
+    if (ret == LZMA_STREAM_END) {
+      break;
+    }
+    if (ret != LZMA_OK) {
+      goto out;
+    }
+  }
+
+  if (fsync(out_fd) == 0 && rename(tmp_path, out_path) == 0) {
+    unlink(path);
+    rc = 0;
+  }
+
+out:
+  lzma_end(&strm);
+  close(in_fd);
+  close(out_fd);
+  if (rc != 0) {
+    unlink(tmp_path);
+  }
+  return rc;
+}
+
+// compressor is a running compress_bg child and the log it compresses.
+struct compressor {
+  pid_t pid;
+  char path[PATH_MAX];
+};
+
+static struct compressor* compressors;
+static size_t num_compressors, cap_compressors;
+
+// compress_bg compresses path in a low-priority child process.
+static void compress_bg(const char* path) {
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    perror_msg("ERROR: could not fork to compress %s: %s", path, strerror(errno));
+    return;
+  }
+  if (pid == 0) {
+    if (nice(19) < 0) {
+      // not fatal
+    }
+    _exit(compress_file(path) == 0 ? 0 : 1);
+  }
+
+  if (num_compressors == cap_compressors) {
+    cap_compressors = cap_compressors == 0 ? 4 : cap_compressors * 2;
+    compressors = realloc(compressors, cap_compressors * sizeof(*compressors));
+    if (compressors == NULL) {
+      abort_msg("ERROR: out of memory");
+    }
+  }
+  compressors[num_compressors].pid = pid;
+  snprintf(compressors[num_compressors].path, sizeof(compressors[num_compressors].path), "%s", path);
+  num_compressors++;
+}
+
+// compressor_done forgets a reaped compressor.
+static void compressor_done(pid_t pid) {
+  size_t i;
+
+  for (i = 0; i < num_compressors; i++) {
+    if (compressors[i].pid == pid) {
+      compressors[i] = compressors[--num_compressors];
+      return;
+    }
+  }
+}
+
+// compressing checks whether a running compressor is writing tmp.
+static int compressing(const char* tmp) {
+  size_t len = strlen(tmp) - strlen(".xz.tmp");
+  size_t i;
+
+  for (i = 0; i < num_compressors; i++) {
+    if (strlen(compressors[i].path) == len && strncmp(compressors[i].path, tmp, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int ends_with(const char* s, const char* suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// log_exists checks for path in any of its forms.
+static int log_exists(const char* path) {
+  char xz[PATH_MAX + 8];
+
+  snprintf(xz, sizeof(xz), "%s.xz", path);
+  return access(path, F_OK) == 0 || access(xz, F_OK) == 0;
+}
+
+static int name_cmp(const void* a, const void* b) {
+  return strcmp(*(char* const*)b, *(char* const*)a);
+}
+
+// prune removes all but the newest keep logs named prefix_*.log (or
+// .log.xz); names sort by their timestamps. A log's .crash file goes
+// with it, so a crash loop doesn't push out logs. Output of
+// compressions that were interrupted (say by a power cut) is removed;
+// their logs are still there, uncompressed.
+static void prune(const struct config* cfg) {
+  DIR* dir = opendir(cfg->dir);
+  struct dirent* ent;
+  char** names = NULL;
+  char** crashes = NULL;
+  size_t num = 0, cap = 0, num_crashes = 0, cap_crashes = 0, i;
+  size_t plen = strlen(cfg->prefix);
+  char path[PATH_MAX];
+
+  if (dir == NULL) {
+    return;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    char*** list = &names;
+    size_t* n = &num;
+    size_t* c = &cap;
+
+    if (strncmp(ent->d_name, cfg->prefix, plen) != 0 || ent->d_name[plen] != '_') {
+      continue;
+    }
+    if (ends_with(ent->d_name, ".xz.tmp")) {
+      snprintf(path, sizeof(path), "%s/%s", cfg->dir, ent->d_name);
+      if (!compressing(path)) {
+        unlink(path);
+      }
+      continue;
+    }
+    if (ends_with(ent->d_name, ".log.crash")) {
+      list = &crashes;
+      n = &num_crashes;
+      c = &cap_crashes;
+    } else if (!ends_with(ent->d_name, ".log") && !ends_with(ent->d_name, ".log.xz")) {
+      continue;
+    }
+    if (*n == *c) {
+      *c = *c == 0 ? 32 : *c * 2;
+      *list = realloc(*list, *c * sizeof(**list));
+      if (*list == NULL) {
+        abort_msg("ERROR: out of memory");
+      }
+    }
+    (*list)[(*n)++] = strdup(ent->d_name);
+  }
+  closedir(dir);
+
+  qsort(names, num, sizeof(*names), name_cmp);
+  for (i = 0; i < num; i++) {
+    if (i >= (size_t)cfg->keep) {
+      snprintf(path, sizeof(path), "%s/%s", cfg->dir, names[i]);
+      unlink(path);
+    }
+    free(names[i]);
+  }
+  free(names);
+
+  // crash files of the logs just removed, or removed earlier
+  for (i = 0; i < num_crashes; i++) {
+    snprintf(path, sizeof(path), "%s/%s", cfg->dir, crashes[i]);
+    path[strlen(path) - strlen(".crash")] = 0;
+    if (!log_exists(path)) {
+      strcat(path, ".crash");
+      unlink(path);
+    }
+    free(crashes[i]);
+  }
+  free(crashes);
+}
+
+static void log_open(const struct config* cfg, struct log* lg) {
+  char stamp[32];
+  time_t t = time(NULL);
+  struct tm tm;
+  int n = 0;
+
+  localtime_r(&t, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+
+  // A quick rotation can land in the same second.
+  snprintf(lg->path, sizeof(lg->path), "%s/%s_%s.log", cfg->dir, cfg->prefix, stamp);
+  while (log_exists(lg->path)) {
+    n++;
+    snprintf(lg->path, sizeof(lg->path), "%s/%s_%s_%d.log", cfg->dir, cfg->prefix, stamp, n);
+  }
+
+  lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (lg->fd < 0) {
+    abort_msg("ERROR: could not open %s: %s", lg->path, strerror(errno));
+  }
+  lg->size = 0;
+
+  prune(cfg);
+}
+
+static void log_flush(struct log* lg) {
+  if (lg->pending_len == 0) {
+    return;
+  }
+  if (write_all(lg->fd, lg->pending, lg->pending_len) != 0) {
+    perror_msg("ERROR: could not write %s: %s", lg->path, strerror(errno));
+  }
+  lg->size += lg->pending_len;
+  lg->pending_len = 0;
+}
+
+static void log_close(const struct config* cfg, struct log* lg) {
+  log_flush(lg);
+  fdatasync(lg->fd);
+  close(lg->fd);
+  lg->fd = -1;
+  if (lg->size == 0 && lg->rotated) {
+    // nothing came after the last rotation
+    unlink(lg->path);
+  } else if (cfg->compress && lg->size > 0) {
+    compress_bg(lg->path);
+  }
+}
+
+static void log_append(struct log* lg, const char* data, size_t len) {
+  if (lg->pending_len + len > lg->pending_cap) {
+    log_flush(lg);
+  }
+  if (len > lg->pending_cap) {
+    if (write_all(lg->fd, data, len) != 0) {
+      perror_msg("ERROR: could not write %s: %s", lg->path, strerror(errno));
+    }
+    lg->size += len;
+    return;
+  }
+  if (lg->pending_len == 0) {
+    lg->pending_since = now();
+  }
+  memcpy(lg->pending + lg->pending_len, data, len);
+  lg->pending_len += len;
+}
+
+static void write_crash(const struct config* cfg, const struct log* lg, const struct history* h,
+                        const char* reason) {
+  char path[PATH_MAX + 8];
+  char hdr[256];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s.crash", lg->path);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror_msg("ERROR: could not open %s: %s", path, strerror(errno));
+    return;
+  }
+  snprintf(hdr, sizeof(hdr), "bdr_logsink: %s; last %ld seconds of output follow\n",
+           reason, cfg->crash_seconds);
+  if (write_all(fd, hdr, strlen(hdr)) != 0 || history_write(h, fd, cfg->crash_seconds) != 0) {
+    perror_msg("ERROR: could not write %s: %s", path, strerror(errno));
+  }
+  fsync(fd);
+  close(fd);
+}
+
+static pid_t spawn(char** argv, int out_fd, const sigset_t* mask) {
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    abort_msg("ERROR: fork failed: %s", strerror(errno));
+  }
+  if (pid == 0) {
+    sigprocmask(SIG_UNBLOCK, mask, NULL);
+    if (dup2(out_fd, STDOUT_FILENO) < 0 || dup2(out_fd, STDERR_FILENO) < 0) {
+      _exit(127);
+    }
+    close(out_fd);
+    execvp(argv[0], argv);
+    fprintf(stderr, "bdr_logsink: could not run %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  return pid;
+}
+
+int main(int argc, char** argv) {
+  struct config cfg = {
+    .dir = NULL,
+    .prefix = DEFAULT_PREFIX,
+    .keep = DEFAULT_KEEP,
+    .flush_bytes = DEFAULT_FLUSH_BYTES,
+    .flush_intvl = DEFAULT_FLUSH_INTVL,
+    .max_size = DEFAULT_MAX_SIZE,
+    .crash_seconds = DEFAULT_CRASH_SECONDS,
+    .crash_buffer = DEFAULT_CRASH_BUFFER,
+    .compress = 1,
+  };
+  struct history hist = { 0 };
+  struct log lg = { .fd = -1 };
+  sigset_t mask;
+  int pipefd[2];
+  int sfd, in_fd, status = 0, exited = 0;
+  pid_t child;
+  double start;
+  char* buf;
+  size_t buf_size;
+
+  parse_args(argc, argv, &cfg);
+
+  if (mkdir(cfg.dir, 0755) != 0 && errno != EEXIST) {
+    abort_msg("ERROR: could not create %s: %s", cfg.dir, strerror(errno));
+  }
+
+  lg.pending_cap = (size_t)cfg.flush_bytes * PENDING_BATCHES;
+  lg.pending = malloc(lg.pending_cap);
+  hist.cap = (size_t)cfg.crash_buffer;
+  hist.buf = malloc(hist.cap + 1);
+  buf_size = (size_t)cfg.flush_bytes < 65536 ? 65536 : (size_t)cfg.flush_bytes;
+  buf = malloc(buf_size);
+  if (lg.pending == NULL || hist.buf == NULL || buf == NULL) {
+    abort_msg("ERROR: out of memory");
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+    abort_msg("ERROR: could not block signals: %s", strerror(errno));
+  }
+  sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (sfd < 0) {
+    abort_msg("ERROR: signalfd failed: %s", strerror(errno));
+  }
+
+  if (pipe(pipefd) != 0) {
+    abort_msg("ERROR: pipe failed: %s", strerror(errno));
+  }
+  fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+
+  log_open(&cfg, &lg);
+
+  start = now();
+  child = spawn(cfg.argv, pipefd[1], &mask);
+  close(pipefd[1]);
+  in_fd = pipefd[0];
+
+  // Run until the command has exited and its output is drained. The
+  // pipe may stay open after it exits if it left children behind, so
+  // stop waiting for EOF shortly after the exit.
+  for (;;) {
+    struct pollfd fds[2] = {
+      { .fd = in_fd, .events = POLLIN },
+      { .fd = sfd, .events = POLLIN },
+    };
+    int timeout = -1;
+    int rc;
+
+    if (lg.pending_len > 0) {
+      double left = lg.pending_since + cfg.flush_intvl - now();
+      timeout = left <= 0 ? 0 : (int)(left * 1000) + 1;
+    }
+    if (exited && (timeout < 0 || timeout > 1000)) {
+      timeout = 1000;
+    }
+
+    // poll ignores the pipe once it is closed (fd -1)
+    rc = poll(fds, 2, timeout);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      abort_msg("ERROR: poll failed: %s", strerror(errno));
+    }
+
+    if (in_fd >= 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+      ssize_t n = read(in_fd, buf, buf_size);
+      if (n > 0) {
+        history_add(&hist, buf, (size_t)n, now());
+        log_append(&lg, buf, (size_t)n);
+        if (lg.pending_len >= (size_t)cfg.flush_bytes) {
+          log_flush(&lg);
+        }
+      } else if (n == 0 || errno != EINTR) {
+        close(in_fd);
+        in_fd = -1;
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo si;
+      while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGCHLD: {
+          pid_t pid;
+          int st;
+          // compressors are children too
+          while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+            if (pid == child) {
+              status = st;
+              exited = 1;
+            } else {
+              compressor_done(pid);
+            }
+          }
+          break;
+        }
+        case SIGUSR1:
+          log_flush(&lg);
+          break;
+        default:
+          if (!exited) {
+            kill(child, (int)si.ssi_signo);
+          }
+          break;
+        }
+      }
+    }
+
+    if (lg.pending_len > 0 && now() - lg.pending_since >= cfg.flush_intvl) {
+      log_flush(&lg);
+    }
+    if (lg.size + lg.pending_len >= (uint64_t)cfg.max_size) {
+      log_close(&cfg, &lg);
+      log_open(&cfg, &lg);
+      lg.rotated = 1;
+    }
+
+    if (exited && (in_fd < 0 || rc == 0)) {
+      break;
+    }
+  }
+
+  {
+    char note[128];
+    int code = 0;
+    int crashed = 0;
+    double runtime = now() - start;
+
+    if (WIFSIGNALED(status)) {
+      code = 128 + WTERMSIG(status);
+      snprintf(note, sizeof(note), "%s killed by signal %d after %.0f seconds",
+               cfg.argv[0], WTERMSIG(status), runtime);
+      crashed = WTERMSIG(status) != SIGINT && WTERMSIG(status) != SIGTERM;
+    } else {
+      code = WEXITSTATUS(status);
+      snprintf(note, sizeof(note), "%s exited with status %d after %.0f seconds",
+               cfg.argv[0], code, runtime);
+      crashed = code != 0;
+    }
+
+    if (crashed) {
+      if (cfg.crash_seconds > 0 && hist.cap > 0) {
+        write_crash(&cfg, &lg, &hist, note);
+      }
+      log_append(&lg, "bdr_logsink: ", 13);
+      log_append(&lg, note, strlen(note));
+      log_append(&lg, "\n", 1);
+    }
+    log_close(&cfg, &lg);
+
+    while (wait(NULL) > 0 || errno == EINTR) {
+      // compressors
+    }
+
+    return code;
+  }
+}
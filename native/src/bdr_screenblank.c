@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if HAVE_LIFEPO4WERED
+#include <lifepo4wered-data.h>
+#endif
+
+// bdr_screenblank powers the display backlight off when the
+// LiFePO4wered-Pi input voltage drops (the car is off and we're
+// running on the backup battery) and back on when it recovers. It is
+// the native replacement for resources/bdr_screenblank.sh and takes
+// the same options.
+//
+// VIN is read, in order of preference, from --vin-file (a sysfs-style
+// file containing millivolts), directly over I2C through
+// liblifepo4wered (when built with HAVE_LIFEPO4WERED=1), or by
+// running --lifepo4wered-binary (the default without the library, or
+// when the option is given explicitly). Only the last forks.
+//
+// All waiting happens in a single poll() on a timerfd and a signalfd.
+// The backlight is written only when the state changes. With
+// --max-blank-interval, while the display is on and VIN is above the
+// wake threshold (on external power) the check interval backs off
+// exponentially up to that limit; it drops back to --blank-interval as
+// soon as VIN falls into the hysteresis band. The back-off delays
+// blanking after the car is switched off by up to the limit, so it is
+// off by default.
+
+#define DEFAULT_BLANK_MV        3750
+#define DEFAULT_WAKE_MV         4000
+#define DEFAULT_BLANK_INTVL     5
+#define DEFAULT_WAKE_INTVL      10
+#define DEFAULT_BINARY          "lifepo4wered-cli"
+
+#define BACKLIGHT_DIR "/sys/class/backlight"
+
+#define BL_POWER_ON  "0"
+#define BL_POWER_OFF "1"
+
+#define VIN_INVALID -1
+
+enum state {
+  AWAKE,
+  BLANK,
+};
+
+struct config {
+  long blank_mv;
+  long wake_mv;
+  long blank_intvl;
+  long wake_intvl;
+  long max_blank_intvl;
+  int daemon;
+  int path_given;
+  const char* path;
+  const char* binary;
+  int binary_given;
+  const char* vin_file;
+};
+
+static void perror_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+static void abort_msg(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static char default_path_buf[PATH_MAX];
+
+// default_path returns the bl_power file of the first entry in
+// /sys/class/backlight, or NULL.
+static const char* default_path(void) {
+  DIR* dir = opendir(BACKLIGHT_DIR);
+  struct dirent* ent;
+  const char* found = NULL;
+  char first[NAME_MAX+1] = { 0 };
+
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  // match `ls -1 | head -n 1`: the lexically first entry
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    if (first[0] == 0 || strcmp(ent->d_name, first) < 0) {
+      snprintf(first, sizeof(first), "%s", ent->d_name);
+    }
+  }
+  closedir(dir);
+
+  if (first[0] != 0) {
+    snprintf(default_path_buf, sizeof(default_path_buf), BACKLIGHT_DIR "/%s/bl_power", first);
+    found = default_path_buf;
+  }
+
+  return found;
+}
+
+static void usage(const char* argv0, const char* err) {
+  const char* path = default_path();
+
+  if (err != NULL) {
+    perror_msg("ERROR: %s", err);
+    printf("\n");
+  }
+  printf("Usage:\n");
+  printf("    %s [options]\n", argv0);
+  printf("\n");
+  printf("Options:\n");
+  printf("    --blank-threshold=MV\n");
+  printf("        Sets the minimum battery voltage (in millivolts) before\n");
+  printf("        the backlight is powered off. Default %d mV.\n", DEFAULT_BLANK_MV);
+  printf("    --wake-threshold=MV\n");
+  printf("        Sets the maximum battery voltage (in millivolts) before\n");
+  printf("        the backlight is powered on . Default %d mV.\n", DEFAULT_WAKE_MV);
+  printf("    --blank-interval=S\n");
+  printf("        Sets the interval (in seconds) between battery voltage\n");
+  printf("        checks when the backlight is on. Controls how quickly the\n");
+  printf("        screen is blanked. Default %d s.\n", DEFAULT_BLANK_INTVL);
+  printf("    --max-blank-interval=S\n");
+  printf("        Sets the longest interval (in seconds) between checks when\n");
+  printf("        the backlight is on and the voltage is above the wake\n");
+  printf("        threshold. Blanking can lag by up to this long. Defaults\n");
+  printf("        to the blank interval (no back-off).\n");
+  printf("    --wake-interval=S\n");
+  printf("        Sets the interval (in seconds) between battery voltage\n");
+  printf("        checks when the backlight is off. Controls how quickly the\n");
+  printf("        screen is unblanked. Default %d s.\n", DEFAULT_WAKE_INTVL);
+  printf("    --daemon\n");
+  printf("        Wait a bit before attempting to find the default device.\n");
+  printf("    --path=PATH\n");
+  printf("        Set the path used to power the backlight on and off.\n");
+  printf("        Defaults to the first entry in /sys/class/backlight,\n");
+  printf("        which is %s.\n", path != NULL ? path : "not available");
+  printf("    --vin-file=PATH\n");
+  printf("        Read the input voltage (in millivolts) from PATH instead\n");
+  printf("        of querying the LiFePO4wered-Pi.\n");
+  printf("    --lifepo4wered-binary=PATH\n");
+  printf("        Set the binary used to query the current input voltage\n");
+  printf("        when the LiFePO4wered-Pi library is not available.\n");
+  printf("        Defaults to %s.\n", DEFAULT_BINARY);
+  exit(1);
+}
+
+// parse_long parses a decimal argument, aborting on garbage.
+static long parse_long(const char* name, const char* value) {
+  char* end = NULL;
+  long v;
+
+  if (value == NULL || *value == 0) {
+    abort_msg("ERROR: %s must have a value", name);
+  }
+
+  errno = 0;
+  v = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != 0) {
+    abort_msg("ERROR: %s must be a number, got %s", name, value);
+  }
+  return v;
+}
+
+static void validate(const char* name, long value, long minval, long maxval) {
+  if (value < minval || value > maxval) {
+    abort_msg("ERROR: %s must be between %ld and %ld, got %ld", name, minval, maxval, value);
+  }
+}
+
+static void parse_args(int argc, char** argv, struct config* cfg) {
+  enum {
+    OPT_BLANK_MV = 1,
+    OPT_WAKE_MV,
+    OPT_BLANK_INTVL,
+    OPT_MAX_BLANK_INTVL,
+    OPT_WAKE_INTVL,
+    OPT_DAEMON,
+    OPT_PATH,
+    OPT_VIN_FILE,
+    OPT_BINARY,
+    OPT_HELP,
+  };
+  static const struct option opts[] = {
+    { "blank-threshold", required_argument, NULL, OPT_BLANK_MV },
+    { "wake-threshold", required_argument, NULL, OPT_WAKE_MV },
+    { "blank-interval", required_argument, NULL, OPT_BLANK_INTVL },
+    { "max-blank-interval", required_argument, NULL, OPT_MAX_BLANK_INTVL },
+    { "wake-interval", required_argument, NULL, OPT_WAKE_INTVL },
+    { "daemon", no_argument, NULL, OPT_DAEMON },
+    { "path", required_argument, NULL, OPT_PATH },
+    { "vin-file", required_argument, NULL, OPT_VIN_FILE },
+    { "lifepo4wered-binary", required_argument, NULL, OPT_BINARY },
+    { "help", no_argument, NULL, OPT_HELP },
+    { 0 },
+  };
+  int c;
+
+  // getopt_long_only accepts the -single-dash spellings the shell
+  // script allowed.
+  while ((c = getopt_long_only(argc, argv, "h", opts, NULL)) != -1) {
+    switch (c) {
+    case OPT_BLANK_MV:
+      cfg->blank_mv = parse_long("blank-threshold", optarg);
+      break;
+    case OPT_WAKE_MV:
+      cfg->wake_mv = parse_long("wake-threshold", optarg);
+      break;
+    case OPT_BLANK_INTVL:
+      cfg->blank_intvl = parse_long("blank-interval", optarg);
+      break;
+    case OPT_MAX_BLANK_INTVL:
+      cfg->max_blank_intvl = parse_long("max-blank-interval", optarg);
+      break;
+    case OPT_WAKE_INTVL:
+      cfg->wake_intvl = parse_long("wake-interval", optarg);
+      break;
+    case OPT_DAEMON:
+      cfg->daemon = 1;
+      break;
+    case OPT_PATH:
+      cfg->path = optarg;
+      cfg->path_given = 1;
+      break;
+    case OPT_VIN_FILE:
+      cfg->vin_file = optarg;
+      break;
+    case OPT_BINARY:
+      cfg->binary = optarg;
+      cfg->binary_given = 1;
+      break;
+    case 'h':
+    case OPT_HELP:
+      usage(argv[0], NULL);
+      break;
+    default:
+      usage(argv[0], "unknown argument");
+      break;
+    }
+  }
+
+  if (optind < argc) {
+    char msg[256];
+    snprintf(msg, sizeof(msg), "unknown argument %s", argv[optind]);
+    usage(argv[0], msg);
+  }
+
+  validate("blank-threshold", cfg->blank_mv, 0, cfg->wake_mv);
+  validate("wake-threshold", cfg->wake_mv, cfg->blank_mv, 5000);
+  validate("blank-interval", cfg->blank_intvl, 0, 3600);
+  validate("wake-interval", cfg->wake_intvl, 0, 3600);
+  if (cfg->max_blank_intvl < cfg->blank_intvl) {
+    cfg->max_blank_intvl = cfg->blank_intvl;
+  }
+  validate("max-blank-interval", cfg->max_blank_intvl, cfg->blank_intvl, 3600);
+}
+
+// read_vin_file reads millivolts from a sysfs-style file. The file is
+// reopened each time, as sysfs attributes must be.
+static long read_vin_file(const char* path) {
+  char buf[32];
+  ssize_t n;
+  char* end;
+  long v;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return VIN_INVALID;
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return VIN_INVALID;
+  }
+  buf[n] = 0;
+
+  v = strtol(buf, &end, 10);
+  if (end == buf || (*end != 0 && *end != '\n')) {
+    return VIN_INVALID;
+  }
+  return v;
+}
+
+// read_vin_binary runs the lifepo4wered-cli compatible binary
+// directly (no shell) and reads its output through a pipe.
+static long read_vin_binary(const char* binary) {
+  char* const argv[] = { (char*)binary, "get", "vin", NULL };
+  char buf[32] = { 0 };
+  size_t len = 0;
+  ssize_t n;
+  char* end;
+  long v = VIN_INVALID;
+  int fds[2];
+  int status;
+  pid_t pid;
+
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    return VIN_INVALID;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return VIN_INVALID;
+  }
+  if (pid == 0) {
+    // dup2 clears O_CLOEXEC on the new stdout
+    if (dup2(fds[1], STDOUT_FILENO) < 0) {
+      _exit(127);
+    }
+    execvp(binary, argv);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  while (len < sizeof(buf) - 1) {
+    n = read(fds[0], buf + len, sizeof(buf) - 1 - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  close(fds[0]);
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return VIN_INVALID;
+    }
+  }
+
+  if (len > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    v = strtol(buf, &end, 10);
+    if (end == buf || (*end != 0 && *end != '\n')) {
+      v = VIN_INVALID;
+    }
+  }
+  return v;
+}
+
+static long read_vin(const struct config* cfg) {
+  if (cfg->vin_file != NULL) {
+    return read_vin_file(cfg->vin_file);
+  }
+
+#if HAVE_LIFEPO4WERED
+  if (!cfg->binary_given) {
+    int32_t v = read_lifepo4wered(VIN);
+    return v < 0 ? VIN_INVALID : v;
+  }
+#endif
+
+  return read_vin_binary(cfg->binary);
+}
+
+static int set_backlight(const char* path, const char* value) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  int rc = 0;
+
+  if (fd < 0) {
+    perror_msg("ERROR: could not open %s: %s", path, strerror(errno));
+    return -1;
+  }
+  if (write(fd, value, 1) != 1) {
+    perror_msg("ERROR: could not write %s: %s", path, strerror(errno));
+    rc = -1;
+  }
+  close(fd);
+  return rc;
+}
+
+static void blank(const char* path) {
+  perror_msg("blanking");
+  set_backlight(path, BL_POWER_OFF);
+}
+
+static void wake(const char* path) {
+  perror_msg("waking");
+  set_backlight(path, BL_POWER_ON);
+}
+
+static int arm_timer(int tfd, long seconds) {
+  struct itimerspec its = { 0 };
+
+  // A zero interval means "as fast as possible"; an all-zero
+  // itimerspec would disarm the timer instead.
+  its.it_value.tv_sec = seconds;
+  its.it_value.tv_nsec = seconds == 0 ? 1 : 0;
+  return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// wait_timer waits for tfd to expire. Returns 0 on expiry or 1 if a
+// termination signal arrived on sfd.
+static int wait_timer(int tfd, int sfd) {
+  struct pollfd fds[2] = {
+    { .fd = tfd, .events = POLLIN },
+    { .fd = sfd, .events = POLLIN },
+  };
+
+  for (;;) {
+    int rc = poll(fds, 2, -1);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      abort_msg("ERROR: poll failed: %s", strerror(errno));
+    }
+
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo si;
+      if (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+        perror_msg("caught signal %d", (int)si.ssi_signo);
+      }
+      return 1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        abort_msg("ERROR: timerfd read failed: %s", strerror(errno));
+      }
+      return 0;
+    }
+  }
+}
+
+// wait_for_default_path waits for /sys/class/backlight to be
+// populated. In theory systemd could order us after whatever
+// configures it, but in practice it's not obvious what that is.
+static const char* wait_for_default_path(const struct config* cfg, int tfd, int sfd) {
+  long intvl = cfg->blank_intvl > 0 ? cfg->blank_intvl : 1;
+  long max_attempts = 300 / intvl;
+  long attempts = 0;
+  const char* path;
+
+  if (max_attempts < 10) {
+    max_attempts = 10;
+  }
+
+  while ((path = default_path()) == NULL) {
+    if (attempts >= max_attempts) {
+      abort_msg("ERROR: path must be set because a suitable default was not found (tried %ld times)",
+                attempts);
+    }
+    perror_msg("waiting for default device to become available");
+    arm_timer(tfd, intvl);
+    if (wait_timer(tfd, sfd)) {
+      exit(0);
+    }
+    attempts++;
+  }
+
+  perror_msg("found default device path %s", path);
+  return path;
+}
+
+int main(int argc, char** argv) {
+  struct config cfg = {
+    .blank_mv = DEFAULT_BLANK_MV,
+    .wake_mv = DEFAULT_WAKE_MV,
+    .blank_intvl = DEFAULT_BLANK_INTVL,
+    .wake_intvl = DEFAULT_WAKE_INTVL,
+    .max_blank_intvl = 0,
+    .daemon = 0,
+    .path_given = 0,
+    .path = NULL,
+    .binary = DEFAULT_BINARY,
+    .binary_given = 0,
+    .vin_file = NULL,
+  };
+  sigset_t mask;
+  int sfd, tfd;
+  enum state state;
+  long last_vin = VIN_INVALID - 1;
+  long intvl;
+
+  parse_args(argc, argv, &cfg);
+
+  if (cfg.binary == NULL || cfg.binary[0] == 0) {
+    abort_msg("ERROR: binary must be set");
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+    abort_msg("ERROR: could not block signals: %s", strerror(errno));
+  }
+
+  sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sfd < 0) {
+    abort_msg("ERROR: signalfd failed: %s", strerror(errno));
+  }
+
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (tfd < 0) {
+    abort_msg("ERROR: timerfd_create failed: %s", strerror(errno));
+  }
+
+  if (!cfg.path_given) {
+    if (cfg.daemon) {
+      cfg.path = wait_for_default_path(&cfg, tfd, sfd);
+    } else {
+      cfg.path = default_path();
+      if (cfg.path == NULL) {
+        abort_msg("ERROR: path must be set because a suitable default was not found");
+      }
+    }
+  } else if (cfg.path == NULL || cfg.path[0] == 0) {
+    abort_msg("ERROR: path must be set to a non-empty value");
+  }
+
+  if (access(cfg.path, F_OK) != 0) {
+    abort_msg("ERROR: path %s does not exist", cfg.path);
+  }
+
+  state = AWAKE;
+  wake(cfg.path);
+  intvl = cfg.blank_intvl;
+
+  for (;;) {
+    long vin = read_vin(&cfg);
+
+    if (vin != last_vin) {
+      if (vin == VIN_INVALID) {
+        perror_msg("VIN:  mV");
+      } else {
+        perror_msg("VIN: %ld mV", vin);
+      }
+      last_vin = vin;
+    }
+
+    switch (state) {
+    case AWAKE:
+      // Ignore bad vin data and leave the display on.
+      if (vin != VIN_INVALID && vin < cfg.blank_mv) {
+        blank(cfg.path);
+        state = BLANK;
+        intvl = cfg.wake_intvl;
+      } else if (vin != VIN_INVALID && vin > cfg.wake_mv) {
+        // Comfortably on external power: check less often.
+        intvl = intvl == 0 ? 1 : intvl * 2;
+        if (intvl > cfg.max_blank_intvl) {
+          intvl = cfg.max_blank_intvl;
+        }
+      } else {
+        intvl = cfg.blank_intvl;
+      }
+      break;
+
+    case BLANK:
+      // Wake the display in the event of bad vin data.
+      if (vin == VIN_INVALID || vin > cfg.wake_mv) {
+        wake(cfg.path);
+        state = AWAKE;
+        intvl = cfg.blank_intvl;
+      }
+      break;
+    }
+
+    if (arm_timer(tfd, intvl) < 0) {
+      abort_msg("ERROR: timerfd_settime failed: %s", strerror(errno));
+    }
+    if (wait_timer(tfd, sfd)) {
+      break;
+    }
+  }
+
+  if (state != AWAKE) {
+    wake(cfg.path);
+  }
+
+  close(tfd);
+  close(sfd);
+  return 0;
+}
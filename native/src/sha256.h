@@ -0,0 +1,28 @@
+#ifndef BDR_SHA256_H
+#define BDR_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small SHA-256 (FIPS 180-4) so the native tools build on macOS and
+// the Pi without OpenSSL or CommonCrypto.
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN    (SHA256_DIGEST_LEN * 2)
+
+struct sha256 {
+  uint32_t state[8];
+  uint64_t len;
+  unsigned char buf[64];
+  size_t buflen;
+};
+
+void sha256_init(struct sha256* s);
+void sha256_update(struct sha256* s, const void* data, size_t len);
+void sha256_final(struct sha256* s, unsigned char digest[SHA256_DIGEST_LEN]);
+
+// sha256_hex formats digest as lower-case hex into hex, which must
+// hold SHA256_HEX_LEN + 1 bytes.
+void sha256_hex(const unsigned char digest[SHA256_DIGEST_LEN], char* hex);
+
+#endif
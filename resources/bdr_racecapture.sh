@@ -16,13 +16,52 @@ RC_DIR="/opt/racecapture"
 LOG_DIR="${DIR}/logs"
 KIVY_DIR="${DIR}/.kivy"
 
+# Boot timeline (see native/src/bdr_boottrace.c). With STANDIN_FLAG
+# present the launcher runs its stand-in for race_capture, which saves
+# the timeline up to the first frame in LOG_DIR.
+BOOTTRACE="/usr/local/bin/bdr_boottrace"
+STANDIN_FLAG="${DIR}/.bdr_boottrace_standin"
+
+# boottrace_mark $1=phase marks a phase of the launch
+boottrace_mark() {
+    if [[ -x "${BOOTTRACE}" ]]; then
+        "${BOOTTRACE}" mark "$1" &>/dev/null
+    fi
+    return 0
+}
+
+boottrace_mark launcher
+
 # Configure keyring to store Podium user credentials
 export PYTHON_KEYRING_BACKEND=sagecipher.keyring.Keyring
 
-# TODO: check for existing agent and just use it
-killall ssh-agent &>/dev/null
-eval "$(ssh-agent -s)" &>/dev/null
-ssh-add &>/dev/null
+# Reuse the agent from an earlier launch (a crash restart, or a relaunch
+# from the console) if it is still running, and only start one when
+# nothing answers on its socket.
+AGENT_SOCK="${DIR}/.ssh/bdr_agent.sock"
+export SSH_AUTH_SOCK="${AGENT_SOCK}"
+ssh-add -l &>/dev/null
+case $? in
+    0)
+        # running, with keys
+        ;;
+    1)
+        # running, without keys
+        ssh-add &>/dev/null
+        ;;
+    *)
+        mkdir -p -m 0700 "${DIR}/.ssh"
+        rm -f "${AGENT_SOCK}"
+        eval "$(ssh-agent -a "${AGENT_SOCK}" -s)" &>/dev/null
+        ssh-add &>/dev/null
+        ;;
+esac
+boottrace_mark agent
+
+# Native log sink (see native/src/bdr_logsink.c): batches writes to
+# the SD card, rotates and compresses logs, and saves the tail of the
+# output next to the log when race_capture crashes.
+LOGSINK="/usr/local/bin/bdr_logsink"
 
 KEEP_N_LOGS=$((10))
 MIN_RUNTIME=$((30))
@@ -36,14 +75,38 @@ RC_ARGS=(
 )
 
 cd "${RC_DIR}" ||:
-while true; do
+
+if [[ -f "${STANDIN_FLAG}" ]] && [[ -x "${BOOTTRACE}" ]]; then
+    boottrace_mark app_exec
+    exec "${BOOTTRACE}" --save="${LOG_DIR}" standin "${RC_DIR}"
+fi
+
+# run_racecapture runs race_capture with its output going to a new log
+# in LOG_DIR.
+run_racecapture() {
+    if [[ -x "${LOGSINK}" ]]; then
+        # The sink prunes old logs and notes the exit status and
+        # runtime in the log itself.
+        "${LOGSINK}" --dir="${LOG_DIR}" --prefix=racecapture --keep="${KEEP_N_LOGS}" \
+                     -- ./race_capture "${RC_ARGS[@]}"
+        return
+    fi
+
     # Delete all but the last KEEP_N_LOGS logs
     find "${LOG_DIR}" -name "*.log" -print | sort -r | tail -n +$((KEEP_N_LOGS+1)) | xargs rm -f
 
     LOGFILE="${LOG_DIR}/racecapture_$(date "+%Y%m%d_%H%M%S").log"
 
+    ./race_capture "${RC_ARGS[@]}" >> "${LOGFILE}" 2>&1
+}
+
+boottrace_mark app_exec
+
+while true; do
+    LOGFILE=""
+
     START="$(date "+%s")"
-    if ./race_capture "${RC_ARGS[@]}" >> "${LOGFILE}" 2>&1; then
+    if run_racecapture; then
         # clean exit, assume the user quit (or someone sent SIGINT/SIGQUIT)
         exit 0
     else
@@ -54,7 +117,9 @@ while true; do
     # Try to detect a crash loop and preserve some older logs (in case they have useful info)
     RUNTIME=$((END-START))
     if [[ "${RUNTIME}" -lt "${MIN_RUNTIME}" ]]; then
-        echo "racecapture quit after ${RUNTIME} seconds" >> "${LOGFILE}"
+        if [[ -n "${LOGFILE}" ]]; then
+            echo "racecapture quit after ${RUNTIME} seconds" >> "${LOGFILE}"
+        fi
 
         SHORT_RUNTIME=$((SHORT_RUNTIME+1))
         if [[ "${SHORT_RUNTIME}" -ge $((KEEP_N_LOGS/2)) ]]; then
@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "bridge_client.h"
+
+#define DEFAULT_BUF_SIZE (64*1024)
+#define DEFAULT_RECONNECT_MIN_MS 100
+#define DEFAULT_RECONNECT_MAX_MS 5000
+
+// A send batches at most this many iovecs (plus the queue).
+#define MAX_IOV 64
+
+struct bridge_client {
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+
+  // mutex guards the connection and the send queue. The receive
+  // buffer belongs to the receiving thread.
+  pthread_mutex_t mutex;
+  int fd;
+  int broken;     // fd is shut down but a receiver may still be polling it
+  int receiving;
+  unsigned int gen;
+
+  int timed;
+  char* hello;      // producer registration, or NULL
+  size_t hello_len;
+  int reconnect;
+  int reconnect_min_ms;
+  int reconnect_max_ms;
+  int backoff_ms;
+  uint64_t next_attempt;
+
+  char* tx;
+  size_t tx_size;
+  size_t tx_off;
+  size_t tx_len;
+
+  char* rx;
+  size_t rx_size;
+  size_t rx_off;    // start of unconsumed data
+  size_t rx_scan;   // end of the part known to hold no newline
+  size_t rx_len;
+  unsigned int rx_gen;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// remaining returns the time left until deadline as a poll timeout.
+static int remaining(int timeout_ms, uint64_t deadline) {
+  uint64_t now;
+
+  if (timeout_ms < 0) {
+    return -1;
+  }
+  now = now_ms();
+  return now >= deadline ? 0 : (int)(deadline - now);
+}
+
+int bridge_socket_addr(struct sockaddr_un* addr, socklen_t* addrlen, const char* name) {
+  size_t len;
+
+  if (name == NULL) {
+    name = BRIDGE_SOCKET_DESC;
+  }
+
+  // The name is stored after a leading null byte and is not null
+  // terminated; addrlen covers exactly the name (see socket.c).
+  len = strlen(name);
+  if (len + 1 > sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path + 1, name, len);
+  *addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+  return 0;
+}
+
+// close_locked drops the connection and whatever was queued for it.
+// While a receiver is polling the fd it is only shut down (which wakes
+// the receiver), and the receiver closes it.
+static void close_locked(struct bridge_client* c) {
+  if (c->fd >= 0) {
+    if (c->receiving) {
+      shutdown(c->fd, SHUT_RDWR);
+      c->broken = 1;
+    } else {
+      close(c->fd);
+      c->fd = -1;
+      c->broken = 0;
+    }
+  }
+  c->tx_off = c->tx_len = 0;
+}
+
+// connect_locked makes a connection attempt if the backoff allows one.
+static int connect_locked(struct bridge_client* c) {
+  uint64_t now = now_ms();
+  int fd;
+
+  if (c->fd >= 0 && c->broken && !c->receiving) {
+    close_locked(c);
+  }
+  if (c->fd >= 0) {
+    return c->broken ? -1 : 0;
+  }
+
+  if (now < c->next_attempt) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr*)&c->addr, c->addrlen) != 0) {
+    int err = errno;
+    close(fd);
+
+    c->next_attempt = now + c->backoff_ms;
+    c->backoff_ms *= 2;
+    if (c->backoff_ms > c->reconnect_max_ms) {
+      c->backoff_ms = c->reconnect_max_ms;
+    }
+    errno = err;
+    return -1;
+  }
+
+  c->fd = fd;
+  c->gen++;
+  c->backoff_ms = c->reconnect_min_ms;
+  c->next_attempt = 0;
+
+  // The registration and the magic lead the (empty) queue of a new
+  // connection, so they go out ahead of the first frame.
+  c->tx_off = 0;
+  c->tx_len = 0;
+  if (c->hello != NULL) {
+    memcpy(c->tx, c->hello, c->hello_len);
+    c->tx_len = c->hello_len;
+  }
+  if (c->timed) {
+    memcpy(c->tx + c->tx_len, BRIDGE_TIMED_MAGIC, BRIDGE_TIMED_MAGIC_LEN);
+    c->tx_len += BRIDGE_TIMED_MAGIC_LEN;
+  }
+  return 0;
+}
+
+// ensure_locked returns 0 if there is a usable connection, connecting
+// if that's allowed.
+static int ensure_locked(struct bridge_client* c) {
+  if (c->fd >= 0 && !c->broken) {
+    return 0;
+  }
+  if (!c->reconnect) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  return connect_locked(c);
+}
+
+struct bridge_client* bridge_client_open(const struct bridge_client_opts* opts) {
+  struct bridge_client_opts defaults = { 0 };
+  struct bridge_client* c;
+
+  if (opts == NULL) {
+    opts = &defaults;
+  }
+
+  c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+
+  if (bridge_socket_addr(&c->addr, &c->addrlen, opts->name) != 0) {
+    free(c);
+    return NULL;
+  }
+
+  pthread_mutex_init(&c->mutex, NULL);
+  c->fd = -1;
+  c->timed = opts->timed;
+  c->reconnect = opts->reconnect;
+  c->reconnect_min_ms = opts->reconnect_min_ms > 0 ? opts->reconnect_min_ms : DEFAULT_RECONNECT_MIN_MS;
+  c->reconnect_max_ms = opts->reconnect_max_ms > 0 ? opts->reconnect_max_ms : DEFAULT_RECONNECT_MAX_MS;
+  if (c->reconnect_max_ms < c->reconnect_min_ms) {
+    c->reconnect_max_ms = c->reconnect_min_ms;
+  }
+  c->backoff_ms = c->reconnect_min_ms;
+
+  if (opts->commands != NULL) {
+    size_t n = strlen(opts->commands);
+
+    if (n == 0 || n >= BRIDGE_PRODUCER_CMDS_MAX || strchr(opts->commands, '\n') != NULL) {
+      bridge_client_close(c);
+      errno = EINVAL;
+      return NULL;
+    }
+    c->hello_len = BRIDGE_PRODUCER_MAGIC_LEN + n + 1;
+    c->hello = malloc(c->hello_len);
+    if (c->hello == NULL) {
+      bridge_client_close(c);
+      errno = ENOMEM;
+      return NULL;
+    }
+    memcpy(c->hello, BRIDGE_PRODUCER_MAGIC, BRIDGE_PRODUCER_MAGIC_LEN);
+    memcpy(c->hello + BRIDGE_PRODUCER_MAGIC_LEN, opts->commands, n);
+    c->hello[c->hello_len - 1] = '\n';
+  }
+  c->tx_size = opts->tx_size > 0 ? opts->tx_size : DEFAULT_BUF_SIZE;
+  if (c->timed && c->tx_size < BRIDGE_TIMED_MAGIC_LEN + sizeof(struct bridge_timed_hdr) + BRIDGE_TIMED_MAX_LEN) {
+    c->tx_size = BRIDGE_TIMED_MAGIC_LEN + sizeof(struct bridge_timed_hdr) + BRIDGE_TIMED_MAX_LEN;
+  }
+  c->tx_size += c->hello_len;
+  c->rx_size = opts->rx_size > 0 ? opts->rx_size : DEFAULT_BUF_SIZE;
+  c->tx = malloc(c->tx_size);
+  c->rx = malloc(c->rx_size);
+
+  if (c->tx == NULL || c->rx == NULL) {
+    bridge_client_close(c);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (connect_locked(c) != 0 && !c->reconnect) {
+    int err = errno;
+    bridge_client_close(c);
+    errno = err;
+    return NULL;
+  }
+
+  return c;
+}
+
+void bridge_client_close(struct bridge_client* c) {
+  if (c == NULL) {
+    return;
+  }
+
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+  pthread_mutex_destroy(&c->mutex);
+  free(c->hello);
+  free(c->tx);
+  free(c->rx);
+  free(c);
+}
+
+int bridge_client_connected(struct bridge_client* c) {
+  int connected;
+
+  pthread_mutex_lock(&c->mutex);
+  connected = c->fd >= 0 && !c->broken;
+  pthread_mutex_unlock(&c->mutex);
+
+  return connected;
+}
+
+// send_locked writes the queue followed by iov in one call and
+// queues what didn't fit. Fails with EAGAIN, leaving nothing of iov
+// queued, if it wouldn't fit in the queue.
+static int send_locked(struct bridge_client* c, const struct iovec* iov, int iovcnt) {
+  struct iovec v[MAX_IOV + 1];
+  struct msghdr msg = { 0 };
+  size_t total = 0;
+  ssize_t n;
+  int cnt;
+  int queued;
+  int retried = 0;
+
+  if (iovcnt > MAX_IOV) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (ensure_locked(c) != 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (c->tx_len - c->tx_off + total > c->tx_size) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+again:
+  cnt = 0;
+  queued = 0;
+  if (c->tx_len > c->tx_off) {
+    v[cnt].iov_base = c->tx + c->tx_off;
+    v[cnt].iov_len = c->tx_len - c->tx_off;
+    cnt++;
+    queued = 1;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > 0) {
+      v[cnt++] = iov[i];
+    }
+  }
+  if (cnt == 0) {
+    return 0;
+  }
+
+  // sendmsg rather than writev for MSG_NOSIGNAL.
+  msg.msg_iov = v;
+  msg.msg_iovlen = cnt;
+  n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      // The queue went with the connection; a new one gets just iov.
+      close_locked(c);
+      if (c->reconnect && iovcnt > 0 && !retried && connect_locked(c) == 0) {
+        retried = 1;
+        goto again;
+      }
+      errno = ENOTCONN;
+      return -1;
+    }
+    n = 0;
+  }
+
+  // Consume what was written, then queue the rest (compacting the
+  // queue first if it doesn't fit after its tail).
+  for (int i = 0; i < cnt; i++) {
+    size_t skip = (size_t)n < v[i].iov_len ? (size_t)n : v[i].iov_len;
+    n -= skip;
+
+    if (i == 0 && queued) {
+      c->tx_off += skip;
+      if (c->tx_off == c->tx_len) {
+        c->tx_off = c->tx_len = 0;
+      }
+      continue;
+    }
+
+    if (skip < v[i].iov_len) {
+      size_t left = v[i].iov_len - skip;
+      if (c->tx_len + left > c->tx_size) {
+        memmove(c->tx, c->tx + c->tx_off, c->tx_len - c->tx_off);
+        c->tx_len -= c->tx_off;
+        c->tx_off = 0;
+      }
+      memcpy(c->tx + c->tx_len, (char*)v[i].iov_base + skip, left);
+      c->tx_len += left;
+    }
+  }
+
+  return 0;
+}
+
+int bridge_client_sendv(struct bridge_client* c, const struct iovec* iov, int iovcnt) {
+  int rc;
+
+  // Unframed data would corrupt a timed connection.
+  if (c->timed) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&c->mutex);
+  rc = send_locked(c, iov, iovcnt);
+  pthread_mutex_unlock(&c->mutex);
+
+  return rc;
+}
+
+int bridge_client_send(struct bridge_client* c, const void* data, size_t len) {
+  struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+  return bridge_client_sendv(c, &iov, 1);
+}
+
+int bridge_client_send_at(struct bridge_client* c, const void* data, size_t len, uint64_t deliver_ns) {
+  struct bridge_timed_hdr hdr = { .deliver_ns = deliver_ns, .len = (uint32_t)len };
+  struct iovec iov[2] = {
+    { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+    { .iov_base = (void*)data, .iov_len = len },
+  };
+
+  int rc;
+
+  if (!c->timed || len > BRIDGE_TIMED_MAX_LEN) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&c->mutex);
+  rc = send_locked(c, iov, 2);
+  pthread_mutex_unlock(&c->mutex);
+
+  return rc;
+}
+
+long bridge_client_flush(struct bridge_client* c, int timeout_ms) {
+  uint64_t deadline = now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+  long queued;
+
+  pthread_mutex_lock(&c->mutex);
+  for (;;) {
+    struct pollfd pfd;
+    int fd;
+
+    if (send_locked(c, NULL, 0) != 0) {
+      pthread_mutex_unlock(&c->mutex);
+      return -1;
+    }
+
+    queued = (long)(c->tx_len - c->tx_off);
+    if (queued == 0 || remaining(timeout_ms, deadline) == 0) {
+      break;
+    }
+
+    // Wait for room without holding the lock so the receiver can get
+    // at the connection.
+    fd = c->fd;
+    pthread_mutex_unlock(&c->mutex);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    poll(&pfd, 1, remaining(timeout_ms, deadline));
+
+    pthread_mutex_lock(&c->mutex);
+  }
+  pthread_mutex_unlock(&c->mutex);
+
+  return queued;
+}
+
+// next_line looks for a complete line in the receive buffer.
+static int next_line(struct bridge_client* c, const char** line, size_t* len) {
+  char* start = c->rx + c->rx_off;
+  char* nl = memchr(c->rx + c->rx_scan, '\n', c->rx_len - c->rx_scan);
+  size_t n;
+
+  if (nl == NULL) {
+    c->rx_scan = c->rx_len;
+    return 0;
+  }
+
+  n = (size_t)(nl - start);
+  c->rx_off += n + 1;
+  c->rx_scan = c->rx_off;
+
+  if (n > 0 && start[n-1] == '\r') {
+    n--;
+  }
+  *line = start;
+  *len = n;
+  return 1;
+}
+
+int bridge_client_recv_line(struct bridge_client* c, const char** line, size_t* len, int timeout_ms) {
+  uint64_t deadline = now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+
+  for (;;) {
+    struct pollfd pfd;
+    unsigned int gen;
+    ssize_t n;
+    int rc;
+
+    if (next_line(c, line, len)) {
+      return 1;
+    }
+
+    // Make room: drop consumed data (invalidating earlier lines) and,
+    // if a single line fills the buffer, discard it.
+    if (c->rx_off > 0) {
+      memmove(c->rx, c->rx + c->rx_off, c->rx_len - c->rx_off);
+      c->rx_len -= c->rx_off;
+      c->rx_scan -= c->rx_off;
+      c->rx_off = 0;
+    }
+    if (c->rx_len == c->rx_size) {
+      c->rx_len = c->rx_scan = 0;
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    rc = ensure_locked(c);
+    pfd.fd = c->fd;
+    gen = c->gen;
+    if (rc == 0) {
+      c->receiving = 1;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    if (gen != c->rx_gen) {
+      // A partial line from an earlier connection is meaningless.
+      c->rx_len = c->rx_scan = 0;
+      c->rx_gen = gen;
+    }
+
+    if (rc != 0) {
+      if (!c->reconnect) {
+        return -1;
+      }
+      // Wait out the backoff, or the caller's timeout.
+      pthread_mutex_lock(&c->mutex);
+      rc = (int)(c->next_attempt > now_ms() ? c->next_attempt - now_ms() : 10);
+      pthread_mutex_unlock(&c->mutex);
+      if (timeout_ms >= 0 && remaining(timeout_ms, deadline) < rc) {
+        rc = remaining(timeout_ms, deadline);
+      }
+      if (rc == 0) {
+        return 0;
+      }
+      poll(NULL, 0, rc);
+      continue;
+    }
+
+    pfd.events = POLLIN;
+    rc = poll(&pfd, 1, remaining(timeout_ms, deadline));
+    if (rc == 0) {
+      pthread_mutex_lock(&c->mutex);
+      c->receiving = 0;
+      pthread_mutex_unlock(&c->mutex);
+      return 0;
+    }
+
+    n = rc > 0 ? read(pfd.fd, c->rx + c->rx_len, c->rx_size - c->rx_len) : -1;
+
+    pthread_mutex_lock(&c->mutex);
+    c->receiving = 0;
+    if (n > 0) {
+      c->rx_len += (size_t)n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      if (c->fd == pfd.fd) {
+        close_locked(c);
+      }
+      if (!c->reconnect) {
+        pthread_mutex_unlock(&c->mutex);
+        errno = ENOTCONN;
+        return -1;
+      }
+    }
+    if (c->broken && c->fd >= 0) {
+      close_locked(c);
+    }
+    pthread_mutex_unlock(&c->mutex);
+  }
+}
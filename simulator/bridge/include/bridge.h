@@ -0,0 +1,142 @@
+#ifndef _TTY_BRIDGE_H_
+#define _TTY_BRIDGE_H_ 1
+
+#include <linux/configfs.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/serial.h>
+#include <linux/spinlock.h>
+#include <linux/tty.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "common.h"
+#include "socket.h"
+
+// Most bridge instances (tty minors) at once.
+#define BRIDGE_TTY_MINORS 16
+
+#define BRIDGE_EVENTS 32
+
+struct bridge_event {
+  u64 ns;
+  const char *what;
+};
+
+// 1PPS emulation: with pps set, an hrtimer raises DCD at the top of
+// every CLOCK_REALTIME second (plus pps_offset_us, plus a uniformly
+// random error of up to +/- pps_jitter_us) and drops it pps_width_ms
+// later, as a GPS receiver's PPS output wired to DCD does.
+#define BRIDGE_PPS_WIDTH_MS_MAX 900
+
+struct bridge_pps_stats {
+  u64 pulses;
+  // CLOCK_REALTIME of the last rising edge, and how far it was from the
+  // top of its second (the error a consumer's timestamp starts from)
+  u64 last_ns;
+  s64 error_ns;
+  // from the timer's programmed expiry to DCD being raised
+  struct bridge_latency late;
+};
+
+// Settings of an instance. hangup_on_disconnect, replug_delay_ms and
+// the pps_ offset, jitter and width take effect right away; the rest
+// when the instance is enabled.
+struct bridge_config {
+  char socket[BRIDGE_SOCKET_DESC_MAX + 1];
+  int rx_buf;
+  int sndbuf;
+  bool timed_rx;
+  bool rt;
+  int rt_cpu;
+  int rt_priority;
+  unsigned int busy_poll_us;
+  bool hangup_on_disconnect;
+  int replug_delay_ms;
+  int producers;
+  bool pps;
+  int pps_offset_us;
+  int pps_jitter_us;
+  int pps_width_ms;
+};
+
+struct bridge_serial {
+  struct tty_struct *tty;
+  int open_count;
+  struct mutex mutex;
+  struct bridge_socket *socket;
+
+  int msr;
+  int mcr;
+
+  struct serial_struct serial;
+  wait_queue_head_t wait;
+  struct async_icount icount;
+
+  // lock protects msr and icount, which the PPS timer changes from
+  // interrupt context, and the instance's pps_stats.
+  spinlock_t lock;
+};
+
+// A bridge instance is one tty minor and its socket. Instance 0 is
+// created at load time from the module parameters; the others through
+// configfs (see configfs.c). Instances are reference counted: by their
+// creator, and by every tty installed on them, so a tty that outlives
+// its instance's removal (an app that hasn't closed a hung up fd)
+// still points at valid memory.
+struct bridge_instance {
+  struct config_group group;
+  struct kref kref;
+  int minor;
+
+  // cfg_mutex serializes configuration changes, enable and disable.
+  struct mutex cfg_mutex;
+  struct bridge_config cfg;
+  bool enabled;
+
+  struct bridge_serial serial;
+  struct tty_port port;
+  struct bridge_socket socket;
+
+  spinlock_t events_lock;
+  struct bridge_event events[BRIDGE_EVENTS];
+  unsigned int event_count;
+
+  // Set by a hangup, cleared by the next open and write.
+  bool await_open;
+  bool await_write;
+
+  struct mutex plug_mutex;
+  bool unplugged;
+  struct delayed_work replug_work;
+
+  struct hrtimer pps_timer;
+  bool pps_high;
+  // top of the second the current pulse belongs to
+  ktime_t pps_second;
+  struct bridge_pps_stats pps_stats;
+};
+
+// allocate an instance on a free minor, configured from the module
+// parameters, with socket name BRIDGE_SOCKET_DESC (for a NULL name) or
+// BRIDGE_SOCKET_DESC "-" name
+struct bridge_instance* bridge_instance_alloc(const char *name);
+
+// drop a reference to an instance
+void bridge_instance_put(struct bridge_instance *inst);
+
+// register the tty device and start listening on the socket
+int bridge_instance_enable(struct bridge_instance *inst);
+
+// hang up the tty, close the socket and unregister the tty device
+void bridge_instance_disable(struct bridge_instance *inst);
+
+// hang up the tty and, for delay_ms >= 0, unplug it for that long
+void bridge_hangup(struct bridge_instance *inst, int delay_ms);
+
+int bridge_configfs_init(void);
+void bridge_configfs_exit(void);
+
+#endif /* _TTY_BRIDGE_H_ */
@@ -0,0 +1,93 @@
+#ifndef _TTY_BRIDGE_CLIENT_H_
+#define _TTY_BRIDGE_CLIENT_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// User space client for the bridge socket, shared by the simulators
+// (and, through libbridge_client.so, bridge_tester).
+//
+// Sends are non-blocking: each one goes to the socket in a single
+// sendmsg together with anything already queued, and whatever doesn't
+// fit is queued for the next send or bridge_client_flush.
+// Received data is split into lines in place; a line stays valid until
+// the next receive call.
+//
+// A client may be used by two threads at once as long as one only
+// sends and the other only receives. Reconnecting happens in whichever
+// call finds the connection gone, and queued data is dropped with it.
+
+struct bridge_client;
+
+struct bridge_client_opts {
+  // Socket name without the leading null byte; NULL for
+  // BRIDGE_SOCKET_DESC.
+  const char* name;
+
+  // Reconnect after the connection drops or fails (with backoff
+  // between reconnect_min_ms and reconnect_max_ms) instead of failing
+  // with ENOTCONN.
+  int reconnect;
+  int reconnect_min_ms;
+  int reconnect_max_ms;
+
+  // Size of the receive buffer, which bounds the line length, and of
+  // the send queue (defaults: 64 KiB each).
+  size_t rx_size;
+  size_t tx_size;
+
+  // Open every connection in timed mode (see common.h). Timed clients
+  // send with bridge_client_send_at only, and the module needs
+  // timed_rx.
+  int timed;
+
+  // Register every connection as a producer for these space separated
+  // command names ("*" for the ones nobody registered for), for an
+  // instance with several producers (see common.h); NULL to not
+  // register.
+  const char* commands;
+};
+
+// bridge_socket_addr fills in the address of the abstract socket name
+// (NULL for BRIDGE_SOCKET_DESC) and its exact length.
+int bridge_socket_addr(struct sockaddr_un* addr, socklen_t* addrlen, const char* name);
+
+// bridge_client_open creates a client and makes a first connection
+// attempt. opts may be NULL. Without reconnect, a failed attempt fails
+// the open. Returns NULL and sets errno on error.
+struct bridge_client* bridge_client_open(const struct bridge_client_opts* opts);
+
+// bridge_client_close closes the connection and frees the client.
+void bridge_client_close(struct bridge_client* c);
+
+// bridge_client_connected returns 1 if the client has a connection.
+int bridge_client_connected(struct bridge_client* c);
+
+// bridge_client_send sends or queues len bytes. Returns 0, or -1 with
+// errno set to EAGAIN (queue full, nothing queued) or ENOTCONN.
+int bridge_client_send(struct bridge_client* c, const void* data, size_t len);
+
+// bridge_client_sendv sends or queues the iovecs as one batch.
+int bridge_client_sendv(struct bridge_client* c, const struct iovec* iov, int iovcnt);
+
+// bridge_client_send_at sends or queues len bytes (at most
+// BRIDGE_TIMED_MAX_LEN) for delivery to the tty at deliver_ns on
+// CLOCK_MONOTONIC (0 for right away). Only for timed clients; fails
+// with EINVAL otherwise.
+int bridge_client_send_at(struct bridge_client* c, const void* data, size_t len, uint64_t deliver_ns);
+
+// bridge_client_flush writes queued data, waiting up to timeout_ms (-1
+// for no limit). Returns the number of bytes still queued, or -1.
+long bridge_client_flush(struct bridge_client* c, int timeout_ms);
+
+// bridge_client_recv_line waits up to timeout_ms (-1 for no limit) for
+// a line and points line/len at it, without the "\n" or "\r\n".
+// Returns 1 for a line, 0 on timeout and -1 on error (ENOTCONN when the
+// connection closed without reconnect, EMSGSIZE when a line didn't fit
+// in the receive buffer and was discarded).
+int bridge_client_recv_line(struct bridge_client* c, const char** line, size_t* len, int timeout_ms);
+
+#endif /* _TTY_BRIDGE_CLIENT_H_ */
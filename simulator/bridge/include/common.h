@@ -1,6 +1,8 @@
 #ifndef _TTY_BRIDGE_COMMON_H_
 #define _TTY_BRIDGE_COMMON_H_ 1
 
+#include <linux/types.h>
+
 #define BRIDGE_DRIVER_NAME "fake_racecap_tty"
 #define BRIDGE_TTY_NAME    "ttyUSB_FAKE_RACECAP"
 
@@ -11,4 +13,37 @@
 // BRIDGE_SOCKET_DESC) which counts the null terminator.
 #define BRIDGE_SOCKET_NAME_LEN (sizeof(BRIDGE_SOCKET_DESC))
 
+// Longest socket name (sun_path less the leading null byte).
+#define BRIDGE_SOCKET_DESC_MAX 107
+
+// Timed delivery. A connection that starts with BRIDGE_TIMED_MAGIC
+// (when the module has timed_rx enabled) sends frames: a struct
+// bridge_timed_hdr followed by len bytes (at most
+// BRIDGE_TIMED_MAX_LEN), which reach the tty at deliver_ns on
+// CLOCK_MONOTONIC, or right away when that is 0 or has passed.
+#define BRIDGE_TIMED_MAGIC     "BRTIMED1"
+#define BRIDGE_TIMED_MAGIC_LEN 8
+#define BRIDGE_TIMED_MAX_LEN   (64*1024)
+
+struct bridge_timed_hdr {
+  __u64 deliver_ns;
+  __u32 len;
+  __u32 flags; // must be 0
+};
+
+// Producers. An instance configured for more than one producer accepts
+// that many simulator connections at once and passes the tty whole
+// lines from each, never mixing two connections within a line. A
+// connection may open (ahead of BRIDGE_TIMED_MAGIC) with
+// BRIDGE_PRODUCER_MAGIC, a space separated list of command names and
+// "\n": the app's lines whose first JSON key is one of the names are
+// sent to that connection. The rest go to a connection that listed
+// "*", or else to the first one that didn't register.
+#define BRIDGE_PRODUCER_MAGIC     "BRPROD1 "
+#define BRIDGE_PRODUCER_MAGIC_LEN 8
+#define BRIDGE_PRODUCER_CMDS_MAX  256 // including the terminating null byte
+
+// Most producers of an instance.
+#define BRIDGE_PRODUCERS_MAX 8
+
 #endif // _TTY_BRIDGE_COMMON_H_
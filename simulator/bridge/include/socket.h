@@ -1,30 +1,231 @@
 #ifndef _TTY_BRIDGE_SOCKET_H_
 #define _TTY_BRIDGE_SOCKET_H_ 1
 
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "common.h"
+
+// Transmit accounting. ns is the time spent copying and sending;
+// unrouted counts app lines dropped with several producers because no
+// connection would take them.
+struct bridge_tx_stats {
+  u64 bytes;
+  u64 sends;
+  u64 ns;
+  u64 unrouted;
+};
+
+// Histogram of delivery latencies: bucket i counts latencies below
+// 2^i microseconds (the last bucket counts everything above).
+#define BRIDGE_LAT_BUCKETS 24
+
+struct bridge_latency {
+  u64 count;
+  u64 max_ns;
+  u64 buckets[BRIDGE_LAT_BUCKETS];
+};
+
+// Bytes of timed frames that may wait for delivery before reading
+// from the socket stops.
+#define BRIDGE_TIMED_QUEUE_MAX (1024*1024)
+
+// Number of recent delivery delays kept for reporting.
+#define BRIDGE_TIMED_RECENT 16
+
+// A frame remembers the connection it came from (conn, and that
+// connection's gen) to go through its line buffer.
+struct bridge_timed_frame {
+  struct list_head node;
+  u64 deliver_ns;
+  int conn;
+  u32 gen;
+  u32 len;
+  u8 data[];
+};
+
+// Timed delivery accounting. late measures from the requested delivery
+// time to the hand off to the consumer; past_due counts the frames that
+// arrived after their delivery time (and went out right away).
+struct bridge_timed_stats {
+  u64 frames;
+  u64 past_due;
+  u64 queued_bytes;
+  struct bridge_latency late;
+  s64 recent_ns[BRIDGE_TIMED_RECENT];
+  unsigned int recent_next;
+};
+
+// Receive parser state (rx_mode) of a connection.
+#define BRIDGE_RX_START    0 // new connection, matching the magics
+#define BRIDGE_RX_RAW      1
+#define BRIDGE_RX_TIMED    2
+#define BRIDGE_RX_DISCARD  3 // framing error, dropped until reconnect
+#define BRIDGE_RX_REGISTER 4 // reading a producer's command names
+
+// Per producer accounting. split_lines counts lines too long for the
+// line buffer, which reach the tty in pieces.
+struct bridge_producer_stats {
+  u64 rx_bytes;
+  u64 tx_bytes;
+  u64 split_lines;
+};
+
+// A simulator connection and its receive parser state.
+struct bridge_conn {
+  struct socket* sock;
+  int rx_mode;
+  u32 rx_have;
+  u8 rx_magic[BRIDGE_TIMED_MAGIC_LEN];
+  struct bridge_timed_hdr rx_hdr;
+  struct bridge_timed_frame* rx_frame;
+
+  // With several producers, the start of an unfinished line.
+  u8* line;
+  int line_len;
+
+  // Bumped for each new connection in this slot, so that timed frames
+  // of a closed one don't end up in its successor's line buffer.
+  u32 gen;
+
+  // Registered command names, space separated.
+  bool registered;
+  int cmds_len;
+  char cmds[BRIDGE_PRODUCER_CMDS_MAX];
+
+  struct bridge_producer_stats stats;
+};
+
+// A producer as reported by socket_producers.
+struct bridge_producer_info {
+  bool connected;
+  char cmds[BRIDGE_PRODUCER_CMDS_MAX];
+  struct bridge_producer_stats stats;
+};
+
+// Routing state of the app's current line (tx_to) with several
+// producers: its first bytes are held in tx_head until they name the
+// command.
+#define BRIDGE_TX_HEAD  -1 // collecting tx_head
+#define BRIDGE_TX_DROP  -2 // no producer for this line
+#define BRIDGE_TX_HEAD_MAX 64
+
+// Work for the rt thread (bits in rt_work).
+#define BRIDGE_RT_RX 0
+
 struct bridge_socket {
   struct mutex mutex;
   struct socket* listener;
-  struct socket* accepted;
   void* buf;
+  int buf_size;
+  int sndbuf;
   int paused;
   int pending_data;
 
   int (*consume)(void* data, void* payload, int len);
   void *consumer_data;
+
+  struct bridge_tx_stats tx_stats;
+
+  // rt mode: reads run on a dedicated (optionally
+  // pinned) SCHED_FIFO kthread that busy-polls for rt_busy_poll_ns
+  // after each read before sleeping.
+  struct task_struct* rt_task;
+  unsigned long rt_work;
+  u64 rt_busy_poll_ns;
+
+  // disconnected is called (with the consumer data) from disconnect_work
+  // after the peer closes its end.
+  struct work_struct disconnect_work;
+  void (*disconnected)(void* data);
+
+  // timed mode: a connection that opens with BRIDGE_TIMED_MAGIC sends
+  // frames, which wait in timed_queue (ordered by deliver_ns, guarded by
+  // mutex) until timed_task delivers them at their deadline.
+  struct task_struct* timed_task;
+  unsigned long timed_kick;
+  struct list_head timed_queue;
+  int timed_full;
+  struct bridge_timed_stats timed_stats;
+
+  // Connections: only conn[0] with one producer, which a new
+  // connection replaces; with more, up to producers at once, with app
+  // lines routed by tx_to.
+  int producers;
+  struct bridge_conn conn[BRIDGE_PRODUCERS_MAX];
+  int tx_to;
+  int tx_head_len;
+  int tx_head_quotes;
+  u8 tx_head[BRIDGE_TX_HEAD_MAX];
+
+  // abstract socket name, without the leading null byte
+  char name[BRIDGE_SOCKET_DESC_MAX + 1];
+
+  // rx_ready_ns is when the oldest unread data arrived; rx_latency
+  // measures from there to its delivery to the consumer.
+  atomic64_t rx_ready_ns;
+  struct bridge_latency rx_latency;
 };
 
 // initial the bridge_socket and set the consumer callback
 int socket_init(struct bridge_socket*, int (*)(void*, void*, int), void*);
 
+// set the socket name (default BRIDGE_SOCKET_DESC) before listening
+int socket_set_name(struct bridge_socket*, const char*);
+
+// set the size of the receive buffer (the most read at once) and the
+// send buffer of accepted connections (0 for the default) before
+// listening
+int socket_set_buffers(struct bridge_socket*, int rx_buf, int sndbuf);
+
+// set the number of simultaneous simulator connections (1 to
+// BRIDGE_PRODUCERS_MAX) before listening
+int socket_set_producers(struct bridge_socket*, int);
+
 // start listening
 int socket_listen(struct bridge_socket*);
 
 // start close the listener and free all resources
 int socket_close(struct bridge_socket*);
 
-// write the give data/length
+// write the give data/length; with several producers, send each line
+// to its producer
 int socket_write(struct bridge_socket*, void*, int);
 
+// call the callback (with the consumer data) when the peer disconnects
+void socket_set_disconnect(struct bridge_socket*, void (*)(void*));
+
+// bytes that socket_write can currently accept
+int socket_write_room(struct bridge_socket*);
+
+// copy the transmit statistics
+void socket_tx_stats(struct bridge_socket*, struct bridge_tx_stats*);
+
+// start rt mode: cpu < 0 leaves the thread unpinned
+int socket_start_rt(struct bridge_socket*, int cpu, int priority, unsigned int busy_poll_us);
+
+// enable timed mode, delivering from a kthread that is SCHED_FIFO at
+// the given priority when it's above 0
+int socket_enable_timed(struct bridge_socket*, int priority);
+
+// copy the state of up to max producers, returning how many there are
+int socket_producers(struct bridge_socket*, struct bridge_producer_info*, int max);
+
+// copy the timed delivery statistics
+void socket_timed_stats(struct bridge_socket*, struct bridge_timed_stats*);
+
+// copy the receive latency histogram
+void socket_rx_latency(struct bridge_socket*, struct bridge_latency*);
+
+// upper bound in ns of the given quantile (in thousandths) of a
+// latency histogram
+u64 socket_latency_percentile(const struct bridge_latency*, int permille);
+
+// add a latency to a histogram
+void socket_record_latency(struct bridge_latency*, u64 ns);
+
 // pause reading
 void socket_pause(struct bridge_socket*);
 
@@ -0,0 +1,267 @@
+#include <linux/kernel.h>
+
+#include <linux/configfs.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "bridge.h"
+#include "common.h"
+
+// Runtime bridge instances:
+//
+//   mkdir /sys/kernel/config/fake_racecap_tty/imu
+//   echo 1 > /sys/kernel/config/fake_racecap_tty/imu/timed_rx
+//   echo 1 > /sys/kernel/config/fake_racecap_tty/imu/enable
+//   cat /sys/kernel/config/fake_racecap_tty/imu/tty
+//   rmdir /sys/kernel/config/fake_racecap_tty/imu
+//
+// A new instance takes the first free minor and is configured from
+// the module parameters, with socket BRIDGE_SOCKET_DESC "-<name>". Its
+// settings can be changed until it is enabled (except for
+// hangup_on_disconnect, replug_delay_ms and the pps_ offset, jitter and
+// width, which apply right away).
+// Creating, changing or removing an instance leaves the others alone.
+
+static inline struct bridge_instance *to_bridge_instance(struct config_item *item)
+{
+  return container_of(to_config_group(item), struct bridge_instance, group);
+}
+
+// bridge_config_lock takes the instance's cfg_mutex for a change, which
+// unless live has to wait for the instance to be disabled.
+static int bridge_config_lock(struct bridge_instance *inst, bool live)
+{
+  mutex_lock(&inst->cfg_mutex);
+  if (inst->enabled && !live) {
+    mutex_unlock(&inst->cfg_mutex);
+    return -EBUSY;
+  }
+  return 0;
+}
+
+static int bridge_parse_bool(const char *s, unsigned int base, bool *v)
+{
+  return kstrtobool(s, v);
+}
+
+#define BRIDGE_CFG_ATTR(_name, _type, _parse, _fmt, _live)                          \
+static ssize_t bridge_inst_##_name##_show(struct config_item *item, char *page)      \
+{                                                                                   \
+  return sprintf(page, _fmt "\n", READ_ONCE(to_bridge_instance(item)->cfg._name));  \
+}                                                                                   \
+                                                                                    \
+static ssize_t bridge_inst_##_name##_store(struct config_item *item,                \
+                                           const char *page, size_t len)            \
+{                                                                                   \
+  struct bridge_instance *inst = to_bridge_instance(item);                          \
+  _type v;                                                                          \
+  int rc = _parse(page, 0, &v);                                                     \
+                                                                                    \
+  if (rc < 0) {                                                                     \
+    return rc;                                                                      \
+  }                                                                                 \
+  rc = bridge_config_lock(inst, _live);                                             \
+  if (rc < 0) {                                                                     \
+    return rc;                                                                      \
+  }                                                                                 \
+  WRITE_ONCE(inst->cfg._name, v);                                                   \
+  mutex_unlock(&inst->cfg_mutex);                                                   \
+  return len;                                                                       \
+}                                                                                   \
+                                                                                    \
+CONFIGFS_ATTR(bridge_inst_, _name)
+
+BRIDGE_CFG_ATTR(rx_buf, int, kstrtoint, "%d", false);
+BRIDGE_CFG_ATTR(sndbuf, int, kstrtoint, "%d", false);
+BRIDGE_CFG_ATTR(timed_rx, bool, bridge_parse_bool, "%d", false);
+BRIDGE_CFG_ATTR(rt, bool, bridge_parse_bool, "%d", false);
+BRIDGE_CFG_ATTR(rt_cpu, int, kstrtoint, "%d", false);
+BRIDGE_CFG_ATTR(rt_priority, int, kstrtoint, "%d", false);
+BRIDGE_CFG_ATTR(busy_poll_us, unsigned int, kstrtouint, "%u", false);
+BRIDGE_CFG_ATTR(hangup_on_disconnect, bool, bridge_parse_bool, "%d", true);
+BRIDGE_CFG_ATTR(replug_delay_ms, int, kstrtoint, "%d", true);
+BRIDGE_CFG_ATTR(producers, int, kstrtoint, "%d", false);
+BRIDGE_CFG_ATTR(pps, bool, bridge_parse_bool, "%d", false);
+BRIDGE_CFG_ATTR(pps_offset_us, int, kstrtoint, "%d", true);
+BRIDGE_CFG_ATTR(pps_jitter_us, int, kstrtoint, "%d", true);
+BRIDGE_CFG_ATTR(pps_width_ms, int, kstrtoint, "%d", true);
+
+static ssize_t bridge_inst_socket_show(struct config_item *item, char *page)
+{
+  struct bridge_instance *inst = to_bridge_instance(item);
+  ssize_t n;
+
+  mutex_lock(&inst->cfg_mutex);
+  n = sprintf(page, "%s\n", inst->cfg.socket);
+  mutex_unlock(&inst->cfg_mutex);
+
+  return n;
+}
+
+static ssize_t bridge_inst_socket_store(struct config_item *item, const char *page, size_t len)
+{
+  struct bridge_instance *inst = to_bridge_instance(item);
+  size_t n = strcspn(page, "\n");
+  int rc;
+
+  if (n == 0 || n >= sizeof(inst->cfg.socket)) {
+    return -EINVAL;
+  }
+
+  rc = bridge_config_lock(inst, false);
+  if (rc < 0) {
+    return rc;
+  }
+  memcpy(inst->cfg.socket, page, n);
+  inst->cfg.socket[n] = '\0';
+  mutex_unlock(&inst->cfg_mutex);
+
+  return len;
+}
+
+CONFIGFS_ATTR(bridge_inst_, socket);
+
+static ssize_t bridge_inst_enable_show(struct config_item *item, char *page)
+{
+  return sprintf(page, "%d\n", READ_ONCE(to_bridge_instance(item)->enabled));
+}
+
+static ssize_t bridge_inst_enable_store(struct config_item *item, const char *page, size_t len)
+{
+  struct bridge_instance *inst = to_bridge_instance(item);
+  bool enable;
+  int rc = kstrtobool(page, &enable);
+
+  if (rc < 0) {
+    return rc;
+  }
+
+  if (enable) {
+    rc = bridge_instance_enable(inst);
+  } else {
+    bridge_instance_disable(inst);
+  }
+
+  return rc < 0 ? rc : len;
+}
+
+CONFIGFS_ATTR(bridge_inst_, enable);
+
+static ssize_t bridge_inst_tty_show(struct config_item *item, char *page)
+{
+  return sprintf(page, "%s%d\n", BRIDGE_TTY_NAME, to_bridge_instance(item)->minor);
+}
+
+CONFIGFS_ATTR_RO(bridge_inst_, tty);
+
+// Writing a delay in ms hangs up and replugs the tty, as the replug
+// module parameter does for instance 0.
+static ssize_t bridge_inst_replug_store(struct config_item *item, const char *page, size_t len)
+{
+  struct bridge_instance *inst = to_bridge_instance(item);
+  int delay_ms;
+  int rc = kstrtoint(page, 0, &delay_ms);
+
+  if (rc < 0) {
+    return rc;
+  }
+
+  mutex_lock(&inst->cfg_mutex);
+  if (inst->enabled) {
+    bridge_hangup(inst, delay_ms);
+  } else {
+    rc = -ENODEV;
+  }
+  mutex_unlock(&inst->cfg_mutex);
+
+  return rc < 0 ? rc : len;
+}
+
+CONFIGFS_ATTR_WO(bridge_inst_, replug);
+
+static struct configfs_attribute *bridge_inst_attrs[] = {
+  &bridge_inst_attr_socket,
+  &bridge_inst_attr_rx_buf,
+  &bridge_inst_attr_sndbuf,
+  &bridge_inst_attr_timed_rx,
+  &bridge_inst_attr_rt,
+  &bridge_inst_attr_rt_cpu,
+  &bridge_inst_attr_rt_priority,
+  &bridge_inst_attr_busy_poll_us,
+  &bridge_inst_attr_hangup_on_disconnect,
+  &bridge_inst_attr_replug_delay_ms,
+  &bridge_inst_attr_producers,
+  &bridge_inst_attr_pps,
+  &bridge_inst_attr_pps_offset_us,
+  &bridge_inst_attr_pps_jitter_us,
+  &bridge_inst_attr_pps_width_ms,
+  &bridge_inst_attr_enable,
+  &bridge_inst_attr_tty,
+  &bridge_inst_attr_replug,
+  NULL,
+};
+
+static void bridge_inst_release(struct config_item *item)
+{
+  bridge_instance_put(to_bridge_instance(item));
+}
+
+static struct configfs_item_operations bridge_inst_item_ops = {
+  .release = bridge_inst_release,
+};
+
+static const struct config_item_type bridge_inst_type = {
+  .ct_item_ops = &bridge_inst_item_ops,
+  .ct_attrs = bridge_inst_attrs,
+  .ct_owner = THIS_MODULE,
+};
+
+static struct config_group *bridge_make_group(struct config_group *group, const char *name)
+{
+  struct bridge_instance *inst = bridge_instance_alloc(name);
+
+  if (IS_ERR(inst)) {
+    return ERR_CAST(inst);
+  }
+
+  config_group_init_type_name(&inst->group, name, &bridge_inst_type);
+  return &inst->group;
+}
+
+static void bridge_drop_item(struct config_group *group, struct config_item *item)
+{
+  bridge_instance_disable(to_bridge_instance(item));
+  config_item_put(item);
+}
+
+static struct configfs_group_operations bridge_group_ops = {
+  .make_group = bridge_make_group,
+  .drop_item = bridge_drop_item,
+};
+
+static const struct config_item_type bridge_subsys_type = {
+  .ct_group_ops = &bridge_group_ops,
+  .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem bridge_subsys = {
+  .su_group = {
+    .cg_item = {
+      .ci_namebuf = BRIDGE_DRIVER_NAME,
+      .ci_type = &bridge_subsys_type,
+    },
+  },
+};
+
+int bridge_configfs_init(void)
+{
+  config_group_init(&bridge_subsys.su_group);
+  mutex_init(&bridge_subsys.su_mutex);
+  return configfs_register_subsystem(&bridge_subsys);
+}
+
+void bridge_configfs_exit(void)
+{
+  configfs_unregister_subsystem(&bridge_subsys);
+}
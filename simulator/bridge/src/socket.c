@@ -1,7 +1,17 @@
 #include <linux/kernel.h>
 
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/net.h>
+#include <linux/overflow.h>
 #include <linux/sched.h>
+#include <linux/sched/types.h>
 #include <linux/slab.h>
 #include <linux/uio.h>
 #include <linux/un.h>
@@ -13,10 +23,47 @@
 #define SOCKET "bridge-socket: "
 #define BUF_SIZE (64*1024)
 
-static char socket_name[BRIDGE_SOCKET_NAME_LEN+1] = BRIDGE_SOCKET_NAME;
+static void socket_disconnect_work(struct work_struct* work);
+static void socket_read_handler(struct bridge_socket* s, u64 ready_ns);
+
+// socket_conn_reset clears a connection's parser and producer state
+// for a new connection (keeping its line buffer).
+static void socket_conn_reset(struct bridge_conn* c) {
+  kfree(c->rx_frame);
+  c->rx_frame = NULL;
+  c->rx_mode = BRIDGE_RX_START;
+  c->rx_have = 0;
+  c->line_len = 0;
+  c->gen++;
+  c->registered = false;
+  c->cmds_len = 0;
+  c->cmds[0] = '\0';
+  memset(&c->stats, 0, sizeof(c->stats));
+}
+
+// socket_conn_release closes a connection; a partial frame or line from
+// it is gone with it.
+static void socket_conn_release(struct bridge_conn* c) {
+  sock_release(c->sock);
+  c->sock = NULL;
+  socket_conn_reset(c);
+}
+
+static bool socket_connected(struct bridge_socket* s) {
+  int i;
+
+  for (i = 0; i < s->producers; i++) {
+    if (s->conn[i].sock != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
 
 int socket_init(struct bridge_socket* s, int (*consume)(void*, void*, int), void* data)
 {
+  int i;
+
   if (s == NULL) {
     return -ENOMEM;
   }
@@ -24,13 +71,40 @@ int socket_init(struct bridge_socket* s, int (*consume)(void*, void*, int), void
   mutex_init(&s->mutex);
 
   s->listener = NULL;
-  s->accepted = NULL;
-  s->buf = kmalloc(BUF_SIZE, GFP_KERNEL);
+  s->producers = 1;
+  for (i = 0; i < BRIDGE_PRODUCERS_MAX; i++) {
+    memset(&s->conn[i], 0, sizeof(s->conn[i]));
+    socket_conn_reset(&s->conn[i]);
+  }
+  s->tx_to = BRIDGE_TX_HEAD;
+  s->tx_head_len = 0;
+  s->tx_head_quotes = 0;
+  strscpy(s->name, BRIDGE_SOCKET_DESC, sizeof(s->name));
+  s->buf_size = BUF_SIZE;
+  s->buf = kmalloc(s->buf_size, GFP_KERNEL);
+  s->sndbuf = 0;
   s->paused = 0;
   s->pending_data = 0;
   s->consume = consume;
   s->consumer_data = data;
 
+  memset(&s->tx_stats, 0, sizeof(s->tx_stats));
+
+  s->disconnected = NULL;
+  INIT_WORK(&s->disconnect_work, socket_disconnect_work);
+
+  s->timed_task = NULL;
+  s->timed_kick = 0;
+  INIT_LIST_HEAD(&s->timed_queue);
+  s->timed_full = 0;
+  memset(&s->timed_stats, 0, sizeof(s->timed_stats));
+
+  s->rt_task = NULL;
+  s->rt_work = 0;
+  s->rt_busy_poll_ns = 0;
+  atomic64_set(&s->rx_ready_ns, 0);
+  memset(&s->rx_latency, 0, sizeof(s->rx_latency));
+
   if (s->buf == NULL) {
     pr_err(SOCKET "failed to allocate recv buffer\n");
     return -ENOMEM;
@@ -39,35 +113,306 @@ int socket_init(struct bridge_socket* s, int (*consume)(void*, void*, int), void
   return 0;
 }
 
-static void socket_read_handler(struct bridge_socket* s) {
-  struct kvec iov[1] = { 0 };
-  struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+void socket_record_latency(struct bridge_latency* lat, u64 ns) {
+  u64 us = div_u64(ns, NSEC_PER_USEC);
+  int b = us == 0 ? 0 : ilog2(us) + 1;
+
+  if (b >= BRIDGE_LAT_BUCKETS) {
+    b = BRIDGE_LAT_BUCKETS - 1;
+  }
+  lat->buckets[b]++;
+  lat->count++;
+  if (ns > lat->max_ns) {
+    lat->max_ns = ns;
+  }
+}
+
+static void socket_timed_kick(struct bridge_socket* s) {
+  struct task_struct* t = READ_ONCE(s->timed_task);
+
+  if (t != NULL) {
+    set_bit(0, &s->timed_kick);
+    wake_up_process(t);
+  }
+}
+
+// socket_timed_enqueue adds a frame to timed_queue, which is kept in
+// delivery order. Frames mostly arrive in order, so the insert point is
+// searched from the tail.
+static void socket_timed_enqueue(struct bridge_socket* s, struct bridge_timed_frame* f) {
+  struct bridge_timed_frame* pos;
+
+  list_for_each_entry_reverse(pos, &s->timed_queue, node) {
+    if (pos->deliver_ns <= f->deliver_ns) {
+      break;
+    }
+  }
+  list_add(&f->node, &pos->node);
+
+  s->timed_stats.queued_bytes += f->len;
+  if (s->timed_stats.queued_bytes >= BRIDGE_TIMED_QUEUE_MAX) {
+    s->timed_full = 1;
+  }
+  if (f->deliver_ns != 0 && f->deliver_ns <= ktime_get_ns()) {
+    // Still goes out right away (it sorts before anything not yet
+    // due), and its lateness counts.
+    s->timed_stats.past_due++;
+  }
+
+  socket_timed_kick(s);
+}
+
+// socket_timed_parse feeds received bytes of a timed connection
+// through the frame parser.
+static int socket_timed_parse(struct bridge_socket* s, struct bridge_conn* c, u8* data, int len) {
+  struct bridge_timed_frame* f;
+  u32 n;
+
+  while (len > 0) {
+    if (c->rx_mode == BRIDGE_RX_DISCARD) {
+      return 0;
+    }
+
+    if (c->rx_frame == NULL) {
+      n = min_t(u32, len, sizeof(c->rx_hdr) - c->rx_have);
+      memcpy((u8*)&c->rx_hdr + c->rx_have, data, n);
+      c->rx_have += n;
+      data += n;
+      len -= n;
+      if (c->rx_have < sizeof(c->rx_hdr)) {
+        break;
+      }
+      c->rx_have = 0;
+
+      if (c->rx_hdr.len > BRIDGE_TIMED_MAX_LEN || c->rx_hdr.flags != 0) {
+        pr_err(SOCKET "bad timed frame (len %u flags %x), discarding until reconnect\n",
+               c->rx_hdr.len, c->rx_hdr.flags);
+        c->rx_mode = BRIDGE_RX_DISCARD;
+        return -EPROTO;
+      }
+      if (c->rx_hdr.len == 0) {
+        continue;
+      }
+
+      f = kmalloc(struct_size(f, data, c->rx_hdr.len), GFP_KERNEL);
+      if (f == NULL) {
+        c->rx_mode = BRIDGE_RX_DISCARD;
+        return -ENOMEM;
+      }
+      f->deliver_ns = c->rx_hdr.deliver_ns;
+      f->conn = c - s->conn;
+      f->gen = c->gen;
+      f->len = c->rx_hdr.len;
+      c->rx_frame = f;
+    }
+
+    f = c->rx_frame;
+    n = min_t(u32, len, f->len - c->rx_have);
+    memcpy(f->data + c->rx_have, data, n);
+    c->rx_have += n;
+    data += n;
+    len -= n;
+
+    if (c->rx_have == f->len) {
+      c->rx_frame = NULL;
+      c->rx_have = 0;
+      socket_timed_enqueue(s, f);
+    }
+  }
 
+  return 0;
+}
+
+// socket_conn_deliver passes raw bytes of a connection to the consumer.
+// With several producers only whole lines go out, so that lines of
+// different connections never mix: the tail of a read waits in the
+// connection's line buffer for the rest of its line. Everything is
+// delivered under the socket mutex, so a buffered start and the rest
+// of its line reach the consumer back to back.
+static int socket_conn_deliver(struct bridge_socket* s, struct bridge_conn* c, u8* data, int len) {
+  int head = len;
   int rc;
 
+  if (c->line == NULL) {
+    return s->consume(s->consumer_data, data, len);
+  }
+
+  while (head > 0 && data[head-1] != '\n') {
+    head--;
+  }
+
+  if (head == 0) {
+    if (c->line_len + len <= s->buf_size) {
+      memcpy(c->line + c->line_len, data, len);
+      c->line_len += len;
+      return 0;
+    }
+    // Too long to hold: it goes out in pieces.
+    c->stats.split_lines++;
+    head = len;
+  }
+
+  if (c->line_len > 0) {
+    rc = s->consume(s->consumer_data, c->line, c->line_len);
+    c->line_len = 0;
+    if (rc < 0) {
+      return rc;
+    }
+  }
+
+  rc = s->consume(s->consumer_data, data, head);
+  if (head < len) {
+    memcpy(c->line, data + head, len - head);
+    c->line_len = len - head;
+  }
+  return rc;
+}
+
+// socket_conn_start matches the first bytes of a connection against
+// the magics, holding them back in rx_magic until they either complete
+// one or turn out to be data. Returns the number of bytes used.
+static int socket_conn_start(struct bridge_socket* s, struct bridge_conn* c, u8* data, int len) {
+  u32 n = min_t(u32, len, BRIDGE_TIMED_MAGIC_LEN - c->rx_have);
+  u32 have = c->rx_have + n;
+  bool timed, producer;
+  int rc;
+
+  BUILD_BUG_ON(BRIDGE_PRODUCER_MAGIC_LEN != BRIDGE_TIMED_MAGIC_LEN);
+
+  memcpy(c->rx_magic + c->rx_have, data, n);
+  timed = s->timed_task != NULL && memcmp(c->rx_magic, BRIDGE_TIMED_MAGIC, have) == 0;
+  producer = !c->registered && memcmp(c->rx_magic, BRIDGE_PRODUCER_MAGIC, have) == 0;
+
+  if (!timed && !producer) {
+    // The held bytes were data, and so is the rest.
+    u32 held = c->rx_have;
+
+    c->rx_mode = BRIDGE_RX_RAW;
+    c->rx_have = 0;
+    rc = held > 0 ? socket_conn_deliver(s, c, c->rx_magic, held) : 0;
+    return rc < 0 ? rc : 0;
+  }
+
+  c->rx_have = have;
+  if (have < BRIDGE_TIMED_MAGIC_LEN) {
+    return n;
+  }
+
+  c->rx_have = 0;
+  if (timed) {
+    pr_info(SOCKET "timed connection\n");
+    c->rx_mode = BRIDGE_RX_TIMED;
+  } else {
+    c->rx_mode = BRIDGE_RX_REGISTER;
+  }
+  return n;
+}
+
+// socket_conn_register reads a producer's command names up to the end
+// of the line. Returns the number of bytes used.
+static int socket_conn_register(struct bridge_socket* s, struct bridge_conn* c, u8* data, int len) {
+  int n;
+
+  for (n = 0; n < len && data[n] != '\n'; n++) {
+    if (data[n] == '\r') {
+      continue;
+    }
+    if (c->cmds_len == sizeof(c->cmds) - 1) {
+      pr_err(SOCKET "producer command names too long, discarding until reconnect\n");
+      c->rx_mode = BRIDGE_RX_DISCARD;
+      return -EPROTO;
+    }
+    c->cmds[c->cmds_len++] = data[n];
+  }
+  if (n == len) {
+    return n;
+  }
+
+  c->cmds[c->cmds_len] = '\0';
+  c->registered = true;
+  c->rx_mode = BRIDGE_RX_START;
+  pr_info(SOCKET "producer %d registered for %s\n", (int)(c - s->conn), c->cmds);
+  return n + 1;
+}
+
+// socket_conn_rx passes received bytes of a connection through its
+// parser: after an optional producer registration and the timed magic,
+// to the consumer or the frame parser.
+static int socket_conn_rx(struct bridge_socket* s, struct bridge_conn* c, u8* data, int len) {
+  int n;
+
+  c->stats.rx_bytes += len;
+
+  while (len > 0) {
+    switch (c->rx_mode) {
+    case BRIDGE_RX_RAW:
+      return socket_conn_deliver(s, c, data, len);
+    case BRIDGE_RX_TIMED:
+    case BRIDGE_RX_DISCARD:
+      return socket_timed_parse(s, c, data, len);
+    case BRIDGE_RX_REGISTER:
+      n = socket_conn_register(s, c, data, len);
+      break;
+    default:
+      n = socket_conn_start(s, c, data, len);
+      break;
+    }
+    if (n < 0) {
+      return n;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+// socket_read_handler reads and consumes whatever is available, taking
+// a read from each connection in turn. ready_ns is when the data
+// arrived, or 0 to not record its latency.
+static void socket_read_handler(struct bridge_socket* s, u64 ready_ns) {
+  struct kvec iov[1] = { 0 };
+  struct msghdr msg = { .msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT };
+  struct bridge_conn* c;
+  int consumed = 0;
+  int i, rc;
+
   iov[0].iov_base = s->buf;
-  iov[0].iov_len = BUF_SIZE;
+  iov[0].iov_len = s->buf_size;
 
   mutex_lock(&s->mutex);
-  if (s->accepted == NULL) {
+  if (!socket_connected(s)) {
     goto done;
   }
 
-  if (s->paused) {
+  if (s->paused || s->timed_full) {
     s->pending_data = 1;
     goto done;
   }
 
   // TODO: if pending_data was set we should check that we read all the data (may need to MSG_PEEK)
-  rc = kernel_recvmsg(s->accepted, &msg, iov, 1, BUF_SIZE, msg.msg_flags);
-  if (rc > 0) {
-    s->pending_data = 0;
-    rc = s->consume(s->consumer_data, s->buf, rc);
-    if (rc < 0) {
-      pr_err(SOCKET "consume error %d\n", rc);
+  for (i = 0; i < s->producers; i++) {
+    c = &s->conn[i];
+    if (c->sock == NULL) {
+      continue;
+    }
+
+    rc = kernel_recvmsg(c->sock, &msg, iov, 1, s->buf_size, msg.msg_flags);
+    if (rc > 0) {
+      s->pending_data = 0;
+      rc = socket_conn_rx(s, c, s->buf, rc);
+      if (rc < 0) {
+        pr_err(SOCKET "consume error %d\n", rc);
+      } else {
+        consumed = 1;
+      }
+    } else if (rc < 0 && rc != -EAGAIN) {
+      pr_err(SOCKET "read error %d\n", rc);
     }
-  } else if (rc < 0 && rc != -EAGAIN) {
-    pr_err(SOCKET "read error %d\n", rc);
+  }
+
+  if (consumed && ready_ns != 0) {
+    socket_record_latency(&s->rx_latency, ktime_get_ns() - ready_ns);
   }
 
  done:
@@ -76,10 +421,59 @@ static void socket_read_handler(struct bridge_socket* s) {
 
 static void socket_read_handler_cb(struct sock* sk) {
   struct bridge_socket* s = (struct bridge_socket*)sk->sk_user_data;
-  socket_read_handler(s);
+  struct task_struct* rt = READ_ONCE(s->rt_task);
+
+  if (rt != NULL) {
+    // Keep the arrival time of the oldest unread data.
+    atomic64_cmpxchg(&s->rx_ready_ns, 0, ktime_get_ns());
+    set_bit(BRIDGE_RT_RX, &s->rt_work);
+    wake_up_process(rt);
+    return;
+  }
+
+  socket_read_handler(s, ktime_get_ns());
 }
+// socket_conn_state_handler notices the peer closing the accepted
+// connection. The connection can't be released from its own callback,
+// so that's left to disconnect_work.
+static void socket_conn_state_handler(struct sock* sk) {
+  struct bridge_socket* s = (struct bridge_socket*)sk->sk_user_data;
+
+  if (READ_ONCE(sk->sk_shutdown) & RCV_SHUTDOWN) {
+    schedule_work(&s->disconnect_work);
+  }
+}
+
+// socket_disconnect_work releases the connections the peers closed. The
+// device counts as disconnected once the last one is gone.
+static void socket_disconnect_work(struct work_struct* work) {
+  struct bridge_socket* s = container_of(work, struct bridge_socket, disconnect_work);
+  struct bridge_conn* c;
+  int closed = 0;
+  int i;
+
+  mutex_lock(&s->mutex);
+  for (i = 0; i < s->producers; i++) {
+    c = &s->conn[i];
+    if (c->sock != NULL && (READ_ONCE(c->sock->sk->sk_shutdown) & RCV_SHUTDOWN)) {
+      pr_info(SOCKET "conn %d closed by peer\n", i);
+      socket_conn_release(c);
+      closed = 1;
+    }
+  }
+  if (socket_connected(s)) {
+    closed = 0;
+  }
+  mutex_unlock(&s->mutex);
+
+  if (closed && s->disconnected != NULL) {
+    s->disconnected(s->consumer_data);
+  }
+}
+
 static void socket_state_handler(struct sock* sk) {
   struct bridge_socket* s = (struct bridge_socket*)sk->sk_user_data;
+  int i;
 
   mutex_lock(&s->mutex);
 
@@ -87,10 +481,11 @@ static void socket_state_handler(struct sock* sk) {
   case TCP_CLOSE:
     fallthrough;
   case TCP_CLOSE_WAIT:
-    if (s->accepted != NULL) {
-      pr_info(SOCKET "conn closed\n");
-      sock_release(s->accepted);
-      s->accepted = NULL;
+    for (i = 0; i < s->producers; i++) {
+      if (s->conn[i].sock != NULL) {
+        pr_info(SOCKET "conn %d closed\n", i);
+        socket_conn_release(&s->conn[i]);
+      }
     }
     break;
   default:
@@ -101,9 +496,14 @@ static void socket_state_handler(struct sock* sk) {
   mutex_unlock(&s->mutex);
 }
 
+// socket_accept_handler takes a new connection. With one producer it
+// replaces the current one; with more it takes a free slot, and is
+// turned away when there is none.
 static void socket_accept_handler(struct sock* sk) {
   struct bridge_socket* s;
+  struct bridge_conn* c;
   struct socket* conn = NULL;
+  int i;
   int rc = sock_create_lite(AF_UNIX, SOCK_STREAM, 0, &conn);
   if (rc < 0) {
     pr_err(SOCKET "failed to create accept socket: %d\n", rc);
@@ -113,10 +513,9 @@ static void socket_accept_handler(struct sock* sk) {
   s = (struct bridge_socket*)sk->sk_user_data;
 
   mutex_lock(&s->mutex);
-  if (s->accepted != NULL) {
+  if (s->producers == 1 && s->conn[0].sock != NULL) {
     pr_info(SOCKET "closing stale connection\n");
-    sock_release(s->accepted);
-    s->accepted = NULL;
+    socket_conn_release(&s->conn[0]);
   }
 
   conn->type = s->listener->type;
@@ -129,10 +528,29 @@ static void socket_accept_handler(struct sock* sk) {
     goto done;
   }
 
-  s->accepted = conn;
+  for (i = 0; i < s->producers && s->conn[i].sock != NULL; i++) {
+  }
+  if (i == s->producers) {
+    pr_err(SOCKET "all %d producers connected, refusing connection\n", s->producers);
+    sock_release(conn);
+    goto done;
+  }
+
+  c = &s->conn[i];
+  socket_conn_reset(c);
+  c->sock = conn;
+
+  if (s->sndbuf > 0) {
+    // As SO_SNDBUF would, doubled for bookkeeping overhead.
+    lock_sock(conn->sk);
+    conn->sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
+    WRITE_ONCE(conn->sk->sk_sndbuf, max_t(int, s->sndbuf * 2, SOCK_MIN_SNDBUF));
+    release_sock(conn->sk);
+  }
 
   conn->sk->sk_user_data = s;
   conn->sk->sk_data_ready = socket_read_handler_cb;
+  conn->sk->sk_state_change = socket_conn_state_handler;
 
  done:
   mutex_unlock(&s->mutex);
@@ -142,23 +560,31 @@ int socket_listen(struct bridge_socket* s)
 {
   struct sockaddr_un addr;
   size_t addrlen;
-  int rc;
+  int i, rc;
 
   if (s == NULL) {
     return -EINVAL;
   }
 
+  // Lines of several producers are held until complete.
+  for (i = 0; s->producers > 1 && i < s->producers; i++) {
+    s->conn[i].line = kmalloc(s->buf_size, GFP_KERNEL);
+    if (s->conn[i].line == NULL) {
+      return -ENOMEM;
+    }
+  }
+
   memset(&addr, 0, sizeof(addr));
   addr.sun_family = AF_UNIX;
 
-  // Copy at offset of 1 to preseve the zero byte at the start of
-  // socket_name. Max copy is size of sun_path - 2 to account for the
-  // leading zero byte and to guarantee a trailing zero byte.
-  strncpy(addr.sun_path+1, socket_name+1, sizeof(addr.sun_path) - 2);
+  // Copy at offset of 1 to keep the zero byte at the start of the
+  // abstract name. The name is at most sizeof(sun_path) - 1 bytes (see
+  // socket_set_name).
+  memcpy(addr.sun_path+1, s->name, strlen(s->name));
 
   // Compute addrlen to avoid creating a socket with trailing zero
   // bytes in its name.
-  addrlen = offsetof(struct sockaddr_un, sun_path)+BRIDGE_SOCKET_NAME_LEN;
+  addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(s->name);
 
   rc = sock_create(AF_UNIX, SOCK_STREAM, 0, &s->listener);
   if (rc < 0) {
@@ -178,7 +604,7 @@ int socket_listen(struct bridge_socket* s)
     return rc;
   }
 
-  rc = s->listener->ops->listen(s->listener, 1);
+  rc = s->listener->ops->listen(s->listener, s->producers);
   if (rc < 0) {
     pr_err(SOCKET "failed to listener on socket: %d\n", rc);
     sock_release(s->listener);
@@ -191,6 +617,8 @@ int socket_listen(struct bridge_socket* s)
 
 int socket_close(struct bridge_socket* s)
 {
+  int i;
+
   if (s == NULL) {
     return 0;
   }
@@ -198,10 +626,10 @@ int socket_close(struct bridge_socket* s)
   mutex_lock(&s->mutex);
   s->paused = 0;
 
-  if (s->accepted != NULL) {
-    struct socket* a = s->accepted;
-    s->accepted = NULL;
-    sock_release(a);
+  for (i = 0; i < s->producers; i++) {
+    if (s->conn[i].sock != NULL) {
+      socket_conn_release(&s->conn[i]);
+    }
   }
 
   if (s->listener != NULL) {
@@ -212,38 +640,207 @@ int socket_close(struct bridge_socket* s)
 
   if (s->buf != NULL) {
     kfree(s->buf);
+    s->buf = NULL;
   }
 
   mutex_unlock(&s->mutex);
 
+  // Only now, with the sockets released, can no state callback queue
+  // disconnect_work again; flush what was queued before.
+  cancel_work_sync(&s->disconnect_work);
+
+  // With the sockets released no callback can wake the rt or timed
+  // threads.
+  if (s->rt_task != NULL) {
+    struct task_struct* rt = s->rt_task;
+    WRITE_ONCE(s->rt_task, NULL);
+    kthread_stop(rt);
+    put_task_struct(rt);
+  }
+
+  if (s->timed_task != NULL) {
+    struct task_struct* t = s->timed_task;
+    struct bridge_timed_frame* f;
+    struct bridge_timed_frame* tmp;
+
+    WRITE_ONCE(s->timed_task, NULL);
+    kthread_stop(t);
+    put_task_struct(t);
+
+    list_for_each_entry_safe(f, tmp, &s->timed_queue, node) {
+      list_del(&f->node);
+      kfree(f);
+    }
+    s->timed_stats.queued_bytes = 0;
+  }
+
+  for (i = 0; i < BRIDGE_PRODUCERS_MAX; i++) {
+    socket_conn_reset(&s->conn[i]);
+    kfree(s->conn[i].line);
+    s->conn[i].line = NULL;
+  }
+
   return 0;
 }
 
-int socket_write(struct bridge_socket* s, void* data, int len) {
+// socket_send_error drops the connection after a failed send. A
+// closed peer isn't an error.
+static int socket_send_error(struct bridge_conn* c, int rc) {
+  if (rc != -EPIPE) {
+    pr_err(SOCKET "send error %d\n", rc);
+  } else {
+    rc = 0;
+  }
+
+  socket_conn_release(c);
+  return rc;
+}
+
+// socket_conn_send copies data to a connection.
+static int socket_conn_send(struct bridge_socket* s, struct bridge_conn* c, void* data, int len) {
   struct kvec iov[1] = { 0 };
   struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+  u64 start = ktime_get_ns();
   int rc;
 
-  mutex_lock(&s->mutex);
+  iov[0].iov_base = data;
+  iov[0].iov_len = len;
 
-  if (s->accepted != NULL) {
-    iov[0].iov_base = data;
-    iov[0].iov_len = len;
+  rc = kernel_sendmsg(c->sock, &msg, iov, 1, len);
+  s->tx_stats.ns += ktime_get_ns() - start;
+  s->tx_stats.sends++;
+  if (rc < 0) {
+    return socket_send_error(c, rc);
+  }
+  s->tx_stats.bytes += rc;
+  c->stats.tx_bytes += rc;
+  return rc;
+}
 
-    rc = kernel_sendmsg(s->accepted, &msg, iov, 1, len);
-    if (rc < 0) {
-      if (rc != -EPIPE) {
-        pr_err(SOCKET "send error %d\n", rc);
+// socket_conn_wants returns whether a producer registered for the
+// command name.
+static bool socket_conn_wants(const struct bridge_conn* c, const char* name, int len) {
+  const char* p = c->cmds;
+  const char* end;
+
+  while (*p != '\0') {
+    for (end = p; *end != '\0' && *end != ' '; end++) {
+    }
+    if (end - p == len && memcmp(p, name, len) == 0) {
+      return true;
+    }
+    p = *end == '\0' ? end : end + 1;
+  }
+  return false;
+}
+
+// socket_route picks the producer for the line starting with tx_head:
+// the one registered for its first JSON key, else the one registered
+// for "*", else the first that didn't register.
+static int socket_route(struct bridge_socket* s) {
+  const char* name = NULL;
+  int name_len = 0;
+  int fallback = BRIDGE_TX_DROP;
+  struct bridge_conn* c;
+  int i;
+
+  if (s->tx_head_quotes >= 2) {
+    const char* end = (const char*)s->tx_head + s->tx_head_len;
+
+    name = (const char*)memchr(s->tx_head, '"', s->tx_head_len) + 1;
+    name_len = (const char*)memchr(name, '"', end - name) - name;
+  }
+
+  for (i = 0; i < s->producers; i++) {
+    c = &s->conn[i];
+    if (c->sock == NULL) {
+      continue;
+    }
+    if (!c->registered) {
+      if (fallback == BRIDGE_TX_DROP) {
+        fallback = i;
+      }
+      continue;
+    }
+    if (name != NULL && socket_conn_wants(c, name, name_len)) {
+      return i;
+    }
+    if (socket_conn_wants(c, "*", 1)) {
+      fallback = i;
+    }
+  }
+  return fallback;
+}
+
+// socket_demux sends each line the app writes to its producer. The
+// start of a line is held in tx_head until it names the command (or
+// the line ends, or tx_head fills); the rest follows it straight
+// through. Lines no producer takes are dropped, as a disconnected
+// device would.
+static int socket_demux(struct bridge_socket* s, u8* data, int len) {
+  struct bridge_conn* c;
+  int used = 0;
+  int n;
+  bool eol;
+
+  while (used < len) {
+    if (s->tx_to == BRIDGE_TX_HEAD) {
+      eol = false;
+      while (used < len && s->tx_head_len < BRIDGE_TX_HEAD_MAX && s->tx_head_quotes < 2 && !eol) {
+        u8 ch = data[used++];
+
+        s->tx_head[s->tx_head_len++] = ch;
+        s->tx_head_quotes += ch == '"';
+        eol = ch == '\n';
+      }
+      if (!eol && s->tx_head_len < BRIDGE_TX_HEAD_MAX && s->tx_head_quotes < 2) {
+        break;
+      }
+
+      s->tx_to = socket_route(s);
+      if (s->tx_to == BRIDGE_TX_DROP) {
+        s->tx_stats.unrouted++;
       } else {
-        rc = 0;
+        socket_conn_send(s, &s->conn[s->tx_to], s->tx_head, s->tx_head_len);
+      }
+      s->tx_head_len = 0;
+      s->tx_head_quotes = 0;
+      if (eol) {
+        s->tx_to = BRIDGE_TX_HEAD;
       }
+      continue;
+    }
 
-      sock_release(s->accepted);
-      s->accepted = NULL;
+    for (n = used; n < len && data[n] != '\n'; n++) {
     }
-  } else {
+    eol = n < len;
+    n += eol;
+
+    c = s->tx_to >= 0 ? &s->conn[s->tx_to] : NULL;
+    if (c != NULL && c->sock != NULL) {
+      socket_conn_send(s, c, data + used, n - used);
+    }
+    used = n;
+    if (eol) {
+      s->tx_to = BRIDGE_TX_HEAD;
+    }
+  }
+
+  return len;
+}
+
+int socket_write(struct bridge_socket* s, void* data, int len) {
+  int rc;
+
+  mutex_lock(&s->mutex);
+
+  if (!socket_connected(s)) {
     pr_err(SOCKET "no socket\n");
     rc = -EINVAL;
+  } else if (s->producers > 1) {
+    rc = socket_demux(s, data, len);
+  } else {
+    rc = socket_conn_send(s, &s->conn[0], data, len);
   }
 
   mutex_unlock(&s->mutex);
@@ -251,6 +848,59 @@ int socket_write(struct bridge_socket* s, void* data, int len) {
   return rc;
 }
 
+int socket_set_name(struct bridge_socket* s, const char* name) {
+  size_t len = strlen(name);
+
+  if (len == 0 || len >= sizeof(s->name)) {
+    return -EINVAL;
+  }
+  memcpy(s->name, name, len + 1);
+  return 0;
+}
+
+int socket_set_buffers(struct bridge_socket* s, int rx_buf, int sndbuf) {
+  void* buf;
+
+  if (rx_buf > 0 && rx_buf != s->buf_size) {
+    buf = kmalloc(rx_buf, GFP_KERNEL);
+    if (buf == NULL) {
+      return -ENOMEM;
+    }
+    mutex_lock(&s->mutex);
+    kfree(s->buf);
+    s->buf = buf;
+    s->buf_size = rx_buf;
+    mutex_unlock(&s->mutex);
+  }
+  s->sndbuf = sndbuf;
+  return 0;
+}
+
+int socket_set_producers(struct bridge_socket* s, int producers) {
+  if (producers < 1 || producers > BRIDGE_PRODUCERS_MAX) {
+    return -EINVAL;
+  }
+  s->producers = producers;
+  return 0;
+}
+
+void socket_set_disconnect(struct bridge_socket* s, void (*disconnected)(void*)) {
+  mutex_lock(&s->mutex);
+  s->disconnected = disconnected;
+  mutex_unlock(&s->mutex);
+}
+
+int socket_write_room(struct bridge_socket* s) {
+  // TODO: this should be less aspirational
+  return 4*1024;
+}
+
+void socket_tx_stats(struct bridge_socket* s, struct bridge_tx_stats* stats) {
+  mutex_lock(&s->mutex);
+  *stats = s->tx_stats;
+  mutex_unlock(&s->mutex);
+}
+
 void socket_pause(struct bridge_socket* s) {
   mutex_lock(&s->mutex);
   s->paused = 1;
@@ -262,12 +912,284 @@ void socket_resume(struct bridge_socket* s) {
 
   mutex_lock(&s->mutex);
   s->paused = 0;
-  if (s->accepted != NULL && s->pending_data) {
+  if (socket_connected(s) && s->pending_data) {
     call_read_handler = 1;
   }
   mutex_unlock(&s->mutex);
 
   if (call_read_handler) {
-    socket_read_handler(s);
+    socket_read_handler(s, 0);
+  }
+  socket_timed_kick(s);
+}
+
+// socket_rt_run does the rt thread's reads. After each it
+// keeps polling for rt_busy_poll_ns, as the next message often follows
+// closely and sleeping would cost a wakeup.
+static void socket_rt_run(struct bridge_socket* s) {
+  u64 deadline;
+
+  if (!test_and_clear_bit(BRIDGE_RT_RX, &s->rt_work)) {
+    return;
+  }
+
+  socket_read_handler(s, atomic64_xchg(&s->rx_ready_ns, 0));
+
+  deadline = ktime_get_ns() + s->rt_busy_poll_ns;
+  while (ktime_get_ns() < deadline && !kthread_should_stop()) {
+    if (test_and_clear_bit(BRIDGE_RT_RX, &s->rt_work)) {
+      socket_read_handler(s, atomic64_xchg(&s->rx_ready_ns, 0));
+      deadline = ktime_get_ns() + s->rt_busy_poll_ns;
+    }
+    cpu_relax();
+  }
+}
+
+static int socket_rt_thread(void* data) {
+  struct bridge_socket* s = data;
+
+  while (!kthread_should_stop()) {
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (READ_ONCE(s->rt_work) == 0) {
+      schedule();
+      continue;
+    }
+    __set_current_state(TASK_RUNNING);
+
+    socket_rt_run(s);
+  }
+
+  __set_current_state(TASK_RUNNING);
+  return 0;
+}
+
+int socket_start_rt(struct bridge_socket* s, int cpu, int priority, unsigned int busy_poll_us) {
+  struct sched_attr attr = {
+    .size = sizeof(attr),
+    .sched_policy = SCHED_FIFO,
+    .sched_priority = priority,
+  };
+  struct task_struct* rt;
+  int rc;
+
+  if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu))) {
+    pr_err(SOCKET "rt cpu %d is not online\n", cpu);
+    return -EINVAL;
+  }
+  if (priority < 1 || priority > MAX_RT_PRIO - 1) {
+    pr_err(SOCKET "rt priority %d out of range\n", priority);
+    return -EINVAL;
+  }
+
+  rt = kthread_create(socket_rt_thread, s, "bridge-rt");
+  if (IS_ERR(rt)) {
+    return PTR_ERR(rt);
+  }
+
+  if (cpu >= 0) {
+    kthread_bind(rt, cpu);
+  }
+
+  rc = sched_setattr_nocheck(rt, &attr);
+  if (rc < 0) {
+    pr_err(SOCKET "failed to make rt thread SCHED_FIFO: %d\n", rc);
+    kthread_stop(rt);
+    return rc;
+  }
+
+  s->rt_busy_poll_ns = (u64)busy_poll_us * NSEC_PER_USEC;
+
+  // Hold a reference so kthread_stop in socket_close is safe even if
+  // the thread has already exited.
+  get_task_struct(rt);
+  WRITE_ONCE(s->rt_task, rt);
+  wake_up_process(rt);
+
+  pr_info(SOCKET "rt thread on cpu %d, priority %d, busy poll %uus\n", cpu, priority, busy_poll_us);
+  return 0;
+}
+
+static void socket_timed_record(struct bridge_socket* s, struct bridge_timed_frame* f, u64 now) {
+  struct bridge_timed_stats* st = &s->timed_stats;
+
+  st->frames++;
+  if (f->deliver_ns == 0) {
+    return;
+  }
+  socket_record_latency(&st->late, now - f->deliver_ns);
+  st->recent_ns[st->recent_next % BRIDGE_TIMED_RECENT] = now - f->deliver_ns;
+  st->recent_next++;
+}
+
+// socket_timed_consume passes a frame on like any read of its
+// connection, so that with several producers its lines stay whole. A
+// frame that outlived its connection goes out as it is: the line it
+// may have started went with the connection.
+static int socket_timed_consume(struct bridge_socket* s, struct bridge_timed_frame* f) {
+  struct bridge_conn* c = &s->conn[f->conn];
+
+  if (c->gen != f->gen) {
+    return s->consume(s->consumer_data, f->data, f->len);
+  }
+  return socket_conn_deliver(s, c, f->data, f->len);
+}
+
+// socket_timed_deliver hands the frames that are due to the consumer
+// and returns the delivery time of the next one (0 when there is none,
+// or while reading is paused).
+static u64 socket_timed_deliver(struct bridge_socket* s) {
+  struct bridge_timed_frame* f;
+  u64 next = 0;
+  u64 now;
+  int resume = 0;
+  int rc;
+
+  mutex_lock(&s->mutex);
+  while (!s->paused && !list_empty(&s->timed_queue)) {
+    f = list_first_entry(&s->timed_queue, struct bridge_timed_frame, node);
+    now = ktime_get_ns();
+    if (f->deliver_ns > now) {
+      next = f->deliver_ns;
+      break;
+    }
+
+    list_del(&f->node);
+    s->timed_stats.queued_bytes -= f->len;
+
+    rc = socket_timed_consume(s, f);
+    if (rc < 0) {
+      pr_err(SOCKET "consume error %d\n", rc);
+    } else {
+      socket_timed_record(s, f, ktime_get_ns());
+    }
+    kfree(f);
+  }
+
+  if (s->timed_full && s->timed_stats.queued_bytes < BRIDGE_TIMED_QUEUE_MAX / 2) {
+    s->timed_full = 0;
+    resume = socket_connected(s) && s->pending_data;
+  }
+  mutex_unlock(&s->mutex);
+
+  if (resume) {
+    socket_read_handler(s, 0);
+  }
+  return next;
+}
+
+// socket_timed_thread sleeps on an hrtimer until the next frame is
+// due. Frames can't be delivered from the timer itself as the consumer
+// sleeps (it takes mutexes), so the timer only wakes this thread.
+static int socket_timed_thread(void* data) {
+  struct bridge_socket* s = data;
+  ktime_t expires;
+  u64 next;
+
+  for (;;) {
+    next = socket_timed_deliver(s);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (kthread_should_stop()) {
+      break;
+    }
+    if (test_and_clear_bit(0, &s->timed_kick)) {
+      // Something was queued (or reading resumed) since the delivery
+      // pass.
+      __set_current_state(TASK_RUNNING);
+      continue;
+    }
+
+    if (next == 0) {
+      schedule();
+    } else {
+      expires = ns_to_ktime(next);
+      schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+    }
+  }
+
+  __set_current_state(TASK_RUNNING);
+  return 0;
+}
+
+int socket_enable_timed(struct bridge_socket* s, int priority) {
+  struct sched_attr attr = {
+    .size = sizeof(attr),
+    .sched_policy = SCHED_FIFO,
+    .sched_priority = priority,
+  };
+  struct task_struct* t;
+  int rc;
+
+  if (priority > MAX_RT_PRIO - 1) {
+    pr_err(SOCKET "timed priority %d out of range\n", priority);
+    return -EINVAL;
+  }
+
+  t = kthread_create(socket_timed_thread, s, "bridge-timed");
+  if (IS_ERR(t)) {
+    return PTR_ERR(t);
+  }
+
+  if (priority > 0) {
+    rc = sched_setattr_nocheck(t, &attr);
+    if (rc < 0) {
+      pr_err(SOCKET "failed to make timed thread SCHED_FIFO: %d\n", rc);
+      kthread_stop(t);
+      return rc;
+    }
+  }
+
+  get_task_struct(t);
+  WRITE_ONCE(s->timed_task, t);
+  wake_up_process(t);
+
+  pr_info(SOCKET "timed delivery thread, priority %d\n", priority);
+  return 0;
+}
+
+int socket_producers(struct bridge_socket* s, struct bridge_producer_info* info, int max) {
+  struct bridge_conn* c;
+  int i;
+
+  mutex_lock(&s->mutex);
+  for (i = 0; i < s->producers && i < max; i++) {
+    c = &s->conn[i];
+    info[i].connected = c->sock != NULL;
+    strscpy(info[i].cmds, c->registered ? c->cmds : "", sizeof(info[i].cmds));
+    info[i].stats = c->stats;
+  }
+  i = s->producers;
+  mutex_unlock(&s->mutex);
+
+  return i;
+}
+
+void socket_timed_stats(struct bridge_socket* s, struct bridge_timed_stats* stats) {
+  mutex_lock(&s->mutex);
+  *stats = s->timed_stats;
+  mutex_unlock(&s->mutex);
+}
+
+void socket_rx_latency(struct bridge_socket* s, struct bridge_latency* lat) {
+  mutex_lock(&s->mutex);
+  *lat = s->rx_latency;
+  mutex_unlock(&s->mutex);
+}
+
+u64 socket_latency_percentile(const struct bridge_latency* lat, int permille) {
+  u64 want = div64_u64(lat->count * permille + 999, 1000);
+  u64 seen = 0;
+  int b;
+
+  if (lat->count == 0) {
+    return 0;
+  }
+
+  for (b = 0; b < BRIDGE_LAT_BUCKETS - 1; b++) {
+    seen += lat->buckets[b];
+    if (seen >= want) {
+      return (1ULL << b) * NSEC_PER_USEC;
+    }
   }
+  return lat->max_ns;
 }
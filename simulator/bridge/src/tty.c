@@ -1,7 +1,13 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 #include <linux/module.h>
+#include <linux/random.h>
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/tty.h>
@@ -10,10 +16,14 @@
 #include <linux/serial.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
+#include <linux/spinlock.h>
+#include <linux/stringify.h>
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
+#include "bridge.h"
 #include "common.h"
 #include "socket.h"
 
@@ -31,58 +41,229 @@ MODULE_LICENSE("Dual MIT/GPL");
 #endif
 
 #define BRIDGE_TTY_MAJOR          233   // seems free on this raspberry pi :-/
-#define BRIDGE_TTY_MINORS         1     // just the 1 device
 
-struct bridge_serial {
-  struct tty_struct *tty;
-  int open_count;
-  struct mutex mutex;
-  struct bridge_socket *socket;
+static int major = BRIDGE_TTY_MAJOR;
+module_param(major, int, 0444);
+MODULE_PARM_DESC(major, "tty major number (0: allocate one)");
+
+// Instance 0 uses BRIDGE_SOCKET_DESC and is configured by the module
+// parameters below, which are also the defaults for instances created
+// through configfs (/sys/kernel/config/fake_racecap_tty/<name>).
+static bool default_device = true;
+module_param(default_device, bool, 0444);
+MODULE_PARM_DESC(default_device, "create instance 0 at load time");
+
+// Latency-critical mode: socket reads run on a
+// SCHED_FIFO kthread instead of in the socket callbacks and the shared
+// workqueue. The "rx:" lines in /proc/tty/driver/fake_racecap_tty give
+// the latency from data arriving on the socket to it reaching the tty.
+static bool rt = false;
+module_param(rt, bool, 0444);
+MODULE_PARM_DESC(rt, "run socket processing on a dedicated real-time kthread");
+
+static int rt_cpu = -1;
+module_param(rt_cpu, int, 0444);
+MODULE_PARM_DESC(rt_cpu, "CPU to pin the rt kthread to (-1: unpinned)");
+
+static int rt_priority = 50;
+module_param(rt_priority, int, 0444);
+MODULE_PARM_DESC(rt_priority, "SCHED_FIFO priority of the rt kthread (1-99)");
+
+static uint busy_poll_us = 50;
+module_param(busy_poll_us, uint, 0444);
+MODULE_PARM_DESC(busy_poll_us, "microseconds the rt kthread polls for more data before sleeping");
+
+// Timed delivery: simulators that open their connection with
+// BRIDGE_TIMED_MAGIC send frames tagged with a CLOCK_MONOTONIC delivery
+// time, which an hrtimer-driven kthread (SCHED_FIFO at rt_priority in
+// rt mode) pushes to the tty at that instant. The "timed:" lines in
+// /proc/tty/driver/fake_racecap_tty report how late frames went out.
+static bool timed_rx = false;
+module_param(timed_rx, bool, 0444);
+MODULE_PARM_DESC(timed_rx, "accept frames with a delivery time from the simulator");
+
+static int rx_buf = 0;
+module_param(rx_buf, int, 0444);
+MODULE_PARM_DESC(rx_buf, "bytes read from the socket at once (0: 64 KiB)");
+
+static int sndbuf = 0;
+module_param(sndbuf, int, 0444);
+MODULE_PARM_DESC(sndbuf, "send buffer of the simulator connection (0: system default)");
+
+// Several simulator processes (say GPS, CAN and storage) can feed one
+// device: with producers above 1 the socket takes that many connections
+// at once, interleaves their lines into the tty and routes each command
+// the app writes to the producer that registered for it (see common.h).
+// The "producer:" lines in /proc/tty/driver/fake_racecap_tty give the
+// traffic of each.
+static int producers = 1;
+module_param(producers, int, 0444);
+MODULE_PARM_DESC(producers, "simulator connections accepted at once (1-" __stringify(BRIDGE_PRODUCERS_MAX) ")");
+
+// GPS 1PPS on DCD (see bridge.h): pulses wake TIOCMIWAIT waiters, count
+// in TIOCGICOUNT's dcd and, with the PPS line discipline attached
+// (ldattach PPS /dev/ttyUSB_FAKE_RACECAP0), feed /dev/ppsN. The "pps:"
+// line in /proc/tty/driver/fake_racecap_tty gives the last pulse's
+// CLOCK_REALTIME timestamp for measuring consumers (test/pps_test.c).
+static bool pps = false;
+module_param(pps, bool, 0444);
+MODULE_PARM_DESC(pps, "pulse DCD once a second like a GPS PPS output");
+
+static int pps_offset_us = 0;
+module_param(pps_offset_us, int, 0444);
+MODULE_PARM_DESC(pps_offset_us, "offset of the PPS pulse from the top of the second");
+
+static int pps_jitter_us = 0;
+module_param(pps_jitter_us, int, 0444);
+MODULE_PARM_DESC(pps_jitter_us, "random error of up to +/- this much added to each PPS pulse");
+
+static int pps_width_ms = 100;
+module_param(pps_width_ms, int, 0444);
+MODULE_PARM_DESC(pps_width_ms, "PPS pulse width (1-" __stringify(BRIDGE_PPS_WIDTH_MS_MAX) ")");
+
+static struct tty_driver *bridge_tty_driver;
+
+static DEFINE_MUTEX(bridge_instances_mutex);
+static struct bridge_instance *bridge_instances[BRIDGE_TTY_MINORS];
+static struct bridge_instance *bridge_default;
+
+// Cable yank emulation. With hangup_on_disconnect, the simulator
+// closing its connection hangs up the tty; writing a delay in ms to
+// the replug parameter does the same on demand. Unless the delay is
+// negative (replug_delay_ms for disconnects), the device node is then
+// unregistered and registered again after the delay. Events are
+// timestamped (CLOCK_MONOTONIC ns) in the "event:" lines of
+// /proc/tty/driver/fake_racecap_tty so a harness can measure recovery.
+// The parameters apply to instance 0 as they change.
+static bool hangup_on_disconnect = false;
+static int replug_delay_ms = -1;
+
+static int hangup_on_disconnect_set(const char *val, const struct kernel_param *kp)
+{
+  int rc = param_set_bool(val, kp);
+
+  if (rc == 0 && bridge_default != NULL) {
+    WRITE_ONCE(bridge_default->cfg.hangup_on_disconnect, hangup_on_disconnect);
+  }
+  return rc;
+}
+
+static int replug_delay_ms_set(const char *val, const struct kernel_param *kp)
+{
+  int rc = param_set_int(val, kp);
 
-  int msr;
-  int mcr;
+  if (rc == 0 && bridge_default != NULL) {
+    WRITE_ONCE(bridge_default->cfg.replug_delay_ms, replug_delay_ms);
+  }
+  return rc;
+}
 
-  struct serial_struct serial;
-  wait_queue_head_t wait;
-  struct async_icount icount;
+static const struct kernel_param_ops hangup_on_disconnect_ops = {
+  .set = hangup_on_disconnect_set,
+  .get = param_get_bool,
 };
 
-static struct bridge_serial *bridge = NULL;
-static struct tty_port bridge_tty_port = { 0 };
-static struct bridge_socket bridge_socket = { 0 };
+static const struct kernel_param_ops replug_delay_ms_ops = {
+  .set = replug_delay_ms_set,
+  .get = param_get_int,
+};
 
-static int bridge_open(struct tty_struct *tty, struct file *file)
+module_param_cb(hangup_on_disconnect, &hangup_on_disconnect_ops, &hangup_on_disconnect, 0644);
+MODULE_PARM_DESC(hangup_on_disconnect, "hang up the tty when the simulator disconnects");
+
+module_param_cb(replug_delay_ms, &replug_delay_ms_ops, &replug_delay_ms, 0644);
+MODULE_PARM_DESC(replug_delay_ms, "after a disconnect hangup, unplug the device for this long (-1: stay plugged)");
+
+static inline struct bridge_instance *bridge_instance_of(struct bridge_serial *bridge)
+{
+  return container_of(bridge, struct bridge_instance, serial);
+}
+
+static void bridge_event(struct bridge_instance *inst, const char *what)
+{
+  unsigned long flags;
+  u64 ns = ktime_get_ns();
+
+  spin_lock_irqsave(&inst->events_lock, flags);
+  inst->events[inst->event_count % BRIDGE_EVENTS].ns = ns;
+  inst->events[inst->event_count % BRIDGE_EVENTS].what = what;
+  inst->event_count++;
+  spin_unlock_irqrestore(&inst->events_lock, flags);
+
+  pr_info("fake racecap %d event %s at %llu\n", inst->minor, what, ns);
+}
+
+// bridge_install attaches a new tty to its instance, which it holds a
+// reference to until bridge_cleanup.
+static int bridge_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+  struct bridge_instance *inst;
+  int rc;
+
+  mutex_lock(&bridge_instances_mutex);
+  inst = bridge_instances[tty->index];
+  if (inst == NULL || !inst->enabled) {
+    mutex_unlock(&bridge_instances_mutex);
+    return -ENODEV;
+  }
+  kref_get(&inst->kref);
+  mutex_unlock(&bridge_instances_mutex);
+
+  rc = tty_port_install(&inst->port, driver, tty);
+  if (rc) {
+    bridge_instance_put(inst);
+    return rc;
+  }
+
+  tty->driver_data = &inst->serial;
+  return 0;
+}
+
+static void bridge_cleanup(struct tty_struct *tty)
 {
+  struct bridge_serial *bridge = tty->driver_data;
+
   tty->driver_data = NULL;
+  if (bridge != NULL) {
+    bridge_instance_put(bridge_instance_of(bridge));
+  }
+}
+
+static int bridge_open(struct tty_struct *tty, struct file *file)
+{
+  struct bridge_serial *bridge = tty->driver_data;
+  struct bridge_instance *inst;
 
   pr_debug("fake racecap open\n");
 
   if (bridge == NULL) {
-    // first open of this tty
-    bridge = kmalloc(sizeof(*bridge), GFP_KERNEL);
-    if (bridge == NULL) {
-      pr_err("fake racecap open failed: no memory\n");
-      return -ENOMEM;
-    }
+    return -ENODEV;
+  }
+  inst = bridge_instance_of(bridge);
 
-    memset(bridge, 0, sizeof(*bridge));
-    mutex_init(&bridge->mutex);
+  if (!READ_ONCE(inst->enabled)) {
+    return -ENODEV;
   }
 
   mutex_lock(&bridge->mutex);
 
-  // reference ourselves from the ttv and remember our tty
-  tty->driver_data = bridge;
+  // remember our tty
   bridge->tty = tty;
 
   bridge->open_count++;
 
   if (bridge->open_count == 1) {
-    bridge->socket = &bridge_socket;
+    bridge->socket = &inst->socket;
+    tty_port_tty_set(&inst->port, tty);
   }
 
   mutex_unlock(&bridge->mutex);
 
+  if (READ_ONCE(inst->await_open)) {
+    WRITE_ONCE(inst->await_open, false);
+    bridge_event(inst, "open");
+  }
+
   return 0;
 }
 
@@ -99,7 +280,8 @@ static void do_close(struct bridge_serial *bridge)
 
   if (bridge->open_count <= 0) {
     bridge->socket = NULL;
-   }
+    tty_port_tty_set(&bridge_instance_of(bridge)->port, NULL);
+  }
 
 exit:
   mutex_unlock(&bridge->mutex);
@@ -119,6 +301,7 @@ static void bridge_close(struct tty_struct *tty, struct file *file)
 static int bridge_write(struct tty_struct *tty, const unsigned char *buffer, int count)
 {
   struct bridge_serial *bridge = tty->driver_data;
+  struct bridge_instance *inst;
   //  int i;
   int retval = -EINVAL;
 
@@ -127,6 +310,7 @@ static int bridge_write(struct tty_struct *tty, const unsigned char *buffer, int
   if (bridge == NULL) {
     return -ENODEV;
   }
+  inst = bridge_instance_of(bridge);
 
   mutex_lock(&bridge->mutex);
 
@@ -135,6 +319,11 @@ static int bridge_write(struct tty_struct *tty, const unsigned char *buffer, int
     goto exit;
   }
 
+  if (READ_ONCE(inst->await_write)) {
+    WRITE_ONCE(inst->await_write, false);
+    bridge_event(inst, "write");
+  }
+
   retval = socket_write(bridge->socket, (void*)buffer, count);
   if (retval < 0) {
     pr_err("socket write error %d\n", retval);
@@ -163,13 +352,12 @@ static unsigned int bridge_write_room(struct tty_struct *tty)
 
   mutex_lock(&bridge->mutex);
 
-  if (!bridge->open_count) {
+  if (!bridge->open_count || bridge->socket == NULL) {
     // never opened?
     goto exit;
   }
 
-  // TODO: this should be less aspirational
-  room = 4*1024;
+  room = socket_write_room(bridge->socket);
 
 exit:
   mutex_unlock(&bridge->mutex);
@@ -177,16 +365,14 @@ exit:
 }
 
 static int bridge_read(void* ctxt, void* data, int len) {
+  struct bridge_instance *inst = ctxt;
+  struct bridge_serial *bridge = &inst->serial;
   struct tty_struct *tty;
   struct tty_port *port;
   int rc = -EINVAL;
 
   pr_debug("fake racecap read\n");
 
-  if (bridge == NULL) {
-    return -ENODEV;
-  }
-
   if (len == 0) {
     return 0;
   }
@@ -213,6 +399,91 @@ static int bridge_read(void* ctxt, void* data, int len) {
   return rc;
 }
 
+// bridge_hangup hangs up the tty like a yanked cable and, for a
+// non-negative delay, removes the device node until replug_work puts it
+// back.
+void bridge_hangup(struct bridge_instance *inst, int delay_ms)
+{
+  mutex_lock(&inst->plug_mutex);
+
+  WRITE_ONCE(inst->await_open, true);
+  WRITE_ONCE(inst->await_write, true);
+
+  bridge_event(inst, "hangup");
+  tty_port_tty_hangup(&inst->port, false);
+
+  if (delay_ms >= 0 && !inst->unplugged) {
+    tty_unregister_device(bridge_tty_driver, inst->minor);
+    inst->unplugged = true;
+    bridge_event(inst, "unplug");
+    schedule_delayed_work(&inst->replug_work, msecs_to_jiffies(delay_ms));
+  }
+
+  mutex_unlock(&inst->plug_mutex);
+}
+
+static void bridge_replug(struct work_struct *work)
+{
+  struct bridge_instance *inst = container_of(to_delayed_work(work), struct bridge_instance, replug_work);
+  struct device *dev;
+
+  mutex_lock(&inst->plug_mutex);
+
+  if (inst->unplugged) {
+    dev = tty_port_register_device(&inst->port, bridge_tty_driver, inst->minor, NULL);
+    if (IS_ERR(dev)) {
+      pr_err("failed to re-register device for %s minor %d %ld\n", BRIDGE_DRIVER_NAME, inst->minor, PTR_ERR(dev));
+    } else {
+      inst->unplugged = false;
+      bridge_event(inst, "replug");
+    }
+  }
+
+  mutex_unlock(&inst->plug_mutex);
+}
+
+static void bridge_disconnected(void* ctxt)
+{
+  struct bridge_instance *inst = ctxt;
+
+  bridge_event(inst, "disconnect");
+
+  if (READ_ONCE(inst->cfg.hangup_on_disconnect)) {
+    bridge_hangup(inst, READ_ONCE(inst->cfg.replug_delay_ms));
+  }
+}
+
+static int replug_set(const char *val, const struct kernel_param *kp)
+{
+  struct bridge_instance *inst = bridge_default;
+  int delay_ms;
+  int rc = kstrtoint(val, 0, &delay_ms);
+
+  if (rc < 0) {
+    return rc;
+  }
+  if (inst == NULL) {
+    return -ENODEV;
+  }
+
+  mutex_lock(&inst->cfg_mutex);
+  if (inst->enabled) {
+    bridge_hangup(inst, delay_ms);
+  } else {
+    rc = -ENODEV;
+  }
+  mutex_unlock(&inst->cfg_mutex);
+
+  return rc;
+}
+
+static const struct kernel_param_ops replug_ops = {
+  .set = replug_set,
+};
+
+module_param_cb(replug, &replug_ops, NULL, 0200);
+MODULE_PARM_DESC(replug, "write a delay in ms to hang up and replug instance 0 (-1: hang up only)");
+
 static void bridge_set_termios(struct tty_struct *tty, struct ktermios *old_termios)
 {
   unsigned int cflag = tty->termios.c_cflag;
@@ -244,10 +515,13 @@ static int bridge_tiocmget(struct tty_struct *tty)
   unsigned int result = 0;
   unsigned int msr;
   unsigned int mcr;
+  unsigned long flags;
 
   mutex_lock(&bridge->mutex);
 
+  spin_lock_irqsave(&bridge->lock, flags);
   msr = bridge->msr;
+  spin_unlock_irqrestore(&bridge->lock, flags);
   mcr = bridge->mcr;
 
   result =
@@ -299,11 +573,238 @@ static int bridge_tiocmset(struct tty_struct *tty,
   return 0;
 }
 
+// bridge_pps_ldisc hands a DCD change to the line discipline, as
+// serial_core does, which is how the PPS line discipline timestamps it.
+static void bridge_pps_ldisc(struct bridge_instance *inst, bool high)
+{
+  struct tty_struct *tty = tty_port_tty_get(&inst->port);
+  struct tty_ldisc *ld;
+
+  if (tty == NULL) {
+    return;
+  }
+
+  ld = tty_ldisc_ref(tty);
+  if (ld != NULL) {
+    if (ld->ops->dcd_change != NULL) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+      ld->ops->dcd_change(tty, high);
+#else
+      ld->ops->dcd_change(tty, high ? 1 : 0);
+#endif
+    }
+    tty_ldisc_deref(ld);
+  }
+  tty_kref_put(tty);
+}
+
+// bridge_pps_next_second returns the top of the next CLOCK_REALTIME
+// second whose pulse (at pps_offset_us) is still ahead.
+static ktime_t bridge_pps_next_second(struct bridge_instance *inst)
+{
+  s64 offset = (s64)READ_ONCE(inst->cfg.pps_offset_us) * NSEC_PER_USEC;
+  s64 now = ktime_get_real_ns();
+
+  return ns_to_ktime((div_s64(now - offset, NSEC_PER_SEC) + 1) * NSEC_PER_SEC);
+}
+
+// bridge_pps_edge returns when the pulse for second is raised: offset
+// and jitter applied.
+static ktime_t bridge_pps_edge(struct bridge_instance *inst, ktime_t second)
+{
+  s64 ns = ktime_to_ns(second) + (s64)READ_ONCE(inst->cfg.pps_offset_us) * NSEC_PER_USEC;
+  int jitter_us = READ_ONCE(inst->cfg.pps_jitter_us);
+
+  if (jitter_us > 0) {
+    ns += ((s64)(get_random_u32() % (2 * (u32)jitter_us + 1)) - jitter_us) * NSEC_PER_USEC;
+  }
+  return ns_to_ktime(ns);
+}
+
+// bridge_pps_fire raises or drops DCD and schedules the next change.
+static enum hrtimer_restart bridge_pps_fire(struct hrtimer *timer)
+{
+  struct bridge_instance *inst = container_of(timer, struct bridge_instance, pps_timer);
+  struct bridge_serial *bridge = &inst->serial;
+  bool high = !inst->pps_high;
+  u64 now = ktime_get_real_ns();
+  s64 late = (s64)now - ktime_to_ns(hrtimer_get_expires(timer));
+  unsigned long flags;
+  int width_ms;
+
+  spin_lock_irqsave(&bridge->lock, flags);
+  if (high) {
+    bridge->msr |= MSR_CD;
+    inst->pps_stats.pulses++;
+    inst->pps_stats.last_ns = now;
+    inst->pps_stats.error_ns = (s64)now - ktime_to_ns(inst->pps_second);
+    socket_record_latency(&inst->pps_stats.late, late > 0 ? late : 0);
+  } else {
+    bridge->msr &= ~MSR_CD;
+  }
+  bridge->icount.dcd++;
+  spin_unlock_irqrestore(&bridge->lock, flags);
+  inst->pps_high = high;
+
+  wake_up_interruptible(&bridge->wait);
+  bridge_pps_ldisc(inst, high);
+
+  if (high) {
+    width_ms = clamp(READ_ONCE(inst->cfg.pps_width_ms), 1, BRIDGE_PPS_WIDTH_MS_MAX);
+    hrtimer_set_expires(timer, ktime_add_ms(hrtimer_get_expires(timer), width_ms));
+  } else {
+    inst->pps_second = bridge_pps_next_second(inst);
+    hrtimer_set_expires(timer, bridge_pps_edge(inst, inst->pps_second));
+  }
+  return HRTIMER_RESTART;
+}
+
+static void bridge_pps_start(struct bridge_instance *inst)
+{
+  inst->pps_high = false;
+  inst->pps_second = bridge_pps_next_second(inst);
+  hrtimer_start(&inst->pps_timer, bridge_pps_edge(inst, inst->pps_second), HRTIMER_MODE_ABS);
+}
+
+// bridge_pps_stop cancels the timer and leaves DCD low.
+static void bridge_pps_stop(struct bridge_instance *inst)
+{
+  unsigned long flags;
+
+  hrtimer_cancel(&inst->pps_timer);
+  if (inst->pps_high) {
+    spin_lock_irqsave(&inst->serial.lock, flags);
+    inst->serial.msr &= ~MSR_CD;
+    inst->serial.icount.dcd++;
+    spin_unlock_irqrestore(&inst->serial.lock, flags);
+    inst->pps_high = false;
+    wake_up_interruptible(&inst->serial.wait);
+  }
+}
+
+static void bridge_proc_show_instance(struct seq_file *m, struct bridge_instance *inst)
+{
+  struct bridge_socket *s = &inst->socket;
+  struct bridge_tx_stats tx;
+  struct bridge_latency *lat;
+  struct bridge_timed_stats *timed;
+  struct bridge_producer_info *producer;
+  struct bridge_pps_stats *pulse;
+  struct bridge_event ev[BRIDGE_EVENTS];
+  unsigned int count, first, n;
+  unsigned long flags;
+  int i;
+
+  spin_lock_irqsave(&inst->events_lock, flags);
+  count = inst->event_count;
+  first = count > BRIDGE_EVENTS ? count - BRIDGE_EVENTS : 0;
+  for (n = first; n < count; n++) {
+    ev[n - first] = inst->events[n % BRIDGE_EVENTS];
+  }
+  spin_unlock_irqrestore(&inst->events_lock, flags);
+
+  for (n = first; n < count; n++) {
+    seq_printf(m, "event:%u ns:%llu %s\n", n, ev[n - first].ns, ev[n - first].what);
+  }
+
+  if (!inst->enabled) {
+    return;
+  }
+
+  socket_tx_stats(s, &tx);
+  seq_printf(m, "tx: bytes:%llu sends:%llu ns:%llu ns_per_kib:%llu\n",
+             tx.bytes, tx.sends, tx.ns,
+             tx.bytes > 0 ? div64_u64(tx.ns * 1024, tx.bytes) : 0);
+
+  producer = inst->cfg.producers > 1 ? kmalloc_array(BRIDGE_PRODUCERS_MAX, sizeof(*producer), GFP_KERNEL) : NULL;
+  if (producer != NULL) {
+    n = socket_producers(s, producer, BRIDGE_PRODUCERS_MAX);
+    seq_printf(m, "producers:%u unrouted:%llu\n", n, tx.unrouted);
+    for (i = 0; i < n; i++) {
+      seq_printf(m, "producer:%d connected:%d rx_bytes:%llu tx_bytes:%llu split_lines:%llu cmds:%s\n",
+                 i, producer[i].connected, producer[i].stats.rx_bytes, producer[i].stats.tx_bytes,
+                 producer[i].stats.split_lines, producer[i].cmds[0] != '\0' ? producer[i].cmds : "-");
+    }
+    kfree(producer);
+  }
+
+  lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+  if (lat != NULL) {
+    socket_rx_latency(s, lat);
+    seq_printf(m, "rx:%s count:%llu p50_ns:%llu p99_ns:%llu p999_ns:%llu max_ns:%llu\n",
+               inst->cfg.rt ? "rt" : "default", lat->count,
+               socket_latency_percentile(lat, 500), socket_latency_percentile(lat, 990),
+               socket_latency_percentile(lat, 999), lat->max_ns);
+    seq_printf(m, "rx_hist_us:");
+    for (i = 0; i < BRIDGE_LAT_BUCKETS; i++) {
+      seq_printf(m, " <%llu:%llu", 1ULL << i, lat->buckets[i]);
+    }
+    seq_printf(m, "\n");
+    kfree(lat);
+  }
+
+  timed = inst->cfg.timed_rx ? kmalloc(sizeof(*timed), GFP_KERNEL) : NULL;
+  if (timed != NULL) {
+    socket_timed_stats(s, timed);
+    lat = &timed->late;
+    seq_printf(m, "timed: frames:%llu past_due:%llu queued_bytes:%llu late_p50_ns:%llu late_p99_ns:%llu "
+               "late_p999_ns:%llu late_max_ns:%llu\n",
+               timed->frames, timed->past_due, timed->queued_bytes,
+               socket_latency_percentile(lat, 500), socket_latency_percentile(lat, 990),
+               socket_latency_percentile(lat, 999), lat->max_ns);
+    seq_printf(m, "timed_recent_late_ns:");
+    n = timed->recent_next > BRIDGE_TIMED_RECENT ? timed->recent_next - BRIDGE_TIMED_RECENT : 0;
+    for (; n < timed->recent_next; n++) {
+      seq_printf(m, " %lld", timed->recent_ns[n % BRIDGE_TIMED_RECENT]);
+    }
+    seq_printf(m, "\n");
+    kfree(timed);
+  }
+
+  pulse = inst->cfg.pps ? kmalloc(sizeof(*pulse), GFP_KERNEL) : NULL;
+  if (pulse != NULL) {
+    spin_lock_irqsave(&inst->serial.lock, flags);
+    *pulse = inst->pps_stats;
+    spin_unlock_irqrestore(&inst->serial.lock, flags);
+    seq_printf(m, "pps: pulses:%llu offset_us:%d jitter_us:%d width_ms:%d last_ns:%llu error_ns:%lld "
+               "late_p50_ns:%llu late_p99_ns:%llu late_max_ns:%llu\n",
+               pulse->pulses, READ_ONCE(inst->cfg.pps_offset_us), READ_ONCE(inst->cfg.pps_jitter_us),
+               READ_ONCE(inst->cfg.pps_width_ms), pulse->last_ns, pulse->error_ns,
+               socket_latency_percentile(&pulse->late, 500), socket_latency_percentile(&pulse->late, 990),
+               pulse->late.max_ns);
+    kfree(pulse);
+  }
+}
+
+// bridge_proc_show prints a "<minor>: socket:<name> ..." line for each
+// instance, followed by that instance's statistics.
 static int bridge_proc_show(struct seq_file *m, void *v)
 {
+  struct bridge_instance *inst;
+  int minor;
+
   seq_printf(m, "bridgeserinfo:1.0 driver:%s\n", DRIVER_VERSION);
-  if (bridge != NULL) {
-    seq_printf(m, "1\n");
+
+  for (minor = 0; minor < BRIDGE_TTY_MINORS; minor++) {
+    mutex_lock(&bridge_instances_mutex);
+    inst = bridge_instances[minor];
+    if (inst != NULL && !kref_get_unless_zero(&inst->kref)) {
+      // being released
+      inst = NULL;
+    }
+    mutex_unlock(&bridge_instances_mutex);
+
+    if (inst == NULL) {
+      continue;
+    }
+
+    mutex_lock(&inst->cfg_mutex);
+    seq_printf(m, "%d: socket:%s enabled:%d open:%d\n",
+               minor, inst->cfg.socket, inst->enabled, READ_ONCE(inst->serial.open_count));
+    bridge_proc_show_instance(m, inst);
+    mutex_unlock(&inst->cfg_mutex);
+
+    bridge_instance_put(inst);
   }
 
   return 0;
@@ -351,6 +852,15 @@ static int bridge_ioctl_tiocgserial(struct tty_struct *tty,
   return -ENOIOCTLCMD;
 }
 
+static void bridge_icount(struct bridge_serial *bridge, struct async_icount *icount)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&bridge->lock, flags);
+  *icount = bridge->icount;
+  spin_unlock_irqrestore(&bridge->lock, flags);
+}
+
 static int bridge_ioctl_tiocmiwait(struct tty_struct *tty,
                                    unsigned int cmd,
                                    unsigned long arg)
@@ -362,18 +872,24 @@ static int bridge_ioctl_tiocmiwait(struct tty_struct *tty,
     struct async_icount cnow;
     struct async_icount cprev;
 
-    cprev = bridge->icount;
+    bridge_icount(bridge, &cprev);
     while (1) {
       add_wait_queue(&bridge->wait, &wait);
       set_current_state(TASK_INTERRUPTIBLE);
-      schedule();
+      // an edge between reading cprev and queueing must not be missed
+      bridge_icount(bridge, &cnow);
+      if (cnow.rng == cprev.rng && cnow.dsr == cprev.dsr &&
+          cnow.dcd == cprev.dcd && cnow.cts == cprev.cts) {
+        schedule();
+      }
+      __set_current_state(TASK_RUNNING);
       remove_wait_queue(&bridge->wait, &wait);
 
       if (signal_pending(current)) {
         return -ERESTARTSYS;
       }
 
-      cnow = bridge->icount;
+      bridge_icount(bridge, &cnow);
       if (cnow.rng == cprev.rng && cnow.dsr == cprev.dsr &&
           cnow.dcd == cprev.dcd && cnow.cts == cprev.cts) {
         // no change is an error
@@ -398,9 +914,11 @@ static int bridge_ioctl_tiocgicount(struct tty_struct *tty,
   struct bridge_serial *bridge = tty->driver_data;
 
   if (cmd == TIOCGICOUNT) {
-    struct async_icount cnow = bridge->icount;
+    struct async_icount cnow;
     struct serial_icounter_struct icount;
 
+    bridge_icount(bridge, &cnow);
+
     icount.cts = cnow.cts;
     icount.dsr = cnow.dsr;
     icount.rng = cnow.rng;
@@ -439,6 +957,8 @@ static int bridge_ioctl(struct tty_struct *tty,
 
 
 static const struct tty_operations serial_ops = {
+  .install = bridge_install,
+  .cleanup = bridge_cleanup,
   .open = bridge_open,
   .close = bridge_close,
   .write = bridge_write,
@@ -450,11 +970,206 @@ static const struct tty_operations serial_ops = {
   .ioctl = bridge_ioctl,
 };
 
-static struct tty_driver *bridge_tty_driver;
+struct bridge_instance* bridge_instance_alloc(const char *name)
+{
+  struct bridge_instance *inst;
+  struct bridge_config *cfg;
+  int minor;
+  int n;
+
+  inst = kzalloc(sizeof(*inst), GFP_KERNEL);
+  if (inst == NULL) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  cfg = &inst->cfg;
+  if (name == NULL) {
+    n = snprintf(cfg->socket, sizeof(cfg->socket), "%s", BRIDGE_SOCKET_DESC);
+  } else {
+    n = snprintf(cfg->socket, sizeof(cfg->socket), "%s-%s", BRIDGE_SOCKET_DESC, name);
+  }
+  if (n >= sizeof(cfg->socket)) {
+    kfree(inst);
+    return ERR_PTR(-ENAMETOOLONG);
+  }
+  cfg->rx_buf = rx_buf;
+  cfg->sndbuf = sndbuf;
+  cfg->timed_rx = timed_rx;
+  cfg->rt = rt;
+  cfg->rt_cpu = rt_cpu;
+  cfg->rt_priority = rt_priority;
+  cfg->busy_poll_us = busy_poll_us;
+  cfg->hangup_on_disconnect = hangup_on_disconnect;
+  cfg->replug_delay_ms = replug_delay_ms;
+  cfg->producers = producers;
+  cfg->pps = pps;
+  cfg->pps_offset_us = pps_offset_us;
+  cfg->pps_jitter_us = pps_jitter_us;
+  cfg->pps_width_ms = pps_width_ms;
+
+  kref_init(&inst->kref);
+  mutex_init(&inst->cfg_mutex);
+  mutex_init(&inst->serial.mutex);
+  init_waitqueue_head(&inst->serial.wait);
+  spin_lock_init(&inst->serial.lock);
+  spin_lock_init(&inst->events_lock);
+  mutex_init(&inst->plug_mutex);
+  INIT_DELAYED_WORK(&inst->replug_work, bridge_replug);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+  hrtimer_setup(&inst->pps_timer, bridge_pps_fire, CLOCK_REALTIME, HRTIMER_MODE_ABS);
+#else
+  hrtimer_init(&inst->pps_timer, CLOCK_REALTIME, HRTIMER_MODE_ABS);
+  inst->pps_timer.function = bridge_pps_fire;
+#endif
+  tty_port_init(&inst->port);
+
+  mutex_lock(&bridge_instances_mutex);
+  for (minor = 0; minor < BRIDGE_TTY_MINORS; minor++) {
+    if (bridge_instances[minor] == NULL) {
+      break;
+    }
+  }
+  if (minor < BRIDGE_TTY_MINORS) {
+    inst->minor = minor;
+    bridge_instances[minor] = inst;
+  }
+  mutex_unlock(&bridge_instances_mutex);
+
+  if (minor == BRIDGE_TTY_MINORS) {
+    tty_port_destroy(&inst->port);
+    kfree(inst);
+    return ERR_PTR(-ENOSPC);
+  }
+
+  return inst;
+}
+
+static void bridge_instance_release(struct kref *kref)
+{
+  struct bridge_instance *inst = container_of(kref, struct bridge_instance, kref);
+
+  mutex_lock(&bridge_instances_mutex);
+  bridge_instances[inst->minor] = NULL;
+  mutex_unlock(&bridge_instances_mutex);
+
+  tty_port_destroy(&inst->port);
+  kfree(inst);
+}
+
+void bridge_instance_put(struct bridge_instance *inst)
+{
+  kref_put(&inst->kref, bridge_instance_release);
+}
+
+int bridge_instance_enable(struct bridge_instance *inst)
+{
+  struct bridge_config *cfg = &inst->cfg;
+  struct bridge_socket *s = &inst->socket;
+  struct device *dev;
+  int retval = 0;
+
+  mutex_lock(&inst->cfg_mutex);
+
+  if (inst->enabled) {
+    goto exit;
+  }
+
+  dev = tty_port_register_device(&inst->port, bridge_tty_driver, inst->minor, NULL);
+  if (IS_ERR(dev)) {
+    retval = PTR_ERR(dev);
+    pr_err("failed to register device for %s minor %d %d\n", BRIDGE_DRIVER_NAME, inst->minor, retval);
+    goto exit;
+  }
+
+  retval = socket_init(s, bridge_read, inst);
+  if (!retval) {
+    retval = socket_set_name(s, cfg->socket);
+  }
+  if (!retval) {
+    retval = socket_set_producers(s, cfg->producers);
+  }
+  if (!retval) {
+    retval = socket_set_buffers(s, cfg->rx_buf, cfg->sndbuf);
+  }
+  if (!retval) {
+    socket_set_disconnect(s, bridge_disconnected);
+    if (cfg->timed_rx) {
+      retval = socket_enable_timed(s, cfg->rt ? cfg->rt_priority : 0);
+    }
+  }
+  if (!retval && cfg->rt) {
+    retval = socket_start_rt(s, cfg->rt_cpu, cfg->rt_priority, cfg->busy_poll_us);
+  }
+  if (!retval) {
+    retval = socket_listen(s);
+  }
+  if (retval < 0) {
+    pr_err("failed to init socket for %s minor %d %d\n", BRIDGE_DRIVER_NAME, inst->minor, retval);
+    socket_close(s);
+    tty_unregister_device(bridge_tty_driver, inst->minor);
+    goto exit;
+  }
+
+  inst->unplugged = false;
+  mutex_lock(&bridge_instances_mutex);
+  WRITE_ONCE(inst->enabled, true);
+  mutex_unlock(&bridge_instances_mutex);
+
+  if (cfg->pps) {
+    bridge_pps_start(inst);
+  }
+
+  pr_info("%s%d on socket %s\n", BRIDGE_TTY_NAME, inst->minor, cfg->socket);
+
+exit:
+  mutex_unlock(&inst->cfg_mutex);
+  return retval;
+}
+
+void bridge_instance_disable(struct bridge_instance *inst)
+{
+  struct tty_struct *tty;
+
+  mutex_lock(&inst->cfg_mutex);
+
+  if (!inst->enabled) {
+    goto exit;
+  }
+
+  // No new ttys from here on; hang up the open one, which closes it.
+  mutex_lock(&bridge_instances_mutex);
+  WRITE_ONCE(inst->enabled, false);
+  mutex_unlock(&bridge_instances_mutex);
+
+  bridge_pps_stop(inst);
+
+  tty = tty_port_tty_get(&inst->port);
+  if (tty != NULL) {
+    tty_vhangup(tty);
+    tty_kref_put(tty);
+  }
+
+  // socket_close releases the connections before flushing
+  // disconnect_work, so after it nothing schedules a replug.
+  socket_close(&inst->socket);
+  cancel_delayed_work_sync(&inst->replug_work);
+
+  mutex_lock(&inst->plug_mutex);
+  if (!inst->unplugged) {
+    tty_unregister_device(bridge_tty_driver, inst->minor);
+  }
+  inst->unplugged = false;
+  mutex_unlock(&inst->plug_mutex);
+
+  pr_info("%s%d removed\n", BRIDGE_TTY_NAME, inst->minor);
+
+exit:
+  mutex_unlock(&inst->cfg_mutex);
+}
 
 static int __init bridge_init(void)
 {
-  struct device* dev;
+  struct bridge_instance *inst;
   int retval;
 
   bridge_tty_driver = alloc_tty_driver(BRIDGE_TTY_MINORS);
@@ -466,7 +1181,7 @@ static int __init bridge_init(void)
   bridge_tty_driver->owner = THIS_MODULE;
   bridge_tty_driver->driver_name = BRIDGE_DRIVER_NAME;
   bridge_tty_driver->name = BRIDGE_TTY_NAME;
-  bridge_tty_driver->major = BRIDGE_TTY_MAJOR;
+  bridge_tty_driver->major = major;
   bridge_tty_driver->type = TTY_DRIVER_TYPE_SERIAL;
   bridge_tty_driver->subtype = SERIAL_TYPE_NORMAL;
   bridge_tty_driver->flags = TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV;
@@ -474,9 +1189,6 @@ static int __init bridge_init(void)
   bridge_tty_driver->init_termios.c_cflag = B9600 | CS8 | CREAD | HUPCL | CLOCAL;
   tty_set_operations(bridge_tty_driver, &serial_ops);
 
-  tty_port_init(&bridge_tty_port);
-  tty_port_link_device(&bridge_tty_port, bridge_tty_driver, 0);
-
   retval = tty_register_driver(bridge_tty_driver);
   if (retval) {
     pr_err("failed to register %s %d\n", BRIDGE_DRIVER_NAME, retval);
@@ -484,45 +1196,55 @@ static int __init bridge_init(void)
     return retval;
   }
 
-  dev = tty_register_device(bridge_tty_driver, 0, NULL);
-  if (IS_ERR(dev)) {
-    pr_err("failed to register device for %s minor %d %ld\n", BRIDGE_DRIVER_NAME, 0, PTR_ERR(dev));
-    tty_unregister_driver(bridge_tty_driver);
-    put_tty_driver(bridge_tty_driver);
-    return PTR_ERR(dev);
+  if (default_device) {
+    inst = bridge_instance_alloc(NULL);
+    if (IS_ERR(inst)) {
+      retval = PTR_ERR(inst);
+      goto fail;
+    }
+    retval = bridge_instance_enable(inst);
+    if (retval < 0) {
+      bridge_instance_put(inst);
+      goto fail;
+    }
+    bridge_default = inst;
   }
 
-  retval = socket_init(&bridge_socket, bridge_read, NULL);
-  if (!retval) {
-    retval = socket_listen(&bridge_socket);
-  }
+  retval = bridge_configfs_init();
   if (retval < 0) {
-    pr_err("failed to init socket for %s minor %d %d\n", BRIDGE_DRIVER_NAME, 0, retval);
-    tty_unregister_device(bridge_tty_driver, 0);
-    tty_unregister_driver(bridge_tty_driver);
-    put_tty_driver(bridge_tty_driver);
-    return retval;
+    pr_err("failed to register configfs subsystem %d\n", retval);
+    goto fail;
   }
 
   pr_info(DRIVER_DESC " " DRIVER_VERSION "\n");
 
+  return 0;
+
+ fail:
+  if (bridge_default != NULL) {
+    bridge_instance_disable(bridge_default);
+    bridge_instance_put(bridge_default);
+    bridge_default = NULL;
+  }
+  tty_unregister_driver(bridge_tty_driver);
+  put_tty_driver(bridge_tty_driver);
   return retval;
 }
 
 static void __exit bridge_exit(void)
 {
-  struct bridge_serial *b = bridge;
+  struct bridge_instance *inst = bridge_default;
 
-  bridge = NULL;
-  if (b != NULL) {
-    while (b->open_count > 0) {
-      do_close(b);
-    }
-  }
+  // configfs holds a module reference for every instance it created,
+  // so only instance 0 can be left.
+  bridge_configfs_exit();
 
-  socket_close(&bridge_socket);
+  bridge_default = NULL;
+  if (inst != NULL) {
+    bridge_instance_disable(inst);
+    bridge_instance_put(inst);
+  }
 
-  tty_unregister_device(bridge_tty_driver, 0);
   tty_unregister_driver(bridge_tty_driver);
   put_tty_driver(bridge_tty_driver);
 
@@ -0,0 +1,1029 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <linux/serial.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "bridge_client.h"
+
+// bridge_stress hammers the fake_racecap_tty module from user space
+// to shake out races between the socket and tty halves of the
+// bridge. It runs, concurrently:
+//
+//   - device threads that connect to BRIDGE_SOCKET_NAME, send
+//     sequence-numbered frames and verify the frames coming back,
+//     disconnecting and reconnecting at random intervals (each new
+//     connection replaces the live one in the module) and pausing
+//     their reads so that socket_write blocks under the socket mutex,
+//   - a tty reader that verifies the device frames arriving on the
+//     tty, stalling and reopening the tty at random intervals,
+//   - a tty writer that sends its own frames towards the devices, and
+//   - opener threads that open and close the tty and poke its ioctls.
+//
+// Every frame carries a stream id, a sequence number and a checksum.
+// Within one connection (or one tty open) frames from a stream must
+// arrive intact and in order; lost frames are expected while
+// connections are being replaced and are only counted. A frame torn
+// by a reconnect is recognised by the start of the next frame inside
+// it. Anything else is corruption and fails the run.
+//
+// Throughput is printed periodically. At the end come the end-to-end
+// frame latencies and the module's own transmit and receive
+// accounting. If the kernel has CONFIG_LOCK_STAT the lock statistics
+// are cleared at the start and the bridge's locks are printed at the
+// end; if it has lockdep, a lockdep report during the run (which clears
+// debug_locks) also fails the run.
+//
+// Usage from the parent dir, as root:
+// $ make bridge_stress
+// $ sudo insmod fake_racecap_tty.ko
+// $ sudo ./bridge_stress --duration=3600
+
+#define STRESS "stress: "
+
+#define FRAME_MAGIC 0x4b425242u // "BRBK"
+#define FRAME_HDR_LEN ((int)sizeof(struct frame_hdr))
+#define MAX_PAYLOAD 4096
+#define MAX_STREAMS 256
+#define RX_BUF_SIZE (4 * (MAX_PAYLOAD + FRAME_HDR_LEN))
+
+#define LAT_BUCKETS 24
+
+// Stream 0 is the tty writer; devices are 1..N.
+#define TTY_STREAM 0
+
+struct frame_hdr {
+  uint32_t magic;
+  uint16_t stream;
+  uint16_t len;
+  uint32_t seq;
+  uint32_t sum;
+  uint64_t sent_ns;
+} __attribute__((packed));
+
+struct config {
+  const char* tty;
+  int devices;
+  int openers;
+  long duration;
+  long report;
+  int frame_size;
+  long reconnect_ms;
+  long reopen_ms;
+  long pause_ms;
+  const char* lock_filter[8];
+  int lock_filters;
+};
+
+static struct config cfg = {
+  .tty = "/dev/" BRIDGE_TTY_NAME "0",
+  .devices = 0,
+  .openers = 1,
+  .duration = 60,
+  .report = 10,
+  .frame_size = 512,
+  .reconnect_ms = 500,
+  .reopen_ms = 2000,
+  .pause_ms = 50,
+};
+
+// Counters shared by all threads.
+static struct {
+  atomic_ullong tx_frames[2];   // [0] tty -> socket, [1] socket -> tty
+  atomic_ullong tx_bytes[2];
+  atomic_ullong rx_frames[2];
+  atomic_ullong rx_bytes[2];
+  atomic_ullong dropped[2];
+  atomic_ullong torn[2];
+  atomic_ullong corrupt[2];
+  atomic_ullong reordered[2];
+  atomic_ullong connects;
+  atomic_ullong connect_errors;
+  atomic_ullong tty_opens;
+  atomic_ullong tty_errors;
+  atomic_ullong write_errors;
+  atomic_ullong pauses;
+
+  // End-to-end latency from building a frame to receiving it: bucket
+  // i counts latencies below 2^i microseconds.
+  atomic_ullong latency[2][LAT_BUCKETS];
+  atomic_ullong latency_max[2];
+} stats;
+
+#define DIR_TO_SOCKET 0
+#define DIR_TO_TTY    1
+
+static const char* dir_names[2] = { "tty->socket", "socket->tty" };
+
+static atomic_int stopping = 0;
+
+static void on_signal(int sig) {
+  atomic_store(&stopping, 1);
+}
+
+static int stopped(void) {
+  return atomic_load(&stopping);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void) {
+  return now_ns() / 1000000;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+// rand_upto returns a value in [0, max) from the thread's own seed.
+static long rand_upto(unsigned int* seed, long max) {
+  if (max <= 0) {
+    return 0;
+  }
+  return (long)(rand_r(seed) % (unsigned long)max);
+}
+
+// Frames
+
+static uint32_t fnv1a(uint32_t h, const uint8_t* p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t frame_sum(const struct frame_hdr* hdr, const uint8_t* payload) {
+  uint32_t h = 2166136261u;
+  h = fnv1a(h, (const uint8_t*)&hdr->stream, sizeof(hdr->stream));
+  h = fnv1a(h, (const uint8_t*)&hdr->len, sizeof(hdr->len));
+  h = fnv1a(h, (const uint8_t*)&hdr->seq, sizeof(hdr->seq));
+  h = fnv1a(h, (const uint8_t*)&hdr->sent_ns, sizeof(hdr->sent_ns));
+  return fnv1a(h, payload, hdr->len);
+}
+
+// frame_build fills buf with frame seq of stream, stamped with the
+// current time. The payload is derived from the stream and sequence
+// number.
+static int frame_build(uint8_t* buf, int stream, uint32_t seq, int len) {
+  struct frame_hdr hdr = {
+    .magic = FRAME_MAGIC,
+    .stream = (uint16_t)stream,
+    .len = (uint16_t)len,
+    .seq = seq,
+    .sent_ns = now_ns(),
+  };
+  uint8_t* payload = buf + FRAME_HDR_LEN;
+  uint32_t x = (seq * 2654435761u) ^ ((uint32_t)stream << 16) ^ 0x9e3779b9u;
+
+  for (int i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    payload[i] = (uint8_t)x;
+  }
+
+  hdr.sum = frame_sum(&hdr, payload);
+  memcpy(buf, &hdr, FRAME_HDR_LEN);
+  return FRAME_HDR_LEN + len;
+}
+
+// An rx_state reassembles and verifies frames from one byte stream
+// (one connection or one tty open).
+struct rx_state {
+  int dir;
+  uint8_t buf[RX_BUF_SIZE];
+  int fill;
+  uint32_t last[MAX_STREAMS];
+  uint8_t seen[MAX_STREAMS];
+};
+
+static void rx_reset(struct rx_state* rx) {
+  rx->fill = 0;
+  memset(rx->seen, 0, sizeof(rx->seen));
+}
+
+// rx_find_magic returns the offset of the next frame magic at or after
+// from, or -1.
+static int rx_find_magic(const uint8_t* buf, int from, int len) {
+  uint32_t magic = FRAME_MAGIC;
+  void* p = memmem(buf + from, len - from, &magic, sizeof(magic));
+  return p == NULL ? -1 : (int)((uint8_t*)p - buf);
+}
+
+static void rx_skip(struct rx_state* rx, int n) {
+  memmove(rx->buf, rx->buf + n, rx->fill - n);
+  rx->fill -= n;
+}
+
+static void record_latency(int d, uint64_t ns) {
+  uint64_t us = ns / 1000;
+  unsigned long long max = atomic_load(&stats.latency_max[d]);
+  int b = 0;
+
+  while (b < LAT_BUCKETS - 1 && us >= (1ULL << b)) {
+    b++;
+  }
+  atomic_fetch_add(&stats.latency[d][b], 1);
+
+  while (ns > max && !atomic_compare_exchange_weak(&stats.latency_max[d], &max, ns)) {
+  }
+}
+
+static void rx_frame(struct rx_state* rx, const struct frame_hdr* hdr) {
+  int d = rx->dir;
+
+  if (rx->seen[hdr->stream]) {
+    uint32_t last = rx->last[hdr->stream];
+    if (hdr->seq <= last) {
+      fprintf(stderr, STRESS "error: %s stream %d: seq %u after %u\n",
+              dir_names[d], hdr->stream, hdr->seq, last);
+      atomic_fetch_add(&stats.reordered[d], 1);
+    } else if (hdr->seq > last + 1) {
+      atomic_fetch_add(&stats.dropped[d], hdr->seq - last - 1);
+    }
+  }
+
+  rx->seen[hdr->stream] = 1;
+  rx->last[hdr->stream] = hdr->seq;
+
+  record_latency(d, now_ns() - hdr->sent_ns);
+
+  atomic_fetch_add(&stats.rx_frames[d], 1);
+  atomic_fetch_add(&stats.rx_bytes[d], hdr->len);
+}
+
+// rx_consume appends data to the stream and verifies every complete
+// frame.
+static void rx_consume(struct rx_state* rx, const uint8_t* data, int len) {
+  int d = rx->dir;
+
+  while (len > 0) {
+    int n = RX_BUF_SIZE - rx->fill;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(rx->buf + rx->fill, data, n);
+    rx->fill += n;
+    data += n;
+    len -= n;
+
+    while (rx->fill >= FRAME_HDR_LEN) {
+      struct frame_hdr hdr;
+      int next;
+
+      memcpy(&hdr, rx->buf, FRAME_HDR_LEN);
+      if (hdr.magic != FRAME_MAGIC || hdr.len > MAX_PAYLOAD || hdr.stream >= MAX_STREAMS) {
+        // Lost sync (e.g. the stream started mid-frame): skip to the
+        // next magic, keeping a possible partial magic at the end.
+        next = rx_find_magic(rx->buf, 1, rx->fill);
+        rx_skip(rx, next < 0 ? rx->fill - (int)sizeof(hdr.magic) + 1 : next);
+        atomic_fetch_add(&stats.torn[d], 1);
+        continue;
+      }
+
+      if (rx->fill < FRAME_HDR_LEN + hdr.len) {
+        break;
+      }
+
+      if (frame_sum(&hdr, rx->buf + FRAME_HDR_LEN) != hdr.sum) {
+        next = rx_find_magic(rx->buf, 1, FRAME_HDR_LEN + hdr.len);
+        if (next > 0) {
+          // The frame was cut short and another started inside it.
+          atomic_fetch_add(&stats.torn[d], 1);
+          rx_skip(rx, next);
+        } else {
+          fprintf(stderr, STRESS "error: %s stream %d seq %u: checksum mismatch\n",
+                  dir_names[d], hdr.stream, hdr.seq);
+          atomic_fetch_add(&stats.corrupt[d], 1);
+          rx_skip(rx, FRAME_HDR_LEN + hdr.len);
+        }
+        continue;
+      }
+
+      rx_frame(rx, &hdr);
+      rx_skip(rx, FRAME_HDR_LEN + hdr.len);
+    }
+  }
+}
+
+// A tx_state tracks a partially sent frame.
+struct tx_state {
+  int stream;
+  uint32_t seq;
+  uint8_t buf[MAX_PAYLOAD + FRAME_HDR_LEN];
+  int len;
+  int off;
+};
+
+static void tx_next(struct tx_state* tx, unsigned int* seed) {
+  int len = 1 + (int)rand_upto(seed, cfg.frame_size);
+  tx->seq++;
+  tx->len = frame_build(tx->buf, tx->stream, tx->seq, len);
+  tx->off = 0;
+}
+
+// Devices
+
+static int connect_bridge(void) {
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  int sfd;
+
+  // Not a bridge_client: the devices manage their own connections so
+  // they can tear them down mid-frame.
+  bridge_socket_addr(&addr, &addrlen, NULL);
+
+  sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sfd < 0) {
+    return -1;
+  }
+
+  if (connect(sfd, (struct sockaddr*)&addr, addrlen) != 0) {
+    int err = errno;
+    close(sfd);
+    errno = err;
+    return -1;
+  }
+
+  return sfd;
+}
+
+struct device {
+  pthread_t thread;
+  int id;
+  unsigned int seed;
+  struct tx_state tx;
+  struct rx_state rx;
+};
+
+// device_session runs one connection until it is replaced, closed by
+// us after a random interval, or the run stops.
+static void device_session(struct device* dev, int sfd) {
+  uint64_t end = now_ms() + 1 + rand_upto(&dev->seed, cfg.reconnect_ms);
+  uint64_t paused_until = 0;
+  uint8_t buf[8192];
+
+  rx_reset(&dev->rx);
+
+  while (!stopped()) {
+    struct pollfd pfd = { .fd = sfd, .events = POLLOUT };
+    uint64_t now = now_ms();
+    ssize_t len;
+
+    if (cfg.reconnect_ms > 0 && now >= end) {
+      return;
+    }
+
+    if (now >= paused_until) {
+      pfd.events |= POLLIN;
+      if (cfg.pause_ms > 0 && rand_upto(&dev->seed, 1000) == 0) {
+        // Stop reading so the module's socket_write backs up.
+        paused_until = now + 1 + rand_upto(&dev->seed, cfg.pause_ms);
+        atomic_fetch_add(&stats.pauses, 1);
+      }
+    }
+
+    if (poll(&pfd, 1, 100) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    if (pfd.revents & POLLIN) {
+      len = read(sfd, buf, sizeof(buf));
+      if (len == 0) {
+        // replaced by another device
+        return;
+      } else if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          return;
+        }
+      } else {
+        rx_consume(&dev->rx, buf, (int)len);
+      }
+    }
+
+    if (pfd.revents & POLLOUT) {
+      if (dev->tx.off == dev->tx.len) {
+        tx_next(&dev->tx, &dev->seed);
+      }
+
+      len = send(sfd, dev->tx.buf + dev->tx.off, dev->tx.len - dev->tx.off, MSG_NOSIGNAL);
+      if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          return;
+        }
+      } else {
+        dev->tx.off += (int)len;
+        atomic_fetch_add(&stats.tx_bytes[DIR_TO_TTY], len);
+        if (dev->tx.off == dev->tx.len) {
+          atomic_fetch_add(&stats.tx_frames[DIR_TO_TTY], 1);
+        }
+      }
+    }
+
+    if (pfd.revents & (POLLHUP | POLLERR)) {
+      return;
+    }
+  }
+}
+
+static void* device_thread(void* arg) {
+  struct device* dev = arg;
+
+  while (!stopped()) {
+    int sfd = connect_bridge();
+    if (sfd < 0) {
+      atomic_fetch_add(&stats.connect_errors, 1);
+      sleep_ms(10);
+      continue;
+    }
+    atomic_fetch_add(&stats.connects, 1);
+
+    device_session(dev, sfd);
+    close(sfd);
+
+    // A torn frame is abandoned; the next connection starts afresh.
+    dev->tx.off = dev->tx.len;
+
+    sleep_ms(rand_upto(&dev->seed, 10));
+  }
+
+  return NULL;
+}
+
+// tty
+
+static int open_tty(void) {
+  struct termios t;
+  int fd;
+
+  fd = open(cfg.tty, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    atomic_fetch_add(&stats.tty_errors, 1);
+    return -1;
+  }
+  atomic_fetch_add(&stats.tty_opens, 1);
+
+  // The default termios echoes, which would bounce device frames
+  // back to the devices.
+  if (tcgetattr(fd, &t) == 0) {
+    cfmakeraw(&t);
+    tcsetattr(fd, TCSANOW, &t);
+  }
+
+  return fd;
+}
+
+static void* tty_reader_thread(void* arg) {
+  static struct rx_state rx = { .dir = DIR_TO_TTY };
+  unsigned int seed = (unsigned int)time(NULL) ^ 0x5eed;
+  uint8_t buf[8192];
+
+  while (!stopped()) {
+    uint64_t end = now_ms() + 1 + rand_upto(&seed, cfg.reopen_ms);
+    int fd = open_tty();
+    if (fd < 0) {
+      sleep_ms(100);
+      continue;
+    }
+
+    rx_reset(&rx);
+
+    while (!stopped() && (cfg.reopen_ms <= 0 || now_ms() < end)) {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      ssize_t len;
+
+      if (cfg.pause_ms > 0 && rand_upto(&seed, 1000) == 0) {
+        // Stall so the flip buffers fill while the devices keep sending.
+        atomic_fetch_add(&stats.pauses, 1);
+        sleep_ms(1 + rand_upto(&seed, cfg.pause_ms));
+      }
+
+      if (poll(&pfd, 1, 100) <= 0) {
+        continue;
+      }
+
+      len = read(fd, buf, sizeof(buf));
+      if (len > 0) {
+        rx_consume(&rx, buf, (int)len);
+      } else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        atomic_fetch_add(&stats.tty_errors, 1);
+        break;
+      }
+    }
+
+    close(fd);
+  }
+
+  return NULL;
+}
+
+static void* tty_writer_thread(void* arg) {
+  static struct tx_state tx = { .stream = TTY_STREAM };
+  unsigned int seed = (unsigned int)time(NULL) ^ 0xfeed;
+
+  while (!stopped()) {
+    uint64_t end = now_ms() + 1 + rand_upto(&seed, cfg.reopen_ms);
+    int fd = open_tty();
+    if (fd < 0) {
+      sleep_ms(100);
+      continue;
+    }
+
+    while (!stopped() && (cfg.reopen_ms <= 0 || now_ms() < end)) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      ssize_t len;
+
+      if (tx.off == tx.len) {
+        tx_next(&tx, &seed);
+      }
+
+      if (poll(&pfd, 1, 100) <= 0) {
+        continue;
+      }
+
+      len = write(fd, tx.buf + tx.off, tx.len - tx.off);
+      if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          // No device connected; the module drops the write.
+          atomic_fetch_add(&stats.write_errors, 1);
+          tx.off = tx.len;
+          sleep_ms(1);
+        }
+        continue;
+      }
+
+      tx.off += (int)len;
+      atomic_fetch_add(&stats.tx_bytes[DIR_TO_SOCKET], len);
+      if (tx.off == tx.len) {
+        atomic_fetch_add(&stats.tx_frames[DIR_TO_SOCKET], 1);
+      }
+    }
+
+    close(fd);
+    tx.off = tx.len;
+  }
+
+  return NULL;
+}
+
+// opener_thread opens and closes the tty as fast as it can, poking
+// the ioctls that take the bridge mutex while it has it open.
+static void* opener_thread(void* arg) {
+  unsigned int seed = (unsigned int)(uintptr_t)arg ^ (unsigned int)time(NULL);
+
+  while (!stopped()) {
+    struct serial_icounter_struct icount;
+    int bits;
+    int fd = open_tty();
+    if (fd < 0) {
+      sleep_ms(100);
+      continue;
+    }
+
+    if (ioctl(fd, TIOCMGET, &bits) == 0) {
+      bits = TIOCM_RTS | TIOCM_DTR;
+      ioctl(fd, rand_upto(&seed, 2) ? TIOCMBIS : TIOCMBIC, &bits);
+    }
+    ioctl(fd, TIOCGICOUNT, &icount);
+
+    close(fd);
+  }
+
+  return NULL;
+}
+
+// Kernel lock statistics
+
+static int write_file(const char* path, const char* value) {
+  int fd = open(path, O_WRONLY);
+  int rc;
+
+  if (fd < 0) {
+    return -1;
+  }
+  rc = write(fd, value, strlen(value)) == (ssize_t)strlen(value) ? 0 : -1;
+  close(fd);
+  return rc;
+}
+
+// debug_locks returns lockdep's debug_locks flag (cleared once lockdep
+// reports a problem) or -1 without lockdep.
+static int debug_locks(void) {
+  char line[256];
+  int v = -1;
+  FILE* f = fopen("/proc/lockdep_stats", "r");
+
+  if (f == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, " debug_locks: %d", &v) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return v;
+}
+
+static char lock_stat_prev = 0;
+
+static void lock_stat_begin(void) {
+  char buf[2] = { 0 };
+  int fd;
+
+  if (access("/proc/lock_stat", R_OK) != 0) {
+    printf(STRESS "/proc/lock_stat unavailable (needs CONFIG_LOCK_STAT); no lock statistics\n");
+    return;
+  }
+
+  fd = open("/proc/sys/kernel/lock_stat", O_RDONLY);
+  if (fd >= 0) {
+    if (read(fd, buf, 1) == 1) {
+      lock_stat_prev = buf[0];
+    }
+    close(fd);
+  }
+
+  if (write_file("/proc/sys/kernel/lock_stat", "1") != 0 ||
+      write_file("/proc/lock_stat", "0") != 0) {
+    printf(STRESS "could not enable/clear lock_stat (%s); statistics include earlier activity\n",
+           strerror(errno));
+  }
+}
+
+// lock_stat_end prints the header and every /proc/lock_stat line for
+// the bridge's locks: the class summaries (contentions, wait and hold
+// times) and the contention points below them.
+static void lock_stat_end(void) {
+  char line[1024];
+  FILE* f = fopen("/proc/lock_stat", "r");
+
+  if (f == NULL) {
+    return;
+  }
+
+  printf("\nlock statistics (times in us):\n");
+  while (fgets(line, sizeof(line), f) != NULL) {
+    int match = strstr(line, "class name") != NULL;
+    for (int i = 0; i < cfg.lock_filters && !match; i++) {
+      match = strstr(line, cfg.lock_filter[i]) != NULL;
+    }
+    if (match) {
+      fputs(line, stdout);
+    }
+  }
+  fclose(f);
+
+  if (lock_stat_prev == '0') {
+    write_file("/proc/sys/kernel/lock_stat", "0");
+  }
+}
+
+// driver_stats prints the module's transmit accounting and receive
+// latencies (see rt in tty.c) for each instance, for comparing its
+// modes.
+static void driver_stats(void) {
+  char line[256];
+  FILE* f = fopen("/proc/tty/driver/" BRIDGE_DRIVER_NAME, "r");
+
+  if (f == NULL) {
+    return;
+  }
+
+  printf("\n");
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (isdigit((unsigned char)line[0]) ||
+        strncmp(line, "tx:", 3) == 0 || strncmp(line, "rx", 2) == 0) {
+      printf("driver %s", line);
+    }
+  }
+  fclose(f);
+}
+
+// Reporting
+
+// latency_quantile returns the upper bound in microseconds of the
+// given quantile (in thousandths) of a direction's latencies.
+static unsigned long long latency_quantile(int d, int permille) {
+  unsigned long long total = 0, seen = 0, want;
+
+  for (int b = 0; b < LAT_BUCKETS; b++) {
+    total += atomic_load(&stats.latency[d][b]);
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  want = (total * permille + 999) / 1000;
+  for (int b = 0; b < LAT_BUCKETS - 1; b++) {
+    seen += atomic_load(&stats.latency[d][b]);
+    if (seen >= want) {
+      return 1ULL << b;
+    }
+  }
+  return atomic_load(&stats.latency_max[d]) / 1000;
+}
+
+struct snapshot {
+  unsigned long long tx_bytes[2];
+  unsigned long long rx_bytes[2];
+  unsigned long long rx_frames[2];
+};
+
+static void take_snapshot(struct snapshot* s) {
+  for (int d = 0; d < 2; d++) {
+    s->tx_bytes[d] = atomic_load(&stats.tx_bytes[d]);
+    s->rx_bytes[d] = atomic_load(&stats.rx_bytes[d]);
+    s->rx_frames[d] = atomic_load(&stats.rx_frames[d]);
+  }
+}
+
+static void report(const struct snapshot* prev, const struct snapshot* cur, double secs) {
+  for (int d = 0; d < 2; d++) {
+    printf(STRESS "%-11s tx %8.1f KiB/s  rx %8.1f KiB/s %8.0f frames/s  dropped %llu torn %llu\n",
+           dir_names[d],
+           (cur->tx_bytes[d] - prev->tx_bytes[d]) / 1024.0 / secs,
+           (cur->rx_bytes[d] - prev->rx_bytes[d]) / 1024.0 / secs,
+           (cur->rx_frames[d] - prev->rx_frames[d]) / secs,
+           (unsigned long long)atomic_load(&stats.dropped[d]),
+           (unsigned long long)atomic_load(&stats.torn[d]));
+  }
+  printf(STRESS "connects %llu (%llu failed) tty opens %llu (%llu failed) write errors %llu pauses %llu\n",
+         (unsigned long long)atomic_load(&stats.connects),
+         (unsigned long long)atomic_load(&stats.connect_errors),
+         (unsigned long long)atomic_load(&stats.tty_opens),
+         (unsigned long long)atomic_load(&stats.tty_errors),
+         (unsigned long long)atomic_load(&stats.write_errors),
+         (unsigned long long)atomic_load(&stats.pauses));
+  fflush(stdout);
+}
+
+// failures counts integrity failures. Torn frames only count when
+// nothing tears connections down.
+static unsigned long long failures(void) {
+  unsigned long long n = 0;
+
+  for (int d = 0; d < 2; d++) {
+    n += atomic_load(&stats.corrupt[d]) + atomic_load(&stats.reordered[d]);
+  }
+  if (cfg.reconnect_ms <= 0 && cfg.reopen_ms <= 0 && cfg.devices == 1) {
+    n += atomic_load(&stats.torn[0]) + atomic_load(&stats.torn[1]);
+  }
+  return n;
+}
+
+// Setup
+
+void usage(const char* argv0) {
+  printf("usage: %s [options]\n", argv0);
+  printf("\n");
+  printf("Stress tests the fake_racecap_tty kernel module: reconnects, tty opens and\n");
+  printf("closes, full-duplex traffic and paused readers, all at once. Frames are\n");
+  printf("sequence-numbered and checksummed; corruption or reordering fails the run.\n");
+  printf("\n");
+  printf("  --tty=PATH           tty to open (default %s)\n", cfg.tty);
+  printf("  --devices=N          connecting device threads (default: number of CPUs)\n");
+  printf("  --openers=N          tty open/close threads (default %d)\n", cfg.openers);
+  printf("  --duration=SECONDS   run time, 0 to run until interrupted (default %ld)\n", cfg.duration);
+  printf("  --report=SECONDS     throughput report interval (default %ld)\n", cfg.report);
+  printf("  --frame-size=BYTES   maximum frame payload, up to %d (default %d)\n", MAX_PAYLOAD, cfg.frame_size);
+  printf("  --reconnect-ms=MS    maximum time a device stays connected, 0 for never (default %ld)\n", cfg.reconnect_ms);
+  printf("  --reopen-ms=MS       maximum time the tty stays open, 0 for never (default %ld)\n", cfg.reopen_ms);
+  printf("  --pause-ms=MS        maximum reader pause, 0 for none (default %ld)\n", cfg.pause_ms);
+  printf("  --lock-filter=NAME   lock_stat classes to report; repeatable\n");
+  printf("                       (default &s->mutex and &bridge->mutex)\n");
+  exit(1);
+}
+
+static long parse_arg(const char* argv0, const char* name, const char* value, long min, long max) {
+  char* end = NULL;
+  long v;
+
+  errno = 0;
+  v = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || v < min || v > max) {
+    fprintf(stderr, STRESS "error: %s must be between %ld and %ld\n", name, min, max);
+    usage(argv0);
+  }
+  return v;
+}
+
+static void parse_args(int argc, char** argv) {
+  static const struct option opts[] = {
+    { "tty", required_argument, NULL, 't' },
+    { "devices", required_argument, NULL, 'd' },
+    { "openers", required_argument, NULL, 'o' },
+    { "duration", required_argument, NULL, 'D' },
+    { "report", required_argument, NULL, 'r' },
+    { "frame-size", required_argument, NULL, 'f' },
+    { "reconnect-ms", required_argument, NULL, 'c' },
+    { "reopen-ms", required_argument, NULL, 'R' },
+    { "pause-ms", required_argument, NULL, 'p' },
+    { "lock-filter", required_argument, NULL, 'l' },
+    { "help", no_argument, NULL, 'h' },
+    { 0 },
+  };
+  int c;
+
+  while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+    switch (c) {
+    case 't':
+      cfg.tty = optarg;
+      break;
+    case 'd':
+      cfg.devices = (int)parse_arg(argv[0], "devices", optarg, 1, MAX_STREAMS - 1);
+      break;
+    case 'o':
+      cfg.openers = (int)parse_arg(argv[0], "openers", optarg, 0, 64);
+      break;
+    case 'D':
+      cfg.duration = parse_arg(argv[0], "duration", optarg, 0, 30L*24*3600);
+      break;
+    case 'r':
+      cfg.report = parse_arg(argv[0], "report", optarg, 1, 3600);
+      break;
+    case 'f':
+      cfg.frame_size = (int)parse_arg(argv[0], "frame-size", optarg, 1, MAX_PAYLOAD);
+      break;
+    case 'c':
+      cfg.reconnect_ms = parse_arg(argv[0], "reconnect-ms", optarg, 0, 3600000);
+      break;
+    case 'R':
+      cfg.reopen_ms = parse_arg(argv[0], "reopen-ms", optarg, 0, 3600000);
+      break;
+    case 'p':
+      cfg.pause_ms = parse_arg(argv[0], "pause-ms", optarg, 0, 60000);
+      break;
+    case 'l':
+      if (cfg.lock_filters == sizeof(cfg.lock_filter) / sizeof(cfg.lock_filter[0])) {
+        fprintf(stderr, STRESS "error: too many lock filters\n");
+        usage(argv[0]);
+      }
+      cfg.lock_filter[cfg.lock_filters++] = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind != argc) {
+    usage(argv[0]);
+  }
+
+  if (cfg.devices == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg.devices = n < 1 ? 1 : (n >= MAX_STREAMS ? MAX_STREAMS - 1 : (int)n);
+  }
+
+  if (cfg.lock_filters == 0) {
+    cfg.lock_filter[cfg.lock_filters++] = "&s->mutex";
+    cfg.lock_filter[cfg.lock_filters++] = "&bridge->mutex";
+  }
+}
+
+int main(int argc, char** argv) {
+  struct sigaction sa = { .sa_handler = on_signal };
+  struct device* devices;
+  pthread_t reader, writer;
+  pthread_t* openers;
+  struct snapshot prev, cur;
+  uint64_t start, last;
+  int locks_before;
+  unsigned long long failed;
+  int rc = 0;
+
+  parse_args(argc, argv);
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (access(cfg.tty, R_OK | W_OK) != 0) {
+    fprintf(stderr, STRESS "error: cannot open %s (%s); is fake_racecap_tty loaded?\n",
+            cfg.tty, strerror(errno));
+    return 1;
+  }
+
+  locks_before = debug_locks();
+  if (locks_before < 0) {
+    printf(STRESS "lockdep unavailable (needs CONFIG_PROVE_LOCKING); no deadlock detection\n");
+  } else if (locks_before == 0) {
+    printf(STRESS "warning: lockdep is already disabled by an earlier report\n");
+  }
+  lock_stat_begin();
+
+  printf(STRESS "%d devices, %d openers, %s for %lds\n", cfg.devices, cfg.openers, cfg.tty, cfg.duration);
+
+  devices = calloc(cfg.devices, sizeof(*devices));
+  openers = calloc(cfg.openers + 1, sizeof(*openers));
+  if (devices == NULL || openers == NULL) {
+    fprintf(stderr, STRESS "error: out of memory\n");
+    return 1;
+  }
+
+  pthread_create(&reader, NULL, tty_reader_thread, NULL);
+  pthread_create(&writer, NULL, tty_writer_thread, NULL);
+  for (int i = 0; i < cfg.devices; i++) {
+    devices[i].id = i + 1;
+    devices[i].seed = (unsigned int)time(NULL) * (i + 1);
+    devices[i].tx.stream = i + 1;
+    devices[i].rx.dir = DIR_TO_SOCKET;
+    pthread_create(&devices[i].thread, NULL, device_thread, &devices[i]);
+  }
+  for (int i = 0; i < cfg.openers; i++) {
+    pthread_create(&openers[i], NULL, opener_thread, (void*)(uintptr_t)(i + 1));
+  }
+
+  start = last = now_ms();
+  take_snapshot(&prev);
+  while (!stopped()) {
+    uint64_t now;
+
+    sleep_ms(100);
+    now = now_ms();
+
+    if (now - last >= (uint64_t)cfg.report * 1000) {
+      take_snapshot(&cur);
+      report(&prev, &cur, (now - last) / 1000.0);
+      prev = cur;
+      last = now;
+    }
+
+    if (cfg.duration > 0 && now - start >= (uint64_t)cfg.duration * 1000) {
+      atomic_store(&stopping, 1);
+    }
+  }
+
+  pthread_join(reader, NULL);
+  pthread_join(writer, NULL);
+  for (int i = 0; i < cfg.devices; i++) {
+    pthread_join(devices[i].thread, NULL);
+  }
+  for (int i = 0; i < cfg.openers; i++) {
+    pthread_join(openers[i], NULL);
+  }
+
+  printf("\ntotals over %.1fs:\n", (now_ms() - start) / 1000.0);
+  for (int d = 0; d < 2; d++) {
+    printf("  %-11s sent %llu frames, received %llu frames (%llu bytes), dropped %llu, torn %llu, "
+           "corrupt %llu, reordered %llu\n",
+           dir_names[d],
+           (unsigned long long)atomic_load(&stats.tx_frames[d]),
+           (unsigned long long)atomic_load(&stats.rx_frames[d]),
+           (unsigned long long)atomic_load(&stats.rx_bytes[d]),
+           (unsigned long long)atomic_load(&stats.dropped[d]),
+           (unsigned long long)atomic_load(&stats.torn[d]),
+           (unsigned long long)atomic_load(&stats.corrupt[d]),
+           (unsigned long long)atomic_load(&stats.reordered[d]));
+    printf("  %-11s latency p50 <%lluus p99 <%lluus p99.9 <%lluus max %lluus\n",
+           "", latency_quantile(d, 500), latency_quantile(d, 990), latency_quantile(d, 999),
+           (unsigned long long)atomic_load(&stats.latency_max[d]) / 1000);
+  }
+
+  driver_stats();
+  lock_stat_end();
+
+  failed = failures();
+  if (failed > 0) {
+    printf(STRESS "FAILED: %llu integrity errors\n", failed);
+    rc = 1;
+  }
+  if (locks_before > 0 && debug_locks() == 0) {
+    printf(STRESS "FAILED: lockdep reported a problem during the run (see dmesg)\n");
+    rc = 1;
+  }
+  if (rc == 0) {
+    printf(STRESS "passed\n");
+  }
+
+  free(devices);
+  free(openers);
+  return rc;
+}
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+// pps_test measures a PPS consumer of the module's emulated GPS 1PPS
+// on DCD (load it with pps=1, or set pps on a configfs instance before
+// enabling it). For each pulse it waits in TIOCMIWAIT, as gpsd and
+// chrony's SOCK refclock helpers do, takes CLOCK_REALTIME on wakeup and
+// compares it with:
+//
+//   - the module's timestamp of the rising edge (last_ns on the "pps:"
+//     line of /proc/tty/driver/fake_racecap_tty): the wakeup latency,
+//     which is what load on the Pi adds, and
+//   - the top of the second: the error of the consumer's timestamp,
+//     which also includes the configured pps_offset_us and
+//     pps_jitter_us.
+//
+// It also checks that TIOCGICOUNT's dcd count moved by two per pulse.
+//
+// Usage from the parent dir, as root:
+// $ make pps_test
+// $ sudo insmod fake_racecap_tty.ko pps=1 pps_jitter_us=50
+// $ sudo ./pps_test --count=60 --rt=80
+//
+// Run it idle and again under load (bridge_stress, or a loadtest.py
+// scenario) to compare. With the PPS line discipline attached
+// (ldattach PPS /dev/ttyUSB_FAKE_RACECAP0), ppstest /dev/ppsN shows the
+// kernel PPS subsystem's timestamps of the same pulses.
+
+#define PPS "pps: "
+
+#define PROC_PATH "/proc/tty/driver/" BRIDGE_DRIVER_NAME
+
+#define NSEC_PER_SEC 1000000000LL
+
+static void usage(const char* argv0) {
+  printf("usage: %s [options]\n", argv0);
+  printf("\n");
+  printf("Measures wakeup latency and timestamp error of a consumer of the\n");
+  printf("fake_racecap_tty module's emulated PPS on DCD.\n");
+  printf("\n");
+  printf("  --tty=PATH     tty to watch (default /dev/%s0)\n", BRIDGE_TTY_NAME);
+  printf("  --minor=N      instance in %s (default from the tty name)\n", PROC_PATH);
+  printf("  --count=N      pulses to measure (default 30)\n");
+  printf("  --rt=PRIO      wait as SCHED_FIFO at this priority\n");
+  printf("  --quiet        only print the summary\n");
+  exit(1);
+}
+
+static int64_t realtime_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// proc_last_ns reads last_ns from the "pps:" line of instance minor,
+// or returns -1.
+static int64_t proc_last_ns(int minor) {
+  char line[512];
+  char header[32];
+  unsigned long long last_ns;
+  const char* p;
+  int current = 0;
+  int64_t result = -1;
+  FILE* f = fopen(PROC_PATH, "r");
+
+  if (f == NULL) {
+    return -1;
+  }
+
+  snprintf(header, sizeof(header), "%d: ", minor);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (isdigit((unsigned char)line[0])) {
+      current = strncmp(line, header, strlen(header)) == 0;
+      continue;
+    }
+    if (!current || strncmp(line, "pps: ", 5) != 0) {
+      continue;
+    }
+    p = strstr(line, " last_ns:");
+    if (p != NULL && sscanf(p, " last_ns:%llu", &last_ns) == 1) {
+      result = (int64_t)last_ns;
+    }
+    break;
+  }
+
+  fclose(f);
+  return result;
+}
+
+static int cmp_i64(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void summary(const char* name, int64_t* ns, int n) {
+  if (n == 0) {
+    return;
+  }
+  qsort(ns, n, sizeof(*ns), cmp_i64);
+  printf(PPS "%-8s min %9.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", name,
+         ns[0] / 1000.0, ns[n / 2] / 1000.0, ns[(n * 99) / 100] / 1000.0, ns[n - 1] / 1000.0);
+}
+
+int main(int argc, char** argv) {
+  static const struct option options[] = {
+    {"tty", required_argument, NULL, 't'},
+    {"minor", required_argument, NULL, 'm'},
+    {"count", required_argument, NULL, 'c'},
+    {"rt", required_argument, NULL, 'r'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+  };
+  char default_tty[64];
+  const char* tty = NULL;
+  int minor = -1;
+  int count = 30;
+  int rt = 0;
+  int quiet = 0;
+  struct serial_icounter_struct ic_start, ic_end;
+  int64_t *latency, *error;
+  int64_t last_ns = -1;
+  int fd, opt, n = 0, missed = 0, dcd_changes;
+
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      tty = optarg;
+      break;
+    case 'm':
+      minor = atoi(optarg);
+      break;
+    case 'c':
+      count = atoi(optarg);
+      break;
+    case 'r':
+      rt = atoi(optarg);
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || count <= 0) {
+    usage(argv[0]);
+  }
+
+  if (tty == NULL) {
+    snprintf(default_tty, sizeof(default_tty), "/dev/%s0", BRIDGE_TTY_NAME);
+    tty = default_tty;
+  }
+  if (minor < 0) {
+    const char* p = tty + strlen(tty);
+    while (p > tty && isdigit((unsigned char)p[-1])) {
+      p--;
+    }
+    minor = *p != '\0' ? atoi(p) : 0;
+  }
+
+  if (rt > 0) {
+    struct sched_param sp = { .sched_priority = rt };
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) != 0) {
+      printf(PPS "error: SCHED_FIFO %d: %s\n", rt, strerror(errno));
+      return 1;
+    }
+  }
+
+  fd = open(tty, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    printf(PPS "error: open %s: %s\n", tty, strerror(errno));
+    return 1;
+  }
+
+  if (proc_last_ns(minor) < 0) {
+    printf(PPS "error: no pps line for instance %d in %s (load the module with pps=1)\n", minor, PROC_PATH);
+    close(fd);
+    return 1;
+  }
+
+  latency = calloc(count, sizeof(*latency));
+  error = calloc(count, sizeof(*error));
+  if (latency == NULL || error == NULL) {
+    printf(PPS "error: out of memory\n");
+    close(fd);
+    return 1;
+  }
+
+  if (ioctl(fd, TIOCGICOUNT, &ic_start) != 0) {
+    printf(PPS "error: TIOCGICOUNT: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+
+  while (n < count) {
+    int64_t now, edge, second;
+    int status;
+
+    if (ioctl(fd, TIOCMIWAIT, TIOCM_CD) != 0) {
+      printf(PPS "error: TIOCMIWAIT: %s\n", strerror(errno));
+      break;
+    }
+    now = realtime_ns();
+
+    if (ioctl(fd, TIOCMGET, &status) != 0) {
+      printf(PPS "error: TIOCMGET: %s\n", strerror(errno));
+      break;
+    }
+    if (!(status & TIOCM_CAR)) {
+      // the falling edge
+      continue;
+    }
+
+    edge = proc_last_ns(minor);
+    if (edge < 0 || edge == last_ns) {
+      // woke up so late that the next pulse's edge isn't recorded
+      // yet, or the proc file went away
+      missed++;
+      continue;
+    }
+    if (last_ns >= 0 && edge - last_ns > NSEC_PER_SEC + NSEC_PER_SEC / 2) {
+      missed += (int)((edge - last_ns + NSEC_PER_SEC / 2) / NSEC_PER_SEC) - 1;
+    }
+    last_ns = edge;
+
+    second = (now + NSEC_PER_SEC / 2) / NSEC_PER_SEC * NSEC_PER_SEC;
+    latency[n] = now - edge;
+    error[n] = now - second;
+    if (!quiet) {
+      printf(PPS "pulse %4d  wakeup %9.1f us  error %+10.1f us\n", n + 1, latency[n] / 1000.0, error[n] / 1000.0);
+      fflush(stdout);
+    }
+    n++;
+  }
+
+  if (ioctl(fd, TIOCGICOUNT, &ic_end) != 0) {
+    printf(PPS "error: TIOCGICOUNT: %s\n", strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  dcd_changes = ic_end.dcd - ic_start.dcd;
+  printf(PPS "%d pulses, %d missed, %d dcd changes%s\n", n, missed, dcd_changes,
+         dcd_changes < 2 * n - 1 ? " (TOO FEW)" : "");
+  summary("wakeup", latency, n);
+  summary("error", error, n);
+
+  free(latency);
+  free(error);
+  return n == count && dcd_changes >= 2 * n - 1 ? 0 : 1;
+}
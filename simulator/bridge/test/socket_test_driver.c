@@ -3,19 +3,16 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "bridge_client.h"
 
 // socket_test_driver tests the socket opened by the module defined in
 // socket_test.c. It writes a message of the format "TICK %d\n", waits
 // for and prints the response, waits 1 second, and then repeats. If
 // the socket is closed, the program exits.
 
-static char socket_name[26] = BRIDGE_SOCKET_NAME;
-
 void usage(const char* argv0) {
   printf("usage: %s\n", argv0);
   printf("\n");
@@ -27,39 +24,17 @@ void usage(const char* argv0) {
 static char buffer[4096];
 
 int main(int argc, char** argv) {
-  struct sockaddr_un addr;
-  socklen_t addrlen;
-  int sfd, rc;
-  ssize_t len;
-  int tick;
+  struct bridge_client* c;
+  const char* line;
+  size_t len;
+  int tick, rc;
   if (argc != 1) {
     usage(argv[0]);
   }
 
-  memset(&addr, 0, sizeof(addr));
-  addr.sun_family = AF_UNIX;
-
-  // 1. addr has been zeroed
-  // 2. socket_name has a leading zero byte, so we strncpy from socket_name+1
-  //    to add.sun_path+1 to preserve it.
-  // 3. len(addr.sun_path)-2 to account for the leading null AND to make sure
-  //    there's a trailing null, no matter now long socket_name is.
-  strncpy(addr.sun_path+1, socket_name+1, sizeof(addr.sun_path) - 2);
-
-  // Set addrlen based on the length of the socket name to avoid a raft of
-  // trailing nulls in the socket name.
-  addrlen = offsetof(struct sockaddr_un, sun_path)+BRIDGE_SOCKET_NAME_LEN;
-
-  sfd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sfd == 0) {
-    printf("driver: error: could not open socket %d (%s)\n", errno, strerror(errno));
-    return 1;
-  }
-
-  rc = connect(sfd, (struct sockaddr*)&addr, addrlen);
-  if (rc != 0) {
+  c = bridge_client_open(NULL);
+  if (c == NULL) {
     printf("driver: error: could not connect socket %d (%s)\n", errno, strerror(errno));
-    close(sfd);
     return 1;
   }
 
@@ -69,36 +44,33 @@ int main(int argc, char** argv) {
     sprintf(buffer, "TICK %d\n", tick);
 
     printf("driver: send %s", buffer);
-    len = send(sfd, buffer, strlen(buffer), MSG_NOSIGNAL);
-    if (len < 0) {
-      if (errno == EPIPE) {
+    if (bridge_client_send(c, buffer, strlen(buffer)) != 0 ||
+        bridge_client_flush(c, -1) < 0) {
+      if (errno == ENOTCONN) {
         printf("driver: got remote close\n");
       } else {
         printf("driver: error: send error %d (%s)\n", errno, strerror(errno));
       }
       break;
     }
-    if (len < strlen(buffer)) {
-      printf("driver: warning: short send (%d vs %d)\n", (int)len, strlen(buffer));
-    }
 
     printf("driver: reading...\n");
-    len = read(sfd, buffer, sizeof(buffer)-1);
-    if (len < 0) {
-      printf("driver: error: read error %d (%s)\n", errno, strerror(errno));
-      break;
-    } else if (len == 0) {
-      printf("driver: got remote close\n");
+    rc = bridge_client_recv_line(c, &line, &len, -1);
+    if (rc < 0) {
+      if (errno == ENOTCONN) {
+        printf("driver: got remote close\n");
+      } else {
+        printf("driver: error: read error %d (%s)\n", errno, strerror(errno));
+      }
       break;
     }
-    buffer[len] = 0;
-    printf("driver: read %d bytes:\n%s\n", len, buffer);
+    printf("driver: read %d bytes:\n%.*s\n", (int)len, (int)len, line);
 
     sleep(1);
   }
 
   printf("driver: closing\n");
 
-  close(sfd);
+  bridge_client_close(c);
   return 0;
 }
@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "bridge_client.h"
 
 // socket_test_server simulates the kernel module in socket_test.c. It
 // listens on BRIDGE_SOCKET_NAME and accepts a connection.  It reads
@@ -16,8 +17,6 @@
 // "TOCK\n" if it's too short). After 10 iteations the socket is
 // closed and the server returns to the listening state.
 
-static char socket_name[26] = BRIDGE_SOCKET_NAME;
-
 void usage(const char* argv0) {
   printf("usage: %s\n", argv0);
   printf("\n");
@@ -37,19 +36,7 @@ int main(int argc, char** argv) {
     usage(argv[0]);
   }
 
-  memset(&addr, 0, sizeof(addr));
-  addr.sun_family = AF_UNIX;
-
-  // 1. addr has been zeroed
-  // 2. socket_name has a leading zero byte, so we strncpy from socket_name+1
-  //    to add.sun_path+1 to preserve it.
-  // 3. len(addr.sun_path)-2 to account for the leading null AND to make sure
-  //    there's a trailing null, no matter now long socket_name is.
-  strncpy(addr.sun_path+1, socket_name+1, sizeof(addr.sun_path) - 2);
-
-  // Set addrlen based on the length of the socket name to avoid a raft of
-  // trailing nulls in the socket name.
-  addrlen = offsetof(struct sockaddr_un, sun_path)+BRIDGE_SOCKET_NAME_LEN;
+  bridge_socket_addr(&addr, &addrlen, NULL);
 
   lfd = socket(AF_UNIX, SOCK_STREAM, 0);
   if (lfd == 0) {
@@ -0,0 +1,562 @@
+#!/usr/bin/env python3
+"""Measure the real app on simulator data, headless.
+
+Starts three things:
+
+  - Xvfb, with its framebuffer kept in a file
+  - fakedevice.py on the bridge
+  - race_capture on the virtual display, with the launcher's options
+    (RC_ARGS in resources/bdr_racecapture.sh)
+
+The app finds the bridge's tty (/dev/ttyUSB_FAKE_RACECAP0) as it would
+a real device. The sweep runs every telemetry rate for each channel
+count. Each step measures, over --dwell seconds:
+
+  app_cpu_pct    CPU of the app's process tree, in % of one core
+  app_rss_mb     the tree's peak resident memory
+  fps            frames drawn per second: framebuffer changes, seen
+                 by polling it at --poll-hz
+  latency_ms     sample to screen (see below)
+  samples_per_s  samples the device got out, against the rate asked
+  rx_p99_us      the module's receive latency (see loadtest.py)
+
+Sample-to-screen latency uses a marker. The device streams a marker
+value in place of --marker-channel's own (Speed by default), flipped
+between --marker-values every --marker-interval seconds. The latency
+runs from when the first sample carrying a new value left the device
+to when --marker-region of the screen changed.
+
+Each step is printed and appended to steps.jsonl in the run
+directory. A screenshot of it is saved as screen-RATExCHANNELS.ppm.
+report.json holds the whole sweep.
+
+A step is flagged:
+
+  "app"        the app's CPU reached --app-cpu-limit
+  "delivery"   the app had CPU to spare, but the device got out less
+               than 90% of the samples asked for; the bridge, or the
+               simulator itself, is the limit
+
+After two flagged steps in a row, the higher rates for that channel
+count are skipped.
+
+  ./apptest.py --rates 10,25,50,100,200 --channels 8,16,32 --run-dir /tmp/apptest
+  ./apptest.py --marker-region 20,300,180,120 ...
+
+Pick --marker-region from a screenshot of the first run: the gauge
+showing the marker channel. Then the rest of the dashboard moving
+doesn't count as the marker being drawn. Without it the whole screen
+is watched, and latencies read short.
+
+Channel counts above the seven GPS channels come from the simulated
+ECU (--obd2 with extra PIDs). The device streams the first N of its
+channels, always including Interval and the marker channel.
+
+Xvfb renders with software OpenGL, so the app's CPU includes drawing
+that the Pi's GPU does in the car. Compare steps against each other
+and runs against runs, not against the car. Run it:
+
+  - with the module loaded and nothing else on the bridge
+  - as the user whose app settings should be used, or with --home
+    for a fresh set
+"""
+
+import argparse
+import json
+import mmap
+import os
+import shlex
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+import bridge
+import control
+import ecu
+import fakedevice
+import loadtest
+from loadtest import ScenarioError
+
+# The launcher's options for race_capture (RC_ARGS in
+# resources/bdr_racecapture.sh).
+RC_ARGS = '-a -c graphics:show_cursor:0 -m cursor -c kivy:keyboard_mode:system'
+
+APP_DIR = '/opt/racecapture'
+
+# Seconds to wait for Xvfb, and a marker to be drawn before it counts
+# as missed.
+XVFB_START_TIMEOUT = 10.0
+MARKER_TIMEOUT = 3.0
+
+# Seconds between samples of the app's resident memory.
+RSS_INTERVAL = 0.5
+
+# Fewer samples than this fraction of the rate asked for is a delivery
+# limit (as in control.py's ramp).
+SATURATED = control.SATURATED
+
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+PAGE_SIZE = os.sysconf('SC_PAGE_SIZE')
+
+# The fixed part of an XWD header: 25 big endian 32 bit fields.
+XWD_HEADER = struct.Struct('>25I')
+
+
+class Framebuffer:
+    """Xvfb's -fbdir screen: an XWD image in a file Xvfb keeps mapped,
+    so reading it shows what is on the screen now."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self._mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        h = XWD_HEADER.unpack_from(self._mm, 0)
+        (header_size, self.width, self.height) = (h[0], h[4], h[5])
+        (self.lsb_first, bits_per_pixel, self.bytes_per_line, ncolors) = (h[7] == 0, h[11], h[12], h[19])
+        if bits_per_pixel != 32:
+            raise ScenarioError('unsupported framebuffer: %d bits per pixel' % bits_per_pixel)
+        self.offset = header_size + ncolors * 12
+        if self.offset + self.bytes_per_line * self.height > len(self._mm):
+            raise ValueError('framebuffer file not complete yet')
+        self._view = memoryview(self._mm)
+
+    def crc(self, region=None):
+        """A checksum of the screen, or of region (x, y, w, h)."""
+        if region is None:
+            return zlib.crc32(self._view[self.offset:self.offset + self.bytes_per_line * self.height])
+        (x, y, w, h) = region
+        crc = 0
+        for row in range(y, y + h):
+            start = self.offset + row * self.bytes_per_line + x * 4
+            crc = zlib.crc32(self._view[start:start + w * 4], crc)
+        return crc
+
+    def save_ppm(self, path):
+        with open(path, 'wb') as f:
+            f.write(b'P6\n%d %d\n255\n' % (self.width, self.height))
+            for y in range(self.height):
+                start = self.offset + y * self.bytes_per_line
+                row = self._mm[start:start + self.width * 4]
+                rgb = bytearray(self.width * 3)
+                if self.lsb_first:
+                    # B G R X
+                    (rgb[0::3], rgb[1::3], rgb[2::3]) = (row[2::4], row[1::4], row[0::4])
+                else:
+                    # X R G B
+                    (rgb[0::3], rgb[1::3], rgb[2::3]) = (row[1::4], row[2::4], row[3::4])
+                f.write(rgb)
+
+    def close(self):
+        self._view.release()
+        self._mm.close()
+
+
+class VirtualDisplay:
+    def __init__(self, number, size, run_dir):
+        self.name = ':%d' % number
+        path = os.path.join(run_dir, 'Xvfb_screen0')
+        if os.path.exists(path):
+            os.unlink(path)
+        cmd = ['Xvfb', self.name, '-screen', '0', '%dx%dx24' % size, '-fbdir', run_dir, '-nolisten', 'tcp']
+        log = open(os.path.join(run_dir, 'xvfb.log'), 'w')
+        try:
+            self.proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+        except OSError as e:
+            raise ScenarioError('cannot start Xvfb (is it installed?): %s' % e)
+        finally:
+            log.close()
+
+        deadline = time.monotonic() + XVFB_START_TIMEOUT
+        self.fb = None
+        while self.fb is None:
+            if self.proc.poll() is not None:
+                raise ScenarioError('Xvfb exited (see xvfb.log)')
+            if time.monotonic() >= deadline:
+                self.close()
+                raise ScenarioError('Xvfb did not start (see xvfb.log)')
+            try:
+                self.fb = Framebuffer(path)
+            except (OSError, ValueError, struct.error):
+                time.sleep(0.1)
+            except ScenarioError:
+                _stop(self.proc)
+                raise
+
+    def close(self):
+        if self.fb is not None:
+            self.fb.close()
+            self.fb = None
+        _stop(self.proc)
+
+
+def _stop(proc, group=False):
+    if proc is None or proc.poll() is not None:
+        return
+    try:
+        if group:
+            os.killpg(proc.pid, signal.SIGTERM)
+        else:
+            proc.terminate()
+        proc.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        if group:
+            os.killpg(proc.pid, signal.SIGKILL)
+        else:
+            proc.kill()
+        proc.wait()
+    except ProcessLookupError:
+        pass
+
+
+def tree_usage(root):
+    """(CPU seconds, resident bytes) of root and its descendants."""
+    procs = {}
+    for name in os.listdir('/proc'):
+        if not name.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % name) as f:
+                stat = f.read()
+        except OSError:
+            continue
+        # the fields after the command name, which may have spaces
+        fields = stat[stat.rfind(')') + 2:].split()
+        procs[int(name)] = (int(fields[1]), int(fields[11]) + int(fields[12]), int(fields[21]))
+
+    children = {}
+    for (pid, (ppid, _, _)) in procs.items():
+        children.setdefault(ppid, []).append(pid)
+    tree = [root] if root in procs else []
+    for pid in tree:
+        tree.extend(children.get(pid, []))
+    return (sum(procs[p][1] for p in tree) / CLK_TCK, sum(procs[p][2] for p in tree) * PAGE_SIZE)
+
+
+def start_app(args, display, run_dir):
+    if args.app_cmd:
+        cmd = shlex.split(args.app_cmd)
+    else:
+        cmd = [os.path.join(args.app_dir, 'race_capture')] + shlex.split(args.app_args)
+    env = dict(os.environ, DISPLAY=display.name)
+    if args.home:
+        os.makedirs(args.home, exist_ok=True)
+        env['HOME'] = args.home
+    log = open(os.path.join(run_dir, 'app.log'), 'w')
+    try:
+        # its own session, so stopping it stops whatever it started
+        return subprocess.Popen(cmd, cwd=args.app_dir, env=env, stdout=log, stderr=subprocess.STDOUT,
+                                preexec_fn=loadtest._pin(args.app_cpus), start_new_session=True)
+    except OSError as e:
+        raise ScenarioError('cannot start %s: %s' % (cmd[0], e))
+    finally:
+        log.close()
+
+
+def wait_for_app(ctl, app, timeout):
+    """Waits for the app to talk to the device."""
+    deadline = time.monotonic() + timeout
+    while not ctl.metrics()['rx']['messages']:
+        if app.poll() is not None:
+            raise ScenarioError('the app exited with status %d (see app.log)' % app.returncode)
+        if time.monotonic() >= deadline:
+            raise ScenarioError('the app did not connect to the device in %ds (see app.log)' % timeout)
+        time.sleep(0.5)
+
+
+def pick_channels(available, count, marker):
+    if count > len(available):
+        raise ScenarioError('%d channels asked for, the device has %d' % (count, len(available)))
+    names = available[:count]
+    if marker not in names:
+        names = names[:-1] + [marker]
+    return names
+
+
+def _sample_rate(snap):
+    m = snap['tx']['messages'].get('sample')
+    return m['per_s'] if m else 0.0
+
+
+def measure(args, ctl, app, fb, names, rate):
+    """One step of the sweep."""
+    ctl.set(channels=names, telemetry_rate=rate)
+    time.sleep(args.settle)
+    # again, in case the app asked for its own rate meanwhile
+    ctl.set(telemetry_rate=rate)
+
+    proc_before = loadtest.read_proc()
+    before = ctl.metrics(reset=True)
+    (cpu_before, rss_max) = tree_usage(app.pid)
+    start = time.monotonic()
+    end = start + args.dwell
+
+    frames = 0
+    last_frame = fb.crc()
+    next_rss = start + RSS_INTERVAL
+    latencies = []
+    missed = 0
+    # start with a value the screen isn't already showing
+    current = ctl.call({'get': None}).get('marker')
+    flips = 1 if current is not None and current['value'] == args.marker_values[0] else 0
+    marker_at = None
+    marker_crc = None
+    next_marker = start
+    next_poll = start
+
+    while True:
+        now = time.monotonic()
+        if now >= end:
+            break
+        if app.poll() is not None:
+            raise ScenarioError('the app exited with status %d (see app.log)' % app.returncode)
+
+        if marker_at is None and now >= next_marker:
+            marker_crc = fb.crc(args.marker_region)
+            value = args.marker_values[flips % len(args.marker_values)]
+            flips += 1
+            ctl.set(marker={'channel': args.marker_channel, 'value': value})
+            marker_at = now
+
+        crc = fb.crc()
+        if crc != last_frame:
+            frames += 1
+            last_frame = crc
+
+        if marker_at is not None:
+            if (crc if args.marker_region is None else fb.crc(args.marker_region)) != marker_crc:
+                shown_ns = time.time_ns()
+                sent_ns = (ctl.call({'get': None}).get('marker') or {}).get('sent_ns')
+                if sent_ns is not None and shown_ns > sent_ns:
+                    latencies.append((shown_ns - sent_ns) / 1e6)
+                else:
+                    # something else on the screen changed first
+                    missed += 1
+                marker_at = None
+                next_marker = now + args.marker_interval
+            elif now - marker_at > MARKER_TIMEOUT:
+                missed += 1
+                marker_at = None
+                next_marker = now
+
+        if now >= next_rss:
+            rss_max = max(rss_max, tree_usage(app.pid)[1])
+            next_rss = now + RSS_INTERVAL
+
+        next_poll += 1.0 / args.poll_hz
+        delay = next_poll - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        else:
+            next_poll = time.monotonic()
+
+    elapsed = time.monotonic() - start
+    (cpu_after, rss) = tree_usage(app.pid)
+    snap = ctl.metrics(reset=True)
+    kernel = (loadtest.kernel_window(proc_before, loadtest.read_proc(), [args.socket]) or {}).get(args.socket)
+
+    samples_per_s = _sample_rate(snap)
+    pct = control.percentiles(latencies, (50, 99))
+    step = {
+        'rate': rate,
+        'channels': len(names),
+        'app_cpu_pct': round((cpu_after - cpu_before) / elapsed * 100, 1),
+        'app_rss_mb': round(max(rss_max, rss) / (1 << 20), 1),
+        'fps': round(frames / elapsed, 1),
+        'latency_ms': {
+            'p50': None if pct[50] is None else round(pct[50], 1),
+            'p99': None if pct[99] is None else round(pct[99], 1),
+            'max': round(max(latencies), 1) if latencies else None,
+        },
+        'markers': len(latencies),
+        'markers_missed': missed,
+        'samples_per_s': samples_per_s,
+        'delivered': round(samples_per_s / rate, 3) if rate else None,
+        'replay_late': snap.get('replay', {}).get('late', 0) - before.get('replay', {}).get('late', 0),
+        'rx_p99_us': kernel['rx_p99_us'] if kernel else None,
+    }
+    step['limit'] = None
+    if step['app_cpu_pct'] >= args.app_cpu_limit:
+        step['limit'] = 'app'
+    elif step['delivered'] is not None and step['delivered'] < SATURATED:
+        step['limit'] = 'delivery'
+    return step
+
+
+HEADER = '%6s %5s %8s %8s %6s %9s %9s %8s %11s %8s %s' % (
+    'RATE', 'CHANS', 'CPU %', 'RSS MB', 'FPS', 'LAT P50', 'LAT P99', 'MISSED', 'SAMPLES/S', 'RX P99', 'LIMIT')
+
+
+def format_step(step):
+    def ms(v):
+        return '-' if v is None else '%.1f' % v
+    return '%6d %5d %8.1f %8.1f %6.1f %9s %9s %8d %11.1f %8s %s' % (
+        step['rate'], step['channels'], step['app_cpu_pct'], step['app_rss_mb'], step['fps'],
+        ms(step['latency_ms']['p50']), ms(step['latency_ms']['p99']), step['markers_missed'],
+        step['samples_per_s'], '-' if step['rx_p99_us'] is None else step['rx_p99_us'],
+        step['limit'] or '')
+
+
+def run(args):
+    run_dir = args.run_dir or tempfile.mkdtemp(prefix='apptest-')
+    os.makedirs(run_dir, exist_ok=True)
+    print("APPTEST: run dir %s" % run_dir)
+
+    available_cpus = os.sched_getaffinity(0)
+    for (role, cpus) in (('app', args.app_cpus), ('device', args.device_cpus), ('harness', args.harness_cpus)):
+        if cpus and not set(cpus) <= available_cpus:
+            raise ScenarioError('%s cpus %s are not all available (%s)' % (role, cpus, sorted(available_cpus)))
+    if args.harness_cpus:
+        os.sched_setaffinity(0, args.harness_cpus)
+
+    gps_channels = len(fakedevice.TELEMETRY_CHANNELS)
+    device_args = []
+    if max(args.channels) > gps_channels:
+        extended = max(0, max(args.channels) - gps_channels - len(ecu.STANDARD_PIDS))
+        device_args += ['--obd2', '--obd2-pids', str(extended), '--obd2-poll', str(args.obd2_poll)]
+    scenario = {
+        'device': {'gps_rate': args.gps_rate, 'args': device_args},
+        'cpus': {'device': args.device_cpus},
+    }
+
+    display = device = ctl = app = None
+    steps = []
+    try:
+        display = VirtualDisplay(args.display, args.screen, run_dir)
+        if args.marker_region is not None:
+            (x, y, w, h) = args.marker_region
+            if w <= 0 or h <= 0 or x + w > display.fb.width or y + h > display.fb.height:
+                raise ScenarioError('marker region %s is not on the %dx%d screen' %
+                                    (args.marker_region, display.fb.width, display.fb.height))
+        device = loadtest.start_device(0, (args.socket,), scenario, run_dir)
+        ctl = loadtest.connect_control(0, device)
+        app = start_app(args, display, run_dir)
+        print("APPTEST: waiting for the app to connect")
+        wait_for_app(ctl, app, args.start_timeout)
+
+        available = ctl.call({'get': None})['available_channels']
+        if args.marker_channel not in available:
+            raise ScenarioError('the device has no %s channel' % args.marker_channel)
+
+        print(HEADER)
+        with open(os.path.join(run_dir, 'steps.jsonl'), 'w') as out:
+            for count in args.channels:
+                names = pick_channels(available, count, args.marker_channel)
+                flagged = 0
+                for rate in args.rates:
+                    step = measure(args, ctl, app, display.fb, names, rate)
+                    display.fb.save_ppm(os.path.join(run_dir, 'screen-%dx%d.ppm' % (rate, count)))
+                    steps.append(step)
+                    out.write(json.dumps(step) + '\n')
+                    out.flush()
+                    print(format_step(step))
+                    sys.stdout.flush()
+                    flagged = flagged + 1 if step['limit'] else 0
+                    if flagged >= 2:
+                        break
+    finally:
+        _stop(app, group=True)
+        if ctl is not None:
+            ctl.close()
+        _stop(device)
+        if display is not None:
+            display.close()
+
+    report = {
+        'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'app': args.app_cmd or os.path.join(args.app_dir, 'race_capture') + ' ' + args.app_args,
+        'screen': '%dx%d' % args.screen,
+        'gps_rate': args.gps_rate,
+        'marker_region': args.marker_region,
+        'steps': steps,
+    }
+    with open(os.path.join(run_dir, 'report.json'), 'w') as f:
+        json.dump(report, f, indent=2)
+
+    print()
+    for count in args.channels:
+        limited = [s for s in steps if s['channels'] == count and s['limit']]
+        ok = [s for s in steps if s['channels'] == count and not s['limit']]
+        if limited:
+            print("APPTEST: %d channels: %s limit from %d samples/s%s" % (
+                count, limited[0]['limit'], limited[0]['rate'],
+                ', ok up to %d' % ok[-1]['rate'] if ok else ''))
+        elif ok:
+            print("APPTEST: %d channels: ok up to %d samples/s" % (count, ok[-1]['rate']))
+    return 0
+
+
+def _ints(s):
+    return [int(v) for v in s.split(',') if v]
+
+
+def _size(s):
+    (w, h) = s.lower().split('x')
+    return (int(w), int(h))
+
+
+def _region(s):
+    region = tuple(_ints(s))
+    if len(region) != 4:
+        raise argparse.ArgumentTypeError('expected X,Y,W,H')
+    return region
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Sweep telemetry rates and channel counts through the '
+                                                 'real app on a virtual display.')
+    parser.add_argument('--rates', type=_ints, default=[10, 25, 50, 100],
+                        help='telemetry rates, samples/s (default 10,25,50,100)')
+    parser.add_argument('--channels', type=_ints, default=[7],
+                        help='channel counts, including Interval (default 7, the GPS channels)')
+    parser.add_argument('--dwell', type=float, default=20.0, help='seconds measured per step (default 20)')
+    parser.add_argument('--settle', type=float, default=5.0,
+                        help='seconds before measuring each step (default 5)')
+    parser.add_argument('--gps-rate', type=int, default=50, help='GPS rate of the replay (default 50)')
+    parser.add_argument('--obd2-poll', type=float, default=10.0,
+                        help='rate each simulated ECU PID is polled at, for more than 7 channels (default 10)')
+    parser.add_argument('--socket', default=bridge.SOCKET_DESC,
+                        help='bridge socket the device connects to (default %s)' % bridge.SOCKET_DESC)
+    parser.add_argument('--app-dir', default=APP_DIR, help='race_capture directory (default %s)' % APP_DIR)
+    parser.add_argument('--app-args', default=RC_ARGS,
+                        help="race_capture's options (default the launcher's: %s)" % RC_ARGS)
+    parser.add_argument('--app-cmd', help='run this instead of race_capture, e.g. the app from source')
+    parser.add_argument('--home', metavar='DIR', help="HOME for the app, for a fresh set of settings")
+    parser.add_argument('--start-timeout', type=int, default=120,
+                        help='seconds for the app to start and connect (default 120)')
+    parser.add_argument('--display', type=int, default=99, help='X display number for Xvfb (default 99)')
+    parser.add_argument('--screen', type=_size, default=(800, 480),
+                        help='screen size (default 800x480, the Pi touchscreen)')
+    parser.add_argument('--poll-hz', type=float, default=120.0,
+                        help='framebuffer polls per second (default 120)')
+    parser.add_argument('--marker-channel', default='Speed',
+                        help='channel the marker is streamed in (default Speed)')
+    parser.add_argument('--marker-values', type=lambda s: [float(v) for v in s.split(',')], default=[40.0, 240.0],
+                        help='values the marker flips between (default 40,240)')
+    parser.add_argument('--marker-interval', type=float, default=1.0,
+                        help='seconds between marker flips (default 1)')
+    parser.add_argument('--marker-region', type=_region, metavar='X,Y,W,H',
+                        help='part of the screen showing the marker channel (default the whole screen)')
+    parser.add_argument('--app-cpu-limit', type=float, default=90.0,
+                        help='app CPU, in %% of one core, flagged as the limit (default 90)')
+    parser.add_argument('--app-cpus', type=_ints, help='cores the app runs on')
+    parser.add_argument('--device-cpus', type=_ints, help='cores the device runs on')
+    parser.add_argument('--harness-cpus', type=_ints, help='cores this script runs on')
+    parser.add_argument('--run-dir', metavar='DIR', help='keep logs, screenshots and the report here '
+                                                         '(default a temp dir)')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    try:
+        return run(args)
+    except (ScenarioError, OSError, ValueError, KeyError) as e:
+        print("APPTEST ERROR:", e)
+        return 2
+
+
+if __name__ == '__main__':
+    sys.exit(main())
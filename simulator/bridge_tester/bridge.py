@@ -0,0 +1,258 @@
+"""Client for the tty bridge socket.
+
+Wraps libbridge_client.so (built by `make client` in ../bridge) when it
+is available, for non-blocking batched sends, in-place line framing and
+automatic reconnects. Without the library the same interface is
+provided with a plain Python socket (and without reconnects).
+
+Set BRIDGE_CLIENT_LIB to load the library from elsewhere, or to an
+empty string to force the Python fallback.
+"""
+
+import ctypes
+import errno
+import fcntl
+import os
+import socket
+import struct
+import sys
+import termios
+import threading
+
+SOCKET_DESC = 'bdr-pi-tty-bridge-socket'
+
+# Timed delivery framing, see common.h.
+TIMED_MAGIC = b'BRTIMED1'
+TIMED_HDR = struct.Struct('=QII')
+TIMED_MAX_LEN = 64 * 1024
+
+# Producer registration, see common.h.
+PRODUCER_MAGIC = b'BRPROD1 '
+
+_LIB_PATH = os.environ.get(
+    'BRIDGE_CLIENT_LIB',
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'bridge', 'libbridge_client.so'))
+
+
+class BridgeError(Exception):
+    pass
+
+
+class _Opts(ctypes.Structure):
+    _fields_ = [
+        ('name', ctypes.c_char_p),
+        ('reconnect', ctypes.c_int),
+        ('reconnect_min_ms', ctypes.c_int),
+        ('reconnect_max_ms', ctypes.c_int),
+        ('rx_size', ctypes.c_size_t),
+        ('tx_size', ctypes.c_size_t),
+        ('timed', ctypes.c_int),
+        ('commands', ctypes.c_char_p),
+    ]
+
+
+def _load():
+    if not _LIB_PATH or not os.path.exists(_LIB_PATH):
+        return None
+    try:
+        lib = ctypes.CDLL(_LIB_PATH, use_errno=True)
+    except OSError as e:
+        print("BRIDGE: cannot load %s: %s" % (_LIB_PATH, e))
+        return None
+
+    lib.bridge_client_open.argtypes = [ctypes.POINTER(_Opts)]
+    lib.bridge_client_open.restype = ctypes.c_void_p
+    lib.bridge_client_close.argtypes = [ctypes.c_void_p]
+    lib.bridge_client_close.restype = None
+    lib.bridge_client_connected.argtypes = [ctypes.c_void_p]
+    lib.bridge_client_send.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.bridge_client_send_at.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_uint64]
+    lib.bridge_client_flush.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.bridge_client_flush.restype = ctypes.c_long
+    lib.bridge_client_recv_line.argtypes = [
+        ctypes.c_void_p,
+        ctypes.POINTER(ctypes.c_void_p),
+        ctypes.POINTER(ctypes.c_size_t),
+        ctypes.c_int,
+    ]
+    return lib
+
+
+_lib = _load()
+
+
+def _timeout_ms(timeout):
+    return -1 if timeout is None else int(timeout * 1000)
+
+
+def _error(what):
+    err = ctypes.get_errno()
+    return BridgeError("%s: %s" % (what, os.strerror(err)))
+
+
+class _LibClient:
+    """Client backed by libbridge_client.so."""
+
+    def __init__(self, name, reconnect, timed, commands):
+        self._name = name.encode('utf-8')
+        self._commands = commands.encode('utf-8') if commands else None
+        opts = _Opts(name=self._name, reconnect=1 if reconnect else 0, timed=1 if timed else 0,
+                     commands=self._commands)
+        self._c = _lib.bridge_client_open(ctypes.byref(opts))
+        if not self._c:
+            raise _error("connect")
+        self._line = ctypes.c_void_p()
+        self._len = ctypes.c_size_t()
+
+    def send(self, data):
+        self._retry(lambda: _lib.bridge_client_send(self._c, data, len(data)))
+
+    def send_at(self, data, deliver_ns):
+        self._retry(lambda: _lib.bridge_client_send_at(self._c, data, len(data), deliver_ns))
+
+    def _retry(self, send):
+        if send() == 0:
+            return
+        if ctypes.get_errno() == errno.EAGAIN:
+            # The queue is full: wait for it to drain and try again.
+            self.flush()
+            if send() == 0:
+                return
+        raise _error("send")
+
+    def flush(self, timeout=None):
+        if _lib.bridge_client_flush(self._c, _timeout_ms(timeout)) < 0:
+            raise _error("flush")
+
+    def queued(self):
+        n = _lib.bridge_client_flush(self._c, 0)
+        return None if n < 0 else n
+
+    def read_line(self, timeout=None):
+        rc = _lib.bridge_client_recv_line(self._c, ctypes.byref(self._line), ctypes.byref(self._len),
+                                          _timeout_ms(timeout))
+        if rc < 0:
+            raise _error("recv")
+        if rc == 0:
+            return None
+        return ctypes.string_at(self._line.value or 0, self._len.value)
+
+    def close(self):
+        if self._c:
+            _lib.bridge_client_close(self._c)
+            self._c = None
+
+
+class _SocketClient:
+    """Fallback client using a Python socket."""
+
+    def __init__(self, name, reconnect, timed, commands):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            self._sock.connect(b'\0' + name.encode('utf-8'))
+            if commands:
+                self._sock.sendall(PRODUCER_MAGIC + commands.encode('utf-8') + b'\n')
+            if timed:
+                self._sock.sendall(TIMED_MAGIC)
+        except socket.error as e:
+            self._sock.close()
+            raise BridgeError("connect: %s" % e)
+        self._buf = b''
+
+    def send(self, data):
+        try:
+            self._sock.sendall(data)
+        except socket.error as e:
+            raise BridgeError("send: %s" % e)
+
+    def send_at(self, data, deliver_ns):
+        self.send(TIMED_HDR.pack(deliver_ns, len(data), 0) + data)
+
+    def flush(self, timeout=None):
+        pass
+
+    def queued(self):
+        # unsent bytes in the socket's send buffer
+        buf = bytearray(4)
+        try:
+            fcntl.ioctl(self._sock.fileno(), termios.TIOCOUTQ, buf)
+        except OSError:
+            return None
+        return int.from_bytes(buf, sys.byteorder)
+
+    def read_line(self, timeout=None):
+        self._sock.settimeout(timeout)
+        while b'\n' not in self._buf:
+            try:
+                data = self._sock.recv(4096)
+            except socket.timeout:
+                return None
+            except socket.error as e:
+                raise BridgeError("recv: %s" % e)
+            if not data:
+                raise BridgeError("recv: connection closed")
+            self._buf += data
+        line, self._buf = self._buf.split(b'\n', 1)
+        return line.rstrip(b'\r')
+
+    def close(self):
+        self._sock.close()
+
+
+class Client:
+    """Line oriented connection to the bridge socket.
+
+    send() may be called from one thread while another calls
+    read_line(). Lines are returned as bytes, without the line ending.
+
+    A timed client (the module needs timed_rx) can also send_at() a
+    CLOCK_MONOTONIC time (as from time.monotonic_ns()) at which the
+    bridge delivers the data to the tty; send() delivers right away.
+
+    On an instance with several producers, commands (space separated
+    command names, "*" for the ones nobody registered for) registers
+    the connection for the app's commands by those names.
+    """
+
+    def __init__(self, name=SOCKET_DESC, reconnect=True, timed=False, commands=None):
+        impl = _LibClient if _lib is not None else _SocketClient
+        self._impl = impl(name, reconnect, timed, commands)
+        self._timed = timed
+        self._send_lock = threading.Lock()
+
+    @staticmethod
+    def native():
+        return _lib is not None
+
+    def send(self, data, flush=True):
+        if isinstance(data, str):
+            data = data.encode('utf-8')
+        if self._timed:
+            self.send_at(data, 0, flush)
+            return
+        with self._send_lock:
+            self._impl.send(data)
+            if flush:
+                self._impl.flush()
+
+    def send_at(self, data, deliver_ns, flush=True):
+        if not self._timed:
+            raise BridgeError("send_at: not a timed client")
+        if isinstance(data, str):
+            data = data.encode('utf-8')
+        with self._send_lock:
+            for i in range(0, len(data), TIMED_MAX_LEN):
+                self._impl.send_at(data[i:i + TIMED_MAX_LEN], deliver_ns)
+            if flush:
+                self._impl.flush()
+
+    def queued(self):
+        """Bytes sent but not yet taken by the bridge, or None."""
+        with self._send_lock:
+            return self._impl.queued()
+
+    def read_line(self, timeout=None):
+        return self._impl.read_line(timeout)
+
+    def close(self):
+        self._impl.close()
@@ -0,0 +1,365 @@
+#!/usr/bin/env python3
+"""Benchmark bulk transfers through the fake tty, as the app.
+
+Talks to fakedevice.py --storage (see storage.py for the protocol) over
+the tty and moves a large payload in one direction:
+
+  list            the logs on the device
+  download        a log, device -> app, over a sliding window of
+                  acknowledged, CRC-checked chunks; the file is checked
+                  against the device's CRC at the end
+  upload-script   a generated Lua script, app -> device, one
+                  acknowledged page at a time as the app does
+  upload-tracks   a generated track database, one track at a time
+
+Each reports the throughput, the acknowledgement round trip times and
+the chunks or pages that had to be sent again. Chunks garbled on the
+way (control.py set '{"errors": {"corrupt": 0.01}}') are caught by
+their CRC and requested again, so the flow control is exercised too.
+
+  ./fakedevice.py --storage /tmp/sd --log-mb 256
+  ./bulk.py download --window 16 --out /tmp/sim.log
+"""
+
+import argparse
+import base64
+import json
+import random
+import sys
+import time
+import zlib
+
+import serial.serialposix
+
+import control
+import storage
+import tracks
+
+TTY = '/dev/ttyUSB_FAKE_RACECAP0'
+
+# Resends after this many timeouts in a row give up.
+MAX_TIMEOUTS = 5
+
+
+class TransferError(Exception):
+    pass
+
+
+class Link:
+    """JSON messages over the tty, skipping streamed telemetry."""
+
+    def __init__(self, tty, timeout):
+        self.ser = serial.serialposix.Serial(tty, timeout=timeout, write_timeout=timeout)
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        self._buf = b''
+
+    def send(self, msg):
+        s = (json.dumps(msg, separators=(',', ':')) + '\r\n').encode('utf-8')
+        self.ser.write(s)
+        self.bytes_sent += len(s)
+
+    def recv(self):
+        """Returns the next message, {} for a garbled line or None on
+        timeout."""
+        while True:
+            line = self._readline()
+            if line is None:
+                return None
+            if line.startswith(b'{"s":'):
+                continue
+            try:
+                msg = json.loads(line)
+            except ValueError:
+                return {}
+            return msg if isinstance(msg, dict) else {}
+
+    def _readline(self):
+        # Serial.read_until reads a byte at a time, far slower than the
+        # bridge; read whatever is waiting instead.
+        while True:
+            i = self._buf.find(b'\n')
+            if i >= 0:
+                line, self._buf = self._buf[:i + 1], self._buf[i + 1:]
+                return line
+            data = self.ser.read(max(1, self.ser.in_waiting))
+            if not data:
+                return None
+            self.bytes_received += len(data)
+            self._buf += data
+
+    def call(self, msg, key):
+        """Sends msg and returns the first response containing key."""
+        self.send(msg)
+        while True:
+            resp = self.recv()
+            if resp is None:
+                raise TransferError('no response to %s' % next(iter(msg)))
+            if key in resp:
+                return resp
+
+    def close(self):
+        self.ser.close()
+
+
+class Stats:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.rtt = []
+        self.resent = 0
+        self.crc_errors = 0
+        self.timeouts = 0
+
+    def report(self, name, nbytes, link):
+        elapsed = max(time.monotonic() - self.start, 1e-9)
+        pct = control.percentiles(self.rtt, (50, 90, 99))
+        print("%s: %d bytes in %.2fs, %.2f MB/s (%.2f MB/s on the wire)" %
+              (name, nbytes, elapsed, nbytes / elapsed / 1e6,
+               (link.bytes_sent + link.bytes_received) / elapsed / 1e6))
+        print("%s: %d resent, %d crc errors, %d timeouts" % (name, self.resent, self.crc_errors, self.timeouts))
+        if self.rtt:
+            print("%s: ack rtt ms p50 %.2f p90 %.2f p99 %.2f max %.2f" %
+                  (name, pct[50] * 1000, pct[90] * 1000, pct[99] * 1000, max(self.rtt) * 1000))
+
+
+def log_list(link):
+    return link.call({'getLogList': None}, 'logList')['logList']['files']
+
+
+def download(link, args):
+    files = log_list(link)
+    if not files:
+        raise TransferError('the device has no logs')
+    info = next((f for f in files if f['name'] == args.name), None) if args.name else files[0]
+    if info is None:
+        raise TransferError('no log named %s' % args.name)
+    name, size = info['name'], info['size']
+
+    out = open(args.out, 'wb') if args.out else None
+    stats = Stats()
+    crc = 0
+    expected = 0
+    # offset the next chunk released by an ack starts at -> ack time
+    released = {}
+    timeouts = 0
+    # offset of the last nak, and of the last chunk received
+    naked = None
+    last_off = -1
+
+    link.send({'getLog': {'name': name, 'off': 0, 'chunk': args.chunk, 'win': args.window}})
+    sent = time.monotonic()
+    for i in range(args.window):
+        released[i * args.chunk] = sent
+    try:
+        while True:
+            msg = link.recv()
+            if msg is None:
+                timeouts += 1
+                stats.timeouts += 1
+                if timeouts >= MAX_TIMEOUTS:
+                    raise TransferError('download stalled at %d of %d' % (expected, size))
+                link.send({'logAck': {'name': name, 'off': expected, 'nak': 1}})
+                naked = expected
+                continue
+            timeouts = 0
+            chunk = msg.get('log')
+            if chunk is None:
+                if msg.get('resp') == 0:
+                    raise TransferError('%s: %s' % (name, msg.get('err')))
+                if msg == {}:
+                    # a garbled line: if it was a chunk, the next one is
+                    # out of order and asks for it again
+                    stats.crc_errors += 1
+                continue
+            try:
+                off = int(chunk['off'])
+                data = base64.b64decode(chunk['data'])
+                valid = chunk.get('name') == name and len(data) == chunk['len'] and \
+                    storage.crc32(data) == chunk['crc']
+            except (KeyError, TypeError, ValueError):
+                # garbled inside the JSON
+                valid = False
+                off = expected
+            if valid and off != expected:
+                # After a lost chunk, ask for everything from it once per
+                # round: an offset going backwards is the device resending.
+                if off > expected and (naked != expected or off <= last_off):
+                    link.send({'logAck': {'name': name, 'off': expected, 'nak': 1}})
+                    naked = expected
+                last_off = off
+                stats.resent += 1
+                continue
+            if not valid:
+                stats.crc_errors += 1
+                if naked != expected:
+                    link.send({'logAck': {'name': name, 'off': expected, 'nak': 1}})
+                    naked = expected
+                continue
+            last_off = off
+
+            now = time.monotonic()
+            t = released.pop(expected, None)
+            if t is not None:
+                stats.rtt.append(now - t)
+            if out is not None:
+                out.write(data)
+            crc = zlib.crc32(data, crc)
+            expected += len(data)
+            naked = None
+            if chunk.get('eof'):
+                link.send({'logAck': {'name': name, 'off': expected}})
+                break
+            link.send({'logAck': {'name': name, 'off': expected}})
+            released[expected + (args.window - 1) * args.chunk] = now
+    finally:
+        if out is not None:
+            out.close()
+
+    stats.report('DOWNLOAD', expected, link)
+    if expected != size or crc & 0xffffffff != info['crc']:
+        raise TransferError('%s: got %d bytes crc %08x, device has %d bytes crc %08x' %
+                            (name, expected, crc & 0xffffffff, size, info['crc']))
+    print("DOWNLOAD: %s verified" % name)
+
+
+def _send_acked(link, stats, msg, cmd, page, corrupt):
+    """Sends a page or track until the device acknowledges it."""
+    body = msg[cmd]
+    for _ in range(MAX_TIMEOUTS):
+        if corrupt > 0 and random.random() < corrupt:
+            link.send({cmd: dict(body, crc=body['crc'] ^ 1)})
+        else:
+            link.send(msg)
+        sent = time.monotonic()
+        resp = link.recv()
+        while resp is not None and 'resp' not in resp:
+            resp = link.recv()
+        if resp is None:
+            stats.timeouts += 1
+        elif resp['resp'] == 1:
+            stats.rtt.append(time.monotonic() - sent)
+            return
+        elif resp.get('err') == 'crc':
+            stats.crc_errors += 1
+        else:
+            raise TransferError('%s %d: %s' % (cmd, page, resp))
+        stats.resent += 1
+    raise TransferError('%s %d: not acknowledged' % (cmd, page))
+
+
+def make_script(size):
+    lines = []
+    n = 0
+    i = 0
+    while n < size:
+        line = 'function onTick_%d() setChannel(%d, getAnalog(%d) * %d) end -- padding\n' % (i, i % 16, i % 8, i)
+        lines.append(line)
+        n += len(line)
+        i += 1
+    return ''.join(lines)[:size]
+
+
+def upload_script(link, args):
+    script = make_script(args.mb << 20)
+    pages = [script[off:off + args.page] for off in range(0, len(script), args.page)]
+    stats = Stats()
+    for i, data in enumerate(pages):
+        mode = storage.SCRIPT_ADD_MODE_COMPLETE if i == len(pages) - 1 else storage.SCRIPT_ADD_MODE_IN_PROGRESS
+        msg = {'setScriptCfg': {'data': data, 'page': i, 'mode': mode,
+                                'crc': storage.crc32(data.encode('utf-8'))}}
+        _send_acked(link, stats, msg, 'setScriptCfg', i, args.corrupt)
+    stats.report('UPLOAD', len(script), link)
+
+    if args.verify:
+        got = []
+        page = 0
+        while True:
+            data = link.call({'getScriptCfg': page}, 'scriptCfg')['scriptCfg']['data']
+            got.append(data)
+            if len(data) < storage.SCRIPT_PAGE_SIZE:
+                break
+            page += 1
+        if ''.join(got) != script:
+            raise TransferError('the script read back differs')
+        print("UPLOAD: %d pages read back and verified" % (page + 1))
+
+
+def upload_tracks(link, args):
+    db = tracks.generate(args.count, args.seed)['tracks']
+    stats = Stats()
+    nbytes = 0
+    for i, track in enumerate(db):
+        mode = storage.TRACK_ADD_MODE_COMPLETE if i == len(db) - 1 else storage.TRACK_ADD_MODE_IN_PROGRESS
+        msg = {'setTrackDb': {'index': i, 'mode': mode, 'track': track, 'crc': storage.track_crc(track)}}
+        nbytes += len(json.dumps(track))
+        _send_acked(link, stats, msg, 'setTrackDb', i, args.corrupt)
+    stats.report('UPLOAD', nbytes, link)
+
+    size = link.call({'getTrackDb': None}, 'trackDb')['trackDb']['size']
+    if size != len(db):
+        raise TransferError('the device has %d tracks, sent %d' % (size, len(db)))
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Benchmark bulk transfers through the fake tty.")
+    parser.add_argument('--tty', default=TTY, help='tty to open (default %s)' % TTY)
+    parser.add_argument('--timeout', type=float, default=2.0,
+                        help='seconds to wait for a chunk or an acknowledgement (default 2)')
+    parser.add_argument('--seed', type=int, default=1, help='seed for generated content and errors')
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    sub.add_parser('list', help='list the logs on the device')
+
+    d = sub.add_parser('download', help='download a log')
+    d.add_argument('--name', help='log to download (default the first)')
+    d.add_argument('--chunk', type=int, default=storage.DEFAULT_CHUNK,
+                   help='bytes per chunk, up to %d (default %d)' % (storage.MAX_CHUNK, storage.DEFAULT_CHUNK))
+    d.add_argument('--window', type=int, default=storage.DEFAULT_WINDOW,
+                   help='chunks in flight, up to %d (default %d)' % (storage.MAX_WINDOW, storage.DEFAULT_WINDOW))
+    d.add_argument('--out', metavar='FILE', help='also write the log to FILE')
+
+    s = sub.add_parser('upload-script', help='upload a generated Lua script')
+    s.add_argument('--mb', type=int, default=1, help='script size in MiB (default 1)')
+    s.add_argument('--page', type=int, default=storage.SCRIPT_PAGE_SIZE,
+                   help='bytes per page (default %d)' % storage.SCRIPT_PAGE_SIZE)
+    s.add_argument('--verify', action='store_true', help='read the script back and compare')
+
+    t = sub.add_parser('upload-tracks', help='upload a generated track database')
+    t.add_argument('--count', type=int, default=1000, help='tracks to upload (default 1000)')
+
+    for p in (s, t):
+        p.add_argument('--corrupt', type=float, default=0.0,
+                       help='probability of sending a page or track with a bad CRC')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    random.seed(args.seed)
+
+    try:
+        link = Link(args.tty, args.timeout)
+    except serial.SerialException as e:
+        print("BULK: cannot open %s: %s" % (args.tty, e))
+        return 1
+
+    try:
+        if args.cmd == 'list':
+            for f in log_list(link):
+                print("%-24s %12d %08x" % (f['name'], f['size'], f['crc']))
+        elif args.cmd == 'download':
+            download(link, args)
+        elif args.cmd == 'upload-script':
+            upload_script(link, args)
+        elif args.cmd == 'upload-tracks':
+            upload_tracks(link, args)
+    except (TransferError, serial.SerialException) as e:
+        print("BULK ERROR:", e)
+        return 1
+    finally:
+        link.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+
+# control.py is the fake device's control plane: a local socket that
+# takes JSON commands, one per line, and answers each with one JSON
+# line, so a running fakedevice.py can be changed and measured without
+# restarting it (and dropping its bridge connection).
+#
+#   {"metrics": {"reset": true}}   metrics since the previous reset
+#   {"get": null}                  the current scenario
+#   {"set": {...}}                 change the scenario (see fakedevice.py)
+#
+# Run as a script to talk to a device:
+#
+#   ./control.py metrics
+#   ./control.py set '{"telemetry_rate": 50, "errors": {"drop": 0.1}}'
+#   ./control.py pause telemetry
+#   ./control.py ramp --start 10 --stop 2000 --dwell 5
+#
+# ramp steps the telemetry rate up on the live connection and prints,
+# per step, the rate asked for against the rate achieved, to find where
+# the device, the bridge or the app stops keeping up.
+
+import argparse
+import collections
+import json
+import socket
+import socketserver
+import sys
+import threading
+import time
+
+CONTROL_DESC = 'bdr-fakedevice-control'
+
+# Response times kept for percentiles between resets.
+MAX_RESPONSE_SAMPLES = 100000
+
+# A ramp step is saturated below this fraction of the requested rate.
+SATURATED = 0.9
+
+
+def percentiles(values, ps):
+    """Returns {p: value} for each percentile p (0-100) of values."""
+    if not values:
+        return {p: None for p in ps}
+    values = sorted(values)
+    return {p: values[min(len(values) - 1, int(len(values) * p / 100.0))] for p in ps}
+
+
+class _Direction:
+    def __init__(self):
+        self.bytes = 0
+        self.messages = collections.Counter()
+
+
+class Metrics:
+    """Thread safe message, byte and response time counters.
+
+    Totals count from the start; the rates, counts and percentiles in a
+    snapshot cover the window since the last reset."""
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._start = time.monotonic()
+        self._total = {'rx': _Direction(), 'tx': _Direction()}
+        self._reset_window(self._start)
+
+    def _reset_window(self, now):
+        self._window_start = now
+        self._window = {'rx': _Direction(), 'tx': _Direction()}
+        self._response_ms = collections.deque(maxlen=MAX_RESPONSE_SAMPLES)
+
+    def _count(self, direction, kind, nbytes):
+        with self._lock:
+            for d in (self._total[direction], self._window[direction]):
+                d.bytes += nbytes
+                d.messages[kind] += 1
+
+    def rx(self, kind, nbytes):
+        self._count('rx', kind, nbytes)
+
+    def tx(self, kind, nbytes):
+        self._count('tx', kind, nbytes)
+
+    def response(self, seconds):
+        with self._lock:
+            self._response_ms.append(seconds * 1000.0)
+
+    def snapshot(self, reset=False, extra=None):
+        now = time.monotonic()
+        with self._lock:
+            interval = max(now - self._window_start, 1e-9)
+            snap = {'uptime': round(now - self._start, 3), 'interval': round(interval, 3)}
+            for name in ('rx', 'tx'):
+                total, window = self._total[name], self._window[name]
+                snap[name] = {
+                    'bytes': total.bytes,
+                    'bytes_per_s': round(window.bytes / interval, 1),
+                    'messages': {
+                        kind: {'count': total.messages[kind],
+                               'per_s': round(window.messages[kind] / interval, 2)}
+                        for kind in sorted(total.messages)
+                    },
+                }
+            pct = percentiles(self._response_ms, (50, 90, 99))
+            snap['response_ms'] = {
+                'count': len(self._response_ms),
+                'p50': pct[50],
+                'p90': pct[90],
+                'p99': pct[99],
+                'max': max(self._response_ms) if self._response_ms else None,
+            }
+            if reset:
+                self._reset_window(now)
+        if extra:
+            snap.update(extra)
+        return snap
+
+
+class _Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        for line in self.rfile:
+            line = line.strip()
+            if not line:
+                continue
+            try:
+                cmd = json.loads(line)
+                if not isinstance(cmd, dict):
+                    raise ValueError('command must be a JSON object')
+                resp = self.server.handler(cmd)
+            except (ValueError, KeyError, TypeError) as e:
+                resp = {'error': str(e)}
+            self.wfile.write((json.dumps(resp) + '\n').encode('utf-8'))
+
+
+class _Server(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+
+class Server:
+    """Serves handler(command dict) -> response dict on an abstract Unix
+    socket named name, from a background thread."""
+
+    def __init__(self, handler, name=CONTROL_DESC):
+        self._server = _Server('\0' + name, _Handler)
+        self._server.handler = handler
+        self._thread = threading.Thread(target=self._server.serve_forever, daemon=True)
+        self._thread.start()
+
+    def close(self):
+        self._server.shutdown()
+        self._server.server_close()
+
+
+class Client:
+    def __init__(self, name=CONTROL_DESC, timeout=10.0):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.settimeout(timeout)
+        self._sock.connect('\0' + name)
+        self._rfile = self._sock.makefile('rb')
+
+    def call(self, cmd):
+        self._sock.sendall((json.dumps(cmd) + '\n').encode('utf-8'))
+        line = self._rfile.readline()
+        if not line:
+            raise ConnectionError('control socket closed')
+        resp = json.loads(line)
+        if 'error' in resp:
+            raise ValueError(resp['error'])
+        return resp
+
+    def metrics(self, reset=False):
+        return self.call({'metrics': {'reset': reset}})
+
+    def set(self, **changes):
+        return self.call({'set': changes})
+
+    def close(self):
+        self._rfile.close()
+        self._sock.close()
+
+
+def _sample_rate(snap):
+    m = snap['tx']['messages'].get('sample')
+    return m['per_s'] if m else 0.0
+
+
+def ramp(c, args):
+    """Steps the telemetry rate from start to stop by factor, dwelling at
+    each step; returns the rows printed."""
+    if args.start < 1:
+        raise ValueError('--start must be at least 1')
+    rows = []
+    saturated = 0
+    rate = args.start
+    print("%8s %10s %7s %12s %10s %8s %8s" %
+          ('RATE', 'SAMPLES/S', 'RATIO', 'TX BYTES/S', 'QUEUED', 'P99 MS', 'LATE'))
+    while rate <= args.stop:
+        c.set(telemetry_rate=rate)
+        # settle, then measure a clean window
+        time.sleep(min(1.0, args.dwell / 4))
+        before = c.metrics(reset=True)
+        time.sleep(args.dwell)
+        snap = c.metrics(reset=True)
+
+        achieved = _sample_rate(snap)
+        ratio = achieved / rate
+        late = snap.get('replay', {}).get('late', 0) - before.get('replay', {}).get('late', 0)
+        row = {
+            'rate': rate,
+            'samples_per_s': achieved,
+            'ratio': round(ratio, 3),
+            'tx_bytes_per_s': snap['tx']['bytes_per_s'],
+            'queued': snap.get('queue', {}).get('client_bytes'),
+            'response_p99_ms': snap['response_ms']['p99'],
+            'late': late,
+        }
+        rows.append(row)
+        print("%8d %10.1f %7.3f %12.0f %10s %8s %8d" %
+              (rate, achieved, ratio, row['tx_bytes_per_s'], row['queued'],
+               '-' if row['response_p99_ms'] is None else '%.1f' % row['response_p99_ms'], late))
+        sys.stdout.flush()
+
+        saturated = saturated + 1 if ratio < SATURATED else 0
+        if saturated >= 2:
+            break
+        rate = max(rate + 1, int(rate * args.factor))
+
+    best = max(rows, key=lambda r: r['samples_per_s']) if rows else None
+    if best is not None:
+        print("RAMP: peak %.1f samples/s (%.0f bytes/s) at rate %d%s" %
+              (best['samples_per_s'], best['tx_bytes_per_s'], best['rate'],
+               ', saturated' if saturated >= 2 else ''))
+    return rows
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Control a running fakedevice.py.")
+    parser.add_argument('--control', default=CONTROL_DESC,
+                        help='control socket name (default %s)' % CONTROL_DESC)
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    m = sub.add_parser('metrics', help='print a metrics snapshot')
+    m.add_argument('--reset', action='store_true', help='start a new metrics window')
+
+    sub.add_parser('get', help='print the current scenario')
+
+    s = sub.add_parser('set', help='change the scenario')
+    s.add_argument('changes', help='JSON object of changes')
+
+    for name in ('pause', 'resume'):
+        p = sub.add_parser(name, help='%s streams' % name)
+        p.add_argument('streams', nargs='+', help='telemetry and/or responses')
+
+    r = sub.add_parser('ramp', help='ramp the telemetry rate and report throughput')
+    r.add_argument('--start', type=int, default=10, help='first rate (default 10)')
+    r.add_argument('--stop', type=int, default=5000, help='last rate (default 5000)')
+    r.add_argument('--factor', type=float, default=1.5, help='rate multiplier per step (default 1.5)')
+    r.add_argument('--dwell', type=float, default=5.0, help='seconds per step (default 5)')
+    r.add_argument('--csv', metavar='FILE', help='also write the steps to FILE')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    try:
+        c = Client(args.control)
+    except OSError as e:
+        print("CONTROL: cannot connect to %s: %s" % (args.control, e))
+        return 1
+
+    try:
+        if args.cmd == 'metrics':
+            print(json.dumps(c.metrics(reset=args.reset), indent=2))
+        elif args.cmd == 'get':
+            print(json.dumps(c.call({'get': None}), indent=2))
+        elif args.cmd == 'set':
+            print(json.dumps(c.call({'set': json.loads(args.changes)}), indent=2))
+        elif args.cmd in ('pause', 'resume'):
+            print(json.dumps(c.call({'set': {args.cmd: args.streams}}), indent=2))
+        elif args.cmd == 'ramp':
+            before = c.call({'get': None})
+            try:
+                rows = ramp(c, args)
+            finally:
+                c.set(telemetry_rate=before['telemetry_rate'])
+            if args.csv:
+                with open(args.csv, 'w') as f:
+                    f.write(','.join(rows[0].keys()) + '\n' if rows else '')
+                    for row in rows:
+                        f.write(','.join('' if v is None else str(v) for v in row.values()) + '\n')
+    except (OSError, ValueError) as e:
+        print("CONTROL ERROR:", e)
+        return 1
+    finally:
+        c.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,407 @@
+#!/usr/bin/env python3
+
+# ecu.py is the simulator's OBD2 and CAN model. It holds a PID table
+# with a value generator per PID, polls the configured PIDs the way the
+# firmware does (one outstanding request at a time, most overdue PID
+# first), and runs every request, response and periodic broadcast frame
+# through a discrete event model of the CAN buses:
+#
+# - a frame occupies the bus for its bit time (11-bit ID, worst case
+#   bit stuffing), and when several frames are waiting the lowest CAN ID
+#   wins arbitration, so OBD2 traffic (0x7DF/0x7E8) queues behind the
+#   car's own broadcast frames;
+# - the ECU answers after a processing delay drawn from a log-normal
+#   distribution, occasionally much later, and not at all past the
+#   OBD2 P2 timeout.
+#
+# Time is the caller's (session time in fakedevice.py), so a run is
+# deterministic for a given seed and much faster than real time.
+#
+# Run as a script to find how many PIDs/s a bus sustains:
+#
+#   ./ecu.py --bench --rate 10 --can-load 0.3
+
+import argparse
+import collections
+import heapq
+import itertools
+import json
+import math
+import random
+import sys
+import time
+
+OBD2_REQUEST_ID = 0x7DF
+OBD2_RESPONSE_ID = 0x7E8
+
+# The firmware gives up on an OBD2 request after this long.
+P2_TIMEOUT_S = 0.050
+
+# Bits of an 11-bit ID data frame besides the data: those subject to
+# bit stuffing (SOF, arbitration, control, CRC) and those that aren't
+# (CRC delimiter, ACK, EOF, interframe space), and the worst case bit
+# stuffing factor applied to the stuffed part only.
+FRAME_STUFFED_BITS = 34
+FRAME_FIXED_BITS = 13
+STUFFING = 1.2
+
+DEFAULT_BITRATE = 500000
+
+# Broadcast periods picked for synthetic bus load, in seconds.
+BROADCAST_PERIODS = [0.010, 0.020, 0.050, 0.100, 0.200, 0.500, 1.0]
+
+# Standard mode 01 PIDs: (pid, name, units, min, max, prec, generator).
+# Generators are described in Pid.value.
+STANDARD_PIDS = [
+    (0x04, 'EngineLoad', '%', 0, 100, 0, ('walk', 35, 5)),
+    (0x05, 'EngineTemp', 'C', -40, 215, 0, ('warmup', 20, 90, 300)),
+    (0x0B, 'MAP', 'kPa', 0, 255, 0, ('sine', 60, 30, 7)),
+    (0x0C, 'RPM', 'rpm', 0, 10000, 0, ('rpm',)),
+    (0x0D, 'VehicleSpeed', 'kph', 0, 255, 0, ('speed',)),
+    (0x0F, 'IAT', 'C', -40, 215, 0, ('walk', 30, 0.5)),
+    (0x10, 'MAF', 'g/s', 0, 655, 2, ('sine', 40, 25, 5)),
+    (0x11, 'TPS', '%', 0, 100, 0, ('walk', 40, 10)),
+    (0x2F, 'FuelLevel', '%', 0, 100, 0, ('ramp', 80, -0.02)),
+    (0x42, 'Battery', 'V', 0, 65, 2, ('walk', 14.1, 0.05)),
+    (0x46, 'AmbientTemp', 'C', -40, 215, 0, ('const', 22)),
+    (0x5C, 'OilTemp', 'C', -40, 215, 0, ('warmup', 20, 105, 600)),
+]
+
+# Manufacturer (mode 22) PIDs added to fill large tables start here.
+EXTENDED_PID_BASE = 0x220000
+
+Frame = collections.namedtuple('Frame', ['can_id', 'dlc', 'bus', 'kind', 'data'])
+
+
+def frame_time(dlc, bitrate):
+    return ((FRAME_STUFFED_BITS + 8 * dlc) * STUFFING + FRAME_FIXED_BITS) / bitrate
+
+
+def _percentile(values, q):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * q))]
+
+
+class Pid:
+    def __init__(self, pid, name, units, mn, mx, prec, gen):
+        self.pid = pid
+        self.name = name
+        self.units = units
+        self.min = mn
+        self.max = mx
+        self.prec = prec
+        self.gen = gen
+        self._walk = None
+
+    def value(self, t, speed, rnd):
+        """Current value at session time t for a car doing speed kph.
+
+        ('const', v), ('sine', mid, amplitude, period_s),
+        ('walk', start, step) a clamped random walk per poll,
+        ('ramp', start, per_s), ('warmup', cold, hot, tau_s),
+        ('speed',) and ('rpm',) follow the car."""
+        kind = self.gen[0]
+        if kind == 'const':
+            v = self.gen[1]
+        elif kind == 'sine':
+            v = self.gen[1] + self.gen[2] * math.sin(2 * math.pi * t / self.gen[3] + self.pid)
+        elif kind == 'walk':
+            if self._walk is None:
+                self._walk = self.gen[1]
+            self._walk += rnd.uniform(-self.gen[2], self.gen[2])
+            v = self._walk
+        elif kind == 'ramp':
+            v = self.gen[1] + self.gen[2] * t
+        elif kind == 'warmup':
+            v = self.gen[2] - (self.gen[2] - self.gen[1]) * math.exp(-t / self.gen[3])
+        elif kind == 'speed':
+            v = speed
+        elif kind == 'rpm':
+            # Six gears, shifting every 35 kph.
+            gear = min(6, 1 + int(speed // 35))
+            v = 850 + speed * (110 - 14 * gear)
+        else:
+            v = 0
+        v = min(self.max, max(self.min, v))
+        if self._walk is not None:
+            self._walk = v
+        return round(v, self.prec)
+
+    def meta(self, rate):
+        return {'nm': self.name, 'ut': self.units, 'min': self.min, 'max': self.max,
+                'prec': self.prec, 'sr': rate, 'pid': self.pid}
+
+
+def pid_table(extended=0, seed=1):
+    """The standard PIDs plus extended synthetic mode 22 PIDs."""
+    rnd = random.Random(seed)
+    table = [Pid(*p) for p in STANDARD_PIDS]
+    for i in range(extended):
+        if rnd.random() < 0.5:
+            gen = ('sine', rnd.uniform(10, 90), rnd.uniform(1, 10), rnd.uniform(1, 30))
+        else:
+            gen = ('walk', rnd.uniform(10, 90), rnd.uniform(0.1, 2))
+        table.append(Pid(EXTENDED_PID_BASE + i, 'Ext%04X' % i, '', 0, 100, 1, gen))
+    return table
+
+
+def broadcast_frames(bus, load, bitrate, seed=1):
+    """Periodic (can_id, dlc, period_s) frames adding up to roughly
+    load (0-1) of the bus."""
+    rnd = random.Random(seed + bus)
+    frames = []
+    used = 0.0
+    ids = rnd.sample(range(0x080, 0x700), 0x680)
+    while ids and used < load:
+        dlc = rnd.choice([8, 8, 8, 6, 4])
+        period = rnd.choice(BROADCAST_PERIODS)
+        frames.append((ids.pop(), dlc, period))
+        used += frame_time(dlc, bitrate) / period
+    return frames
+
+
+class Bus:
+    def __init__(self, index, bitrate):
+        self.index = index
+        self.bitrate = bitrate
+        self.free_at = 0.0
+        self.pending = []
+        self.busy_s = 0.0
+        self.frames = 0
+
+    def next_start(self):
+        """(start time, frame, index) of the next transmission, or None."""
+        if not self.pending:
+            return None
+        start = max(self.free_at, min(ready for (ready, _) in self.pending))
+        ready = [(f.can_id, i) for i, (r, f) in enumerate(self.pending) if r <= start]
+        (_, i) = min(ready)
+        return (start, self.pending[i][1], i)
+
+
+class Ecu:
+    """OBD2 poller, ECU and CAN buses.
+
+    Every bus carries broadcast frames; OBD2 requests and responses go
+    over obd2_bus. configure() sets the polled PIDs and their sample rates; advance()
+    runs the model up to a session time; take_fresh() returns the PIDs
+    answered since the previous call."""
+
+    def __init__(self, table, bitrates=(DEFAULT_BITRATE,), can_load=0.0, obd2_bus=0,
+                 latency_ms=8.0, latency_sigma=0.5, slow_prob=0.01, slow_ms=40.0, seed=1):
+        self.table = {p.pid: p for p in table}
+        self.buses = [Bus(i, b) for (i, b) in enumerate(bitrates)]
+        self.obd2_bus = obd2_bus
+        self.latency_s = latency_ms / 1000.0
+        self.latency_sigma = latency_sigma
+        self.slow_prob = slow_prob
+        self.slow_s = slow_ms / 1000.0
+        self.rnd = random.Random(seed)
+
+        self.now = 0.0
+        self.speed = 0.0
+        self._seq = itertools.count()
+        self._events = []
+
+        for bus in self.buses:
+            for (can_id, dlc, period) in broadcast_frames(bus.index, can_load, bus.bitrate, seed):
+                self._push(self.rnd.uniform(0, period), 'broadcast', (bus.index, can_id, dlc, period))
+
+        self.enabled = False
+        self.rates = {}
+        self.configure([])
+
+    def _push(self, t, kind, arg):
+        heapq.heappush(self._events, (t, next(self._seq), kind, arg))
+
+    def configure(self, pids, enabled=True):
+        """pids is [(pid, rate)]; unknown PIDs are skipped."""
+        self.enabled = enabled
+        self.rates = collections.OrderedDict((pid, rate) for (pid, rate) in pids
+                                             if pid in self.table and rate > 0)
+        self.values = {pid: None for pid in self.rates}
+        self.due = {pid: self.now for pid in self.rates}
+        self._fresh = set()
+        self._outstanding = None
+        self._stats_reset(self.now)
+        if self.rates:
+            self._push(self.now, 'poll', None)
+
+    def channels(self):
+        return [self.table[pid] for pid in self.rates]
+
+    def _stats_reset(self, t):
+        self.stats_start = t
+        self.responses = {pid: 0 for pid in self.rates}
+        self.latencies = []
+        self.timeouts = 0
+        for bus in self.buses:
+            bus.busy_s = 0.0
+            bus.frames = 0
+
+    def advance(self, until, speed=None):
+        if speed is not None:
+            self.speed = speed
+        while True:
+            tx = None
+            for bus in self.buses:
+                n = bus.next_start()
+                if n is not None and (tx is None or n[0] < tx[1][0]):
+                    tx = (bus, n)
+            event_t = self._events[0][0] if self._events else math.inf
+
+            # Arrivals at or before a transmission start take part in
+            # its arbitration.
+            if tx is not None and tx[1][0] < event_t:
+                (bus, (start, frame, i)) = tx
+                if start >= until:
+                    break
+                del bus.pending[i]
+                end = start + frame_time(frame.dlc, bus.bitrate)
+                bus.free_at = end
+                bus.busy_s += end - start
+                bus.frames += 1
+                if frame.kind != 'broadcast':
+                    self._push(end, frame.kind + '_done', frame.data)
+            else:
+                if event_t >= until:
+                    break
+                (t, _, kind, arg) = heapq.heappop(self._events)
+                self._handle(t, kind, arg)
+        self.now = until
+
+    def _queue(self, t, frame):
+        self.buses[frame.bus].pending.append((t, frame))
+
+    def _handle(self, t, kind, arg):
+        if kind == 'broadcast':
+            (bus, can_id, dlc, period) = arg
+            self._queue(t, Frame(can_id, dlc, bus, 'broadcast', None))
+            self._push(t + period, kind, arg)
+        elif kind == 'poll':
+            self._poll(t)
+        elif kind == 'request_done':
+            (pid, gen, sent) = arg
+            delay = self.latency_s * self.rnd.lognormvariate(0, self.latency_sigma)
+            if self.rnd.random() < self.slow_prob:
+                delay += self.slow_s
+            self._push(t + delay, 'respond', arg)
+        elif kind == 'respond':
+            (pid, gen, sent) = arg
+            self._queue(t, Frame(OBD2_RESPONSE_ID, 8, self.obd2_bus, 'response', arg))
+        elif kind == 'response_done':
+            (pid, gen, sent) = arg
+            if self._outstanding is None or self._outstanding[:2] != (pid, gen):
+                # Late answer to a request that timed out.
+                return
+            self._outstanding = None
+            if pid in self.values:
+                self.values[pid] = self.table[pid].value(t, self.speed, self.rnd)
+                self.responses[pid] += 1
+                self._fresh.add(pid)
+            self.latencies.append(t - sent)
+            self._push(t, 'poll', None)
+        elif kind == 'timeout':
+            if self._outstanding is not None and self._outstanding[:2] == arg:
+                self._outstanding = None
+                self.timeouts += 1
+                self._push(t, 'poll', None)
+
+    def _poll(self, t):
+        if self._outstanding is not None or not self.enabled or not self.rates:
+            return
+        pid = min(self.due, key=self.due.get)
+        if self.due[pid] > t:
+            self._push(self.due[pid], 'poll', None)
+            return
+        # A PID that fell behind is rescheduled from now rather than
+        # polled back to back to catch up.
+        self.due[pid] = max(self.due[pid] + 1.0 / self.rates[pid], t)
+        gen = next(self._seq)
+        self._outstanding = (pid, gen, t)
+        self._queue(t, Frame(OBD2_REQUEST_ID, 8, self.obd2_bus, 'request', (pid, gen, t)))
+        self._push(t + P2_TIMEOUT_S, 'timeout', (pid, gen))
+
+    def take_fresh(self):
+        fresh = self._fresh
+        self._fresh = set()
+        return fresh
+
+    def stats(self, reset=False):
+        elapsed = max(self.now - self.stats_start, 1e-9)
+        requested = sum(self.rates.values())
+        achieved = sum(self.responses.values())
+        worst = min((self.responses[pid] / elapsed / rate for (pid, rate) in self.rates.items()),
+                    default=None)
+        s = {
+            'pids': len(self.rates),
+            'requested_pids_per_s': round(requested, 1),
+            'achieved_pids_per_s': round(achieved / elapsed, 1),
+            # Lowest achieved / requested rate over the polled PIDs.
+            'worst_rate_ratio': None if worst is None else round(worst, 3),
+            'timeouts': self.timeouts,
+            'latency_ms_p50': _ms(_percentile(self.latencies, 0.50)),
+            'latency_ms_p99': _ms(_percentile(self.latencies, 0.99)),
+            'bus_load': [round(b.busy_s / elapsed, 3) for b in self.buses],
+        }
+        if reset:
+            self._stats_reset(self.now)
+        return s
+
+
+def _ms(s):
+    return None if s is None else round(s * 1000.0, 2)
+
+
+def bench(args):
+    """Sweeps the number of polled PIDs and reports where the achieved
+    rate falls behind the requested one."""
+    table = pid_table(extended=args.max_pids, seed=args.seed)
+    counts = []
+    n = 1
+    while n <= args.max_pids:
+        counts.append(n)
+        n *= 2
+
+    for n in counts:
+        e = Ecu(table, bitrates=(args.bitrate,), can_load=args.can_load,
+                latency_ms=args.latency_ms, seed=args.seed)
+        e.configure([(p.pid, args.rate) for p in table[:n]])
+        start = time.monotonic()
+        t = 0.0
+        while t < args.seconds:
+            t += 0.1
+            e.advance(t, speed=100.0)
+        s = e.stats()
+        s['model_realtime_factor'] = round(args.seconds / (time.monotonic() - start), 1)
+        print(json.dumps(s))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulator OBD2/CAN ECU model.')
+    parser.add_argument('--bench', action='store_true',
+                        help='sweep the number of polled PIDs and report sustained rates')
+    parser.add_argument('--max-pids', type=int, default=256)
+    parser.add_argument('--rate', type=float, default=10.0,
+                        help='requested sample rate per PID in Hz (default 10)')
+    parser.add_argument('--bitrate', type=int, default=DEFAULT_BITRATE)
+    parser.add_argument('--can-load', type=float, default=0.3,
+                        help='bus load from broadcast frames, 0-1 (default 0.3)')
+    parser.add_argument('--latency-ms', type=float, default=8.0,
+                        help='median ECU response time (default 8)')
+    parser.add_argument('--seconds', type=float, default=60.0)
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    if args.bench:
+        bench(args)
+    else:
+        parser.print_usage()
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
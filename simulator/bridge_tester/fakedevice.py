@@ -1,28 +1,153 @@
 #!/usr/bin/env python3
 
-import socket
+import argparse
 import json
+import random
+import sys
+import threading
 import time
 
+import bridge
+import control
+import ecu
+import session
+import storage
+import tracks
+
 FRIENDLY_NAME = 'RaceCapture/Pro MK3'
 START_TIME = time.monotonic_ns()
 
-def read(sock):
+# Default position reported when no session is being replayed.
+DEFAULT_FIX = session.Fix(0.0, 37.7749, -122.4194, None, 0.0, 0.0)
+
+# Telemetry channels streamed while a session replays, in order:
+# (name, units, min, max, precision)
+TELEMETRY_CHANNELS = [
+    ('Interval', 'ms', 0, 0, 0),
+    ('Latitude', 'Degrees', -180.0, 180.0, 6),
+    ('Longitude', 'Degrees', -180.0, 180.0, 6),
+    ('Speed', 'kph', 0, 300, 2),
+    ('Altitude', 'm', -500, 9000, 1),
+    ('Heading', 'Deg', 0, 360, 1),
+    ('GPSSats', '', 0, 20, 0),
+]
+
+# Lap timing channels appended when a track database is loaded; see
+# tracks.LapTimer.channels.
+LAP_CHANNELS = [
+    ('LapCount', '', 0, 0, 0),
+    ('LapTime', 'Min', 0, 0, 4),
+    ('Sector', '', 0, 0, 0),
+    ('SectorTime', 'Min', 0, 0, 4),
+    ('CurrentLap', '', 0, 0, 0),
+    ('ElapsedTime', 'Min', 0, 0, 4),
+]
+
+# GPS sample rate advertised in capabilities.
+GPS_RATE = 1
+
+# CAN buses on the device; broadcast traffic runs on all of them and
+# OBD2 polling on the first.
+CAN_BUSES = 2
+
+_fix = DEFAULT_FIX
+_telemetry_rate = 0
+_lap_timer = None
+
+
+class Marker:
+    """A value streamed in place of channel's own, and when the first
+    sample carrying it was sent (CLOCK_REALTIME ns), to time samples to
+    the app's screen. The replay stamps the marker it actually sent, so
+    a new marker can't inherit the time of an old one."""
+
+    def __init__(self, channel, value):
+        self.channel = channel
+        self.value = value
+        self.sent_ns = None
+
+
+class Scenario:
+    """What the device does beyond answering commands, changeable while
+    it runs through the control socket (see control.py and
+    set_scenario)."""
+
+    STREAMS = ('telemetry', 'responses')
+
+    def __init__(self):
+        # Telemetry channel names to stream; None streams them all.
+        self.channels = None
+        self.paused = set()
+        # Injected errors: probabilities that a response is dropped,
+        # that a command is answered with a failure and that a line
+        # sent is garbled, and a delay added to every response.
+        self.drop = 0.0
+        self.fail = 0.0
+        self.corrupt = 0.0
+        self.delay_ms = 0.0
+        # Capability flags reported instead of the defaults.
+        self.flags = None
+        # The Marker streamed, if any.
+        self.marker = None
+        # Changes whenever the telemetry meta does.
+        self.gen = 0
+
+
+_scenario = Scenario()
+_metrics = control.Metrics()
+
+# Set by main for the control plane's metrics and speed changes.
+_client = None
+_replay = None
+
+# The SD card and script/track flash, with --storage.
+_storage = None
+
+# With --sample-log, a line per telemetry sample sent: its Interval
+# value in ms and when it was generated, in CLOCK_REALTIME ns, for
+# podium.py to time the app's uploads against.
+_sample_log = None
+
+# The ECU model is advanced by the replay thread and configured by
+# commands, under _ecu_lock. _ecu_gen changes with the OBD2 config so
+# the replay resends the telemetry meta.
+_ecu = None
+_ecu_gen = 0
+_ecu_lock = threading.Lock()
+
+def read(client):
     try:
-        res = sock.recv(4096)
-        return res.decode('utf-8')
-    except socket.error as e:
+        return client.read_line().decode('utf-8')
+    except bridge.BridgeError as e:
         print("DEVICE RECV ERROR:", e)
         return None
 
 
-def write(sock, s):
+def garble(s):
+    """Returns s with a stretch of it overwritten, keeping the line ending."""
+    body = s.rstrip('\r\n')
+    if not body:
+        return s
+    i = random.randrange(len(body))
+    n = random.randint(1, max(1, len(body) // 4))
+    return body[:i] + '#' * n + body[i + n:] + s[len(body):]
+
+
+def write(client, s, deliver_ns=None, kind='response'):
+    if _scenario.corrupt > 0 and random.random() < _scenario.corrupt:
+        s = garble(s)
     try:
-        sock.sendall(s.encode('utf-8'))
-        return True
-    except socket.error as e:
+        # The replay thread and the command loop share the client,
+        # which serializes sends.
+        if deliver_ns is None:
+            client.send(s)
+        else:
+            client.send_at(s, deliver_ns)
+    except bridge.BridgeError as e:
         print("DEVICE SEND ERROR:", e)
         return False
+    _metrics.tx(kind, len(s))
+    return True
 
 def version_info():
     return {
@@ -37,7 +162,211 @@ def uptime():
     now = time.monotonic_ns()
     return int((now - START_TIME) / 1000000000)
 
+def telemetry_channels():
+    if _lap_timer is not None:
+        return TELEMETRY_CHANNELS + LAP_CHANNELS
+    return TELEMETRY_CHANNELS
+
+
+def channel_names():
+    names = [c[0] for c in telemetry_channels()]
+    if _ecu is not None and _ecu.enabled:
+        names += [p.name for p in _ecu.channels()]
+    return names
+
+
+def telemetry_meta(rate):
+    meta = [
+        {'nm': nm, 'ut': ut, 'min': mn, 'max': mx, 'prec': prec, 'sr': rate}
+        for (nm, ut, mn, mx, prec) in telemetry_channels()
+    ]
+    if _ecu is not None and _ecu.enabled:
+        meta += [{'nm': p.name, 'ut': p.units, 'min': p.min, 'max': p.max, 'prec': p.prec,
+                  'sr': min(rate, _ecu.rates[p.pid])}
+                 for p in _ecu.channels()]
+    if _scenario.channels is not None:
+        meta = [m for m in meta if m['nm'] in _scenario.channels]
+    return {
+        's': {
+            't': 0,
+            'meta': meta,
+        },
+    }
+
+
+def telemetry_sample(tick, fix, marker=None):
+    values = [
+        int(fix.t * 1000),
+        round(fix.lat, 6),
+        round(fix.lon, 6),
+        round(fix.speed or 0.0, 2),
+        round(fix.alt or 0.0, 1),
+        round(fix.heading or 0.0, 1),
+        6,
+    ]
+    if _lap_timer is not None:
+        values += _lap_timer.channels(fix.t)
+    present = (1 << len(values)) - 1
+
+    # OBD2 channels are only present when the ECU answered since the
+    # previous sample, so a PID that can't keep up shows as gaps.
+    if _ecu is not None and _ecu.enabled:
+        fresh = _ecu.take_fresh()
+        for p in _ecu.channels():
+            v = _ecu.values[p.pid]
+            if p.pid in fresh:
+                present |= 1 << len(values)
+            values.append(v if v is not None else 0)
+
+    # The marker's channel goes away if the ECU is turned off.
+    if marker is not None and marker.channel in channel_names():
+        i = channel_names().index(marker.channel)
+        values[i] = marker.value
+        present |= 1 << i
+
+    if _scenario.channels is not None:
+        keep = [i for (i, nm) in enumerate(channel_names()) if nm in _scenario.channels]
+        values = [values[i] for i in keep]
+        present = sum(((present >> i) & 1) << j for (j, i) in enumerate(keep))
+
+    # Trailing bitmasks, 32 channels each, mark the channels present in
+    # this sample.
+    n = len(values)
+    for i in range(0, n, 32):
+        values.append((present >> i) & 0xffffffff)
+    return {'s': {'t': tick, 'd': values}}
+
+
+def replay(client, r, stats_interval, timed):
+    global _fix
+
+    seq = 0
+    owed = 0
+    sent_meta = None
+    last_stats = time.monotonic()
+    for fix in r:
+        _fix = fix
+
+        if _ecu is not None:
+            with _ecu_lock:
+                _ecu.advance(fix.t, fix.speed or 0.0)
+
+        if _lap_timer is not None:
+            for (kind, value) in _lap_timer.update(fix.t, fix.lat, fix.lon):
+                if kind == 'track':
+                    print("DEVICE TRACK: detected %d (%s)" % (value.id, value.name))
+                elif kind == 'lap':
+                    print("DEVICE LAP: lap %d %.3fs" % value)
+                elif kind == 'sector':
+                    print("DEVICE SECTOR: sector %d %.3fs" % (value[0] + 1, value[1]))
+
+        rate = _telemetry_rate
+        if rate > 0 and 'telemetry' not in _scenario.paused:
+            with _ecu_lock:
+                if sent_meta != (rate, _ecu_gen, _scenario.gen):
+                    if not write(client, json.dumps(telemetry_meta(rate)) + "\r\n", kind='meta'):
+                        return
+                    sent_meta = (rate, _ecu_gen, _scenario.gen)
+
+                # Telemetry can be slower than GPS, or (for load tests)
+                # faster, several samples per fix. What is owed (in
+                # units of 1/GPS rate samples) carries over, so any rate
+                # comes out exact, not rounded to a divisor or multiple
+                # of the GPS rate.
+                owed += rate
+                count = owed // r.rate
+                owed -= count * r.rate
+                for i in range(count):
+                    # Extra samples of a fix are spread over the time
+                    # to the next one, each with its own time.
+                    at = fix._replace(t=fix.t + i / rate) if i > 0 else fix
+                    marker = _scenario.marker
+                    sample = json.dumps(telemetry_sample(seq, at, marker)) + "\r\n"
+                    seq += 1
+                    # Timed clients leave the sample's spacing to the
+                    # bridge instead of this thread's wakeups.
+                    deliver_ns = r.deliver_ns(at) if timed else None
+                    if _sample_log is not None:
+                        # Logged before it is sent, so podium.py
+                        # never sees a sample first. A timed sample
+                        # is generated when it is due.
+                        gen_ns = time.time_ns()
+                        if deliver_ns is not None and deliver_ns > 0:
+                            gen_ns += deliver_ns - time.monotonic_ns()
+                        _sample_log.write('%d %d\n' % (int(at.t * 1000), gen_ns))
+                    if not write(client, sample, deliver_ns, kind='sample'):
+                        return
+                    if marker is not None and marker.sent_ns is None:
+                        sent_ns = time.time_ns()
+                        if deliver_ns is not None and deliver_ns > 0:
+                            sent_ns += deliver_ns - time.monotonic_ns()
+                        marker.sent_ns = sent_ns
+        else:
+            owed = 0
+
+        if stats_interval > 0 and time.monotonic() - last_stats >= stats_interval:
+            last_stats = time.monotonic()
+            print("DEVICE REPLAY:", json.dumps(r.stats()))
+            if _ecu is not None and _ecu.enabled:
+                with _ecu_lock:
+                    print("DEVICE OBD2:", json.dumps(_ecu.stats(reset=True)))
+
+    print("DEVICE REPLAY DONE:", json.dumps(r.stats()))
+
+
+def track_status():
+    if _lap_timer is None:
+        return {
+            'status': 0,
+            'valid': False,
+            'trackId': 0,
+            'inLap': 0,
+            'armed': 0,
+        }
+    return _lap_timer.status()
+
+
+def obd2_cfg():
+    if _ecu is None:
+        return {'en': 0, 'pids': []}
+    return {
+        'en': 1 if _ecu.enabled else 0,
+        'pids': [p.meta(_ecu.rates[p.pid]) for p in _ecu.channels()],
+    }
+
+
+def set_obd2_cfg(cfg):
+    global _ecu_gen
+
+    if _ecu is None:
+        return 0
+    pids = [(int(p['pid']), p.get('sr', 1)) for p in cfg.get('pids', [])]
+    _ecu.configure(pids, enabled=bool(cfg.get('en', 1)))
+    _ecu_gen += 1
+    return 1
+
+
+def can_cfg():
+    if _ecu is None:
+        return {'en': 0, 'baud': [], 'term': []}
+    return {
+        'en': 1,
+        'baud': [b.bitrate for b in _ecu.buses],
+        'term': [0 for _ in _ecu.buses],
+    }
+
+
+def set_can_cfg(cfg):
+    if _ecu is None:
+        return 0
+    for (bus, baud) in zip(_ecu.buses, cfg.get('baud', [])):
+        bus.bitrate = int(baud)
+    return 1
+
+
 def handle(msg):
+    global _telemetry_rate
+
     payload = json.loads(msg)
     resp = {}
 
@@ -52,7 +381,7 @@ def handle(msg):
     elif 'getCapabilities' in payload:
         resp = {
             'capabilities': {
-                'flags': [
+                'flags': _scenario.flags if _scenario.flags is not None else [
                     'activetrack',
                     'adc',
                     # 'bt',
@@ -84,7 +413,7 @@ def handle(msg):
                     'canChan': 1,
                 },
                 'sampleRates': {
-                    'gps': 1,
+                    'gps': GPS_RATE,
                     'sensor': 1,
                 },
                 'db': {
@@ -104,8 +433,8 @@ def handle(msg):
                 'GPS': {
                     'init': 1, # GPS_STATUS_PROVISIONED
                     'qual': 2, # GPS_QUALITY_3D
-                    'lat': 37.7749,
-                    'lon': -122.4194,
+                    'lat': _fix.lat,
+                    'lon': _fix.lon,
                     'sats': 6,
                     'DOP': 0.5, # "ideal"
                 },
@@ -114,60 +443,314 @@ def handle(msg):
                     'init': 0, # BT_STATUS_NOT_INIT
                 },
                 'logging': {
-                    'status': 3, # LOGGING_STATUS_CARD_NOT_PRESENT
+                    # LOGGING_STATUS_IDLE or LOGGING_STATUS_CARD_NOT_PRESENT
+                    'status': 0 if _storage is not None else 3,
                     'dur': 0,
                 },
-                'track': {
-                    'status': 0,
-                    'valid': False,
-                    'trackId': 0,
-                    'inLap': 0,
-                    'armed': 0,
-                },
+                'track': track_status(),
             },
         }
+    elif 'getObd2Cfg' in payload:
+        with _ecu_lock:
+            resp = {'obd2Cfg': obd2_cfg()}
+    elif 'setObd2Cfg' in payload:
+        with _ecu_lock:
+            resp = {'resp': set_obd2_cfg(payload['setObd2Cfg'] or {})}
+    elif 'getCanCfg' in payload:
+        with _ecu_lock:
+            resp = {'canCfg': can_cfg()}
+    elif 'setCanCfg' in payload:
+        with _ecu_lock:
+            resp = {'resp': set_can_cfg(payload['setCanCfg'] or {})}
+    elif 'setTelemetry' in payload:
+        _telemetry_rate = int((payload['setTelemetry'] or {}).get('rate', 0))
+        resp = {'resp': 1}
     return json.dumps(resp)
 
 
+def _probability(name, v):
+    v = float(v)
+    if not 0.0 <= v <= 1.0:
+        raise ValueError('%s must be between 0 and 1' % name)
+    return v
+
+
+def set_scenario(changes):
+    """Applies a control plane "set" command. Keys:
+
+    telemetry_rate   samples/s, also above the GPS rate (several per fix)
+    speed            replay speed multiplier, 0 for as fast as possible
+    position         {"lat": .., "lon": ..} reported without a session
+    gps_rate         GPS rate advertised in capabilities
+    flags            capability flags, null for the defaults
+    channels         telemetry channel names to stream, null for all
+    pause, resume    lists of streams: "telemetry", "responses"
+    errors           {"drop", "fail", "corrupt": probability, "delay_ms"}
+    marker           {"channel": .., "value": ..} streamed in place of
+                     the channel's value, null to stop; "get" reports
+                     when the first sample carrying it was sent
+    """
+    global _telemetry_rate, _fix, GPS_RATE
+
+    unknown = set(changes) - {'telemetry_rate', 'speed', 'position', 'gps_rate', 'flags',
+                              'channels', 'pause', 'resume', 'errors', 'marker'}
+    if unknown:
+        raise ValueError('unknown settings: %s' % ', '.join(sorted(unknown)))
+
+    for name in ('pause', 'resume'):
+        bad = set(changes.get(name) or []) - set(Scenario.STREAMS)
+        if bad:
+            raise ValueError('unknown streams: %s' % ', '.join(sorted(bad)))
+
+    if 'telemetry_rate' in changes:
+        rate = int(changes['telemetry_rate'])
+        if rate < 0:
+            raise ValueError('telemetry_rate must be >= 0')
+        _telemetry_rate = rate
+    if 'speed' in changes:
+        if _replay is None:
+            raise ValueError('speed needs a replayed session')
+        speed = float(changes['speed'])
+        if speed < 0:
+            raise ValueError('speed must be >= 0')
+        _replay.set_speed(speed, _fix.t)
+    if 'position' in changes:
+        if _replay is not None:
+            raise ValueError('the position comes from the replayed session')
+        pos = changes['position']
+        _fix = _fix._replace(lat=float(pos['lat']), lon=float(pos['lon']))
+    if 'gps_rate' in changes:
+        GPS_RATE = int(changes['gps_rate'])
+    if 'flags' in changes:
+        flags = changes['flags']
+        _scenario.flags = None if flags is None else [str(f) for f in flags]
+    if 'channels' in changes:
+        channels = changes['channels']
+        _scenario.channels = None if channels is None else set(channels)
+        _scenario.gen += 1
+    _scenario.paused |= set(changes.get('pause') or [])
+    _scenario.paused -= set(changes.get('resume') or [])
+    if 'errors' in changes:
+        errors = changes['errors']
+        for name in ('drop', 'fail', 'corrupt'):
+            if name in errors:
+                setattr(_scenario, name, _probability(name, errors[name]))
+        if 'delay_ms' in errors:
+            _scenario.delay_ms = max(0.0, float(errors['delay_ms']))
+    if 'marker' in changes:
+        marker = changes['marker']
+        if marker is not None:
+            if marker.get('channel') not in channel_names():
+                raise ValueError('unknown marker channel: %s' % marker.get('channel'))
+            marker = Marker(marker['channel'], float(marker['value']))
+        _scenario.marker = marker
+
+
+def scenario_state():
+    marker = _scenario.marker
+    return {
+        'telemetry_rate': _telemetry_rate,
+        'speed': _replay.speed if _replay is not None else None,
+        'position': {'lat': _fix.lat, 'lon': _fix.lon},
+        'gps_rate': GPS_RATE,
+        'flags': _scenario.flags,
+        'channels': sorted(_scenario.channels) if _scenario.channels is not None else None,
+        'available_channels': channel_names(),
+        'paused': sorted(_scenario.paused),
+        'marker': None if marker is None else {
+            'channel': marker.channel,
+            'value': marker.value,
+            'sent_ns': marker.sent_ns,
+        },
+        'errors': {
+            'drop': _scenario.drop,
+            'fail': _scenario.fail,
+            'corrupt': _scenario.corrupt,
+            'delay_ms': _scenario.delay_ms,
+        },
+    }
+
+
+def control_command(cmd):
+    """Handles a control plane command; see control.py."""
+    if 'metrics' in cmd:
+        extra = {'queue': {'client_bytes': _client.queued() if _client is not None else None}}
+        if _replay is not None:
+            extra['replay'] = _replay.stats()
+        if _ecu is not None and _ecu.enabled:
+            with _ecu_lock:
+                extra['obd2'] = _ecu.stats()
+        if _storage is not None:
+            extra['storage'] = dict(_storage.stats)
+        return _metrics.snapshot(bool((cmd['metrics'] or {}).get('reset')), extra)
+    if 'set' in cmd:
+        set_scenario(cmd['set'] or {})
+    elif 'get' not in cmd:
+        raise ValueError('unknown command')
+    return scenario_state()
+
+
+def command_kind(line):
+    try:
+        payload = json.loads(line)
+    except ValueError:
+        return 'invalid'
+    if not isinstance(payload, dict) or not payload:
+        return 'invalid'
+    return next(iter(payload))
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Fake RaceCapture device for the tty bridge.')
+    parser.add_argument('--session', metavar='FILE',
+                        help='replay GPS positions from a GPX or RaceCapture CSV log')
+    parser.add_argument('--gps-rate', type=int, default=10, choices=session.GPS_RATES,
+                        help='GPS sample rate in Hz (default 10)')
+    parser.add_argument('--speed', type=float, default=1.0,
+                        help='replay speed multiplier; 0 replays as fast as possible (default 1)')
+    parser.add_argument('--loop', action='store_true',
+                        help='restart the session when it ends')
+    parser.add_argument('--telemetry-rate', type=int, default=0,
+                        help='stream telemetry at this rate without waiting for setTelemetry')
+    parser.add_argument('--tracks', metavar='DB',
+                        help='track database used for track detection and lap timing')
+    parser.add_argument('--track-id', type=int,
+                        help='use this track from the database instead of auto-detecting')
+    parser.add_argument('--obd2', action='store_true',
+                        help='simulate an ECU answering OBD2 PIDs (configured with setObd2Cfg)')
+    parser.add_argument('--obd2-pids', type=int, default=0,
+                        help='extra manufacturer PIDs in the ECU PID table')
+    parser.add_argument('--obd2-poll', type=float, default=0,
+                        help='poll every PID in the table at this rate without waiting for setObd2Cfg')
+    parser.add_argument('--ecu-latency-ms', type=float, default=8.0,
+                        help='median ECU response time in ms (default 8)')
+    parser.add_argument('--can-bitrate', type=int, default=ecu.DEFAULT_BITRATE,
+                        help='CAN bitrate of every bus (default %d)' % ecu.DEFAULT_BITRATE)
+    parser.add_argument('--can-load', type=float, default=0.3,
+                        help='bus load from broadcast frames, 0-1 (default 0.3)')
+    parser.add_argument('--timed-lead-ms', type=float, default=0,
+                        help='send telemetry this far ahead, tagged with its due time, for the bridge '
+                             'to deliver on time (needs the timed_rx module parameter)')
+    parser.add_argument('--socket', default=bridge.SOCKET_DESC,
+                        help='bridge socket to connect to, for an instance created through configfs '
+                             '(default %s)' % bridge.SOCKET_DESC)
+    parser.add_argument('--storage', metavar='DIR',
+                        help='emulate the SD card and script/track flash in DIR: logs in DIR/logs for '
+                             'download, uploads to DIR/script.lua and DIR/tracks.jsonl (see storage.py)')
+    parser.add_argument('--log-mb', type=int, default=0,
+                        help='create a synthetic log of this many MiB in DIR/logs for --storage')
+    parser.add_argument('--commands', metavar='NAMES',
+                        help='on a bridge with several producers, take only the app commands by these '
+                             '(space separated) names, "*" for the ones no other producer takes, or '
+                             '"storage" for the --storage commands')
+    parser.add_argument('--reconnect', action='store_true',
+                        help='reconnect when the bridge drops the connection (needs libbridge_client.so)')
+    parser.add_argument('--sample-log', metavar='FILE',
+                        help='record when each telemetry sample was generated, for podium.py')
+    parser.add_argument('--stats-interval', type=float, default=10.0,
+                        help='seconds between replay statistics (0 disables)')
+    parser.add_argument('--control', default=control.CONTROL_DESC,
+                        help='control socket for runtime changes and metrics, see control.py '
+                             '(default %s; empty to disable)' % control.CONTROL_DESC)
+    return parser.parse_args()
+
+
 def main():
-    addr = b'\0bdr-pi-tty-bridge-socket'
+    global GPS_RATE, _telemetry_rate, _lap_timer, _ecu, _client, _replay, _storage, _sample_log
+
+    args = parse_args()
+
+    # before connecting, so a bad track id doesn't look like a device
+    # coming and going
+    if args.tracks:
+        db = tracks.TrackDb.load(args.tracks)
+        print("DEVICE TRACKS: loaded %d tracks" % len(db.tracks))
+        if args.track_id is not None and args.track_id not in db.tracks:
+            print("DEVICE TRACKS: no track %d in the database" % args.track_id)
+            return 1
+        _lap_timer = tracks.LapTimer(db, args.track_id)
 
-    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
     try:
-        sock.connect(addr)
-    except socket.error as e:
+        commands = ' '.join(storage.COMMANDS) if args.commands == 'storage' else args.commands
+        client = bridge.Client(args.socket, reconnect=args.reconnect, timed=args.timed_lead_ms > 0,
+                               commands=commands)
+    except bridge.BridgeError as e:
         print("connect error:", e)
-        return
+        return 1
+    print("DEVICE CONNECTED: %s client" % ("native" if bridge.Client.native() else "python"))
+    _client = client
+
+    if args.obd2:
+        table = ecu.pid_table(extended=args.obd2_pids)
+        _ecu = ecu.Ecu(table, bitrates=[args.can_bitrate] * CAN_BUSES, can_load=args.can_load,
+                       latency_ms=args.ecu_latency_ms)
+        _ecu.configure([(p.pid, args.obd2_poll) for p in table], enabled=args.obd2_poll > 0)
+        print("DEVICE OBD2: %d PIDs, %d CAN buses" % (len(table), CAN_BUSES))
+
+    if args.storage:
+        _storage = storage.Storage(args.storage, log_size=args.log_mb << 20)
+        print("DEVICE STORAGE: %s, %d logs" % (args.storage, len(_storage.logs)))
+
+    if args.sample_log:
+        # line buffered, so podium.py sees samples as they are sent
+        _sample_log = open(args.sample_log, 'w', buffering=1)
+
+    if args.session:
+        GPS_RATE = args.gps_rate
+        _telemetry_rate = args.telemetry_rate
+        r = _replay = session.Replay(args.session, rate=args.gps_rate, speed=args.speed, loop=args.loop,
+                                     lead=args.timed_lead_ms / 1000.0)
+        t = threading.Thread(target=replay, args=(client, r, args.stats_interval, args.timed_lead_ms > 0),
+                             daemon=True)
+        t.start()
+
+    server = None
+    if args.control:
+        try:
+            server = control.Server(control_command, args.control)
+            print("DEVICE CONTROL: listening on %s" % args.control)
+        except OSError as e:
+            print("DEVICE CONTROL: cannot listen on %s: %s" % (args.control, e))
 
     try:
-        buffer = None
         while True:
-            s = read(sock)
-            if s is None:
+            line = read(client)
+            if line is None:
                 return
+            received = time.monotonic()
+            kind = command_kind(line)
+            _metrics.rx(kind, len(line))
 
-            lines = s.split('\n')
-            lines.reverse()
-            while len(lines) > 1:
-                line = lines.pop()
-                if buffer:
-                    line = buffer + line
-                    buffer = None
-
+            bulk = kind in storage.BULK_COMMANDS
+            if not bulk:
                 print("DEVICE RECV: ", line.strip())
-                resp = handle(line)
-                print("DEVICE SEND: ", resp)
-                if not write(sock, resp+"\r\n"):
-                    break
-
-            if len(lines) == 1 and lines[0] != '':
-                # partial line received
-                buffer = lines[0]
+            if 'responses' in _scenario.paused or random.random() < _scenario.drop:
+                print("DEVICE DROP: ", kind)
+                continue
+            if _scenario.fail > 0 and random.random() < _scenario.fail:
+                resps = [json.dumps({'resp': -1})]
+            elif _storage is not None and kind in storage.COMMANDS:
+                resps = [json.dumps(m) for m in _storage.handle(json.loads(line))]
+                if kind == 'getLog':
+                    print("DEVICE SEND:  %d log chunks" % len(resps))
+                    bulk = True
+            else:
+                resps = [handle(line)]
+            if _scenario.delay_ms > 0:
+                time.sleep(_scenario.delay_ms / 1000.0)
+            if not bulk:
+                print("DEVICE SEND: ", ' '.join(resps))
+            if not all(write(client, resp+"\r\n", kind=kind) for resp in resps):
+                break
+            _metrics.response(time.monotonic() - received)
 
     finally:
         print("DEVICE CLOSE")
-        sock.close()
-
+        if server is not None:
+            server.close()
+        if _storage is not None:
+            _storage.close()
+        client.close()
 
 if __name__=="__main__":
-    main()
+    sys.exit(main())
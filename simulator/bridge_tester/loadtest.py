@@ -0,0 +1,800 @@
+#!/usr/bin/env python3
+"""Run a repeatable load test scenario through the tty bridge.
+
+Reads a JSON scenario, starts one fakedevice.py per simulated device
+on the bridge side and one app load generator per device on the tty
+side (each pinned to the scenario's cores), runs the scenario's
+events, and at the end collects the apps' measurements, the devices'
+control plane metrics and the module's counters from
+/proc/tty/driver/fake_racecap_tty. The results are checked against
+the scenario's SLOs and, given --baseline, compared with an earlier
+run saved with --save. The exit status is 0 only if every SLO holds
+and nothing regressed past --tolerance.
+
+  ./loadtest.py run scenarios/telemetry_500.json --save base.json
+  ./loadtest.py run scenarios/telemetry_500.json --baseline base.json
+
+A scenario (everything but duration is optional):
+
+  {
+    "name": "telemetry-500",
+    "duration": 30,           seconds measured, after
+    "warmup": 3,              seconds of unmeasured load
+    "devices": 2,             simulated devices, see below
+    "bridge": {"timed_rx": 1},
+                              configfs settings for each instance
+    "device": {"gps_rate": 50, "timed_lead_ms": 0, "obd2_poll": 0,
+               "args": []},   fakedevice.py options
+    "traffic": {"telemetry_rate": 500,
+                "command_rate": 20,
+                "mix": {"getStatus": 8, "getVer": 1, "getCapabilities": 1}},
+                              per device: samples/s the app asks for,
+                              commands/s it sends (one outstanding at a
+                              time, as the app does) and their weights
+    "link": {"delay_ms": 1, "drop": 0, "corrupt": 0, "fail": 0},
+                              device side errors, see control.py
+    "events": [{"at": 10, "action": "replug", "delay_ms": 500},
+               {"at": 15, "action": "reopen", "device": 1},
+               {"at": 20, "action": "set", "changes": {"telemetry_rate": 100}}],
+                              seconds from the start (warmup included),
+                              for every device unless one is given
+    "cpus": {"device": [2], "app": [3]},
+                              cores the device and app processes run on
+    "slo": {"rtt_p99_ms": {"max": 5}, "sample_ratio": {"min": 0.98}}
+  }
+
+With one device and no "bridge" settings the module's default
+instance is used. Otherwise an instance per device is created through
+configfs (as root) and removed afterwards. "devices" may instead list
+{"socket": .., "tty": ..} endpoints of an existing bridge.
+
+sample_ratio compares each app's sample rate with the rate in force
+over the measured window, weighted by time. "set" events that change
+telemetry_rate count from their time, and a replug or reopen counts as
+going back to the traffic rate, which the app asks for again when it
+reopens the tty.
+
+Metrics, for SLOs and baselines (see METRICS): the worst device's
+command round trip percentiles, telemetry rate and largest gap between
+samples, command timeouts and failures, the devices' own response
+times, and the module's receive latency and late timed frames over the
+measured window.
+"""
+
+import argparse
+import json
+import math
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial.serialposix
+
+import bridge
+import control
+
+PROC_PATH = '/proc/tty/driver/fake_racecap_tty'
+CONFIGFS_PATH = '/sys/kernel/config/fake_racecap_tty'
+REPLUG_PARAM = '/sys/module/fake_racecap_tty/parameters/replug'
+DEFAULT_TTY = '/dev/ttyUSB_FAKE_RACECAP0'
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# Responses the app waits for, by command; anything else that isn't
+# telemetry is taken as the response to the outstanding command.
+RESPONSE_KEYS = {
+    'getStatus': 'status',
+    'getVer': 'ver',
+    'getCapabilities': 'capabilities',
+    'getObd2Cfg': 'obd2Cfg',
+    'getCanCfg': 'canCfg',
+    'getLogList': 'logList',
+    'setTelemetry': 'resp',
+}
+
+DEFAULT_MIX = {'getStatus': 1}
+
+# A command unanswered for this long counts as a timeout.
+COMMAND_TIMEOUT = 1.0
+
+# How long to wait for a device's control socket after starting it.
+DEVICE_START_TIMEOUT = 10.0
+
+# Metric name -> (description, True if higher is better). Only these
+# are checked against SLOs and baselines.
+METRICS = {
+    'rtt_p50_ms': ('command round trip p50, worst device', False),
+    'rtt_p90_ms': ('command round trip p90, worst device', False),
+    'rtt_p99_ms': ('command round trip p99, worst device', False),
+    'commands_per_s': ('commands answered per second, all devices', True),
+    'command_timeouts': ('commands not answered in time', False),
+    'command_errors': ('commands answered with an error', False),
+    'samples_per_s': ('telemetry samples per second, worst device', True),
+    'sample_ratio': ('telemetry rate achieved / asked for, worst device', True),
+    'sample_gap_max_ms': ('longest gap between telemetry samples', False),
+    'recovery_max_ms': ('longest app recovery after a replug or reopen', False),
+    'device_response_p99_ms': ('device command handling p99, worst device', False),
+    'kernel_rx_p99_us': ('module receive latency p99 (bucket bound), worst instance', False),
+    'kernel_timed_past_due': ('timed frames delivered past due, all instances', False),
+}
+
+
+class ScenarioError(Exception):
+    pass
+
+
+# --- the app side ----------------------------------------------------
+
+class AppLink:
+    """The tty as the app sees it: lines in, JSON commands out, reopened
+    after a hangup."""
+
+    def __init__(self, tty):
+        self.tty = tty
+        self.ser = None
+        self._buf = b''
+
+    def open(self, deadline):
+        while True:
+            try:
+                self.ser = serial.serialposix.Serial(self.tty, timeout=0.005, write_timeout=1.0)
+                self._buf = b''
+                return True
+            except (serial.SerialException, OSError):
+                if time.monotonic() >= deadline:
+                    return False
+                time.sleep(0.01)
+
+    def close(self):
+        if self.ser is not None:
+            try:
+                self.ser.close()
+            except (serial.SerialException, OSError):
+                pass
+            self.ser = None
+
+    def send(self, msg):
+        self.ser.write((json.dumps(msg, separators=(',', ':')) + '\r\n').encode('utf-8'))
+
+    def readline(self):
+        """Returns the next line, or None if none arrived in time."""
+        i = self._buf.find(b'\n')
+        if i < 0:
+            data = self.ser.read(max(1, self.ser.in_waiting))
+            if not data:
+                return None
+            self._buf += data
+            i = self._buf.find(b'\n')
+            if i < 0:
+                return None
+        line, self._buf = self._buf[:i + 1], self._buf[i + 1:]
+        return line
+
+
+def run_app(args):
+    """The app load generator for one device; prints its results as
+    one JSON line."""
+    mix = json.loads(args.mix) if args.mix else DEFAULT_MIX
+    kinds = sorted(mix)
+    weights = [float(mix[k]) for k in kinds]
+    reopen_at = sorted(args.reopen_at or [])
+
+    start = time.monotonic()
+    measure_from = start + args.warmup
+    end = measure_from + args.duration
+
+    link = AppLink(args.tty)
+    if not link.open(start + DEVICE_START_TIMEOUT):
+        print(json.dumps({'error': 'cannot open %s' % args.tty}))
+        return 1
+
+    rtt = []
+    samples = 0
+    sample_gap = 0.0
+    last_sample = None
+    commands = timeouts = errors = 0
+    recoveries = []
+    outstanding = None
+    interval = 1.0 / args.command_rate if args.command_rate > 0 else None
+    next_cmd = start
+    lost_at = None
+
+    def restart():
+        # answered like any command, but not counted
+        link.send({'setTelemetry': {'rate': args.telemetry_rate}})
+        return ('setTelemetry', time.monotonic())
+
+    outstanding = restart()
+    while True:
+        now = time.monotonic()
+        if now >= end:
+            break
+
+        if reopen_at and now - start >= reopen_at[0]:
+            reopen_at.pop(0)
+            link.close()
+            lost_at = now
+
+        try:
+            if link.ser is None:
+                if not link.open(end):
+                    break
+                outstanding = restart()
+                last_sample = None
+                continue
+
+            if interval is not None and outstanding is None and now >= next_cmd:
+                kind = random.choices(kinds, weights)[0]
+                link.send({kind: None})
+                outstanding = (kind, now)
+                # Keep the schedule, but don't burst to catch up after
+                # a slow response.
+                next_cmd = max(next_cmd + interval, now)
+
+            line = link.readline()
+        except (serial.SerialException, OSError):
+            # hung up (replug); reopen as the app would
+            link.close()
+            if lost_at is None:
+                lost_at = now
+            continue
+
+        now = time.monotonic()
+        measuring = now >= measure_from
+        if line is not None:
+            if line.startswith(b'{"s":'):
+                if b'"meta"' not in line:
+                    if lost_at is not None:
+                        recoveries.append(now - lost_at)
+                        lost_at = None
+                    if measuring:
+                        samples += 1
+                        if last_sample is not None:
+                            sample_gap = max(sample_gap, now - last_sample)
+                    last_sample = now
+                continue
+            if outstanding is not None:
+                try:
+                    resp = json.loads(line)
+                except ValueError:
+                    resp = {}
+                kind, sent = outstanding
+                if isinstance(resp, dict) and (RESPONSE_KEYS.get(kind) in resp or 'resp' in resp):
+                    if lost_at is not None and args.telemetry_rate == 0:
+                        recoveries.append(now - lost_at)
+                        lost_at = None
+                    if measuring and sent >= measure_from and kind != 'setTelemetry':
+                        commands += 1
+                        rtt.append(now - sent)
+                        if resp.get('resp', 1) != 1:
+                            errors += 1
+                    outstanding = None
+
+        if outstanding is not None and now - outstanding[1] > COMMAND_TIMEOUT:
+            if measuring:
+                timeouts += 1
+            outstanding = None
+
+    link.close()
+    pct = control.percentiles(rtt, (50, 90, 99))
+    print(json.dumps({
+        'tty': args.tty,
+        'duration': args.duration,
+        'commands': commands,
+        'commands_per_s': round(commands / args.duration, 2),
+        'timeouts': timeouts,
+        'errors': errors,
+        'rtt_ms': {p: None if v is None else round(v * 1000, 3) for (p, v) in pct.items()},
+        'rtt_max_ms': round(max(rtt) * 1000, 3) if rtt else None,
+        'samples': samples,
+        'samples_per_s': round(samples / args.duration, 2),
+        'sample_gap_max_ms': round(sample_gap * 1000, 3),
+        'recovery_ms': [round(r * 1000, 1) for r in recoveries],
+    }))
+    return 0
+
+
+# --- the module ------------------------------------------------------
+
+def read_proc():
+    """Returns {socket name: {line tag: {key: value}}} from the module's
+    proc file, or None without the module."""
+    try:
+        with open(PROC_PATH) as f:
+            lines = f.read().splitlines()
+    except OSError:
+        return None
+
+    instances = {}
+    current = None
+    for line in lines:
+        m = re.match(r'^(\d+): socket:(\S+)', line)
+        if m:
+            current = instances.setdefault(m.group(2), {})
+            continue
+        if current is None or line.startswith('event:'):
+            continue
+        fields = line.split()
+        if not fields:
+            continue
+        tag = fields[0].split(':', 1)[0]
+        values = {}
+        for field in fields[1:]:
+            key, _, value = field.partition(':')
+            if key.startswith('<'):
+                key = key[1:]
+            try:
+                values[key] = int(value)
+            except ValueError:
+                values[key] = value
+        current[tag] = values
+    return instances
+
+
+def _hist_p99_us(before, after):
+    """p99 upper bound in us from the delta of two rx_hist_us lines."""
+    if not before or not after:
+        return None
+    buckets = sorted((int(k), after[k] - before.get(k, 0)) for k in after)
+    total = sum(n for (_, n) in buckets)
+    if total <= 0:
+        return None
+    want = math.ceil(total * 0.99)
+    seen = 0
+    for (bound, n) in buckets:
+        seen += n
+        if seen >= want:
+            return bound
+    return buckets[-1][0]
+
+
+def kernel_window(before, after, sockets):
+    """Counters over the measured window for the instances on sockets."""
+    if before is None or after is None:
+        return None
+    result = {}
+    for name in sockets:
+        b, a = before.get(name, {}), after.get(name, {})
+        if not a:
+            result[name] = None
+            continue
+        tx_b, tx_a = b.get('tx', {}), a.get('tx', {})
+        timed_b, timed_a = b.get('timed', {}), a.get('timed', {})
+        result[name] = {
+            'tx_bytes': tx_a.get('bytes', 0) - tx_b.get('bytes', 0),
+            'tx_sends': tx_a.get('sends', 0) - tx_b.get('sends', 0),
+            'rx_frames': a.get('rx', {}).get('count', 0) - b.get('rx', {}).get('count', 0),
+            'rx_p99_us': _hist_p99_us(b.get('rx_hist_us'), a.get('rx_hist_us')),
+            'timed_past_due': (timed_a.get('past_due', 0) - timed_b.get('past_due', 0)) if timed_a else None,
+        }
+    return result
+
+
+class Instances:
+    """Bridge endpoints for the scenario's devices: (socket, tty,
+    replug path), creating configfs instances if needed."""
+
+    def __init__(self, scenario):
+        self.created = []
+        self.endpoints = []
+
+        devices = scenario.get('devices', 1)
+        settings = scenario.get('bridge')
+        if isinstance(devices, list):
+            for d in devices:
+                self.endpoints.append((d['socket'], d['tty'], d.get('replug')))
+        elif devices == 1 and not settings:
+            self.endpoints.append((bridge.SOCKET_DESC, DEFAULT_TTY, REPLUG_PARAM))
+        else:
+            try:
+                for i in range(int(devices)):
+                    self.endpoints.append(self._create('loadtest%d' % i, settings or {}))
+            except OSError as e:
+                self.close()
+                raise ScenarioError('cannot create bridge instances in %s: %s' % (CONFIGFS_PATH, e))
+
+    def _create(self, name, settings):
+        path = os.path.join(CONFIGFS_PATH, name)
+        os.mkdir(path)
+        self.created.append(path)
+        for key, value in settings.items():
+            with open(os.path.join(path, key), 'w') as f:
+                f.write(str(value))
+        with open(os.path.join(path, 'enable'), 'w') as f:
+            f.write('1')
+        with open(os.path.join(path, 'socket')) as f:
+            sock = f.read().strip()
+        with open(os.path.join(path, 'tty')) as f:
+            tty = '/dev/' + f.read().strip()
+        return (sock, tty, os.path.join(path, 'replug'))
+
+    def close(self):
+        for path in reversed(self.created):
+            try:
+                os.rmdir(path)
+            except OSError as e:
+                print("LOADTEST: cannot remove %s: %s" % (path, e))
+        self.created = []
+
+
+# --- the orchestrator ------------------------------------------------
+
+def write_session(path):
+    """Writes a looping GPX lap (a 1km circle at 100km/h) to replay."""
+    lat0, lon0, radius = 37.7749, -122.4194, 160.0
+    points = 58  # ~21.6s around at 100 km/h, one fix per ~0.37s
+    with open(path, 'w') as f:
+        f.write('<?xml version="1.0"?>\n<gpx version="1.1"><trk><trkseg>\n')
+        t0 = 1700000000.0
+        for i in range(points + 1):
+            a = 2 * math.pi * i / points
+            lat = lat0 + radius * math.sin(a) / 111320.0
+            lon = lon0 + radius * math.cos(a) / (111320.0 * math.cos(math.radians(lat0)))
+            ts = time.strftime('%Y-%m-%dT%H:%M:%S', time.gmtime(t0 + i * 0.372))
+            ms = int(round((t0 + i * 0.372) % 1 * 1000))
+            f.write('<trkpt lat="%.7f" lon="%.7f"><time>%s.%03dZ</time></trkpt>\n' % (lat, lon, ts, ms))
+        f.write('</trkseg></trk></gpx>\n')
+
+
+def _pin(cpus):
+    if not cpus:
+        return None
+    return lambda: os.sched_setaffinity(0, cpus)
+
+
+def start_device(i, endpoint, scenario, run_dir):
+    sock = endpoint[0]
+    dev = scenario.get('device', {})
+    gps_rate = int(dev.get('gps_rate', 50))
+    session_path = os.path.join(run_dir, 'session.gpx')
+    if not os.path.exists(session_path):
+        write_session(session_path)
+
+    cmd = [sys.executable, os.path.join(HERE, 'fakedevice.py'),
+           '--session', session_path, '--loop', '--gps-rate', str(gps_rate),
+           '--socket', sock, '--control', 'loadtest-control-%d' % i, '--stats-interval', '0']
+    if dev.get('timed_lead_ms'):
+        cmd += ['--timed-lead-ms', str(dev['timed_lead_ms'])]
+    if dev.get('obd2_poll'):
+        cmd += ['--obd2', '--obd2-poll', str(dev['obd2_poll'])]
+    cmd += [str(a) for a in dev.get('args', [])]
+
+    log = open(os.path.join(run_dir, 'device%d.log' % i), 'w')
+    proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT, cwd=HERE,
+                            preexec_fn=_pin(scenario.get('cpus', {}).get('device')))
+    log.close()
+    return proc
+
+
+def connect_control(i, proc):
+    deadline = time.monotonic() + DEVICE_START_TIMEOUT
+    while True:
+        try:
+            return control.Client('loadtest-control-%d' % i)
+        except OSError:
+            if proc.poll() is not None or time.monotonic() >= deadline:
+                raise ScenarioError('device %d did not start (see device%d.log)' % (i, i))
+            time.sleep(0.05)
+
+
+def start_app(i, endpoint, scenario, run_dir):
+    traffic = scenario.get('traffic', {})
+    reopen = [str(e['at']) for e in scenario.get('events', [])
+              if e.get('action') == 'reopen' and e.get('device', i) == i]
+    cmd = [sys.executable, os.path.abspath(__file__), 'app',
+           '--tty', endpoint[1],
+           '--duration', str(scenario['duration']),
+           '--warmup', str(scenario.get('warmup', 2)),
+           '--telemetry-rate', str(traffic.get('telemetry_rate', 0)),
+           '--command-rate', str(traffic.get('command_rate', 0)),
+           '--mix', json.dumps(traffic.get('mix', DEFAULT_MIX))]
+    if reopen:
+        cmd += ['--reopen-at'] + reopen
+    out = open(os.path.join(run_dir, 'app%d.json' % i), 'w+')
+    proc = subprocess.Popen(cmd, stdout=out, stderr=subprocess.STDOUT, cwd=HERE,
+                            preexec_fn=_pin(scenario.get('cpus', {}).get('app')))
+    return proc, out
+
+
+def run_event(event, endpoints, controls):
+    action = event.get('action')
+    targets = [event['device']] if 'device' in event else range(len(endpoints))
+    for i in targets:
+        if action == 'replug':
+            path = endpoints[i][2]
+            if path is None:
+                raise ScenarioError('device %d has no replug path' % i)
+            with open(path, 'w') as f:
+                f.write(str(int(event.get('delay_ms', 500))))
+        elif action == 'set':
+            controls[i].set(**event['changes'])
+        # reopen is run by the app itself
+    print("LOADTEST: %6.1fs %s%s" % (event['at'], action,
+                                     '' if 'device' not in event else ' device %d' % event['device']))
+
+
+def summarize(apps, devices, kernel):
+    """Reduces the per-device results to METRICS."""
+    rtt = [a['rtt_ms'] for a in apps]
+
+    def worst(values, higher_is_better):
+        values = [v for v in values if v is not None]
+        if not values:
+            return None
+        return min(values) if higher_is_better else max(values)
+
+    metrics = {
+        # percentiles of the merged samples aren't recoverable from the
+        # per device ones; the worst device bounds them
+        'rtt_p50_ms': worst([r['50'] for r in rtt], False),
+        'rtt_p90_ms': worst([r['90'] for r in rtt], False),
+        'rtt_p99_ms': worst([r['99'] for r in rtt], False),
+        'commands_per_s': round(sum(a['commands_per_s'] for a in apps), 2),
+        'command_timeouts': sum(a['timeouts'] for a in apps),
+        'command_errors': sum(a['errors'] for a in apps),
+        'samples_per_s': worst([a['samples_per_s'] for a in apps], True),
+        'sample_ratio': worst([a.get('sample_ratio') for a in apps], True),
+        'sample_gap_max_ms': worst([a['sample_gap_max_ms'] for a in apps], False),
+        'recovery_max_ms': worst([max(a['recovery_ms']) if a['recovery_ms'] else None for a in apps], False),
+        'device_response_p99_ms': worst([d['response_ms']['p99'] for d in devices if d], False),
+        'kernel_rx_p99_us': None,
+        'kernel_timed_past_due': None,
+    }
+    if kernel:
+        inst = [k for k in kernel.values() if k]
+        metrics['kernel_rx_p99_us'] = worst([k['rx_p99_us'] for k in inst], False)
+        past_due = [k['timed_past_due'] for k in inst if k['timed_past_due'] is not None]
+        metrics['kernel_timed_past_due'] = sum(past_due) if past_due else None
+    return metrics
+
+
+def check_slos(metrics, slos):
+    """Returns [(metric, bound, value, ok)]."""
+    results = []
+    for name, bounds in sorted(slos.items()):
+        if name not in METRICS:
+            raise ScenarioError('unknown SLO metric %s' % name)
+        value = metrics.get(name)
+        for kind in ('min', 'max'):
+            if kind not in bounds:
+                continue
+            bound = bounds[kind]
+            ok = value is not None and (value >= bound if kind == 'min' else value <= bound)
+            results.append((name, '%s %s' % ('>=' if kind == 'min' else '<=', bound), value, ok))
+    return results
+
+
+def compare(metrics, baseline, tolerance):
+    """Returns [(metric, base, value, change, regressed)] for the
+    metrics both runs have."""
+    rows = []
+    for name, (_, higher_is_better) in METRICS.items():
+        base, value = baseline.get(name), metrics.get(name)
+        if base is None or value is None:
+            continue
+        change = (value - base) / abs(base) if base else (0.0 if value == base else math.inf)
+        worse = -change if higher_is_better else change
+        # counts that were zero regress on any increase
+        regressed = worse > tolerance if base else (value > base and not higher_is_better)
+        rows.append((name, base, value, change, regressed))
+    return rows
+
+
+def expected_rate(scenario, device, start, end):
+    """The telemetry rate device's app should see, averaged over the
+    seconds [start, end) of the run, given the scenario's events."""
+    base = scenario.get('traffic', {}).get('telemetry_rate', 0)
+    changes = []
+    for e in sorted(scenario.get('events', []), key=lambda e: e['at']):
+        if e.get('device', device) != device:
+            continue
+        if e.get('action') == 'set' and 'telemetry_rate' in e.get('changes', {}):
+            changes.append((float(e['at']), float(e['changes']['telemetry_rate'])))
+        elif e.get('action') in ('replug', 'reopen'):
+            # the app asks for its own rate again on reopening
+            changes.append((float(e['at']), float(base)))
+
+    rate = float(base)
+    total = 0.0
+    prev = start
+    for (at, new) in changes:
+        if at >= end:
+            break
+        if at > start:
+            total += rate * (at - prev)
+            prev = at
+        rate = new
+    total += rate * (end - prev)
+    return total / (end - start) if end > start else rate
+
+
+def _fmt(v):
+    if v is None:
+        return '-'
+    if isinstance(v, float):
+        return '%.3f' % v if abs(v) < 100 else '%.1f' % v
+    return str(v)
+
+
+def run(args):
+    with open(args.scenario) as f:
+        scenario = json.load(f)
+    if 'duration' not in scenario:
+        raise ScenarioError('the scenario has no duration')
+    name = scenario.get('name', os.path.splitext(os.path.basename(args.scenario))[0])
+    warmup = float(scenario.get('warmup', 2))
+    duration = float(scenario['duration'])
+    events = sorted(scenario.get('events', []), key=lambda e: e['at'])
+    available = os.sched_getaffinity(0)
+    for role, cpus in scenario.get('cpus', {}).items():
+        if not set(cpus) <= available:
+            raise ScenarioError('%s cpus %s are not all available (%s)' % (role, cpus, sorted(available)))
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    run_dir = args.run_dir or tempfile.mkdtemp(prefix='bdr-loadtest.')
+    os.makedirs(run_dir, exist_ok=True)
+    print("LOADTEST: %s, %gs + %gs warmup, logs in %s" % (name, duration, warmup, run_dir))
+
+    instances = Instances(scenario)
+    endpoints = instances.endpoints
+    sockets = [e[0] for e in endpoints]
+    device_procs, controls, apps = [], [], []
+    try:
+        for i, endpoint in enumerate(endpoints):
+            device_procs.append(start_device(i, endpoint, scenario, run_dir))
+        for i, proc in enumerate(device_procs):
+            controls.append(connect_control(i, proc))
+            if scenario.get('link'):
+                controls[i].set(errors=scenario['link'])
+
+        start = time.monotonic()
+        for i, endpoint in enumerate(endpoints):
+            apps.append(start_app(i, endpoint, scenario, run_dir))
+
+        # warmup, then the measured window, running events on time
+        pending = [e for e in events if e.get('action') != 'reopen']
+        for e in events:
+            if e.get('action') not in ('replug', 'reopen', 'set'):
+                raise ScenarioError('unknown event action %s' % e.get('action'))
+        proc_before = None
+        measuring = False
+        while any(p.poll() is None for (p, _) in apps):
+            now = time.monotonic() - start
+            if not measuring and now >= warmup:
+                proc_before = read_proc()
+                for c in controls:
+                    c.metrics(reset=True)
+                measuring = True
+            while pending and now >= pending[0]['at']:
+                run_event(pending.pop(0), endpoints, controls)
+            time.sleep(0.05)
+
+        proc_after = read_proc()
+        devices = [c.metrics(reset=True) for c in controls]
+    finally:
+        for c in controls:
+            c.close()
+        for p in device_procs:
+            p.terminate()
+        for p in device_procs:
+            try:
+                p.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                p.kill()
+        for (p, _) in apps:
+            if p.poll() is None:
+                p.kill()
+        instances.close()
+
+    results = []
+    for i, (p, out) in enumerate(apps):
+        out.seek(0)
+        lines = out.read().splitlines()
+        out.close()
+        try:
+            result = json.loads(lines[-1])
+        except (IndexError, ValueError):
+            raise ScenarioError('app %d failed (see app%d.json)' % (i, i))
+        if 'error' in result:
+            raise ScenarioError('app %d: %s' % (i, result['error']))
+        target_rate = expected_rate(scenario, i, warmup, warmup + duration)
+        if target_rate > 0:
+            result['sample_ratio'] = round(result['samples_per_s'] / target_rate, 4)
+        results.append(result)
+
+    kernel = kernel_window(proc_before, proc_after, sockets)
+    metrics = summarize(results, devices, kernel)
+
+    print()
+    print("%-8s %-22s %10s %10s %9s %9s %9s %8s %10s" %
+          ('DEVICE', 'TTY', 'SAMPLES/S', 'CMDS/S', 'P50 MS', 'P99 MS', 'GAP MS', 'TIMEOUT', 'KRX P99US'))
+    for i, r in enumerate(results):
+        k = (kernel or {}).get(sockets[i]) or {}
+        print("%-8d %-22s %10s %10s %9s %9s %9s %8d %10s" %
+              (i, r['tty'], _fmt(r['samples_per_s']), _fmt(r['commands_per_s']), _fmt(r['rtt_ms']['50']),
+               _fmt(r['rtt_ms']['99']), _fmt(r['sample_gap_max_ms']), r['timeouts'], _fmt(k.get('rx_p99_us'))))
+    if kernel is None:
+        print("LOADTEST: no module counters (%s not readable)" % PROC_PATH)
+
+    failed = False
+    slos = check_slos(metrics, scenario.get('slo', {}))
+    if slos:
+        print()
+        for (metric, bound, value, ok) in slos:
+            print("SLO %-4s %-24s %-12s %s" % ('ok' if ok else 'FAIL', metric, bound, _fmt(value)))
+            failed |= not ok
+
+    if baseline is not None:
+        print()
+        print("%-24s %12s %12s %9s" % ('VS BASELINE', 'BASE', 'NOW', 'CHANGE'))
+        for (metric, base, value, change, regressed) in compare(metrics, baseline['metrics'], args.tolerance):
+            print("%-24s %12s %12s %8s%% %s" % (metric, _fmt(base), _fmt(value),
+                                               '%+.1f' % (change * 100) if math.isfinite(change) else 'inf',
+                                               'REGRESSED' if regressed else ''))
+            failed |= regressed
+
+    report = {
+        'name': name,
+        'scenario': scenario,
+        'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'metrics': metrics,
+        'apps': results,
+        'devices': devices,
+        'kernel': kernel,
+        'passed': not failed,
+    }
+    with open(os.path.join(run_dir, 'report.json'), 'w') as f:
+        json.dump(report, f, indent=2)
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(report, f, indent=2)
+
+    print()
+    print("LOADTEST %s: %s" % ('PASS' if not failed else 'FAIL', name))
+    return 1 if failed else 0
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Run a load test scenario through the tty bridge.')
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    r = sub.add_parser('run', help='run a scenario')
+    r.add_argument('scenario', help='scenario JSON file')
+    r.add_argument('--baseline', metavar='FILE', help='compare with a report saved by --save')
+    r.add_argument('--save', metavar='FILE', help='save the report, e.g. as a baseline')
+    r.add_argument('--tolerance', type=float, default=0.1,
+                   help='fraction a metric may be worse than the baseline (default 0.1)')
+    r.add_argument('--run-dir', metavar='DIR', help='keep logs and the report here (default a temp dir)')
+
+    a = sub.add_parser('app', help='the app load generator for one device (run by "run")')
+    a.add_argument('--tty', default=DEFAULT_TTY)
+    a.add_argument('--duration', type=float, required=True)
+    a.add_argument('--warmup', type=float, default=2.0)
+    a.add_argument('--telemetry-rate', type=int, default=0)
+    a.add_argument('--command-rate', type=float, default=0)
+    a.add_argument('--mix', help='JSON object of command weights')
+    a.add_argument('--reopen-at', type=float, nargs='*', help='close and reopen the tty at these times')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    if args.cmd == 'app':
+        return run_app(args)
+    try:
+        return run(args)
+    except (ScenarioError, OSError, ValueError, KeyError) as e:
+        print("LOADTEST ERROR:", e)
+        return 2
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,654 @@
+#!/usr/bin/env python3
+"""A local stand-in for Podium's live telemetry ingest.
+
+The app streams live telemetry to Podium (the reason for the
+credential store stage 220 sets up and the keyring in
+bdr_racecapture.sh) over a TCP connection, one JSON message per line:
+an auth command naming the device, answered with a status, then the
+channel meta and one sample per line, as the device sends them to the
+app:
+
+  {"cmd": {"schemaVer": 2, "auth": {"deviceId": "..."}}}
+                                   answered {"status": "ok"}
+  {"s": {"meta": [{"nm": "Interval", ...}, ...]}}
+  {"s": {"t": 1234, "d": [...]}}
+
+serve accepts those connections and records when each sample arrives.
+The uplink, shared by every connection as the in-car hotspot is, is
+shaped with:
+
+  --rate-kbps    how fast the server reads; the receive buffer is kept
+                 small so a backlog builds up in the sender, as it does
+                 on a slow link
+  --latency-ms   added to every sample's arrival time, with a uniform
+  --jitter-ms    +/- jitter (arrivals stay in order)
+
+The latency only delays the recorded arrivals (and the auth answer),
+not TCP's round trips. To shape the round trips too, use tc netem on
+the interface and leave --latency-ms at 0.
+
+For end-to-end timing, run fakedevice.py with --sample-log. That
+records when each sample was generated: its Interval channel value
+and the CLOCK_REALTIME time. serve --generated matches arrivals
+against that log on the same channel. It then reports:
+
+  - the lag from generation to arrival
+  - the share of generated samples that got out
+  - the backlog: samples generated but not yet arrived
+
+Run serve on the same host as fakedevice.py, or on one with a
+synchronized clock.
+
+  ./fakedevice.py --session s.gpx --gps-rate 50 --sample-log /tmp/gen.log
+  ./podium.py serve --rate-kbps 256 --latency-ms 80 --jitter-ms 30 \\
+      --generated /tmp/gen.log --record /tmp/arrivals.csv --report /tmp/podium.json
+  ./podium.py forward --rate 50 --duration 60
+
+forward is a minimal app uplink for simulator runs without the app.
+It asks the tty for telemetry and uploads every sample. When the link
+falls behind it buffers up to --buffer-kb, then drops the oldest
+samples. It reconnects when the connection is lost.
+
+To measure the app itself, run serve on port 8080, on the Pi or on a
+laptop on its network. Then point the app's telemetry host at that
+machine with an /etc/hosts entry.
+"""
+
+import argparse
+import collections
+import json
+import random
+import socket
+import socketserver
+import sys
+import threading
+import time
+
+import control
+
+DEFAULT_PORT = 8080
+
+# Receive buffer of shaped connections, so that the backlog stays in
+# the sender rather than in this host's socket.
+SHAPED_RCVBUF = 16 * 1024
+
+# Bytes the uplink may burst above its rate, in seconds of rate.
+BURST_S = 0.1
+
+# Largest read while shaping, so the connections share the uplink.
+SHAPED_READ = 1024
+
+# Generated samples this far (in ms of Interval) behind the latest
+# arrival are given up on as never sent.
+GIVE_UP_MS = 600000
+
+# Lags kept for percentiles.
+MAX_LAG_SAMPLES = 1000000
+
+# The channel samples are matched on: fakedevice.py's Interval, or a
+# real device's GPS time.
+KEY_CHANNELS = ('Interval', 'Utc')
+
+# forward's connection timeouts and reconnect backoff, in seconds.
+CONNECT_TIMEOUT = 5.0
+RETRY_S = 1.0
+
+
+def percentile_summary(values):
+    pct = control.percentiles(values, (50, 90, 99))
+    return {
+        'p50': None if pct[50] is None else round(pct[50], 3),
+        'p90': None if pct[90] is None else round(pct[90], 3),
+        'p99': None if pct[99] is None else round(pct[99], 3),
+        'max': round(max(values), 3) if values else None,
+    }
+
+
+# --- the ingest ------------------------------------------------------
+
+class GenLog:
+    """Generation times from fakedevice.py --sample-log, read as the
+    file grows."""
+
+    def __init__(self, path):
+        self.path = path
+        self.generated = 0
+        self.given_up = 0
+        self._f = None
+        self._partial = ''
+        # Interval -> generation times, in generation order; more than
+        # one when samples are under a millisecond apart.
+        self._pending = collections.OrderedDict()
+
+    def poll(self):
+        if self._f is None:
+            try:
+                self._f = open(self.path)
+            except OSError:
+                return
+        lines = (self._partial + self._f.read()).split('\n')
+        self._partial = lines.pop()
+        for line in lines:
+            try:
+                (key, ns) = (int(f) for f in line.split())
+            except ValueError:
+                continue
+            self._pending.setdefault(key, collections.deque()).append(ns)
+            self.generated += 1
+
+    def match(self, key):
+        """Returns the generation time of the oldest unmatched sample
+        with this key, or None."""
+        if key not in self._pending:
+            self.poll()
+            if key not in self._pending:
+                return None
+        times = self._pending[key]
+        ns = times.popleft()
+        if not times:
+            del self._pending[key]
+        while self._pending:
+            oldest = next(iter(self._pending))
+            if oldest >= key - GIVE_UP_MS:
+                break
+            self.given_up += len(self._pending.pop(oldest))
+        return ns
+
+    def backlog(self):
+        """Samples generated but not (yet) arrived."""
+        self.poll()
+        return sum(len(t) for t in self._pending.values()) + self.given_up
+
+
+class _Window:
+    def __init__(self):
+        self.bytes = 0
+        self.samples = 0
+        self.lag_ms = []
+
+
+class Recorder:
+    """Arrivals from every connection; thread safe."""
+
+    def __init__(self, generated=None, record=None):
+        self._lock = threading.Lock()
+        self.gen = GenLog(generated) if generated else None
+        self._record = None
+        if record:
+            self._record = open(record, 'w')
+            self._record.write('arrival_ns,key,generated_ns,lag_ms,bytes\n')
+        self.connections = 0
+        self.devices = set()
+        self.metas = 0
+        self.samples = 0
+        self.matched = 0
+        self.invalid = 0
+        self.bytes = 0
+        self.first_ns = None
+        self.last_ns = None
+        self.gap_ns = 0
+        self._lag_ms = collections.deque(maxlen=MAX_LAG_SAMPLES)
+        self._window = _Window()
+        self._window_start = time.monotonic()
+
+    def connected(self, device):
+        with self._lock:
+            self.connections += 1
+            self.devices.add(device)
+
+    def meta(self):
+        with self._lock:
+            self.metas += 1
+
+    def bad_line(self):
+        with self._lock:
+            self.invalid += 1
+
+    def sample(self, arrival_ns, key, nbytes):
+        with self._lock:
+            self.samples += 1
+            self.bytes += nbytes
+            self._window.samples += 1
+            self._window.bytes += nbytes
+            if self.last_ns is not None:
+                self.gap_ns = max(self.gap_ns, arrival_ns - self.last_ns)
+            else:
+                self.first_ns = arrival_ns
+            self.last_ns = arrival_ns
+
+            gen_ns = None
+            lag_ms = None
+            if self.gen is not None and key is not None:
+                gen_ns = self.gen.match(key)
+            if gen_ns is not None:
+                self.matched += 1
+                lag_ms = (arrival_ns - gen_ns) / 1e6
+                self._lag_ms.append(lag_ms)
+                self._window.lag_ms.append(lag_ms)
+            if self._record is not None:
+                self._record.write('%d,%s,%s,%s,%d\n' % (
+                    arrival_ns, '' if key is None else key, '' if gen_ns is None else gen_ns,
+                    '' if lag_ms is None else '%.3f' % lag_ms, nbytes))
+
+    def window(self):
+        """A line of statistics since the previous call."""
+        with self._lock:
+            now = time.monotonic()
+            interval = max(now - self._window_start, 1e-9)
+            w, self._window, self._window_start = self._window, _Window(), now
+            line = '%.1f kbit/s, %.1f samples/s' % (w.bytes * 8 / interval / 1000.0, w.samples / interval)
+            if self.gen is not None:
+                pct = control.percentiles(w.lag_ms, (50, 99))
+                if w.lag_ms:
+                    line += ', lag p50 %.1f ms p99 %.1f ms' % (pct[50], pct[99])
+                line += ', backlog %d' % self.gen.backlog()
+            return line
+
+    def summary(self):
+        with self._lock:
+            span = (self.last_ns - self.first_ns) / 1e9 if self.samples > 1 else 0.0
+            out = {
+                'connections': self.connections,
+                'devices': sorted(self.devices),
+                'metas': self.metas,
+                'samples': self.samples,
+                'invalid': self.invalid,
+                'bytes': self.bytes,
+                'kbit_per_s': round(self.bytes * 8 / span / 1000.0, 2) if span else None,
+                'samples_per_s': round((self.samples - 1) / span, 2) if span else None,
+                'gap_max_ms': round(self.gap_ns / 1e6, 3),
+            }
+            if self.gen is not None:
+                backlog = self.gen.backlog()
+                out.update({
+                    'generated': self.gen.generated,
+                    'matched': self.matched,
+                    'delivered_ratio': round(self.matched / self.gen.generated, 4) if self.gen.generated else None,
+                    'backlog': backlog,
+                    'lag_ms': percentile_summary(list(self._lag_ms)),
+                })
+            return out
+
+    def close(self):
+        with self._lock:
+            if self._record is not None:
+                self._record.close()
+                self._record = None
+
+
+class Shaper:
+    """The uplink every connection shares: a token bucket of rate_kbps,
+    and the latency and jitter added to arrivals."""
+
+    def __init__(self, rate_kbps, latency_ms, jitter_ms):
+        self.rate = rate_kbps * 1000 / 8.0
+        self.latency_ns = int(latency_ms * 1e6)
+        self.jitter_ns = int(jitter_ms * 1e6)
+        self._lock = threading.Lock()
+        self._burst = max(self.rate * BURST_S, SHAPED_READ)
+        self._tokens = 0.0
+        self._last = time.monotonic()
+
+    def take(self, want):
+        """Waits until some of want bytes may be read; returns how many."""
+        if self.rate <= 0:
+            return want
+        while True:
+            with self._lock:
+                now = time.monotonic()
+                self._tokens = min(self._burst, self._tokens + (now - self._last) * self.rate)
+                self._last = now
+                if self._tokens >= 1:
+                    n = min(want, SHAPED_READ, int(self._tokens))
+                    self._tokens -= n
+                    return n
+                wait = (1 - self._tokens) / self.rate
+            time.sleep(max(wait, 0.001))
+
+    def refund(self, n):
+        if self.rate > 0 and n > 0:
+            with self._lock:
+                self._tokens = min(self._burst, self._tokens + n)
+
+    def delay_ns(self):
+        if self.jitter_ns <= 0:
+            return self.latency_ns
+        return max(0, self.latency_ns + random.randint(-self.jitter_ns, self.jitter_ns))
+
+
+def _send(conn, msg):
+    conn.sendall((json.dumps(msg, separators=(',', ':')) + '\n').encode('utf-8'))
+
+
+class _Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        conn = self.request
+        shaper = self.server.shaper
+        recorder = self.server.recorder
+        peer = '%s:%d' % self.client_address[:2]
+        device = None
+        key_index = None
+        last_arrival = 0
+        buf = b''
+
+        while True:
+            want = shaper.take(65536)
+            try:
+                data = conn.recv(want)
+            except OSError:
+                data = b''
+            shaper.refund(want - len(data))
+            if not data:
+                break
+            arrival = max(last_arrival, time.time_ns() + shaper.delay_ns())
+            last_arrival = arrival
+            buf += data
+
+            while True:
+                i = buf.find(b'\n')
+                if i < 0:
+                    break
+                line, buf = buf[:i + 1], buf[i + 1:]
+                try:
+                    msg = json.loads(line)
+                except ValueError:
+                    msg = None
+                if not isinstance(msg, dict):
+                    if line.strip():
+                        recorder.bad_line()
+                    continue
+
+                if device is None:
+                    auth = (msg.get('cmd') or {}).get('auth') if isinstance(msg.get('cmd'), dict) else None
+                    device = (auth or {}).get('deviceId') if isinstance(auth, dict) else None
+                    if not device or (self.server.device_id and device != self.server.device_id):
+                        print("PODIUM AUTH: %s refused %r" % (peer, device))
+                        _send(conn, {'status': 'error', 'message': 'unknown device'})
+                        return
+                    # the answer comes back after a round trip
+                    time.sleep(2 * shaper.latency_ns / 1e9)
+                    _send(conn, {'status': 'ok'})
+                    recorder.connected(device)
+                    print("PODIUM AUTH: %s device %s" % (peer, device))
+                    continue
+
+                s = msg.get('s')
+                if not isinstance(s, dict):
+                    recorder.bad_line()
+                elif 'meta' in s:
+                    names = [m.get('nm') for m in s['meta'] if isinstance(m, dict)]
+                    key_index = next((names.index(k) for k in KEY_CHANNELS if k in names), None)
+                    recorder.meta()
+                elif isinstance(s.get('d'), list):
+                    d = s['d']
+                    key = None
+                    if key_index is not None and key_index < len(d):
+                        try:
+                            key = int(d[key_index])
+                        except (TypeError, ValueError):
+                            pass
+                    recorder.sample(arrival, key, len(line))
+                else:
+                    recorder.bad_line()
+
+        print("PODIUM CLOSE: %s" % peer)
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def __init__(self, addr, shaper, recorder, device_id=None):
+        self.shaper = shaper
+        self.recorder = recorder
+        self.device_id = device_id
+        super().__init__(addr, _Handler, bind_and_activate=False)
+        if shaper.rate > 0:
+            # set before listen() so accepted sockets get a small window
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, SHAPED_RCVBUF)
+        try:
+            self.server_bind()
+            self.server_activate()
+        except OSError:
+            self.server_close()
+            raise
+
+
+def run_serve(args):
+    shaper = Shaper(args.rate_kbps, args.latency_ms, args.jitter_ms)
+    recorder = Recorder(args.generated, args.record)
+    try:
+        server = Server((args.host, args.port), shaper, recorder, args.device_id)
+    except OSError as e:
+        print("PODIUM: cannot listen on %s:%d: %s" % (args.host, args.port, e))
+        return 2
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("PODIUM LISTEN: %s:%d, %s" % (
+        args.host, args.port,
+        '%g kbit/s' % args.rate_kbps if args.rate_kbps > 0 else 'unlimited',
+    ) + (', %g +/- %g ms' % (args.latency_ms, args.jitter_ms) if args.latency_ms or args.jitter_ms else ''))
+
+    end = time.monotonic() + args.duration if args.duration > 0 else None
+    try:
+        while end is None or time.monotonic() < end:
+            wait = args.stats_interval if args.stats_interval > 0 else 1.0
+            if end is not None:
+                wait = min(wait, max(0.0, end - time.monotonic()))
+            time.sleep(wait)
+            if args.stats_interval > 0:
+                print("PODIUM STATS:", recorder.window())
+                sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.shutdown()
+        server.server_close()
+
+    summary = recorder.summary()
+    recorder.close()
+    print("PODIUM SUMMARY:", json.dumps(summary))
+    if args.report:
+        with open(args.report, 'w') as f:
+            json.dump(summary, f, indent=2)
+            f.write('\n')
+    return 0
+
+
+# --- a stand-in for the app's uplink ---------------------------------
+
+class Uplink:
+    """The app's side of the connection: a bounded send buffer drained
+    into a non-blocking socket, reconnecting (and resending the meta)
+    when the connection is lost."""
+
+    def __init__(self, addr, device_id, buffer_bytes):
+        self.addr = addr
+        self.device_id = device_id
+        self.limit = buffer_bytes
+        self.sock = None
+        self.meta = None
+        self.queued = 0
+        self.sent = 0
+        self.dropped = 0
+        self.reconnects = 0
+        self._queue = collections.deque()
+        self._out = b''
+        self._out_meta = False
+        self._retry_at = 0.0
+
+    def _connect(self):
+        now = time.monotonic()
+        if now < self._retry_at:
+            return False
+        self._retry_at = now + RETRY_S
+        try:
+            sock = socket.create_connection(self.addr, timeout=CONNECT_TIMEOUT)
+            try:
+                auth = {'cmd': {'schemaVer': 2, 'auth': {'deviceId': self.device_id}}}
+                sock.sendall((json.dumps(auth) + '\n').encode('utf-8'))
+                resp = b''
+                while not resp.endswith(b'\n'):
+                    data = sock.recv(4096)
+                    if not data:
+                        raise OSError('connection closed during auth')
+                    resp += data
+                status = json.loads(resp).get('status')
+                if status != 'ok':
+                    raise OSError('auth refused: %s' % resp.decode('utf-8', 'replace').strip())
+                sock.setblocking(False)
+            except (OSError, ValueError, AttributeError):
+                sock.close()
+                raise
+        except (OSError, ValueError, AttributeError) as e:
+            print("APP UPLINK: %s:%d: %s" % (self.addr[0], self.addr[1], e))
+            return False
+        self.sock = sock
+        if self.meta is not None and not (self._queue and self._queue[0][1]):
+            self._queue.appendleft((self.meta, True))
+            self.queued += len(self.meta)
+        return True
+
+    def _lost(self):
+        self.sock.close()
+        self.sock = None
+        self.reconnects += 1
+        if self._out and not self._out_meta:
+            self.dropped += 1
+        self._out = b''
+
+    def push(self, line, is_meta):
+        if is_meta:
+            self.meta = line
+        self._queue.append((line, is_meta))
+        self.queued += len(line)
+        keep = None
+        while self.queued > self.limit and len(self._queue) > 1:
+            (data, meta) = self._queue.popleft()
+            self.queued -= len(data)
+            if meta:
+                keep = (data, meta)
+            else:
+                self.dropped += 1
+        if keep is not None:
+            # samples after a meta change need it
+            self._queue.appendleft(keep)
+            self.queued += len(keep[0])
+
+    def flush(self):
+        if self.sock is None and not self._connect():
+            return
+        while self._out or self._queue:
+            if not self._out:
+                (self._out, self._out_meta) = self._queue.popleft()
+                self.queued -= len(self._out)
+            try:
+                n = self.sock.send(self._out)
+            except BlockingIOError:
+                return
+            except OSError as e:
+                print("APP UPLINK: lost: %s" % e)
+                self._lost()
+                return
+            self._out = self._out[n:]
+            if not self._out and not self._out_meta:
+                self.sent += 1
+
+    def buffered(self):
+        return sum(1 for (_, meta) in self._queue if not meta)
+
+    def close(self):
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+
+
+def run_forward(args):
+    # the tty side is the load test's app link
+    import serial
+    import loadtest
+
+    uplink = Uplink((args.host, args.port), args.device_id, args.buffer_kb * 1024)
+    link = loadtest.AppLink(args.tty)
+    start = time.monotonic()
+    end = start + args.duration if args.duration > 0 else None
+    samples = 0
+
+    try:
+        while end is None or time.monotonic() < end:
+            try:
+                if link.ser is None:
+                    if not link.open(time.monotonic() + loadtest.DEVICE_START_TIMEOUT):
+                        print("APP: cannot open %s" % args.tty)
+                        return 1
+                    link.send({'setTelemetry': {'rate': args.rate}})
+                line = link.readline()
+            except (serial.SerialException, OSError):
+                # hung up; reopen as the app would
+                link.close()
+                continue
+            if line is not None and line.startswith(b'{"s":'):
+                is_meta = b'"meta"' in line
+                if not is_meta:
+                    samples += 1
+                uplink.push(line.rstrip(b'\r\n') + b'\n', is_meta)
+            uplink.flush()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        link.close()
+        uplink.close()
+
+    print(json.dumps({
+        'samples': samples,
+        'sent': uplink.sent,
+        'dropped': uplink.dropped,
+        'buffered': uplink.buffered(),
+        'reconnects': uplink.reconnects,
+    }))
+    return 0
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Local stand-in for Podium live telemetry.')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('serve', help='accept telemetry uploads over a shaped uplink')
+    p.add_argument('--host', default='0.0.0.0', help='address to listen on (default all)')
+    p.add_argument('--port', type=int, default=DEFAULT_PORT,
+                   help='port to listen on (default %d)' % DEFAULT_PORT)
+    p.add_argument('--device-id', help='accept only this device id (default any)')
+    p.add_argument('--rate-kbps', type=float, default=0,
+                   help='uplink bandwidth in kbit/s, shared by all connections (default unlimited)')
+    p.add_argument('--latency-ms', type=float, default=0, help='one way uplink latency')
+    p.add_argument('--jitter-ms', type=float, default=0, help='uniform +/- jitter on the latency')
+    p.add_argument('--generated', metavar='FILE',
+                   help="fakedevice.py's --sample-log, to time samples from generation to arrival")
+    p.add_argument('--record', metavar='FILE', help='write every arrival to this CSV file')
+    p.add_argument('--report', metavar='FILE', help='write the summary to this JSON file')
+    p.add_argument('--duration', type=float, default=0,
+                   help='seconds to run (default until interrupted)')
+    p.add_argument('--stats-interval', type=float, default=5.0,
+                   help='seconds between statistics (0 disables)')
+
+    p = sub.add_parser('forward', help='upload telemetry from the tty as the app does')
+    p.add_argument('--tty', default='/dev/ttyUSB_FAKE_RACECAP0', help='tty to read telemetry from')
+    p.add_argument('--rate', type=int, default=50, help='telemetry rate to ask the device for (default 50)')
+    p.add_argument('--host', default='127.0.0.1', help='ingest to upload to (default 127.0.0.1)')
+    p.add_argument('--port', type=int, default=DEFAULT_PORT)
+    p.add_argument('--device-id', default='fakedevice', help='device id to authenticate with')
+    p.add_argument('--buffer-kb', type=int, default=256,
+                   help='samples buffered while the link is behind before the oldest are dropped')
+    p.add_argument('--duration', type=float, default=0,
+                   help='seconds to run (default until interrupted)')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    if args.command == 'serve':
+        return run_serve(args)
+    return run_forward(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
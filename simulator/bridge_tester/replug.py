@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""Measure how fast the app recovers from an emulated cable yank.
+
+Acts as the device (answering commands like fakedevice.py) and
+repeatedly hangs up and replugs the fake tty through the module's
+replug parameter, or by dropping the bridge connection when the module
+was loaded with hangup_on_disconnect=1 replug_delay_ms=N. For each
+cycle it reports, relative to the kernel's replug event, when the app
+reopened the tty, when the app's first command arrived and when the
+response to it was sent.
+
+All timestamps are CLOCK_MONOTONIC, shared by the kernel events in
+/proc/tty/driver/fake_racecap_tty and time.monotonic_ns().
+
+For an instance created through configfs pass its --minor, --socket
+and --replug-path (/sys/kernel/config/fake_racecap_tty/<name>/replug).
+"""
+
+import argparse
+import statistics
+import sys
+import time
+
+import bridge
+import fakedevice
+
+PROC_PATH = '/proc/tty/driver/fake_racecap_tty'
+REPLUG_PARAM = '/sys/module/fake_racecap_tty/parameters/replug'
+
+
+def read_events(minor):
+    """Returns [(seq, ns, name)] from the event ring of instance minor."""
+    events = []
+    header = '%d:' % minor
+    current = False
+    with open(PROC_PATH) as f:
+        for line in f:
+            if line[:1].isdigit():
+                current = line.split(None, 1)[0] == header
+                continue
+            if not current or not line.startswith('event:'):
+                continue
+            seq, ns, name = line.split()
+            events.append((int(seq[len('event:'):]), int(ns[len('ns:'):]), name))
+    return events
+
+
+def last_seq(minor):
+    events = read_events(minor)
+    return events[-1][0] if events else -1
+
+
+def wait_event(minor, name, after, deadline):
+    """Waits for an event newer than seq after; returns (seq, ns) or None."""
+    while time.monotonic() < deadline:
+        for seq, ns, ev in read_events(minor):
+            if seq > after and ev == name:
+                return seq, ns
+        time.sleep(0.005)
+    return None
+
+
+def trigger_param(path, delay_ms):
+    with open(path, 'w') as f:
+        f.write(str(delay_ms))
+
+
+def connect(args):
+    return bridge.Client(args.socket, reconnect=False)
+
+
+def cycle(args, client):
+    """Runs one unplug/replug cycle; returns (client, result or None)."""
+    seq = last_seq(args.minor)
+
+    if args.disconnect:
+        client.close()
+        client = None
+    else:
+        trigger_param(args.replug_path, args.delay_ms)
+
+    deadline = time.monotonic() + args.timeout
+    replug = wait_event(args.minor, 'replug', seq, deadline)
+    if replug is None:
+        print("REPLUG: no replug event within %.1fs" % args.timeout)
+        if client is None:
+            # the next cycle needs a connection to drop
+            client = connect(args)
+        return client, None
+
+    if client is None:
+        client = connect(args)
+
+    opened = wait_event(args.minor, 'open', replug[0], deadline)
+
+    # Answer commands until the first one that parses; anything the app
+    # wrote before the hangup may still be in flight.
+    while True:
+        remaining = deadline - time.monotonic()
+        if remaining <= 0:
+            print("REPLUG: no command within %.1fs" % args.timeout)
+            return client, None
+        line = client.read_line(timeout=remaining)
+        if line is None:
+            continue
+        recv_ns = time.monotonic_ns()
+        try:
+            resp = fakedevice.handle(line.decode('utf-8'))
+        except ValueError:
+            continue
+        client.send(resp + "\r\n")
+        sent_ns = time.monotonic_ns()
+        break
+
+    base = replug[1]
+    return client, {
+        'open': (opened[1] - base) if opened else None,
+        'command': recv_ns - base,
+        'response': sent_ns - base,
+    }
+
+
+def ms(ns):
+    return '-' if ns is None else '%.1f' % (ns / 1e6)
+
+
+def summary(name, values):
+    values = sorted(v for v in values if v is not None)
+    if not values:
+        return
+    p99 = values[min(len(values) - 1, int(len(values) * 0.99))]
+    print("REPLUG %-9s min %8s ms  median %8s ms  p99 %8s ms  max %8s ms" %
+          (name, ms(values[0]), ms(statistics.median(values)), ms(p99), ms(values[-1])))
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Measure app recovery after an emulated unplug/replug.')
+    parser.add_argument('--iterations', type=int, default=10,
+                        help='number of unplug/replug cycles (default 10)')
+    parser.add_argument('--delay-ms', type=int, default=500,
+                        help='time the device stays unplugged (default 500)')
+    parser.add_argument('--interval', type=float, default=2.0,
+                        help='seconds between cycles (default 2)')
+    parser.add_argument('--timeout', type=float, default=30.0,
+                        help='seconds to wait for the app to recover (default 30)')
+    parser.add_argument('--disconnect', action='store_true',
+                        help='unplug by dropping the bridge connection instead of writing the replug '
+                             'parameter (needs hangup_on_disconnect=1 and replug_delay_ms)')
+    parser.add_argument('--minor', type=int, default=0,
+                        help='tty minor of the bridge instance (default 0)')
+    parser.add_argument('--socket', default=bridge.SOCKET_DESC,
+                        help='bridge socket of the instance (default %s)' % bridge.SOCKET_DESC)
+    parser.add_argument('--replug-path', default=REPLUG_PARAM,
+                        help='file to write the delay to (default %s)' % REPLUG_PARAM)
+    args = parser.parse_args()
+    if args.delay_ms < 0:
+        parser.error('--delay-ms must be >= 0 to get a replug event')
+    return args
+
+
+def main():
+    args = parse_args()
+
+    try:
+        client = connect(args)
+    except bridge.BridgeError as e:
+        print("connect error:", e)
+        return 1
+
+    results = []
+    failed = 0
+    try:
+        for i in range(args.iterations):
+            time.sleep(args.interval)
+            client, r = cycle(args, client)
+            if r is None:
+                failed += 1
+                continue
+            results.append(r)
+            print("REPLUG %d: open %s ms, first command %s ms, response %s ms" %
+                  (i, ms(r['open']), ms(r['command']), ms(r['response'])))
+    except (bridge.BridgeError, OSError) as e:
+        print("REPLUG ERROR:", e)
+        failed += 1
+    finally:
+        if client is not None:
+            client.close()
+
+    for key in ('open', 'command', 'response'):
+        summary(key, [r[key] for r in results])
+    print("REPLUG: %d recovered, %d failed" % (len(results), failed))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
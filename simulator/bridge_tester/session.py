@@ -0,0 +1,345 @@
+#!/usr/bin/env python3
+
+# session.py replays recorded GPS sessions (GPX tracks or RaceCapture
+# CSV logs) for fakedevice.py. Logs may be hours long, so they are
+# memory-mapped and parsed incrementally rather than loaded whole.
+# Fixes are interpolated to the configured GPS sample rate and paced
+# against the monotonic clock, optionally accelerated.
+
+import collections
+import csv
+import datetime
+import math
+import mmap
+import time
+import xml.etree.ElementTree as ET
+
+GPS_RATES = (10, 25, 50)
+
+EARTH_RADIUS_M = 6371000.0
+MPS_TO_KPH = 3.6
+
+# A single position sample. t is seconds since the start of the
+# session, speed is km/h and heading is degrees from north. alt,
+# speed and heading may be None when the source doesn't provide them.
+Fix = collections.namedtuple('Fix', ['t', 'lat', 'lon', 'alt', 'speed', 'heading'])
+
+
+def distance_m(lat1, lon1, lat2, lon2):
+    p1 = math.radians(lat1)
+    p2 = math.radians(lat2)
+    dp = p2 - p1
+    dl = math.radians(lon2 - lon1)
+    a = math.sin(dp / 2) ** 2 + math.cos(p1) * math.cos(p2) * math.sin(dl / 2) ** 2
+    return 2 * EARTH_RADIUS_M * math.asin(min(1.0, math.sqrt(a)))
+
+
+def bearing_deg(lat1, lon1, lat2, lon2):
+    p1 = math.radians(lat1)
+    p2 = math.radians(lat2)
+    dl = math.radians(lon2 - lon1)
+    y = math.sin(dl) * math.cos(p2)
+    x = math.cos(p1) * math.sin(p2) - math.sin(p1) * math.cos(p2) * math.cos(dl)
+    return (math.degrees(math.atan2(y, x)) + 360.0) % 360.0
+
+
+def _open_mapped(path):
+    f = open(path, 'rb')
+    try:
+        m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    except ValueError:
+        # empty file
+        f.close()
+        return None, None
+    try:
+        # Parsing is strictly sequential.
+        m.madvise(mmap.MADV_SEQUENTIAL)
+    except (AttributeError, OSError):
+        pass
+    return f, m
+
+
+def _parse_iso8601(s):
+    s = s.strip()
+    if s.endswith('Z'):
+        s = s[:-1] + '+00:00'
+    return datetime.datetime.fromisoformat(s).timestamp()
+
+
+def _strip_ns(tag):
+    return tag.rsplit('}', 1)[-1]
+
+
+def read_gpx(path):
+    """Yields Fix tuples from the trkpt elements of a GPX file."""
+    f, m = _open_mapped(path)
+    if m is None:
+        return
+
+    try:
+        start = None
+        for _, elem in ET.iterparse(m, events=('end',)):
+            if _strip_ns(elem.tag) != 'trkpt':
+                continue
+
+            ts = None
+            alt = None
+            speed = None
+            for child in elem:
+                name = _strip_ns(child.tag)
+                if name == 'time' and child.text:
+                    ts = _parse_iso8601(child.text)
+                elif name == 'ele' and child.text:
+                    alt = float(child.text)
+                elif name == 'speed' and child.text:
+                    # GPX 1.0 speed is in m/s
+                    speed = float(child.text) * MPS_TO_KPH
+
+            lat = float(elem.get('lat'))
+            lon = float(elem.get('lon'))
+
+            # Drop the element so memory stays flat on long tracks.
+            elem.clear()
+
+            if ts is None:
+                continue
+            if start is None:
+                start = ts
+            yield Fix(ts - start, lat, lon, alt, speed, None)
+    finally:
+        m.close()
+        f.close()
+
+
+# Column names accepted for each field, compared case-insensitively. The
+# RaceCapture names come first; the others cover generic exports.
+_CSV_COLUMNS = {
+    't': ('interval', 'utc', 'time', 'timestamp'),
+    'lat': ('latitude', 'lat'),
+    'lon': ('longitude', 'lon', 'lng'),
+    'alt': ('altitude', 'alt', 'elevation', 'ele'),
+    'speed': ('speed', 'gpsspeed'),
+    'heading': ('heading', 'course'),
+}
+
+
+def _csv_column_name(raw):
+    # RaceCapture headers look like "Latitude"|"Degrees"|-180.0|180.0|10
+    return raw.split('|', 1)[0].strip().strip('"').lower()
+
+
+def _csv_float(row, idx):
+    if idx is None or idx >= len(row):
+        return None
+    v = row[idx].strip()
+    if v == '':
+        return None
+    try:
+        return float(v)
+    except ValueError:
+        return None
+
+
+def read_csv(path):
+    """Yields Fix tuples from a RaceCapture (or similar) CSV log.
+
+    RaceCapture logs interleave channels sampled at different rates,
+    so rows without a position are skipped."""
+    f, m = _open_mapped(path)
+    if m is None:
+        return
+
+    try:
+        lines = (l.decode('utf-8') for l in iter(m.readline, b''))
+        reader = csv.reader(lines)
+
+        header = next(reader, None)
+        if header is None:
+            return
+
+        names = [_csv_column_name(h) for h in header]
+        cols = {}
+        for field, candidates in _CSV_COLUMNS.items():
+            cols[field] = next((names.index(c) for c in candidates if c in names), None)
+
+        if cols['lat'] is None or cols['lon'] is None:
+            raise ValueError('%s: no latitude/longitude columns' % path)
+
+        # Interval and Utc are in milliseconds; a generic time column
+        # is either seconds or an ISO-8601 timestamp.
+        t_scale = 1.0
+        if cols['t'] is not None and names[cols['t']] in ('interval', 'utc'):
+            t_scale = 0.001
+
+        start = None
+        n = 0
+        for row in reader:
+            lat = _csv_float(row, cols['lat'])
+            lon = _csv_float(row, cols['lon'])
+            if lat is None or lon is None or (lat == 0.0 and lon == 0.0):
+                continue
+
+            if cols['t'] is None:
+                # no time column: assume 10 Hz
+                ts = n / 10.0
+            else:
+                ts = _csv_float(row, cols['t'])
+                if ts is None:
+                    try:
+                        ts = _parse_iso8601(row[cols['t']])
+                    except (ValueError, IndexError):
+                        continue
+                else:
+                    ts *= t_scale
+            n += 1
+
+            if start is None:
+                start = ts
+            yield Fix(ts - start, lat, lon,
+                      _csv_float(row, cols['alt']),
+                      _csv_float(row, cols['speed']),
+                      _csv_float(row, cols['heading']))
+    finally:
+        m.close()
+        f.close()
+
+
+def read_session(path):
+    lower = path.lower()
+    if lower.endswith('.gpx'):
+        return read_gpx(path)
+    if lower.endswith('.csv') or lower.endswith('.log'):
+        return read_csv(path)
+    raise ValueError('%s: unknown session format (want .gpx or .csv)' % path)
+
+
+def _lerp(a, b, f):
+    if a is None or b is None:
+        return a if b is None else b
+    return a + (b - a) * f
+
+
+def _lerp_angle(a, b, f):
+    if a is None or b is None:
+        return a if b is None else b
+    d = ((b - a + 540.0) % 360.0) - 180.0
+    return (a + d * f) % 360.0
+
+
+def interpolate(fixes, rate):
+    """Resamples a stream of fixes to rate Hz.
+
+    Yields Fix tuples at t = 0, 1/rate, 2/rate, ... using linear
+    interpolation between the bracketing source fixes. Speed and
+    heading are derived from the source positions when absent. Only
+    two source fixes are held at a time."""
+    if rate <= 0:
+        raise ValueError('rate must be positive')
+
+    fixes = iter(fixes)
+    prev = next(fixes, None)
+    if prev is None:
+        return
+
+    step = 1.0 / rate
+    n = 0
+    for cur in fixes:
+        dt = cur.t - prev.t
+        if dt <= 0:
+            # duplicate or out of order sample
+            continue
+
+        speed_a, speed_b = prev.speed, cur.speed
+        heading_a, heading_b = prev.heading, cur.heading
+        if speed_a is None or speed_b is None or heading_a is None or heading_b is None:
+            seg_speed = distance_m(prev.lat, prev.lon, cur.lat, cur.lon) / dt * MPS_TO_KPH
+            seg_heading = bearing_deg(prev.lat, prev.lon, cur.lat, cur.lon)
+            if speed_a is None or speed_b is None:
+                speed_a = speed_b = seg_speed
+            if heading_a is None or heading_b is None:
+                heading_a = heading_b = seg_heading
+
+        t = n * step
+        while t <= cur.t:
+            f = (t - prev.t) / dt
+            yield Fix(t,
+                      prev.lat + (cur.lat - prev.lat) * f,
+                      prev.lon + (cur.lon - prev.lon) * f,
+                      _lerp(prev.alt, cur.alt, f),
+                      _lerp(speed_a, speed_b, f),
+                      _lerp_angle(heading_a, heading_b, f))
+            n += 1
+            t = n * step
+
+        prev = cur
+
+
+class Replay:
+    """Paces interpolated fixes against the monotonic clock.
+
+    speed is the playback multiplier (1.0 for real time, 10.0 to play
+    ten seconds of session per second); 0 disables pacing entirely.
+    If loop is set, the session restarts when it runs out and session
+    time keeps increasing across laps of the file. With a lead (in
+    seconds), fixes are yielded that much ahead of their due time, for
+    callers that schedule their delivery with deliver_ns()."""
+
+    def __init__(self, path, rate=10, speed=1.0, loop=False, lead=0.0):
+        if rate not in GPS_RATES:
+            raise ValueError('gps rate must be one of %s' % (GPS_RATES,))
+        self.path = path
+        self.rate = rate
+        self.speed = speed
+        self.loop = loop
+        self.lead = lead
+        self.start = None
+
+        self.samples = 0
+        self.late = 0
+        self.max_lag = 0.0
+
+    def _fixes(self):
+        offset = 0.0
+        while True:
+            last = None
+            for fix in interpolate(read_session(self.path), self.rate):
+                last = fix
+                yield fix._replace(t=fix.t + offset)
+            if not self.loop or last is None:
+                return
+            offset += last.t + 1.0 / self.rate
+
+    def __iter__(self):
+        self.start = time.monotonic()
+        for fix in self._fixes():
+            if self.speed > 0:
+                due = self.start + fix.t / self.speed - self.lead
+                delay = due - time.monotonic()
+                if delay > 0:
+                    time.sleep(delay)
+                else:
+                    self.late += 1
+                    self.max_lag = max(self.max_lag, -delay)
+            self.samples += 1
+            yield fix
+
+    def set_speed(self, speed, t):
+        """Changes the speed while replaying, carrying on from session
+        time t (that of the last fix yielded)."""
+        if self.start is not None and speed > 0:
+            self.start = time.monotonic() - t / speed
+        self.speed = speed
+
+    def deliver_ns(self, fix):
+        """Due time of fix on the time.monotonic_ns() clock, or 0 when
+        not pacing."""
+        if self.speed <= 0 or self.start is None:
+            return 0
+        return int((self.start + fix.t / self.speed) * 1e9)
+
+    def stats(self):
+        return {
+            'samples': self.samples,
+            'late': self.late,
+            'max_lag_ms': round(self.max_lag * 1000.0, 3),
+        }
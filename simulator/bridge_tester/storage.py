@@ -0,0 +1,359 @@
+#!/usr/bin/env python3
+
+# storage.py is the simulator's SD card and script/track flash: the
+# device side of the largest transfers the app makes, for benchmarking
+# sustained bulk throughput and flow control through the bridge.
+#
+# Logs (device -> app) are files in <dir>/logs, memory-mapped and sent
+# in base64 chunks, each with its CRC-32, over a sliding window the app
+# acknowledges:
+#
+#   > {"getLogList": null}
+#   < {"logList": {"files": [{"name": "sim_0001.log", "size": N, "crc": C}]}}
+#   > {"getLog": {"name": "sim_0001.log", "off": 0, "chunk": 4096, "win": 8}}
+#   < {"log": {"name": .., "off": 0, "len": 4096, "crc": .., "data": ".."}}
+#   < ... up to win chunks ahead of the last acknowledgement
+#   > {"logAck": {"name": .., "off": 4096}}           next offset wanted
+#   > {"logAck": {"name": .., "off": 4096, "nak": 1}}  resend from off
+#   < {"log": {..., "eof": 1}}                         last chunk
+#
+# Lua script and track database uploads (app -> device) use the
+# firmware's paged setScriptCfg and per-track setTrackDb commands, with
+# a CRC-32 of each page or track added, and land in memory-mapped files
+# that grow as needed:
+#
+#   > {"setScriptCfg": {"data": "..", "page": 0, "mode": 1, "crc": C}}
+#   < {"resp": 1}   or   {"resp": 0, "err": "crc", "page": 0}
+#   > {"setTrackDb": {"index": 0, "mode": 1, "track": {..}, "crc": C}}
+#   < {"resp": 1}
+#
+# Mode 1 is in progress and 2 completes the upload. bulk.py is the app
+# side.
+
+import base64
+import json
+import mmap
+import os
+import zlib
+
+SCRIPT_ADD_MODE_IN_PROGRESS = 1
+SCRIPT_ADD_MODE_COMPLETE = 2
+TRACK_ADD_MODE_IN_PROGRESS = 1
+TRACK_ADD_MODE_COMPLETE = 2
+
+# Commands Storage.handle answers; the acks and upload pages among them
+# are too many to log one by one.
+COMMANDS = ('getLogList', 'getLog', 'logAck', 'setScriptCfg', 'getScriptCfg', 'setTrackDb', 'getTrackDb')
+BULK_COMMANDS = ('logAck', 'setScriptCfg', 'setTrackDb')
+
+# Page size of getScriptCfg.
+SCRIPT_PAGE_SIZE = 4096
+
+DEFAULT_CHUNK = 4096
+MAX_CHUNK = 48 * 1024
+DEFAULT_WINDOW = 8
+MAX_WINDOW = 256
+
+# getTrackDb without an index lists the tracks when they fit.
+TRACK_LIST_MAX_BYTES = 64 * 1024
+
+# Uploads start with this much file and double from there.
+UPLOAD_INITIAL_SIZE = 1024 * 1024
+
+# Synthetic log content is this block of CSV, repeated.
+_LOG_BLOCK_LINES = 10000
+
+
+def crc32(data):
+    return zlib.crc32(data) & 0xffffffff
+
+
+def track_crc(track):
+    """CRC-32 of a track as uploaded: compact JSON with sorted keys."""
+    return crc32(json.dumps(track, sort_keys=True, separators=(',', ':')).encode('utf-8'))
+
+
+def make_log(path, size):
+    """Writes size bytes of RaceCapture-style CSV telemetry to path."""
+    lines = ['"Interval"|"ms"|0|0|1,"Latitude"|"Degrees"|-180|180|10,'
+             '"Longitude"|"Degrees"|-180|180|10,"Speed"|"kph"|0|300|10\n']
+    for i in range(_LOG_BLOCK_LINES):
+        lines.append('%d,%.6f,%.6f,%.2f\n' % (i * 100, 37.0 + i * 1e-6, -122.0 - i * 1e-6, (i % 2000) / 10.0))
+    block = ''.join(lines).encode('utf-8')
+
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        left = size
+        while left > 0:
+            n = min(left, len(block))
+            f.write(block[:n])
+            left -= n
+    os.rename(tmp, path)
+
+
+class LogFile:
+    """A log memory-mapped for reading, with its whole-file CRC."""
+
+    def __init__(self, path):
+        self.name = os.path.basename(path)
+        self.path = path
+        self.size = os.path.getsize(path)
+        self._crc = None
+        self._f = open(path, 'rb')
+        self.map = mmap.mmap(self._f.fileno(), 0, access=mmap.ACCESS_READ) if self.size > 0 else b''
+
+    @property
+    def crc(self):
+        if self._crc is None:
+            crc = 0
+            for off in range(0, self.size, 1 << 20):
+                crc = zlib.crc32(self.map[off:off + (1 << 20)], crc)
+            self._crc = crc & 0xffffffff
+        return self._crc
+
+    def close(self):
+        if self.size > 0:
+            self.map.close()
+        self._f.close()
+
+
+class Download:
+    """Go-back-N sender state of a getLog."""
+
+    def __init__(self, log, off, chunk, win):
+        self.log = log
+        self.chunk = chunk
+        self.win = win
+        self.acked = off
+        self.next = off
+        self.chunks = 0
+        self.resent = 0
+
+    def pending(self):
+        """Chunks to send now, as (off, len), advancing next."""
+        out = []
+        if self.log.size == 0:
+            # one empty chunk carries the eof
+            if not self.chunks:
+                out.append((0, 0))
+                self.chunks += 1
+            return out
+        limit = min(self.log.size, self.acked + self.win * self.chunk)
+        while self.next < limit:
+            n = min(self.chunk, self.log.size - self.next)
+            out.append((self.next, n))
+            self.next += n
+            self.chunks += 1
+        return out
+
+
+class Upload:
+    """A memory-mapped file receiving an upload, grown as needed."""
+
+    def __init__(self, path):
+        self.path = path
+        self.size = 0
+        self.complete = False
+        self._f = open(path, 'w+b')
+        self._f.truncate(UPLOAD_INITIAL_SIZE)
+        self.map = mmap.mmap(self._f.fileno(), UPLOAD_INITIAL_SIZE)
+
+    def write(self, off, data):
+        end = off + len(data)
+        if end > len(self.map):
+            cap = len(self.map)
+            while cap < end:
+                cap *= 2
+            self._f.truncate(cap)
+            self.map.resize(cap)
+        self.map[off:end] = data
+        self.size = max(self.size, end)
+
+    def reset(self):
+        self.size = 0
+        self.complete = False
+
+    def finish(self):
+        self.complete = True
+        self.map.flush()
+
+    def read(self, off, n):
+        return bytes(self.map[off:min(self.size, off + n)])
+
+    def close(self):
+        self.map.close()
+        self._f.truncate(self.size)
+        self._f.close()
+
+
+class Storage:
+    """Device-side handler for log, script and track DB commands."""
+
+    def __init__(self, path, log_size=0):
+        self.path = path
+        self.log_dir = os.path.join(path, 'logs')
+        os.makedirs(self.log_dir, exist_ok=True)
+        if log_size > 0:
+            sim = os.path.join(self.log_dir, 'sim_0001.log')
+            if not os.path.exists(sim) or os.path.getsize(sim) != log_size:
+                make_log(sim, log_size)
+
+        self.logs = {}
+        for name in sorted(os.listdir(self.log_dir)):
+            if name.endswith('.log'):
+                log = LogFile(os.path.join(self.log_dir, name))
+                self.logs[log.name] = log
+
+        self.script = Upload(os.path.join(path, 'script.lua'))
+        self.script_page_size = None
+        self.tracks = Upload(os.path.join(path, 'tracks.jsonl'))
+        # offsets of each track's line in self.tracks
+        self.track_offs = []
+
+        self.download = None
+        self.stats = {'chunks_sent': 0, 'chunks_resent': 0, 'bytes_sent': 0,
+                      'pages': 0, 'tracks': 0, 'bytes_received': 0, 'crc_errors': 0}
+
+    def close(self):
+        for log in self.logs.values():
+            log.close()
+        self.script.close()
+        self.tracks.close()
+
+    def handle(self, payload):
+        """Returns the response messages, possibly none, for a storage
+        command, or None if payload isn't one."""
+        if 'getLogList' in payload:
+            return [{'logList': {'files': [{'name': log.name, 'size': log.size, 'crc': log.crc}
+                                           for log in self.logs.values()]}}]
+        if 'getLog' in payload:
+            return self._get_log(payload['getLog'] or {})
+        if 'logAck' in payload:
+            return self._log_ack(payload['logAck'] or {})
+        if 'setScriptCfg' in payload:
+            return [self._set_script(payload['setScriptCfg'] or {})]
+        if 'getScriptCfg' in payload:
+            return [self._get_script(payload['getScriptCfg'])]
+        if 'setTrackDb' in payload:
+            return [self._set_track(payload['setTrackDb'] or {})]
+        if 'getTrackDb' in payload:
+            return [self._get_tracks(payload['getTrackDb'])]
+        return None
+
+    # Downloads
+
+    def _chunks(self, d):
+        out = []
+        for (off, n) in d.pending():
+            data = d.log.map[off:off + n]
+            msg = {'name': d.log.name, 'off': off, 'len': n, 'crc': crc32(data),
+                   'data': base64.b64encode(data).decode('ascii')}
+            if off + n >= d.log.size:
+                msg['eof'] = 1
+            out.append({'log': msg})
+            self.stats['chunks_sent'] += 1
+            self.stats['bytes_sent'] += n
+        return out
+
+    def _get_log(self, req):
+        log = self.logs.get(req.get('name'))
+        if log is None:
+            return [{'resp': 0, 'err': 'no such log'}]
+        off = int(req.get('off', 0))
+        chunk = int(req.get('chunk', DEFAULT_CHUNK))
+        win = int(req.get('win', DEFAULT_WINDOW))
+        if not 0 <= off <= log.size or not 0 < chunk <= MAX_CHUNK or not 0 < win <= MAX_WINDOW:
+            return [{'resp': 0, 'err': 'bad request'}]
+        self.download = Download(log, off, chunk, win)
+        return self._chunks(self.download)
+
+    def _log_ack(self, ack):
+        d = self.download
+        if d is None or ack.get('name') != d.log.name:
+            return [{'resp': 0, 'err': 'no download'}]
+        off = int(ack.get('off', 0))
+        if not d.acked <= off <= d.next:
+            # stale, from before a rewind
+            return []
+        d.acked = off
+        if ack.get('nak'):
+            n = (d.next - off + d.chunk - 1) // d.chunk
+            d.resent += n
+            self.stats['chunks_resent'] += n
+            d.next = off
+        if d.acked >= d.log.size:
+            self.download = None
+            return []
+        return self._chunks(d)
+
+    # Uploads
+
+    def _set_script(self, req):
+        data = str(req.get('data', '')).encode('utf-8')
+        page = int(req.get('page', 0))
+        mode = int(req.get('mode', SCRIPT_ADD_MODE_COMPLETE))
+        if 'crc' in req and int(req['crc']) != crc32(data):
+            self.stats['crc_errors'] += 1
+            return {'resp': 0, 'err': 'crc', 'page': page}
+
+        if page == 0:
+            self.script.reset()
+            self.script_page_size = len(data)
+        if self.script_page_size is None or (page > 0 and self.script.complete):
+            return {'resp': 0, 'err': 'no upload', 'page': page}
+        self.script.write(page * self.script_page_size, data)
+        if mode == SCRIPT_ADD_MODE_COMPLETE:
+            self.script.size = page * self.script_page_size + len(data)
+            self.script.finish()
+        self.stats['pages'] += 1
+        self.stats['bytes_received'] += len(data)
+        return {'resp': 1}
+
+    def _get_script(self, page):
+        page = int(page or 0)
+        data = self.script.read(page * SCRIPT_PAGE_SIZE, SCRIPT_PAGE_SIZE)
+        return {'scriptCfg': {'data': data.decode('utf-8', 'replace'), 'page': page}}
+
+    def _set_track(self, req):
+        index = int(req.get('index', 0))
+        mode = int(req.get('mode', TRACK_ADD_MODE_COMPLETE))
+        track = req.get('track')
+        if track is not None and 'crc' in req and int(req['crc']) != track_crc(track):
+            self.stats['crc_errors'] += 1
+            return {'resp': 0, 'err': 'crc', 'index': index}
+
+        if index == 0:
+            self.tracks.reset()
+            self.track_offs = []
+        if index != len(self.track_offs):
+            # tracks are added in order; a resent track replaces the last
+            if index == len(self.track_offs) - 1:
+                self.tracks.size = self.track_offs.pop()
+            else:
+                return {'resp': 0, 'err': 'index', 'index': index}
+        if track is not None:
+            line = (json.dumps(track, separators=(',', ':')) + '\n').encode('utf-8')
+            self.track_offs.append(self.tracks.size)
+            self.tracks.write(self.tracks.size, line)
+            self.stats['bytes_received'] += len(line)
+        if mode == TRACK_ADD_MODE_COMPLETE:
+            self.tracks.finish()
+        self.stats['tracks'] += 1
+        return {'resp': 1}
+
+    def _track(self, i):
+        start = self.track_offs[i]
+        end = self.track_offs[i + 1] if i + 1 < len(self.track_offs) else self.tracks.size
+        return json.loads(self.tracks.read(start, end - start))
+
+    def _get_tracks(self, req):
+        n = len(self.track_offs)
+        if isinstance(req, dict) and 'index' in req:
+            i = int(req['index'])
+            if not 0 <= i < n:
+                return {'resp': 0, 'err': 'index'}
+            return {'trackDb': {'size': n, 'index': i, 'track': self._track(i)}}
+        db = {'size': n}
+        if self.tracks.size <= TRACK_LIST_MAX_BYTES:
+            db['tracks'] = [self._track(i) for i in range(n)]
+        return {'trackDb': db}
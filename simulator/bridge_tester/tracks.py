@@ -0,0 +1,386 @@
+#!/usr/bin/env python3
+
+# tracks.py is the simulator's lap timing engine. It loads a track
+# database, finds the active track for a position through a grid
+# index, and detects start/finish and sector line crossings between
+# consecutive GPS samples, interpolating the crossing time within the
+# sample interval.
+#
+# The track database is JSON:
+#
+#   {"tracks": [{"id": 1001, "name": "Sonoma",
+#                "sf": [[lat, lon], [lat, lon]],
+#                "sec": [[[lat, lon], [lat, lon]], ...],
+#                "fin": [[lat, lon], [lat, lon]]}]}
+#
+# Each line is a pair of endpoints. "sec" lists the sector lines in
+# driving order and "fin" is only present for point-to-point stages.
+#
+# Run as a script to generate a synthetic database or benchmark the
+# engine against many simulated devices:
+#
+#   ./tracks.py --generate 20000 > tracks.json
+#   ./tracks.py --bench tracks.json --devices 200 --rate 50
+
+import argparse
+import json
+import math
+import random
+import sys
+import time
+
+EARTH_RADIUS_M = 6371000.0
+
+# Grid cell size, in degrees, of the active track index. Roughly 5.5km
+# of latitude, so a position lands in a cell holding a handful of
+# tracks even for a dense database.
+GRID_DEG = 0.05
+
+# How far outside a track's gate bounding box a car can be and still
+# be considered on that track.
+TRACK_MARGIN_M = 2000.0
+
+# Values for the 'status' field of the 'track' status message.
+TRACK_STATUS_WAITING = 0
+TRACK_STATUS_FIXED = 1
+TRACK_STATUS_DETECTED = 2
+
+TRACK_TYPE_CIRCUIT = 1
+TRACK_TYPE_STAGE = 2
+
+
+class Track:
+    def __init__(self, d):
+        self.id = int(d['id'])
+        self.name = d.get('name', str(self.id))
+        self.type = TRACK_TYPE_STAGE if 'fin' in d else TRACK_TYPE_CIRCUIT
+
+        lines = [d['sf']] + list(d.get('sec', []))
+        if 'fin' in d:
+            lines.append(d['fin'])
+        points = [p for line in lines for p in line]
+
+        # Gates are kept in a local equirectangular projection in
+        # meters centered on the track, which is plenty accurate over a
+        # few km and makes crossing tests plain 2D segment math.
+        self.lat0 = sum(p[0] for p in points) / len(points)
+        self.lon0 = sum(p[1] for p in points) / len(points)
+        self.kx = math.radians(1.0) * EARTH_RADIUS_M * math.cos(math.radians(self.lat0))
+        self.ky = math.radians(1.0) * EARTH_RADIUS_M
+
+        self.gates = [self._gate(line) for line in lines]
+        self.num_sectors = len(d.get('sec', [])) + 1
+
+        margin_lat = TRACK_MARGIN_M / self.ky
+        margin_lon = TRACK_MARGIN_M / self.kx
+        self.min_lat = min(p[0] for p in points) - margin_lat
+        self.max_lat = max(p[0] for p in points) + margin_lat
+        self.min_lon = min(p[1] for p in points) - margin_lon
+        self.max_lon = max(p[1] for p in points) + margin_lon
+
+    def _gate(self, line):
+        (ax, ay) = self.project(line[0][0], line[0][1])
+        (bx, by) = self.project(line[1][0], line[1][1])
+        return (ax, ay, bx - ax, by - ay)
+
+    def project(self, lat, lon):
+        return ((lon - self.lon0) * self.kx, (lat - self.lat0) * self.ky)
+
+    def contains(self, lat, lon):
+        return self.min_lat <= lat <= self.max_lat and self.min_lon <= lon <= self.max_lon
+
+    def distance2(self, lat, lon):
+        (x, y) = self.project(lat, lon)
+        (ax, ay, dx, dy) = self.gates[0]
+        mx = ax + dx / 2 - x
+        my = ay + dy / 2 - y
+        return mx * mx + my * my
+
+
+def _cell(lat, lon):
+    return (int(math.floor(lat / GRID_DEG)), int(math.floor(lon / GRID_DEG)))
+
+
+class TrackDb:
+    """Holds every track and a uniform grid index over their bounds.
+
+    Tracks are immutable once loaded, so a single TrackDb can be shared
+    by any number of LapTimers."""
+
+    def __init__(self, tracks):
+        self.tracks = {}
+        self.grid = {}
+        for t in tracks:
+            self.add(t)
+
+    @classmethod
+    def load(cls, path):
+        with open(path) as f:
+            data = json.load(f)
+        return cls(Track(d) for d in data.get('tracks', []))
+
+    def add(self, track):
+        self.tracks[track.id] = track
+        (lat0, lon0) = _cell(track.min_lat, track.min_lon)
+        (lat1, lon1) = _cell(track.max_lat, track.max_lon)
+        for i in range(lat0, lat1 + 1):
+            for j in range(lon0, lon1 + 1):
+                self.grid.setdefault((i, j), []).append(track)
+
+    def find(self, lat, lon):
+        """Returns the track whose area contains lat/lon, preferring
+        the one with the nearest start/finish line, or None."""
+        best = None
+        best_d2 = None
+        for t in self.grid.get(_cell(lat, lon), ()):
+            if not t.contains(lat, lon):
+                continue
+            d2 = t.distance2(lat, lon)
+            if best is None or d2 < best_d2:
+                best = t
+                best_d2 = d2
+        return best
+
+
+def _crossing(px, py, qx, qy, gate):
+    """Returns the fraction along p->q at which it crosses gate, or
+    None if the segments don't intersect."""
+    (ax, ay, gx, gy) = gate
+    rx = qx - px
+    ry = qy - py
+    denom = rx * gy - ry * gx
+    if denom == 0.0:
+        return None
+    wx = ax - px
+    wy = ay - py
+    u = (wx * gy - wy * gx) / denom
+    v = (wx * ry - wy * rx) / denom
+    if 0.0 < u <= 1.0 and 0.0 <= v <= 1.0:
+        return u
+    return None
+
+
+class LapTimer:
+    """Per-device lap and sector state.
+
+    update() is called with each GPS sample (t in seconds) and returns
+    a list of (kind, payload) events: ('track', track) when a track is
+    detected, ('lap_start', lap), ('sector', (sector, seconds)) and
+    ('lap', (lap, seconds)). The current state is available through
+    status() and channels()."""
+
+    def __init__(self, db, track_id=None):
+        self.db = db
+        self.track = db.tracks.get(track_id) if track_id is not None else None
+        # an unknown id leaves the track to be detected
+        self.fixed = self.track is not None
+
+        self.prev = None
+        self.in_lap = False
+        self.lap_count = 0
+        self.lap_start = 0.0
+        self.sector = 0
+        self.sector_start = 0.0
+        self.last_lap = 0.0
+        self.best_lap = 0.0
+        self.last_sector = 0.0
+
+    def _reset(self):
+        self.prev = None
+        self.in_lap = False
+        self.sector = 0
+
+    def update(self, t, lat, lon):
+        events = []
+
+        if self.track is None or not self.track.contains(lat, lon):
+            if self.fixed and self.track is not None:
+                self.prev = None
+                return events
+            track = self.db.find(lat, lon)
+            if track is not self.track:
+                self.track = track
+                self._reset()
+                if track is not None:
+                    events.append(('track', track))
+            if track is None:
+                return events
+
+        track = self.track
+        (x, y) = track.project(lat, lon)
+        prev = self.prev
+        self.prev = (t, x, y)
+        if prev is None:
+            return events
+        (pt, px, py) = prev
+
+        # Only the start/finish line and the next expected gate can be
+        # crossed, which keeps the per-sample cost constant regardless
+        # of the number of sectors.
+        if self.in_lap:
+            u = _crossing(px, py, x, y, track.gates[self.sector + 1]) \
+                if self.sector + 1 < len(track.gates) else None
+            if u is not None:
+                ct = pt + (t - pt) * u
+                self._sector_done(ct, events)
+                if track.type == TRACK_TYPE_STAGE and self.sector == track.num_sectors:
+                    self._lap_done(ct, events)
+                return events
+
+        u = _crossing(px, py, x, y, track.gates[0])
+        if u is not None:
+            ct = pt + (t - pt) * u
+            if self.in_lap:
+                self._sector_done(ct, events)
+                self._lap_done(ct, events)
+            if track.type == TRACK_TYPE_CIRCUIT or not self.in_lap:
+                self.in_lap = True
+                self.lap_start = ct
+                self.sector = 0
+                self.sector_start = ct
+                events.append(('lap_start', self.lap_count + 1))
+
+        return events
+
+    def _sector_done(self, ct, events):
+        self.last_sector = ct - self.sector_start
+        events.append(('sector', (self.sector, self.last_sector)))
+        self.sector += 1
+        self.sector_start = ct
+
+    def _lap_done(self, ct, events):
+        self.last_lap = ct - self.lap_start
+        if self.best_lap == 0.0 or self.last_lap < self.best_lap:
+            self.best_lap = self.last_lap
+        self.lap_count += 1
+        self.in_lap = False
+        self.sector = 0
+        events.append(('lap', (self.lap_count, self.last_lap)))
+
+    def status(self):
+        if self.track is None:
+            status = TRACK_STATUS_WAITING
+        elif self.fixed:
+            status = TRACK_STATUS_FIXED
+        else:
+            status = TRACK_STATUS_DETECTED
+        return {
+            'status': status,
+            'valid': self.track is not None,
+            'trackId': self.track.id if self.track is not None else 0,
+            'inLap': 1 if self.in_lap else 0,
+            'armed': 1 if self.track is not None else 0,
+        }
+
+    def channels(self, t):
+        """Returns LapCount, LapTime (minutes), Sector, SectorTime
+        (minutes) and CurrentLap, as the device reports them."""
+        current = self.lap_count + 1 if self.in_lap else self.lap_count
+        elapsed = (t - self.lap_start) if self.in_lap else self.last_lap
+        return [
+            self.lap_count,
+            round(self.last_lap / 60.0, 4),
+            self.sector + 1 if self.in_lap else 0,
+            round(self.last_sector / 60.0, 4),
+            current,
+            round(elapsed / 60.0, 4),
+        ]
+
+
+def _offset(lat, lon, north_m, east_m):
+    dlat = north_m / EARTH_RADIUS_M
+    dlon = east_m / (EARTH_RADIUS_M * math.cos(math.radians(lat)))
+    return (lat + math.degrees(dlat), lon + math.degrees(dlon))
+
+
+def _circle_track(track_id, lat, lon, radius_m, sectors):
+    """A circular circuit: start/finish and sector lines are radial
+    gates 30m wide, evenly spaced counterclockwise from the north."""
+    def gate(angle):
+        inner = _offset(lat, lon, (radius_m - 15) * math.cos(angle), (radius_m - 15) * math.sin(angle))
+        outer = _offset(lat, lon, (radius_m + 15) * math.cos(angle), (radius_m + 15) * math.sin(angle))
+        return [list(inner), list(outer)]
+
+    step = 2 * math.pi / (sectors + 1)
+    return {
+        'id': track_id,
+        'name': 'synthetic-%d' % track_id,
+        'sf': gate(0.0),
+        'sec': [gate(step * (i + 1)) for i in range(sectors)],
+    }
+
+
+def generate(n, seed):
+    rnd = random.Random(seed)
+    tracks = []
+    for i in range(n):
+        lat = rnd.uniform(-60.0, 65.0)
+        lon = rnd.uniform(-180.0, 180.0)
+        tracks.append(_circle_track(i + 1, lat, lon, rnd.uniform(300, 1500), rnd.randint(2, 8)))
+    return {'tracks': tracks}
+
+
+def bench(db, devices, rate, seconds, seed):
+    rnd = random.Random(seed)
+    tracks = list(db.tracks.values())
+    cars = []
+    for _ in range(devices):
+        t = rnd.choice(tracks)
+        radius = math.sqrt(t.gates[0][0] ** 2 + t.gates[0][1] ** 2) + 15.0
+        lap_s = rnd.uniform(60, 120)
+        cars.append((LapTimer(db), t, radius, lap_s))
+
+    samples = devices * rate * seconds
+    laps = 0
+    start = time.monotonic()
+    for i in range(rate * seconds):
+        st = i / rate
+        for (timer, t, radius, lap_s) in cars:
+            angle = 2 * math.pi * st / lap_s
+            (lat, lon) = _offset(t.lat0, t.lon0, radius * math.cos(angle), radius * math.sin(angle))
+            for (kind, _) in timer.update(st, lat, lon):
+                if kind == 'lap':
+                    laps += 1
+    elapsed = time.monotonic() - start
+
+    print(json.dumps({
+        'devices': devices,
+        'rate': rate,
+        'session_s': seconds,
+        'samples': samples,
+        'laps': laps,
+        'elapsed_s': round(elapsed, 3),
+        'samples_per_s': round(samples / elapsed),
+        # >1 means the engine keeps up with real time
+        'realtime_factor': round(seconds / elapsed, 2),
+    }))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulator track database tools.')
+    parser.add_argument('--generate', type=int, metavar='N',
+                        help='write a synthetic database of N tracks to stdout')
+    parser.add_argument('--bench', metavar='DB',
+                        help='benchmark lap detection against DB')
+    parser.add_argument('--devices', type=int, default=50)
+    parser.add_argument('--rate', type=int, default=50)
+    parser.add_argument('--seconds', type=int, default=300)
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    if args.generate:
+        json.dump(generate(args.generate, args.seed), sys.stdout)
+        print()
+    elif args.bench:
+        load_start = time.monotonic()
+        db = TrackDb.load(args.bench)
+        print('loaded %d tracks in %.2fs' % (len(db.tracks), time.monotonic() - load_start))
+        bench(db, args.devices, args.rate, args.seconds, args.seed)
+    else:
+        parser.print_usage()
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
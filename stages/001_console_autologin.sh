@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+
 is_boot_cli() {
     if systemctl get-default | grep -q multi-user; then
         # Set to boot multi-user
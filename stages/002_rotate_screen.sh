@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+# STAGE_REBOOT: true
+
 run_stage() {
     local ROTATE_DISPLAY="$(get_setup_config DISPLAY_ROTATE)"
 
@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+
 _systemctl_disble() {
     local GROUP="$1"
     shift
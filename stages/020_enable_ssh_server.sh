@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+# STAGE_REBOOT: true
+
 run_stage() {
     if service ssh status | grep -q inactive; then
         report "ssh service not active"
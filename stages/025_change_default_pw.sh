@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# STAGE_DEPENDS: 020_enable_ssh_server
+# STAGE_INTERACTIVE: true
+
 run_stage() {
     if service ssh status | grep -q inactive; then
         report "ssh server not active, skipping default pw check"
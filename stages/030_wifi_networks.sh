@@ -1,5 +1,11 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+# STAGE_REBOOT: true
+# STAGE_INTERACTIVE: true
+# STAGE_INPUTS: lib/network.sh
+# STAGE_CONFIG: WIFI_COUNTRY WIFI_SSID WIFI_PASS WIFI_PRIO
+
 run_stage() {
     local IFACE
     IFACE="$(wireless_first_interface)"
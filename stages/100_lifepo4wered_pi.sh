@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+
 run_stage() {
     local PERFORM_SETUP="$(get_setup_config LIFEPO_PERFORM_SETUP)"
     if [[ -n "${PERFORM_SETUP}" ]] && [[ "${PERFORM_SETUP}" != "true" ]]; then
@@ -13,7 +15,8 @@ run_stage() {
         build-essential
         libsystemd-dev
     )
-    apt-get install -q -y "${PKGS[@]}" || abort "unable to install packages: ${PKGS[*]}"
+    # Other stages may be installing packages concurrently.
+    apt-get install -q -y -o DPkg::Lock::Timeout=600 "${PKGS[@]}" || abort "unable to install packages: ${PKGS[*]}"
 
     local UPS_DIR="${SETUP_HOME}/lifepo4wered-pi"
     local UPS_REPO="https://github.com/xorbit/LiFePO4wered-Pi.git"
@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS: 002_rotate_screen
+
 run_stage() {
     # Disable pi logo, console blanking, and the splash screen
     if ! grep -q "logo\.nologo" /boot/firmware/cmdline.txt; then
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# STAGE_DEPENDS: 100_lifepo4wered_pi
+# STAGE_INPUTS: native
+
+run_stage() {
+    report "installing packages for native tools"
+
+    local PKGS=(
+        build-essential
+        liblzma-dev
+        pkg-config
+    )
+    # Other stages may be installing packages concurrently.
+    apt-get install -q -y -o DPkg::Lock::Timeout=600 "${PKGS[@]}" || abort "unable to install packages: ${PKGS[*]}"
+
+    # build as the setup user for permissions reasons; after
+    # 100_lifepo4wered_pi so liblifepo4wered is picked up
+    report "building native tools"
+    sudo -u "${SETUP_USER}" make -C "${BDR_REPO_DIR}/native" || abort "native tools build failed"
+
+    make -C "${BDR_REPO_DIR}/native" install || abort "native tools install failed"
+}
@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS: 100_lifepo4wered_pi
+
 run_stage() {
     local PERFORM_SETUP="$(get_setup_config LIFEPO_PERFORM_SETUP)"
     if [[ -n "${PERFORM_SETUP}" ]] && [[ "${PERFORM_SETUP}" != "true" ]]; then
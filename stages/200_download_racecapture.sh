@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS: 030_wifi_networks
+
 run_stage() {
     local RC_URL="$(curl -s https://podium.live/software | \
                          grep -Po '(?<=<a href=")[^"]*racecapture_linux_raspberrypi[^"]*.deb[^"]*' | \
@@ -9,16 +11,21 @@ run_stage() {
 
     local RC_FILE="$(basename "${RC_URL}" | sed 's/\?.*//')"
 
-    push_dir "/tmp"
-
-    rm -f "${RC_FILE}"
-
-    # download and extract as the setup user to keep the permissions correct
+    # The cache skips the download when this release was fetched
+    # before and resumes it if it was interrupted.
     report "downloading ${RC_URL}"
-    wget -O "${RC_FILE}" --no-verbose "${RC_URL}" || abort "unable to download ${RC_URL}"
+    local RC_CACHED
+    RC_CACHED="$(download_cached "${RC_URL}")" || abort "unable to download ${RC_URL}"
+
+    # apt-get wants a .deb extension
+    push_dir "/tmp"
+    ln -sf "${RC_CACHED}" "${RC_FILE}"
 
     report "installing ${RC_FILE}"
-    apt-get install -y "/tmp/${RC_FILE}"
+    # Other stages may be installing packages concurrently.
+    apt-get install -y -o DPkg::Lock::Timeout=600 "/tmp/${RC_FILE}"
+
+    rm -f "/tmp/${RC_FILE}"
 
     [[ -d "/opt/racecapture" ]] || abort "missing /opt/racecapture directory"
 
@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+
 run_stage() {
     local LOG_DIR="${SETUP_HOME}/logs"
     local KIVY_DIR="${SETUP_HOME}/.kivy"
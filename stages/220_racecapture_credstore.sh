@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# STAGE_DEPENDS:
+
 run_stage() {
     if [[ ! -d "${SETUP_HOME}/.ssh" ]]; then
         # Create the ssh keys if they don't exist
@@ -1,8 +1,43 @@
 #!/bin/bash
 
+# STAGE_DEPENDS: 002_rotate_screen 020_enable_ssh_server 120_native_tools 200_download_racecapture 210_racecapture_prep_env
+# STAGE_INPUTS: resources/bdr_racecapture.sh resources/bdr_prewarm.service resources/bdr_racecapture.service
+
+# Units for RACECAPTURE_LAUNCH_MODE=service, from resources/.
+RCAP_UNITS=(bdr_prewarm.service bdr_racecapture.service)
+
+# _rcap_install_units writes the launch service units with the setup user
+# and home filled in.
+_rcap_install_units() {
+    local ESCAPED_HOME="${SETUP_HOME//\//\\\/}"
+    local UNIT
+
+    for UNIT in "${RCAP_UNITS[@]}"; do
+        if ! sed -e "s/{{SETUP_HOME}}/${ESCAPED_HOME}/g" \
+                 -e "s/{{SETUP_USER}}/${SETUP_USER}/g" \
+                 "${BDR_REPO_DIR}/resources/${UNIT}" >"/etc/systemd/system/${UNIT}"; then
+            abort "error preparing ${UNIT}"
+        fi
+    done
+
+    systemctl daemon-reload || abort "unable to reload systemd units"
+}
+
+# _rcap_disable_units turns off the launch service left by an earlier setup.
+_rcap_disable_units() {
+    local UNIT
+
+    for UNIT in "${RCAP_UNITS[@]}"; do
+        if [[ -f "/etc/systemd/system/${UNIT}" ]]; then
+            systemctl disable "${UNIT}" || abort "unable to disable ${UNIT}"
+        fi
+    done
+}
+
 run_stage() {
-    local AUTOSTART
+    local AUTOSTART MODE
     AUTOSTART="$(get_setup_config RACECAPTURE_AUTOLAUNCH)"
+    MODE="$(get_setup_config RACECAPTURE_LAUNCH_MODE)"
 
     report "preparing racecapture launch script"
 
@@ -19,6 +54,17 @@ run_stage() {
     chown "${SETUP_USER}:${SETUP_USER}" "${SCRIPT_TARGET}"
     chmod a+x "${SCRIPT_TARGET}"
 
+    local BASHRC="${SETUP_HOME}/.bashrc"
+
+    local START_FLAG="BEGIN_RCAP_START"
+    local END_FLAG="END_RCAP_START"
+    if grep -q "# ${START_FLAG}:" "${BASHRC}"; then
+        sed_inplace -e "/# ${START_FLAG}:/,/# ${END_FLAG}/d" "${BASHRC}" || \
+            abort "failed to clear old start handler in ${BASHRC}"
+    fi
+
+    _rcap_disable_units
+
     if [[ "${AUTOSTART}" == "false" ]]; then
         report "not enabling auto-start of racecapture, as directed by image config"
         return 0
@@ -26,19 +72,22 @@ run_stage() {
 
     report "enabling auto-start of racecapture"
 
-    local BASHRC="${SETUP_HOME}/.bashrc"
+    if [[ "${MODE}" == "service" ]]; then
+        # Starts with the rest of boot rather than after autologin, the
+        # login shell and the abort prompt, with /opt/racecapture read
+        # into the page cache in parallel.
+        _rcap_install_units
+        systemctl enable "${RCAP_UNITS[@]}" || abort "unable to enable ${RCAP_UNITS[*]}"
 
-    local START_FLAG="BEGIN_RCAP_START"
-    local END_FLAG="END_RCAP_START"
-    if grep -q "# ${START_FLAG}:" "${BASHRC}"; then
-        sed_inplace -e "/# ${START_FLAG}:/,/# ${END_FLAG}/d" "${BASHRC}" || \
-            abort "failed to clear old start handler in ${BASHRC}"
+        report "configured racecapture to start on /dev/tty1 at boot"
+        return 0
     fi
 
     sed -e 's/^ \{6\}//' >>"${BASHRC}" << EOF
 
       # ${START_FLAG}: start racecapture on login from tty1
       if [[ "\$(tty)" == "/dev/tty1" ]]; then
+        /usr/local/bin/bdr_boottrace mark login &>/dev/null
         echo
         if ! read -t 3 -p "starting racecapture in 3s (press ENTER to abort) "; then
           printf "\nsend it!\n"
@@ -2,10 +2,10 @@
 
 init_test_tmpdir() {
     local NAME
-    NAME="$(mktemp -d /tmp/bdr-pi-test.XXXXXX)"
+    NAME="$(mktemp -d "${TMPDIR:-/tmp/}bdr-pi-test.XXXXXX")"
 
     if [[ -z "${NAME}" ]]; then
-        echo "failed to make temp dir" >/dev/stderr
+        echo "failed to make temp dir" >&2
         return 1
     fi
 
@@ -26,7 +26,7 @@ mk_test_tmpfile() {
     NAME="$(mktemp "${DIR}/bdr-pi-test.XXXXXX")"
 
     if [[ -z "${NAME}" ]]; then
-        echo "failed to make temp file" >/dev/stderr
+        echo "failed to make temp file" >&2
         return 1
     fi
 
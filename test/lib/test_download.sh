@@ -0,0 +1,138 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+source "${_TEST_ROOT_DIR}/mocks.sh"
+
+BDRPI_TEST_DIR="${TMPDIR:-/tmp/}bdr-pi-test-download.$$"
+
+export DOWNLOAD_CACHE_DIR="${BDRPI_TEST_DIR}/cache"
+
+source "${_ROOT_DIR}/lib/download.sh"
+
+_SRC="${BDRPI_TEST_DIR}/src"
+
+before_each() {
+    mkdir -p "${_SRC}"
+    seq 1 10000 >"${_SRC}/data.txt"
+    DOWNLOAD_MIRROR_DIR=""
+}
+
+after_each() {
+    rm -rf "${BDRPI_TEST_DIR}"
+    clear_mocks
+}
+
+_sha() {
+    download_sha256 <"$1"
+}
+
+test_download_cached() {
+    local HASH OUT
+    HASH="$(_sha "${_SRC}/data.txt")"
+
+    OUT="$(download_cached "file://${_SRC}/data.txt" "${HASH}" 2>/dev/null)"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+    assert_eq "$(_sha "${OUT}")" "${HASH}"
+
+    # The second call never reaches the network, with or without a hash.
+    mock_error curl
+    OUT="$(download_cached "file://${_SRC}/data.txt" "${HASH}" 2>/dev/null)"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+    OUT="$(download_cached "file://${_SRC}/data.txt" 2>/dev/null)"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+}
+
+test_download_cached_by_content() {
+    local HASH OUT
+    HASH="$(_sha "${_SRC}/data.txt")"
+    download_cached "file://${_SRC}/data.txt" >/dev/null 2>&1
+
+    # Same content at another URL is found by hash.
+    mock_error curl
+    OUT="$(download_cached "https://example.com/other.txt" "${HASH}" 2>/dev/null)"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+}
+
+test_download_cached_hash_mismatch() {
+    assert_stderr_contains "hash mismatch" \
+        download_cached "file://${_SRC}/data.txt" "0123456789abcdef"
+
+    assert_eq "$(find "${DOWNLOAD_CACHE_DIR}" -type f | wc -l | tr -d ' ')" "0"
+}
+
+test_download_cached_xz() {
+    local HASH OUT
+    HASH="$(_sha "${_SRC}/data.txt")"
+    xz --keep "${_SRC}/data.txt"
+
+    OUT="$(download_cached "file://${_SRC}/data.txt.xz" "${HASH}" 2>/dev/null)"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+    assert_succeeds cmp "${OUT}" "${_SRC}/data.txt"
+
+    # Only the decompressed content is kept.
+    assert_eq "$(find "${DOWNLOAD_CACHE_DIR}/partial" -type f | wc -l | tr -d ' ')" "0"
+}
+
+test_download_cached_keep_compressed() {
+    local OUT
+    xz --keep "${_SRC}/data.txt"
+
+    OUT="$(download_cached --keep-compressed "file://${_SRC}/data.txt.xz" "ignored" 2>/dev/null)"
+    assert_succeeds cmp "${OUT}" "${_SRC}/data.txt.xz"
+
+    # The decompressed and compressed forms are cached separately.
+    OUT="$(download_cached "file://${_SRC}/data.txt.xz" 2>/dev/null)"
+    assert_succeeds cmp "${OUT}" "${_SRC}/data.txt"
+}
+
+test_download_cached_resume() {
+    local URL="file://${_SRC}/data.txt"
+    local HASH OUT
+    HASH="$(_sha "${_SRC}/data.txt")"
+
+    mkdir -p "${DOWNLOAD_CACHE_DIR}/partial"
+    local PARTIAL="${DOWNLOAD_CACHE_DIR}/partial/$(_download_key "${URL}")-data.txt"
+    head -c 1000 "${_SRC}/data.txt" >"${PARTIAL}"
+
+    local ERR
+    ERR="$(download_cached "${URL}" "${HASH}" 2>&1 >"${BDRPI_TEST_DIR}/out")"
+    OUT="$(cat "${BDRPI_TEST_DIR}/out")"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+    [[ "${ERR}" == *Resuming* ]] || assert_failed "download was not resumed: ${ERR}"
+    assert_succeeds cmp "${OUT}" "${_SRC}/data.txt"
+}
+
+test_download_cached_resume_corrupt() {
+    local URL="file://${_SRC}/data.txt"
+    local HASH
+    HASH="$(_sha "${_SRC}/data.txt")"
+
+    mkdir -p "${DOWNLOAD_CACHE_DIR}/partial"
+    local PARTIAL="${DOWNLOAD_CACHE_DIR}/partial/$(_download_key "${URL}")-data.txt"
+    echo "garbage" >"${PARTIAL}"
+
+    # A bad partial fails verification and is discarded...
+    assert_stderr_contains "hash mismatch" download_cached "${URL}" "${HASH}"
+    assert_fails test -f "${PARTIAL}"
+
+    # ...so the next attempt starts over.
+    assert_succeeds download_cached "${URL}" "${HASH}" 2>/dev/null
+}
+
+test_download_cached_mirror() {
+    local HASH OUT
+    HASH="$(_sha "${_SRC}/data.txt")"
+
+    DOWNLOAD_MIRROR_DIR="${_SRC}"
+    mock_error curl
+
+    OUT="$(download_cached "https://example.com/files/data.txt?v=1" "${HASH}" 2>/dev/null)"
+    assert_eq "${OUT}" "${DOWNLOAD_CACHE_DIR}/sha256/${HASH}"
+    assert_succeeds cmp "${OUT}" "${_SRC}/data.txt"
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
@@ -0,0 +1,283 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+source "${_TEST_ROOT_DIR}/mocks.sh"
+
+BDRPI_TEST_DIR="${TMPDIR:-/tmp/}bdr-pi-test-stages.$$"
+
+export BDR_DIR="${BDRPI_TEST_DIR}/bdr"
+export BDR_REPO_DIR="${BDRPI_TEST_DIR}/repo"
+export SETUP_HOME="${BDRPI_TEST_DIR}/home"
+export SETUP_USER="bob"
+export SETUP_TTY="/dev/tty0"
+export SETUP_FLUSH_PID=0
+
+export BDRPI_SETUP_CONFIG_FILE="${BDRPI_TEST_DIR}/config.txt"
+
+source "${_ROOT_DIR}/lib/setup_config.sh"
+source "${_ROOT_DIR}/lib/stages.sh"
+
+_ORDER="${BDRPI_TEST_DIR}/order"
+
+before_each() {
+    mkdir -p "${BDR_REPO_DIR}/stages" "${SETUP_HOME}"
+    touch "${SETUP_HOME}/.bashrc"
+    REBOOT_REQUIRED=false
+    _FORCE_STAGES=false
+}
+
+after_each() {
+    rm -rf "${BDRPI_TEST_DIR}"
+    reset_setup_config
+    clear_mocks
+}
+
+# _add_stage $1=name $2=header-lines $3=body writes a stage that
+# records its start and end in the order file around body.
+_add_stage() {
+    local NAME="$1"
+    local HEADER="$2"
+    local BODY="${3:-:}"
+
+    cat >"${BDR_REPO_DIR}/stages/${NAME}.sh" <<EOF
+#!/bin/bash
+
+${HEADER}
+
+run_stage() {
+    echo "start ${NAME}" >>"${_ORDER}"
+    ${BODY}
+    echo "end ${NAME}" >>"${_ORDER}"
+}
+EOF
+}
+
+# _line $1=pattern prints the line number of pattern in the order file
+_line() {
+    grep -n -x "$1" "${_ORDER}" | cut -d: -f1
+}
+
+test_stage_run_sequential_by_default() {
+    _add_stage 010_a "" "sleep 0.2"
+    _add_stage 020_b ""
+    _add_stage 030_c ""
+
+    assert_succeeds stage_run >/dev/null
+
+    assert_eq "$(cat "${_ORDER}" | tr '\n' ' ')" \
+              "start 010_a end 010_a start 020_b end 020_b start 030_c end 030_c "
+}
+
+test_stage_run_parallel() {
+    _add_stage 010_a "# STAGE_DEPENDS:" "sleep 1"
+    _add_stage 020_b "# STAGE_DEPENDS:" "sleep 1"
+    _add_stage 030_c "# STAGE_DEPENDS: 010_a 020_b"
+
+    BDR_STAGE_JOBS=4 stage_run >"${BDRPI_TEST_DIR}/out" || assert_failed "stage_run failed"
+
+    # a and b overlap, c waits for both
+    [[ "$(_line "start 020_b")" -lt "$(_line "end 010_a")" ]] || assert_failed "stages did not overlap"
+    [[ "$(_line "start 030_c")" -gt "$(_line "end 010_a")" ]] || assert_failed "030_c ran before 010_a"
+    [[ "$(_line "start 030_c")" -gt "$(_line "end 020_b")" ]] || assert_failed "030_c ran before 020_b"
+
+    assert_succeeds test -f "${BDR_DIR}/state/010_a"
+    assert_succeeds test -f "${BDR_DIR}/state/020_b"
+    assert_succeeds test -f "${BDR_DIR}/state/030_c"
+    assert_succeeds test -f "${BDR_DIR}/logs/stages/010_a.log"
+
+    assert_succeeds grep -q "stage timing:" "${BDRPI_TEST_DIR}/out"
+    assert_succeeds grep -q "030_c .* ok" "${BDRPI_TEST_DIR}/out"
+}
+
+test_stage_run_captures_output() {
+    _add_stage 010_a "# STAGE_DEPENDS:" 'report "hello from a"'
+
+    stage_run >"${BDRPI_TEST_DIR}/out" || assert_failed "stage_run failed"
+
+    assert_succeeds grep -q "010_a: hello from a" "${BDR_DIR}/logs/stages/010_a.log"
+    assert_succeeds grep -q "010_a: hello from a" "${BDRPI_TEST_DIR}/out"
+}
+
+test_stage_run_skips_complete() {
+    _add_stage 010_a "# STAGE_DEPENDS:"
+    _add_stage 020_b "# STAGE_DEPENDS: 010_a"
+
+    mkdir -p "${BDR_DIR}/state"
+    date "+%s" >"${BDR_DIR}/state/010_a"
+
+    stage_run >"${BDRPI_TEST_DIR}/out" || assert_failed "stage_run failed"
+
+    assert_succeeds grep -q "skipping 010_a, already complete" "${BDRPI_TEST_DIR}/out"
+    assert_eq "$(cat "${_ORDER}" | tr '\n' ' ')" "start 020_b end 020_b "
+}
+
+test_stage_run_records_hash() {
+    _add_stage 010_a "# STAGE_DEPENDS:"
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+
+    assert_eq "$(_stage_state 010_a hash)" "$(_stage_hash "${BDR_REPO_DIR}/stages/010_a.sh")"
+    [[ "$(_stage_state 010_a duration)" =~ ^[0-9]+$ ]] || assert_failed "no duration recorded"
+}
+
+test_stage_run_adopts_legacy_state() {
+    _add_stage 010_a "# STAGE_DEPENDS:"
+
+    mkdir -p "${BDR_DIR}/state"
+    date "+%s" >"${BDR_DIR}/state/010_a"
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+
+    assert_fails test -f "${_ORDER}"
+    assert_eq "$(_stage_state 010_a hash)" "$(_stage_hash "${BDR_REPO_DIR}/stages/010_a.sh")"
+}
+
+test_stage_run_reruns_changed_stage() {
+    _add_stage 010_a "# STAGE_DEPENDS:"
+    _add_stage 020_b "# STAGE_DEPENDS:"
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+    rm -f "${_ORDER}"
+
+    _add_stage 020_b "# STAGE_DEPENDS:" "echo changed >/dev/null"
+    stage_run >"${BDRPI_TEST_DIR}/out" || assert_failed "stage_run failed"
+
+    assert_eq "$(cat "${_ORDER}" | tr '\n' ' ')" "start 020_b end 020_b "
+    assert_succeeds grep -q "rerunning stage 020_b, its inputs changed" "${BDRPI_TEST_DIR}/out"
+}
+
+test_stage_run_reruns_on_input_change() {
+    mkdir -p "${BDR_REPO_DIR}/resources/dir"
+    echo "one" >"${BDR_REPO_DIR}/resources/file"
+    echo "one" >"${BDR_REPO_DIR}/resources/dir/file"
+    _add_stage 010_a "# STAGE_DEPENDS:
+# STAGE_INPUTS: resources/file"
+    _add_stage 020_b "# STAGE_DEPENDS:
+# STAGE_INPUTS: resources/dir"
+    _add_stage 030_c "# STAGE_DEPENDS:"
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+    rm -f "${_ORDER}"
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+    assert_fails test -f "${_ORDER}"
+
+    echo "two" >"${BDR_REPO_DIR}/resources/file"
+    echo "two" >"${BDR_REPO_DIR}/resources/dir/other"
+    stage_run >/dev/null || assert_failed "stage_run failed"
+
+    assert_eq "$(cat "${_ORDER}" | tr '\n' ' ')" "start 010_a end 010_a start 020_b end 020_b "
+}
+
+test_stage_run_reruns_on_config_change() {
+    set_setup_config WIFI_COUNTRY US
+    set_setup_config_array WIFI_SSID append home
+    _add_stage 010_a "# STAGE_DEPENDS:" 'local MODE="$(get_setup_config MODE)"'
+    _add_stage 020_b "# STAGE_DEPENDS:
+# STAGE_CONFIG: WIFI_SSID"
+    _add_stage 030_c "# STAGE_DEPENDS:"
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+    rm -f "${_ORDER}"
+
+    # unrelated keys don't matter
+    set_setup_config WIFI_COUNTRY CA
+    stage_run >/dev/null || assert_failed "stage_run failed"
+    assert_fails test -f "${_ORDER}"
+
+    set_setup_config MODE service
+    set_setup_config_array WIFI_SSID append car
+    stage_run >/dev/null || assert_failed "stage_run failed"
+
+    assert_eq "$(cat "${_ORDER}" | tr '\n' ' ')" "start 010_a end 010_a start 020_b end 020_b "
+}
+
+test_stage_run_reports_saved_time() {
+    _add_stage 010_a "# STAGE_DEPENDS:"
+    _add_stage 020_b "# STAGE_DEPENDS:"
+
+    mkdir -p "${BDR_DIR}/state"
+    _stage_complete 010_a "${BDR_REPO_DIR}/stages/010_a.sh" 40
+    _stage_complete 020_b "${BDR_REPO_DIR}/stages/020_b.sh" 2
+
+    stage_run >"${BDRPI_TEST_DIR}/out" || assert_failed "stage_run failed"
+
+    assert_succeeds grep -q "010_a .* skipped .* (40s last run)" "${BDRPI_TEST_DIR}/out"
+    assert_succeeds grep -q "saved .* 42s (2 unchanged, full rerun ~42s of stage time)" "${BDRPI_TEST_DIR}/out"
+}
+
+test_stage_run_force() {
+    _add_stage 010_a "# STAGE_DEPENDS:"
+
+    mkdir -p "${BDR_DIR}/state"
+    date "+%s" >"${BDR_DIR}/state/010_a"
+
+    stage_force_all
+    stage_run >/dev/null || assert_failed "stage_run failed"
+
+    assert_eq "$(cat "${_ORDER}" | tr '\n' ' ')" "start 010_a end 010_a "
+}
+
+test_stage_run_failure() {
+    _add_stage 010_a "# STAGE_DEPENDS:" "abort failed on purpose"
+    _add_stage 020_b "# STAGE_DEPENDS:" "sleep 0.2"
+    _add_stage 030_c "# STAGE_DEPENDS: 010_a"
+
+    assert_stderr_contains "stage 010_a failed" stage_run
+
+    assert_fails test -f "${BDR_DIR}/state/010_a"
+    assert_fails grep -q "start 030_c" "${_ORDER}"
+    assert_succeeds grep -q "failed on purpose" "${BDR_DIR}/logs/stages/010_a.log"
+}
+
+test_stage_run_stage_killed() {
+    # SIGKILL skips the EXIT trap that writes the stage's exit code
+    _add_stage 010_a "# STAGE_DEPENDS:" 'kill -KILL "${BASHPID}"'
+    _add_stage 020_b "# STAGE_DEPENDS: 010_a"
+
+    assert_stderr_contains "stage 010_a failed" stage_run
+
+    assert_fails test -f "${BDR_DIR}/state/010_a"
+    assert_fails grep -q "start 020_b" "${_ORDER}"
+    assert_succeeds grep -q "wait status 137" "${BDR_DIR}/logs/stages/010_a.log"
+}
+
+test_stage_run_reboot() {
+    _add_stage 010_a "# STAGE_DEPENDS:
+# STAGE_REBOOT: true" "reboot_required"
+    _add_stage 020_b "# STAGE_DEPENDS: 010_a"
+
+    mock_success _stage_reboot
+
+    stage_run >/dev/null || assert_failed "stage_run failed"
+
+    expect_mock_called _stage_reboot
+    assert_succeeds test -f "${BDR_DIR}/state/010_a"
+    assert_fails grep -q "start 020_b" "${_ORDER}"
+    assert_succeeds reboot_configured
+}
+
+test_stage_run_interactive() {
+    _add_stage 010_a "# STAGE_DEPENDS:" "sleep 0.5"
+    _add_stage 020_b "# STAGE_DEPENDS:
+# STAGE_INTERACTIVE: true"
+    _add_stage 030_c "# STAGE_DEPENDS:"
+
+    BDR_STAGE_JOBS=4 stage_run >/dev/null || assert_failed "stage_run failed"
+
+    # the interactive stage waits for a, and c waits for it
+    [[ "$(_line "start 020_b")" -gt "$(_line "end 010_a")" ]] || assert_failed "020_b overlapped 010_a"
+    [[ "$(_line "start 030_c")" -gt "$(_line "end 020_b")" ]] || assert_failed "030_c overlapped 020_b"
+}
+
+test_stage_run_unknown_dependency() {
+    _add_stage 010_a "# STAGE_DEPENDS: 005_nope"
+
+    assert_stderr_contains "depends on unknown stage 005_nope" stage_run
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
@@ -0,0 +1,121 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+
+BDRPI_TEST_DIR="${TMPDIR:-/tmp/}bdr-pi-test-boottrace.$$"
+
+_CMD="${_ROOT_DIR}/native/bdr_boottrace"
+_TIMELINE="${BDRPI_TEST_DIR}/timeline"
+
+before_all() {
+    make -s -C "${_ROOT_DIR}/native" bdr_boottrace
+}
+
+before_each() {
+    mkdir -p "${BDRPI_TEST_DIR}"
+}
+
+after_each() {
+    rm -rf "${BDRPI_TEST_DIR}"
+}
+
+# _phases $1=timeline prints the phases of a report, in order
+_phases() {
+    "${_CMD}" report "$1" | tail -n +2 | awk '{ print $1 }' | tr '\n' ' '
+}
+
+# _app creates a fake /opt/racecapture of a few files
+_app() {
+    mkdir -p "${BDRPI_TEST_DIR}/app/lib"
+    head -c 100000 /dev/zero >"${BDRPI_TEST_DIR}/app/race_capture"
+    head -c 50000 /dev/zero >"${BDRPI_TEST_DIR}/app/lib/a.so"
+    echo "x" >"${BDRPI_TEST_DIR}/app/lib/b.py"
+}
+
+test_bdr_boottrace_mark() {
+    BDR_BOOTTRACE_FILE="${_TIMELINE}" "${_CMD}" mark login || assert_failed "mark failed"
+    "${_CMD}" --file="${_TIMELINE}" mark launcher || assert_failed "mark failed"
+
+    assert_succeeds grep -q "^# bdr_boottrace boot_id " "${_TIMELINE}"
+    assert_eq "$(grep -c "^[0-9]* login$" "${_TIMELINE}")" "1"
+    assert_eq "$(grep -c "^[0-9]* launcher$" "${_TIMELINE}")" "1"
+
+    # Marks are shared by the setup user and root.
+    assert_eq "$(stat -c "%a" "${_TIMELINE}" 2>/dev/null || stat -f "%Lp" "${_TIMELINE}")" "666"
+}
+
+test_bdr_boottrace_report() {
+    cat >"${_TIMELINE}" <<EOF
+# bdr_boottrace boot_id test
+3000000000 login
+2000000000 init
+4500000000 first_frame
+EOF
+
+    assert_eq "$(_phases "${_TIMELINE}")" "kernel init login first_frame "
+    assert_stdout_contains "first_frame +4\.500 +\+1\.500" "${_CMD}" report "${_TIMELINE}"
+    assert_stdout_contains "login +3\.000 +\+1\.000" "${_CMD}" --file="${_TIMELINE}" report
+}
+
+test_bdr_boottrace_compare() {
+    cat >"${BDRPI_TEST_DIR}/login" <<EOF
+2000000000 init
+9000000000 login
+12500000000 first_frame
+EOF
+    cat >"${BDRPI_TEST_DIR}/service" <<EOF
+2000000000 init
+2100000000 prewarm_start
+6000000000 first_frame
+EOF
+
+    local OUT
+    OUT="$("${_CMD}" report "${BDRPI_TEST_DIR}/login" "${BDRPI_TEST_DIR}/service")"
+
+    [[ "${OUT}" =~ first_frame\ +12\.500\ +6\.000\ +-6\.500 ]] || assert_failed "no first_frame change in ${OUT}"
+    [[ "${OUT}" =~ login\ +9\.000\ +-\ +- ]] || assert_failed "no login row in ${OUT}"
+    [[ "${OUT}" =~ prewarm_start\ +-\ +2\.100 ]] || assert_failed "no prewarm_start row in ${OUT}"
+}
+
+test_bdr_boottrace_prewarm() {
+    _app
+
+    assert_stdout_contains "prewarm: 3 files, 0\.1 MiB" \
+                           "${_CMD}" --file="${_TIMELINE}" prewarm "${BDRPI_TEST_DIR}/app"
+    assert_eq "$(_phases "${_TIMELINE}" | sed -e 's/init //')" "kernel prewarm_start prewarm_done "
+}
+
+test_bdr_boottrace_standin() {
+    _app
+    touch "${BDRPI_TEST_DIR}/fb"
+    mkdir -p "${BDRPI_TEST_DIR}/logs"
+
+    "${_CMD}" --file="${_TIMELINE}" mark launcher
+    "${_CMD}" --file="${_TIMELINE}" --fb="${BDRPI_TEST_DIR}/fb" --save="${BDRPI_TEST_DIR}/logs" --quiet \
+              standin "${BDRPI_TEST_DIR}/app" || assert_failed "standin failed"
+
+    assert_eq "$(_phases "${_TIMELINE}" | sed -e 's/init //')" "kernel launcher app_start app_loaded first_frame "
+
+    # An 800x480 32-bit frame when the file isn't a framebuffer.
+    assert_eq "$(wc -c <"${BDRPI_TEST_DIR}/fb" | tr -d ' ')" "1536000"
+
+    local SAVED
+    SAVED="$(find "${BDRPI_TEST_DIR}/logs" -name "boottrace_*.timeline")"
+    assert_ne "${SAVED}" ""
+    assert_eq "$(cat "${SAVED}")" "$(cat "${_TIMELINE}")"
+}
+
+test_bdr_boottrace_args() {
+    assert_stderr_contains "a command is required" "${_CMD}"
+    assert_stderr_contains "unknown command" "${_CMD}" frobnicate
+    assert_stderr_contains "mark takes one PHASE" "${_CMD}" mark
+    assert_stderr_contains "single word" "${_CMD}" --file="${_TIMELINE}" mark "two words"
+    assert_stderr_contains "prewarm needs a DIR" "${_CMD}" prewarm
+    assert_stderr_contains "could not open" "${_CMD}" report "${BDRPI_TEST_DIR}/missing"
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
@@ -0,0 +1,97 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+
+BDRPI_TEST_DIR="${TMPDIR:-/tmp/}bdr-pi-test-imgwrite.$$"
+
+_CMD="${_ROOT_DIR}/native/bdr_imgwrite"
+_IMG="${BDRPI_TEST_DIR}/image"
+
+_sha() {
+    shasum -a 256 "$1" | awk '{print $1}'
+}
+
+before_all() {
+    make -s -C "${_ROOT_DIR}/native" bdr_imgwrite || return 1
+
+    # An "image" with a data prefix, a zero run spanning several blocks
+    # and an unaligned tail.
+    mkdir -p "${BDRPI_TEST_DIR}"
+    {
+        head -c 3000000 /dev/urandom
+        head -c 20000000 /dev/zero
+        head -c 1234567 /dev/urandom
+    } >"${_IMG}"
+    xz --keep --threads=0 "${_IMG}"
+}
+
+after_all() {
+    rm -rf "${BDRPI_TEST_DIR}"
+}
+
+after_each() {
+    rm -f "${BDRPI_TEST_DIR}/out"
+}
+
+test_bdr_imgwrite_raw() {
+    local OUT
+    OUT="$("${_CMD}" "${_IMG}" "${BDRPI_TEST_DIR}/out" 2>/dev/null)" || assert_failed "write failed"
+
+    assert_succeeds cmp "${_IMG}" "${BDRPI_TEST_DIR}/out"
+    assert_eq "${OUT}" "$(_sha "${_IMG}")"
+}
+
+test_bdr_imgwrite_xz() {
+    assert_succeeds "${_CMD}" --sha256="$(_sha "${_IMG}")" --verify \
+                    "${_IMG}.xz" "${BDRPI_TEST_DIR}/out" 2>/dev/null
+
+    assert_succeeds cmp "${_IMG}" "${BDRPI_TEST_DIR}/out"
+}
+
+test_bdr_imgwrite_stdin() {
+    "${_CMD}" - "${BDRPI_TEST_DIR}/out" <"${_IMG}.xz" >/dev/null 2>&1 || assert_failed "write failed"
+
+    assert_succeeds cmp "${_IMG}" "${BDRPI_TEST_DIR}/out"
+}
+
+test_bdr_imgwrite_skip_zeros() {
+    local ERR
+    ERR="$("${_CMD}" --skip-zeros --verify "${_IMG}.xz" "${BDRPI_TEST_DIR}/out" 2>&1 >/dev/null)" || \
+        assert_failed "write failed: ${ERR}"
+
+    assert_succeeds cmp "${_IMG}" "${BDRPI_TEST_DIR}/out"
+    [[ "${ERR}" =~ \(16777216\ skipped\) ]] || assert_failed "expected 4 skipped blocks: ${ERR}"
+}
+
+test_bdr_imgwrite_skip_zeros_device() {
+    # A device that hasn't been zeroed by a discard holds old data, so
+    # zero blocks are written unless BLKZEROOUT can zero them, which a
+    # character device can't.
+    local ERR
+    ERR="$("${_CMD}" --skip-zeros "${_IMG}.xz" /dev/null 2>&1 >/dev/null)" || \
+        assert_failed "write failed: ${ERR}"
+
+    [[ "${ERR}" =~ \(0\ skipped\) ]] || assert_failed "expected no skipped blocks: ${ERR}"
+}
+
+test_bdr_imgwrite_hash_mismatch() {
+    local BAD
+    BAD="$(printf '0%.0s' {1..64})"
+
+    assert_stderr_contains "hash mismatch" "${_CMD}" --sha256="${BAD}" "${_IMG}.xz" "${BDRPI_TEST_DIR}/out"
+
+    # The first block is never written.
+    assert_eq "$(head -c 4096 "${BDRPI_TEST_DIR}/out" | tr -d '\0' | wc -c | tr -d ' ')" "0"
+}
+
+test_bdr_imgwrite_args() {
+    assert_stderr_contains "IMAGE and TARGET are required" "${_CMD}" "${_IMG}"
+    assert_stderr_contains "block-size must be" "${_CMD}" --block-size=1000 "${_IMG}" "${BDRPI_TEST_DIR}/out"
+    assert_stderr_contains "sha256 must be" "${_CMD}" --sha256=abc "${_IMG}" "${BDRPI_TEST_DIR}/out"
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
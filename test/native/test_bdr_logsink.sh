@@ -0,0 +1,161 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+
+BDRPI_TEST_DIR="${TMPDIR:-/tmp/}bdr-pi-test-logsink.$$"
+
+_CMD="${_ROOT_DIR}/native/bdr_logsink"
+_LOGS="${BDRPI_TEST_DIR}/logs"
+
+before_all() {
+    make -s -C "${_ROOT_DIR}/native" bdr_logsink
+}
+
+before_each() {
+    mkdir -p "${BDRPI_TEST_DIR}"
+}
+
+after_each() {
+    rm -rf "${BDRPI_TEST_DIR}"
+}
+
+# _logs $1=glob lists matching files in the log dir
+_logs() {
+    find "${_LOGS}" -name "$1" 2>/dev/null | sort
+}
+
+# _await_file $1=glob waits for a matching file to appear
+_await_file() {
+    local N=0
+    while [[ -z "$(_logs "$1")" ]]; do
+        N=$((N + 1))
+        if [[ "${N}" -gt 50 ]]; then
+            assert_failed "timed out waiting for $1"
+        fi
+        sleep 0.1
+    done
+}
+
+test_bdr_logsink_captures_output() {
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --no-compress -- \
+              sh -c 'echo out; echo err >&2' 2>/dev/null || assert_failed "logsink failed"
+
+    local LOG
+    LOG="$(_logs "rc_*.log")"
+    assert_eq "$(cat "${LOG}")" "out
+err"
+    assert_eq "$(_logs "*.crash")" ""
+}
+
+test_bdr_logsink_batches_writes() {
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --no-compress --flush-interval=30 -- \
+              sh -c 'echo hello; sleep 1' 2>/dev/null &
+    local PID=$!
+
+    _await_file "rc_*.log"
+    sleep 0.5
+
+    # Nothing is written while the output is below the thresholds...
+    assert_eq "$(wc -c <"$(_logs "rc_*.log")" | tr -d ' ')" "0"
+
+    wait "${PID}"
+
+    # ...and everything is written on exit.
+    assert_eq "$(cat "$(_logs "rc_*.log")")" "hello"
+}
+
+test_bdr_logsink_flush_bytes() {
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --no-compress --flush-bytes=100 -- \
+              sh -c 'seq 1 100; sleep 1' 2>/dev/null &
+    local PID=$!
+
+    sleep 0.5
+    [[ "$(wc -c <"$(_logs "rc_*.log")")" -gt 100 ]] || assert_failed "output was not flushed"
+
+    wait "${PID}"
+}
+
+test_bdr_logsink_crash() {
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --no-compress -- \
+              sh -c 'echo before; echo boom >&2; exit 3' 2>/dev/null
+    assert_eq "$?" "3"
+
+    local LOG
+    LOG="$(_logs "rc_*.log")"
+    assert_succeeds grep -q "boom" "${LOG}"
+    assert_succeeds grep -q "sh exited with status 3" "${LOG}"
+
+    assert_succeeds grep -q "boom" "${LOG}.crash"
+    assert_succeeds grep -q "before" "${LOG}.crash"
+}
+
+test_bdr_logsink_signal() {
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --no-compress -- \
+              sh -c 'echo going; kill -SEGV $$' 2>/dev/null
+    assert_eq "$?" "139"
+
+    assert_succeeds grep -q "killed by signal 11" "$(_logs "rc_*.log")"
+    assert_succeeds grep -q "going" "$(_logs "rc_*.log.crash")"
+}
+
+test_bdr_logsink_rotate_and_compress() {
+    local GEN='for I in $(seq 1 20); do seq 1 500; sleep 0.01; done'
+
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --flush-bytes=1000 --max-size=10000 -- \
+              sh -c "${GEN}" 2>/dev/null || assert_failed "logsink failed"
+
+    # The sink waits for its background compressors before exiting.
+    assert_eq "$(_logs "rc_*.log")" ""
+    assert_eq "$(_logs "rc_*.tmp")" ""
+
+    [[ "$(_logs "rc_*.log.xz" | wc -l)" -gt 1 ]] || assert_failed "log was not rotated"
+
+    assert_eq "$(_logs "rc_*.log.xz" | xargs xz -dc | md5sum)" "$(sh -c "${GEN}" | md5sum)"
+}
+
+test_bdr_logsink_keep() {
+    mkdir -p "${_LOGS}"
+    local I
+    for I in 1 2 3 4 5; do
+        touch "${_LOGS}/rc_2020010${I}_000000.log.xz"
+    done
+    touch "${_LOGS}/other.log"
+
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --keep=3 --no-compress -- true 2>/dev/null
+
+    assert_eq "$(_logs "rc_*" | wc -l | tr -d ' ')" "3"
+    assert_succeeds test -f "${_LOGS}/rc_20200105_000000.log.xz"
+    assert_succeeds test -f "${_LOGS}/other.log"
+}
+
+test_bdr_logsink_keep_crash_and_tmp() {
+    mkdir -p "${_LOGS}"
+    local I
+    for I in 1 2 3 4 5; do
+        touch "${_LOGS}/rc_2020010${I}_000000.log.xz" "${_LOGS}/rc_2020010${I}_000000.log.crash"
+    done
+    # a compression cut short by a power loss, the log still there
+    touch "${_LOGS}/rc_20200106_000000.log" "${_LOGS}/rc_20200106_000000.log.xz.tmp"
+
+    "${_CMD}" --dir="${_LOGS}" --prefix=rc --keep=3 --no-compress -- true 2>/dev/null
+
+    # crash reports don't count toward --keep, but go with their logs
+    assert_eq "$(_logs "rc_*.log*" | grep -v crash | wc -l | tr -d ' ')" "3"
+    assert_eq "$(_logs "rc_*.crash" | wc -l | tr -d ' ')" "1"
+    assert_succeeds test -f "${_LOGS}/rc_20200105_000000.log.crash"
+    assert_succeeds test -f "${_LOGS}/rc_20200106_000000.log"
+    assert_eq "$(_logs "rc_*.tmp")" ""
+}
+
+test_bdr_logsink_args() {
+    assert_stderr_contains "dir must be set" "${_CMD}" -- true
+    assert_stderr_contains "a command is required" "${_CMD}" --dir="${_LOGS}"
+    assert_stderr_contains "keep must be between" "${_CMD}" --dir="${_LOGS}" --keep=0 -- true
+    assert_stderr_contains "prefix must be" "${_CMD}" --dir="${_LOGS}" --prefix=a/b -- true
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
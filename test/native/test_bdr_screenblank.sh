@@ -0,0 +1,193 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+source "${_TEST_ROOT_DIR}/io.sh"
+
+# Per-process, so suites and tests can run concurrently.
+export BDRPI_FAKE_VOLTAGE_FILE="$(mk_test_tmpdir)/.fake-voltage"
+_FAKE_VOLTAGE_FILE="${BDRPI_FAKE_VOLTAGE_FILE}"
+_CMD="${_ROOT_DIR}/native/bdr_screenblank"
+
+await() {
+    local MAX_WAIT="$1"
+    local FILE="$2"
+    local CONTENTS="$3"
+
+    local N=0
+    while true; do
+        N=$((N + 1))
+
+        if [[ "${N}" -gt "${MAX_WAIT}" ]]; then
+            echo "exceeded max attempts waiting on ${FILE} to contain ${CONTENTS}"
+            exit 1
+        fi
+
+        if [[ -e "${FILE}" ]]; then
+            local DATA
+            DATA="$(cat "${FILE}")"
+            if  [[ "${DATA}" == "${CONTENTS}" ]]; then
+                break
+            fi
+        fi
+
+        sleep 1
+    done
+
+    return 0
+}
+
+# set_voltage $1=mV replaces the fake voltage atomically so the
+# daemon never reads a truncated file.
+set_voltage() {
+    echo "$1" >"${_FAKE_VOLTAGE_FILE}.tmp"
+    mv -f "${_FAKE_VOLTAGE_FILE}.tmp" "${_FAKE_VOLTAGE_FILE}"
+}
+
+await_output() {
+    local MAX_WAIT="$1"
+    local FILE="$2"
+    local PATTERN="$3"
+
+    local N=0
+    while ! grep -q "${PATTERN}" "${FILE}"; do
+        N=$((N + 1))
+        if [[ "${N}" -gt "${MAX_WAIT}" ]]; then
+            echo "exceeded max attempts waiting on ${FILE} to contain ${PATTERN}"
+            exit 1
+        fi
+        sleep 1
+    done
+
+    return 0
+}
+
+before_all() {
+    make -s -C "${_ROOT_DIR}/native" bdr_screenblank
+}
+
+after_all() {
+    rm -f "${_FAKE_VOLTAGE_FILE}"
+}
+
+# run_blank_cycle $@=voltage source args
+run_blank_cycle() {
+    local BLANK_FILE
+    BLANK_FILE="$(mk_test_tmpfile)" || exit 1
+
+    touch "${BLANK_FILE}"
+
+    set_voltage 5000
+
+    local HANDLE
+    capture_output_bg \
+        "${_CMD}" \
+        --blank-interval=1 --wake-interval=1 --max-blank-interval=1 \
+        "$@" \
+        --path="${BLANK_FILE}" |
+        while read HANDLE; do
+            await 10 "${BLANK_FILE}" "0" || assert_failed "blank file was not written with 0"
+            await_output 10 "$(output_file "${HANDLE}")" "VIN: 5000 mV" || \
+                assert_failed "initial voltage was not read"
+
+            set_voltage 500
+
+            await 10 "${BLANK_FILE}" "1" || assert_failed "blank file was not written with 1"
+
+            set_voltage 4999
+
+            await 10 "${BLANK_FILE}" "0" || assert_failed "blank file was not written with 0 again"
+
+            kill_bg "${HANDLE}"
+
+            local OUTPUT
+            OUTPUT="$(output_file "${HANDLE}")"
+            assert_succeeds grep -q "VIN: 5000 mV" "${OUTPUT}"
+            assert_succeeds grep -q "VIN: 500 mV" "${OUTPUT}"
+            assert_succeeds grep -q "VIN: 4999 mV" "${OUTPUT}"
+
+            # the backlight is only written on state changes
+            assert_eq "$(grep -c "blanking" "${OUTPUT}")" "1"
+            assert_eq "$(grep -c "waking" "${OUTPUT}")" "2"
+        done
+}
+
+test_bdr_screenblank_vin_file() {
+    run_blank_cycle --vin-file="${_FAKE_VOLTAGE_FILE}"
+}
+
+test_bdr_screenblank_binary() {
+    run_blank_cycle --lifepo4wered-binary="${_TEST_ROOT_DIR}/resources/fake-lifepo4wered-cli.sh"
+}
+
+test_bdr_screenblank_binary_quoted_path() {
+    # the binary is run without a shell, so its path is taken literally
+    local DIR
+    DIR="$(mk_test_tmpdir)/it's \$(false)" || exit 1
+    mkdir -p "${DIR}"
+    cp "${_TEST_ROOT_DIR}/resources/fake-lifepo4wered-cli.sh" "${DIR}/"
+
+    run_blank_cycle --lifepo4wered-binary="${DIR}/fake-lifepo4wered-cli.sh"
+}
+
+test_bdr_screenblank_blanks_promptly() {
+    local BLANK_FILE
+    BLANK_FILE="$(mk_test_tmpfile)" || exit 1
+
+    touch "${BLANK_FILE}"
+
+    set_voltage 5000
+
+    local HANDLE
+    capture_output_bg \
+        "${_CMD}" \
+        --blank-interval=1 --wake-interval=1 \
+        --vin-file="${_FAKE_VOLTAGE_FILE}" \
+        --path="${BLANK_FILE}" |
+        while read HANDLE; do
+            await 10 "${BLANK_FILE}" "0" || assert_failed "blank file was not written with 0"
+
+            # a long stretch on external power must not stretch the
+            # check interval past --blank-interval (a back-off from 1 s
+            # would be at 8 s by now)
+            sleep 8
+
+            set_voltage 500
+            local START="${SECONDS}"
+            await 10 "${BLANK_FILE}" "1" || assert_failed "blank file was not written with 1"
+            local ELAPSED=$((SECONDS - START))
+
+            kill_bg "${HANDLE}"
+
+            # the interval, plus await's and SECONDS' 1 s resolution
+            if [[ "${ELAPSED}" -gt 3 ]]; then
+                assert_failed "blanking took ${ELAPSED} s with a 1 s blank interval"
+            fi
+        done
+}
+
+test_bdr_screenblank_args() {
+    assert_fails "${_CMD}" --blank-threshold=9999 2>/dev/null
+    assert_stderr_contains "blank-threshold must be between" "${_CMD}" --blank-threshold=9999
+
+    assert_fails "${_CMD}" --wake-threshold=9999 2>/dev/null
+    assert_stderr_contains "wake-threshold must be between" "${_CMD}" --wake-threshold=9999
+
+    assert_fails "${_CMD}" --wake-threshold=1000 --blank-threshold=3000 2>/dev/null
+    assert_stderr_contains "blank-threshold must be between" "${_CMD}" --wake-threshold=1000 \
+                           --blank-threshold=3000
+
+    assert_fails "${_CMD}" --blank-interval=9999 2>/dev/null
+    assert_stderr_contains "blank-interval must be between" "${_CMD}" --blank-interval=9999
+
+    assert_fails "${_CMD}" --wake-interval=9999 2>/dev/null
+    assert_stderr_contains "wake-interval must be between" "${_CMD}" --wake-interval=9999
+
+    assert_fails "${_CMD}" --path "" 2>/dev/null
+    assert_fails "${_CMD}" --path "/tmp/nopenopenope.$$" 2>/dev/null
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
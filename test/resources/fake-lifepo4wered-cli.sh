@@ -1,11 +1,12 @@
 #!/bin/bash
 
-# Test version: looks for .fake_voltage in its own directory.
+# Test version: looks for .fake_voltage in its own directory, unless
+# BDRPI_FAKE_VOLTAGE_FILE names another file.
 
 _TEST_SH="${BASH_SOURCE[0]}"
 _SCRIPT_DIR="$(cd "$(dirname "${_TEST_SH}")" && pwd)"
 
-_VOLTAGE_FILE="${_SCRIPT_DIR}/.fake-voltage"
+_VOLTAGE_FILE="${BDRPI_FAKE_VOLTAGE_FILE:-${_SCRIPT_DIR}/.fake-voltage}"
 
 if [[ "$1" == "get" ]] && [[ "$2" == "vin" ]]; then
     if [[ -f "${_VOLTAGE_FILE}" ]]; then
@@ -16,5 +17,5 @@ if [[ "$1" == "get" ]] && [[ "$2" == "vin" ]]; then
     exit 0
 fi
 
-echo "fake_lifepo4wered-cli.sh bad args: $*" >/dev/stderr
+echo "fake_lifepo4wered-cli.sh bad args: $*" >&2
 exit 1
@@ -7,7 +7,9 @@ _ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
 source "${_TEST_ROOT_DIR}/assertions.sh"
 source "${_TEST_ROOT_DIR}/io.sh"
 
-_FAKE_VOLTAGE_FILE="${_TEST_ROOT_DIR}/resources/.fake-voltage"
+# Per-process, so suites and tests can run concurrently.
+export BDRPI_FAKE_VOLTAGE_FILE="$(mk_test_tmpdir)/.fake-voltage"
+_FAKE_VOLTAGE_FILE="${BDRPI_FAKE_VOLTAGE_FILE}"
 
 await() {
     local MAX_WAIT="$1"
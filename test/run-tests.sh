@@ -1,21 +1,193 @@
 #!/bin/bash
 
+#/# Usage: run-tests.sh [-j N] [SUITE...]
+#/#
+#/# Runs the test suites (default: every test_*.sh under test/). Each
+#/# test function runs as its own job, up to N at a time (default: the
+#/# number of CPUs), in a private temporary directory with its own
+#/# TMPDIR and BDR_DIR. Output is collected per test and printed by
+#/# suite once everything has finished, followed by the slowest tests.
+
 _TEST_SH="${BASH_SOURCE[0]}"
 _TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")" && pwd)"
+_RUNNER="${_TEST_ROOT_DIR}/$(basename "${_TEST_SH}")"
+
+# Number of slowest tests to report.
+SLOWEST=10
+
+usage() {
+    grep "^#/#" "${_RUNNER}" | cut -c"5-" >&2
+    exit 1
+}
+
+# now_ms prints the current time in milliseconds (in seconds
+# resolution where bash and date can't do better).
+now_ms() {
+    if [[ -n "${EPOCHREALTIME:-}" ]]; then
+        local T="${EPOCHREALTIME/[.,]/}"
+        echo "${T:0:${#T}-3}"
+    else
+        echo "$(date "+%s")000"
+    fi
+}
+
+# ncpus prints the number of CPUs on Linux or macOS.
+ncpus() {
+    getconf _NPROCESSORS_ONLN 2>/dev/null || sysctl -n hw.ncpu 2>/dev/null || echo 1
+}
+
+# result_name $1=suite $2=test names a test's files in the results dir
+result_name() {
+    local SUITE="${1#./}"
+    echo "${SUITE//\//_}.$2"
+}
+
+# run_one $1=results-dir $2=suite $3=test runs a single test in a
+# sandbox and records "rc ms" in the results dir.
+run_one() {
+    local RESULTS="$1"
+    local SUITE="$2"
+    local TEST="$3"
+
+    local NAME SANDBOX START END RC
+    NAME="$(result_name "${SUITE}" "${TEST}")"
+    SANDBOX="$(mktemp -d "${RESULTS}/sandbox.XXXXXX")" || exit 1
+    mkdir -p "${SANDBOX}/tmp" "${SANDBOX}/bdr"
+
+    START="$(now_ms)"
+    (
+        # Everything the suites and mocks put in TMPDIR (which they
+        # use as a prefix, hence the trailing slash) stays private.
+        export TMPDIR="${SANDBOX}/tmp/"
+        export BDR_DIR="${SANDBOX}/bdr"
+        export BDRPI_TEST_ONLY="${TEST}"
+        cd "${_TEST_ROOT_DIR}" && "${SUITE}"
+    ) >"${RESULTS}/${NAME}.out" 2>&1 </dev/null
+    RC=$?
+    END="$(now_ms)"
+
+    echo "${RC} $((END - START))" >"${RESULTS}/${NAME}.result"
+    rm -rf "${SANDBOX}"
+}
+
+if [[ "${1:-}" == "--run-one" ]]; then
+    shift
+    run_one "$@"
+    exit 0
+fi
 
 cd "${_TEST_ROOT_DIR}" || { echo "failed to cd to ${_TEST_ROOT_DIR}"; exit 1; }
 
+JOBS="$(ncpus)"
+SUITES=()
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        -j)
+            [[ -n "${2:-}" ]] || usage
+            JOBS="$2"
+            shift 2
+            ;;
+        -j*)
+            JOBS="${1#-j}"
+            shift
+            ;;
+        -h|--help)
+            usage
+            ;;
+        *)
+            SUITES+=("./${1#"${_TEST_ROOT_DIR}"/}")
+            shift
+            ;;
+    esac
+done
+
+if [[ "${#SUITES[@]}" -eq 0 ]]; then
+    while IFS= read -r TEST_FILE; do
+        SUITES+=("${TEST_FILE}")
+    done < <(find . -type f -name "test_*.sh" | sort)
+fi
+
+RESULTS="$(mktemp -d "${TMPDIR:-/tmp/}bdr-pi-tests.XXXXXX")" || exit 1
+trap 'rm -rf "${RESULTS}"' EXIT
+
+# Build the native tools once up front rather than racing to build
+# them from every test's before_all.
+if [[ -f "${_TEST_ROOT_DIR}/../native/Makefile" ]]; then
+    make -s -C "${_TEST_ROOT_DIR}/../native" >"${RESULTS}/make.out" 2>&1 || {
+        echo "native build failed:"
+        cat "${RESULTS}/make.out"
+    }
+fi
+
+# List each suite's tests (in its own sandbox, as sourcing a suite has
+# side effects) and queue one job per test.
 FAILED=false
-while IFS= read -d $'\0' TEST_FILE; do
-    echo "test/${TEST_FILE#./}:"
-    if ( "${TEST_FILE}" ); then
-        echo "pass"
-    else
-        echo "FAILED"
+for SUITE in "${SUITES[@]}"; do
+    LIST_DIR="$(mktemp -d "${RESULTS}/list.XXXXXX")"
+    if ! TMPDIR="${LIST_DIR}/" BDRPI_TEST_LIST=1 "${SUITE}" >"${LIST_DIR}/tests" 2>&1; then
+        echo "test/${SUITE#./}: could not list tests"
+        sed -e "s/^/      /" "${LIST_DIR}/tests"
         FAILED=true
+        continue
+    fi
+    while IFS= read -r TEST; do
+        printf "%s\0%s\0" "${SUITE}" "${TEST}"
+        echo "${SUITE} ${TEST}" >>"${RESULTS}/queue"
+    done <"${LIST_DIR}/tests"
+    rm -rf "${LIST_DIR}"
+done >"${RESULTS}/jobs"
+
+START="$(now_ms)"
+xargs -0 -n 2 -P "${JOBS}" "${_RUNNER}" --run-one "${RESULTS}" <"${RESULTS}/jobs"
+END="$(now_ms)"
+
+# Report by suite, in order.
+LAST_SUITE=""
+SUITE_FAILED=false
+report_suite_end() {
+    [[ -n "${LAST_SUITE}" ]] || return
+    if "${SUITE_FAILED}"; then
+        echo "FAILED"
+    else
+        echo "pass"
     fi
     echo
-done < <(find -s . -type f -a -name "test_*.sh" -print0)
+}
+
+if [[ -f "${RESULTS}/queue" ]]; then
+    while read -r SUITE TEST; do
+        if [[ "${SUITE}" != "${LAST_SUITE}" ]]; then
+            report_suite_end
+            echo "test/${SUITE#./}:"
+            LAST_SUITE="${SUITE}"
+            SUITE_FAILED=false
+        fi
+
+        NAME="$(result_name "${SUITE}" "${TEST}")"
+        RC=1
+        MS=0
+        if [[ -f "${RESULTS}/${NAME}.result" ]]; then
+            read -r RC MS <"${RESULTS}/${NAME}.result"
+        else
+            echo "  ${TEST}: did not run"
+        fi
+        cat "${RESULTS}/${NAME}.out" 2>/dev/null
+
+        if [[ "${RC}" -ne 0 ]]; then
+            SUITE_FAILED=true
+            FAILED=true
+        fi
+        echo "${MS} test/${SUITE#./} ${TEST}" >>"${RESULTS}/timings"
+    done <"${RESULTS}/queue"
+    report_suite_end
+
+    echo "Slowest tests:"
+    sort -rn "${RESULTS}/timings" | head -n "${SLOWEST}" | \
+        awk '{ printf "  %8.2fs  %s %s\n", $1 / 1000, $2, $3 }'
+    echo
+    printf "Ran %d tests in %.2fs with %d jobs.\n" \
+           "$(wc -l <"${RESULTS}/queue")" "$(echo "$((END - START))" | awk '{print $1 / 1000}')" "${JOBS}"
+fi
 
 if "${FAILED}"; then
     echo "One or more test suites failed."
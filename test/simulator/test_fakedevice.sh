@@ -0,0 +1,109 @@
+#!/bin/bash
+
+_TEST_SH="${BASH_SOURCE[0]}"
+_TEST_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/.. && pwd)"
+_ROOT_DIR="$(cd "$(dirname "${_TEST_SH}")"/../.. && pwd)"
+
+source "${_TEST_ROOT_DIR}/assertions.sh"
+source "${_TEST_ROOT_DIR}/io.sh"
+
+_SIM_DIR="${_ROOT_DIR}/simulator/bridge_tester"
+
+# write_session $1=path $2=seconds writes a straight GPX track with a
+# fix at each end.
+write_session() {
+    cat >"$1" <<GPX
+<?xml version="1.0"?>
+<gpx version="1.1"><trk><trkseg>
+<trkpt lat="37.7749000" lon="-122.4194000"><time>2023-11-14T22:13:20.000Z</time></trkpt>
+<trkpt lat="37.7849000" lon="-122.4194000"><time>2023-11-14T22:13:$((20 + $2)).000Z</time></trkpt>
+</trkseg></trk></gpx>
+GPX
+}
+
+# replay_rate $@=fakedevice.py options replays a session as fast as
+# possible into a stand-in for the bridge socket and prints the
+# telemetry rate, in samples per second of session time.
+replay_rate() {
+    python3 - "${_SIM_DIR}" "$@" <<'PY'
+import json
+import os
+import socket
+import subprocess
+import sys
+
+sim = sys.argv[1]
+name = 'bdr-pi-test-%d' % os.getpid()
+srv = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+srv.bind(b'\0' + name.encode('utf-8'))
+srv.listen(1)
+srv.settimeout(10)
+
+dev = subprocess.Popen([sys.executable, os.path.join(sim, 'fakedevice.py'), '--socket', name,
+                        '--control', '', '--stats-interval', '0', '--speed', '0'] + sys.argv[2:],
+                       stdout=subprocess.DEVNULL, stderr=subprocess.STDOUT)
+try:
+    conn = srv.accept()[0]
+    conn.settimeout(2)
+    data = b''
+    try:
+        while True:
+            chunk = conn.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+    except socket.timeout:
+        pass
+finally:
+    dev.kill()
+    dev.wait()
+
+intervals = []
+for line in data.split(b'\n'):
+    msg = json.loads(line) if line.startswith(b'{"s":') else None
+    if msg is not None and 'd' in msg['s']:
+        intervals.append(msg['s']['d'][0])
+if len(intervals) < 2 or intervals[-1] == intervals[0]:
+    print(0)
+else:
+    print(round((len(intervals) - 1) * 1000.0 / (intervals[-1] - intervals[0])))
+PY
+}
+
+test_fakedevice_telemetry_above_gps_rate() {
+    local SESSION
+    SESSION="$(mk_test_tmpdir)/session.gpx"
+    write_session "${SESSION}" 30
+
+    # several samples per fix, not clamped to the GPS rate
+    assert_eq "$(replay_rate --session "${SESSION}" --gps-rate 10 --telemetry-rate 50)" "50"
+    assert_eq "$(replay_rate --session "${SESSION}" --gps-rate 10 --telemetry-rate 4)" "4"
+}
+
+test_fakedevice_channel_names_unique() {
+    # the app, apptest.py's marker and scenario channel filters find
+    # channels by name, so the GPS, lap and ECU channels must not share
+    # one
+    local DUPS
+    DUPS="$(cd "${_SIM_DIR}" && python3 - <<'PY'
+import ecu
+import fakedevice
+
+names = [c[0] for c in fakedevice.TELEMETRY_CHANNELS + fakedevice.LAP_CHANNELS]
+names += [p.name for p in ecu.pid_table(extended=300)]
+print(' '.join(sorted(n for n in set(names) if names.count(n) > 1)))
+PY
+)" || assert_failed "could not list the channels"
+    assert_eq "${DUPS}" ""
+}
+
+test_fakedevice_unknown_track_id() {
+    local DB
+    DB="$(mk_test_tmpdir)/tracks.json"
+    echo '{"tracks": []}' >"${DB}"
+
+    # fails before connecting, so no socket is needed
+    assert_fails python3 "${_SIM_DIR}/fakedevice.py" --control '' --tracks "${DB}" --track-id 7 >/dev/null
+}
+
+source "${_TEST_ROOT_DIR}/test-harness.sh"
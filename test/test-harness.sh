@@ -1,5 +1,11 @@
 #!/bin/bash
 
+# runsuite runs every test_* function defined by the sourcing suite,
+# with before_each/after_each around each and before_all/after_all
+# around the lot. test/run-tests.sh drives it through two variables:
+#
+#   BDRPI_TEST_LIST=1       print the suite's test names and exit
+#   BDRPI_TEST_ONLY=<name>  run only the named test
 runsuite() {
     declare -a SUITE
 
@@ -8,7 +14,9 @@ runsuite() {
     for F in $(declare -F | awk '{print $3}'); do
         case "${F}" in
             test_*)
-                SUITE+=("${F}")
+                if [[ -z "${BDRPI_TEST_ONLY:-}" || "${F}" == "${BDRPI_TEST_ONLY}" ]]; then
+                    SUITE+=("${F}")
+                fi
                 ;;
             before_each)
                 BEFORE_EACH="${F}"
@@ -30,6 +38,11 @@ runsuite() {
         return 1
     fi
 
+    if [[ -n "${BDRPI_TEST_LIST:-}" ]]; then
+        printf "%s\n" "${SUITE[@]}"
+        return 0
+    fi
+
     local TEST START END DURATION
     local TEST_OUTPUT="${TMPDIR:-/tmp/}/.bdr-pi-tests.$$"
     local FAILED=false
@@ -5,8 +5,12 @@ set -u
 
 SCRIPT_DIR="$(cd "$(dirname "$0")" || exit; pwd)"
 
+# Keep downloads alongside the rest of the setup state.
+DOWNLOAD_CACHE_DIR="${BDR_DIR}/cache"
+
 for LIB in "${SCRIPT_DIR}/lib"/*.sh; do
     # shellcheck source=lib/boot_config.sh
+    # shellcheck source=lib/download.sh
     # shellcheck source=lib/fs.sh
     # shellcheck source=lib/io.sh
     # shellcheck source=lib/network.sh